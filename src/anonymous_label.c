@@ -20,6 +20,7 @@ anonymous_label_collection *anonymous_label_make_collection(void)
     DYNAMIC_ARRAY_CREATE_WITH_CAPACITY(collection->all, value, 97);
     collection->backward_index = 0;
     collection->forward_index = 0;
+    collection->executed = 0;
     collection->add_mode = 1;
     collection->all->initialize = 1;
     return collection;
@@ -123,4 +124,16 @@ void anonymous_label_collection_reset(anonymous_label_collection *collection)
     collection->add_mode = 0;
     collection->backward_index = 0;
     collection->forward_index = 0;
+    collection->executed = 0;
+}
+
+size_t anonymous_label_next_index(anonymous_label_collection *collection)
+{
+    return collection->executed++;
+}
+
+int anonymous_label_collection_is_complete(const anonymous_label_collection *collection)
+{
+    return collection->add_mode ||
+           (collection->forward_index == collection->forward->count && collection->backward_index == collection->back->count);
 }
@@ -30,6 +30,7 @@ typedef struct anonymous_label_collection
     dynamic_array *all;
     size_t backward_index;
     size_t forward_index;
+    size_t executed;
     size_t count;
     size_t capacity;
     int add_mode;
@@ -51,4 +52,10 @@ value anonymous_label_get_by_name(anonymous_label_collection *collection, const
 void anonymous_label_update_current(anonymous_label_collection *collection, size_t at_index, value value);
 value anonymous_label_get_current(anonymous_label_collection *collection, size_t at_index);
 
+/* the index of the statement being run in this pass, counting each time a loop body is run */
+size_t anonymous_label_next_index(anonymous_label_collection *collection);
+
+/* whether a pass after the first defined the same anonymous labels as the first */
+int anonymous_label_collection_is_complete(const anonymous_label_collection *collection);
+
 #endif /* anonymous_label_h */
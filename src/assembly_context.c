@@ -9,11 +9,24 @@
 
 #include "assembly_context.h"
 #include "anonymous_label.h"
+#include "builtin_functions.h"
+#include "compress.h"
+#include "conditional.h"
+#include "dataflow.h"
+#include "dead_code.h"
 #include "error.h"
+#include "loop.h"
 #include "memory.h"
 #include "output.h"
+#include "page_layout.h"
+#include "pass_trace.h"
+#include "peephole.h"
+#include "profile.h"
 #include "string_htable.h"
+#include "string_pool.h"
+#include "test_suite.h"
 #include "token.h"
+#include "zp_allocator.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -21,18 +34,18 @@
 
 static const size_t LINE_LEN = 200UL;
 
-static void first_line_output(char line[LINE_LEN], const char *disasm, const char *src_line, int start_pc, int start_with_pc)
+static void first_line_output(char line[LINE_LEN], const char *disasm, const char *cycles, const char *src_line, int start_pc, int start_with_pc)
 {
     int line_end;
     if (disasm) {
         if (start_with_pc) {
-            line_end = snprintf(line + 1, LINE_LEN - 1, "%-22.4x%-17s%s", start_pc, disasm, src_line);
+            line_end = snprintf(line + 1, LINE_LEN - 1, "%-22.4x%-17s%-6s%s", start_pc, disasm, cycles, src_line);
         } else {
-            line_end = snprintf(line + 1, LINE_LEN - 1, "%-39s%s", disasm, src_line);
+            line_end = snprintf(line + 1, LINE_LEN - 1, "%-45s%s", disasm, src_line);
         }
     } else if (src_line) {
         if (start_with_pc) {
-            line_end = snprintf(line + 1, LINE_LEN - 1, "%-39.4x%s", start_pc, src_line);
+            line_end = snprintf(line + 1, LINE_LEN - 1, "%-45.4x%s", start_pc, src_line);
         } else {
             line_end = snprintf(line + 1, LINE_LEN - 1, "%s", src_line);
         }
@@ -76,9 +89,13 @@ void assembly_context_add_disasm_opt_pc(assembly_context *ctx, const char *disas
     int logical_start = ctx->logical_start_pc;
     int start_pc = ctx->start_pc;
     if (!ctx->pass_needed && ctx->options.list) {
+        char cycles[CYCLE_RANGE_FORMAT_LEN] = {};
+        if (ctx->cycles.max) {
+            cycles_format(ctx->cycles, cycles);
+        }
         line[0] = preamble;
         if (logical_start == ctx->output->logical_pc || start_pc < ctx->output->start || start_pc >= ctx->output->end) {
-            first_line_output(line, disasm, src_line, logical_start, start_with_pc);
+            first_line_output(line, disasm, cycles, src_line, logical_start, start_with_pc);
             copy_line_to_disassembly(ctx, line);
             if (start_pc < ctx->output->start || start_pc >= ctx->output->end) {
                 return;
@@ -91,12 +108,15 @@ void assembly_context_add_disasm_opt_pc(assembly_context *ctx, const char *disas
             if (bytes > 8) bytes = 8;
             if (logical_start == ctx->logical_start_pc) {
                 if (disasm && bytes > 4) bytes = 4;
-                first_line_output(line, disasm, src_line, logical_start, start_with_pc);
+                first_line_output(line, disasm, cycles, src_line, logical_start, start_with_pc);
             } else {
                 snprintf(line + 1, LINE_LEN - 1, "%-32.4x\n", logical_start);
             }
             char *line_bytes = line+8;
             const char *output_bytes = ctx->output->buffer + start_pc;
+            /* a first line with disassembly holds fewer bytes */
+            start_pc += bytes;
+            logical_start += bytes;
             while (bytes-- > 0) {
                 char disasm_bytes[3] = {};
                 snprintf(disasm_bytes, 3, "%02x", ((int)*output_bytes) & 0xff);
@@ -105,8 +125,6 @@ void assembly_context_add_disasm_opt_pc(assembly_context *ctx, const char *disas
                 output_bytes++;
             }
             copy_line_to_disassembly(ctx, line);
-            start_pc += 8;
-            logical_start += 8;
         }
     }
 }
@@ -125,8 +143,16 @@ void assembly_context_reset(assembly_context *ctx)
     ctx->m16 = ctx->x16 = 0;
     ctx->page = 0;
     ctx->print_off = 0;
+    ctx->cycles = (cycle_range){};
+    cycle_log_reset(ctx->cycle_log);
+    if (ctx->profile) {
+        profile_reset(ctx->profile);
+    }
+    test_suite_reset(ctx->tests);
+    page_layout_reset(ctx->pages);
     output_reset(ctx->output);
     anonymous_label_collection_reset(ctx->anonymous_labels_new);
+    loop_stack_reset(ctx->loops);
     ctx->disassembly_length = 0;
 }
 
@@ -169,7 +195,12 @@ void assembly_context_to_disk(assembly_context *ctx)
                 for(int i = 1; i < ctx->options.argc; i++) {
                     fprintf(fp, " %s", ctx->options.argv[i]);
                 }
-                fprintf(fp, "\n\n%s", ctx->disassembly);
+                fputs("\n\n", fp);
+                if (ctx->profile && ctx->profile->sim) {
+                    profile_write_listing(ctx->profile, ctx->disassembly, ctx->disassembly_length, fp);
+                } else {
+                    fputs(ctx->disassembly, fp);
+                }
                 fclose(fp); 
             }
         }
@@ -183,6 +214,7 @@ void assembly_context_to_disk(assembly_context *ctx)
             char *buffer;
             char *symbol_report = symbol_table_report(ctx->sym_tab, &buffer);
             fputs(symbol_report, fp);
+            dead_code_list(ctx->procs, fp);
             fclose(fp);
             tiny_free(symbol_report);
         }
@@ -196,6 +228,21 @@ void assembly_context_destroy(assembly_context *ctx)
     source_file_cleanup(&ctx->source);
     source_file_cleanup(&ctx->options.defines);
     string_htable_destroy(ctx->binary_files);
+    pass_trace_destroy(ctx->trace);
+    cycle_log_destroy(ctx->cycle_log);
+    profile_destroy(ctx->profile);
+    test_suite_destroy(ctx->tests);
+    peephole_destroy(ctx->peephole);
+    tiny_free(ctx->long_branches);
+    zp_allocator_destroy(ctx->zp_vars);
+    dataflow_destroy(ctx->dataflow);
+    page_layout_destroy(ctx->pages);
+    dead_code_destroy(ctx->procs);
+    builtin_cache_destroy(ctx->functions);
+    loop_stack_destroy(ctx->loops);
+    conditional_destroy(ctx->conditions);
+    string_pool_destroy(ctx->strings);
+    compressor_destroy(ctx->compress);
     tiny_free(ctx->disassembly);
     tiny_free(ctx->output);
     tiny_free(ctx);
@@ -203,7 +250,7 @@ void assembly_context_destroy(assembly_context *ctx)
 
 assembly_context *assembly_context_create(options options)
 {
-    assembly_context *ctx = tiny_malloc(sizeof(assembly_context));
+    assembly_context *ctx = tiny_calloc(1, sizeof(assembly_context));
     ctx->output = tiny_malloc(sizeof(output));
     output_reset(ctx->output);
     ctx->options = options;
@@ -212,9 +259,24 @@ assembly_context *assembly_context_create(options options)
     ctx->passes = 0;
     ctx->disassembly_capacity = 4096;
     ctx->disassembly = tiny_calloc(4096, sizeof(char));
+    ctx->cycle_log = cycle_log_create();
+    ctx->profile = options.profile ? profile_create() : NULL;
+    ctx->tests = test_suite_create();
+    ctx->peephole = options.optimize ? peephole_create() : NULL;
+    ctx->zp_vars = zp_allocator_create();
+    ctx->dataflow = options.redundant ? dataflow_create(options.redundant == REDUNDANT_REMOVE) : NULL;
+    ctx->pages = page_layout_create();
+    ctx->procs = dead_code_create(options.case_sensitive);
+    ctx->functions = builtin_cache_create();
+    ctx->loops = loop_stack_create(options.case_sensitive);
+    ctx->conditions = conditional_create(options.case_sensitive);
+    ctx->strings = options.pool_strings ? string_pool_create() : NULL;
+    ctx->compress = compressor_create(options.compress_cache);
     assembly_context_reset(ctx);
     ctx->anonymous_labels_new->add_mode = 1;
     ctx->binary_files = string_htable_create(sizeof(binary_file));
     ctx->binary_files->dtor = binary_file_dtor;
+    ctx->encode = m6502_select_encoder(options.cpu);
+    ctx->trace = options.trace_passes ? pass_trace_create() : NULL;
     return ctx;
 }
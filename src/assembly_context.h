@@ -10,16 +10,31 @@
 #ifndef assembly_context_h
 #define assembly_context_h
 
+#include "cycles.h"
 #include "file.h"
 #include "m6502.h"
 #include "options.h"
+#include "source_manager.h"
 #include "symbol_table.h"
 #include <ctype.h>
 
 typedef struct output output;
 typedef struct token token;
 typedef struct anonymous_label_collection anonymous_label_collection;
+typedef struct builtin_cache builtin_cache;
+typedef struct conditional conditional;
+typedef struct compressor compressor;
+typedef struct dataflow dataflow;
+typedef struct dead_code dead_code;
+typedef struct loop_stack loop_stack;
+typedef struct page_layout page_layout;
 typedef struct string_htable string_htable;
+typedef struct string_pool string_pool;
+typedef struct pass_trace pass_trace;
+typedef struct peephole peephole;
+typedef struct profile profile;
+typedef struct test_suite test_suite;
+typedef struct zp_allocator zp_allocator;
 
 typedef struct assembly_context
 {
@@ -42,9 +57,31 @@ typedef struct assembly_context
     anonymous_label_collection *anonymous_labels_new;
     token *local_label;
     string_htable *binary_files;
+    pass_trace *trace;
+    m6502_encoder encode;
+    cycle_log *cycle_log;
+    cycle_range cycles;
+    profile *profile;
+    test_suite *tests;
+    peephole *peephole;
+    source_loc *long_branches;
+    size_t long_branch_count;
+    size_t long_branch_capacity;
+    zp_allocator *zp_vars;
+    dataflow *dataflow;
+    page_layout *pages;
+    dead_code *procs;
+    builtin_cache *functions;
+    loop_stack *loops;
+    conditional *conditions;
+    string_pool *strings;
+    compressor *compress;
     
 } assembly_context;
 
+/* the 1-based number of the pass being executed */
+#define ASSEMBLY_CONTEXT_PASS(ctx) ((ctx)->passes ? (ctx)->passes : 1)
+
 assembly_context *assembly_context_create(options options);
 void assembly_context_reset(assembly_context *ctx);
 void assembly_context_destroy(assembly_context *ctx);
@@ -0,0 +1,330 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "builtin_functions.h"
+#include "error.h"
+#include "evaluator.h"
+#include "memory.h"
+#include "token.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#define TAU 6.283185307179586
+
+/* sin and cos default to a circle of 256 steps and results in 8.8 fixed point */
+#define DEFAULT_PERIOD  256
+#define DEFAULT_SCALE   256
+
+static value domain_error(const token *where, int report, const char *message)
+{
+    if (report) {
+        tiny_error(where, ERROR_MODE_RECOVER, message);
+    }
+    return VALUE_UNDEFINED;
+}
+
+static value fcn_abs(const value *args, size_t count, const token *where, int report)
+{
+    return args[0] < 0 ? -args[0] : args[0];
+}
+
+static value fcn_min(const value *args, size_t count, const token *where, int report)
+{
+    value result = args[0];
+    for(size_t i = 1; i < count; i++) {
+        if (args[i] < result) {
+            result = args[i];
+        }
+    }
+    return result;
+}
+
+static value fcn_max(const value *args, size_t count, const token *where, int report)
+{
+    value result = args[0];
+    for(size_t i = 1; i < count; i++) {
+        if (args[i] > result) {
+            result = args[i];
+        }
+    }
+    return result;
+}
+
+/* divide and round half away from zero, for scaling fixed-point values */
+static value fcn_round(const value *args, size_t count, const token *where, int report)
+{
+    value dividend = args[0], divisor = args[1];
+    if (!divisor) {
+        return domain_error(where, report, "Divide by zero error");
+    }
+    int negative = (dividend < 0) != (divisor < 0);
+    value magnitude = dividend < 0 ? -dividend : dividend;
+    value by = divisor < 0 ? -divisor : divisor;
+    value quotient = (magnitude + by / 2) / by;
+    return negative ? -quotient : quotient;
+}
+
+static value fcn_pow(const value *args, size_t count, const token *where, int report)
+{
+    value base = args[0], exponent = args[1];
+    if (exponent < 0) {
+        return domain_error(where, report, "Exponent cannot be negative");
+    }
+    value result = 1;
+    while (exponent) {
+        if (exponent & 1) {
+            if (base && (result > INT64_MAX / llabs(base) || result < -(INT64_MAX / llabs(base)))) {
+                return domain_error(where, report, "Arithmetic overflow");
+            }
+            result *= base;
+        }
+        exponent >>= 1;
+        if (exponent) {
+            if (llabs(base) > 3037000499LL) {
+                return domain_error(where, report, "Arithmetic overflow");
+            }
+            base *= base;
+        }
+    }
+    return result;
+}
+
+static uint64_t isqrt(uint64_t n)
+{
+    uint64_t root = 0, bit = 1ULL << 62;
+    while (bit > n) {
+        bit >>= 2;
+    }
+    while (bit) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+/* the square root, truncated, with an optional number of fractional bits */
+static value fcn_sqrt(const value *args, size_t count, const token *where, int report)
+{
+    value bits = count > 1 ? args[1] : 0;
+    if (args[0] < 0) {
+        return domain_error(where, report, "Square root of a negative number");
+    }
+    if (bits < 0 || bits > 16) {
+        return domain_error(where, report, "Illegal quantity");
+    }
+    if (bits && args[0] >= (value)1 << (62 - 2 * bits)) {
+        return domain_error(where, report, "Arithmetic overflow");
+    }
+    return (value)isqrt((uint64_t)args[0] << (2 * bits));
+}
+
+static value fcn_log(const value *args, size_t count, const token *where, int report)
+{
+    if (args[0] <= 0) {
+        return domain_error(where, report, "Logarithm of a number that is not positive");
+    }
+    value scale = count > 1 ? args[1] : 1;
+    return llround(scale * log((double)args[0]));
+}
+
+/* without a scale the result is the exact integer logarithm, the index of the highest bit set */
+static value fcn_log2(const value *args, size_t count, const token *where, int report)
+{
+    if (args[0] <= 0) {
+        return domain_error(where, report, "Logarithm of a number that is not positive");
+    }
+    if (count == 1) {
+        value result = 0;
+        for(value n = args[0]; n > 1; n >>= 1) {
+            result++;
+        }
+        return result;
+    }
+    return llround(args[1] * log2((double)args[0]));
+}
+
+static value wave(const value *args, size_t count, const token *where, int report, int quarter_offset)
+{
+    value scale = count > 1 ? args[1] : DEFAULT_SCALE;
+    value period = count > 2 ? args[2] : DEFAULT_PERIOD;
+    if (period <= 0) {
+        return domain_error(where, report, "Illegal quantity");
+    }
+    value angle = args[0] % period;
+    if (angle < 0) {
+        angle += period;
+    }
+    if ((angle * 4) % period == 0) {
+        /* the quarter turns are exact */
+        static const int quadrants[] = { 0, 1, 0, -1 };
+        return scale * quadrants[((angle * 4) / period + quarter_offset) % 4];
+    }
+    double radians = TAU * (double)angle / (double)period;
+    return llround(scale * (quarter_offset ? cos(radians) : sin(radians)));
+}
+
+static value fcn_sin(const value *args, size_t count, const token *where, int report)
+{
+    return wave(args, count, where, report, 0);
+}
+
+static value fcn_cos(const value *args, size_t count, const token *where, int report)
+{
+    return wave(args, count, where, report, 1);
+}
+
+static value fcn_bank(const value *args, size_t count, const token *where, int report)
+{
+    return (args[0] >> 16) & 0xff;
+}
+
+static value fcn_page(const value *args, size_t count, const token *where, int report)
+{
+    return (args[0] >> 8) & 0xff;
+}
+
+/* a string argument is passed as its length */
+static value fcn_len(const value *args, size_t count, const token *where, int report)
+{
+    return args[0];
+}
+
+static const builtin_function builtin_functions[] =
+{
+    { "abs",    1, 1,                           fcn_abs },
+    { "bank",   1, 1,                           fcn_bank },
+    { "cos",    1, 3,                           fcn_cos },
+    { "len",    1, 1,                           fcn_len, 1 },
+    { "log",    1, 2,                           fcn_log },
+    { "log2",   1, 2,                           fcn_log2 },
+    { "max",    2, BUILTIN_FUNCTION_MAX_ARGS,   fcn_max },
+    { "min",    2, BUILTIN_FUNCTION_MAX_ARGS,   fcn_min },
+    { "page",   1, 1,                           fcn_page },
+    { "pow",    2, 2,                           fcn_pow },
+    { "round",  2, 2,                           fcn_round },
+    { "sin",    1, 3,                           fcn_sin },
+    { "sqrt",   1, 2,                           fcn_sqrt }
+};
+
+const builtin_function *builtin_function_lookup(const char *name)
+{
+    size_t lo = 0, hi = sizeof builtin_functions / sizeof builtin_functions[0];
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int compare = strcasecmp(name, builtin_functions[mid].name);
+        if (!compare) {
+            return builtin_functions + mid;
+        }
+        if (compare > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+value builtin_string_length(const token *string_literal)
+{
+    TOKEN_GET_TEXT(string_literal, text);
+    const char *c = text + 1;
+    const char *end = text + strlen(text) - 1;
+    value length = 0;
+    while (c < end) {
+        evaluate_char_literal(c, &c);
+        length++;
+    }
+    return length;
+}
+
+static size_t hash_call(const builtin_function *function, const value *args, size_t count)
+{
+    size_t hash = (size_t)(function - builtin_functions) + 1;
+    for(size_t i = 0; i < count; i++) {
+        hash = (hash ^ (size_t)args[i]) * 1099511628211UL;
+    }
+    return hash;
+}
+
+static builtin_cache_entry *find_entry(builtin_cache_entry *entries, size_t capacity, const builtin_function *function, const value *args, size_t count)
+{
+    size_t ix = hash_call(function, args, count) & (capacity - 1);
+    for(;;) {
+        builtin_cache_entry *entry = entries + ix;
+        if (!entry->function ||
+            (entry->function == function && entry->count == count && !memcmp(entry->args, args, count * sizeof(value)))) {
+            return entry;
+        }
+        ix = (ix + 1) & (capacity - 1);
+    }
+}
+
+static void grow(builtin_cache *cache)
+{
+    size_t capacity = cache->capacity * 2;
+    builtin_cache_entry *entries = tiny_calloc(capacity, sizeof(builtin_cache_entry));
+    for(size_t i = 0; i < cache->capacity; i++) {
+        const builtin_cache_entry *entry = cache->entries + i;
+        if (entry->function) {
+            *find_entry(entries, capacity, entry->function, entry->args, entry->count) = *entry;
+        }
+    }
+    tiny_free(cache->entries);
+    cache->entries = entries;
+    cache->capacity = capacity;
+}
+
+value builtin_function_call(builtin_cache *cache, const builtin_function *function, const value *args, size_t count, const token *where, int report)
+{
+    if (!cache || count > BUILTIN_CACHE_MAX_ARGS) {
+        return function->callback(args, count, where, report);
+    }
+    builtin_cache_entry *entry = find_entry(cache->entries, cache->capacity, function, args, count);
+    if (entry->function) {
+        cache->hits++;
+        return entry->result;
+    }
+    value result = function->callback(args, count, where, report);
+    if (result == VALUE_UNDEFINED) {
+        /* an error is reported again while the arguments may still change */
+        return result;
+    }
+    entry->function = function;
+    entry->count = count;
+    memcpy(entry->args, args, count * sizeof(value));
+    entry->result = result;
+    if (++cache->count * 2 >= cache->capacity) {
+        grow(cache);
+    }
+    return result;
+}
+
+builtin_cache *builtin_cache_create(void)
+{
+    builtin_cache *cache = tiny_calloc(1, sizeof(builtin_cache));
+    cache->capacity = 256;
+    cache->entries = tiny_calloc(cache->capacity, sizeof(builtin_cache_entry));
+    return cache;
+}
+
+void builtin_cache_destroy(builtin_cache *cache)
+{
+    if (!cache) {
+        return;
+    }
+    tiny_free(cache->entries);
+    tiny_free(cache);
+}
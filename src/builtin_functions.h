@@ -0,0 +1,68 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef builtin_functions_h
+#define builtin_functions_h
+
+#include "value.h"
+#include <stddef.h>
+
+typedef struct token token;
+
+#define BUILTIN_FUNCTION_MAX_ARGS   16
+
+/* arguments up to this many are part of a memoized call's key */
+#define BUILTIN_CACHE_MAX_ARGS      4
+
+/* compute a function's result from its evaluated arguments, reporting a domain error at where if report is set */
+typedef value (*builtin_function_callback)(const value *args, size_t count, const token *where, int report);
+
+/* a function callable from expressions; every builtin is pure, so a call can be memoized by its arguments */
+typedef struct builtin_function
+{
+    const char *name;
+    size_t min_args;
+    size_t max_args;
+    builtin_function_callback callback;
+    int string_arg;
+
+} builtin_function;
+
+typedef struct builtin_cache_entry
+{
+    const builtin_function *function;
+    size_t count;
+    value args[BUILTIN_CACHE_MAX_ARGS];
+    value result;
+
+} builtin_cache_entry;
+
+/* the results of calls already made, kept across passes */
+typedef struct builtin_cache
+{
+    builtin_cache_entry *entries;
+    size_t count;
+    size_t capacity;
+    size_t hits;
+
+} builtin_cache;
+
+/* the builtin function with the name, in any case, or NULL */
+const builtin_function *builtin_function_lookup(const char *name);
+
+/* the number of characters in a string literal, with its escape sequences decoded */
+value builtin_string_length(const token *string_literal);
+
+/* call the function, looking its result up in the cache first if there is one */
+value builtin_function_call(builtin_cache *cache, const builtin_function *function, const value *args, size_t count, const token *where, int report);
+
+builtin_cache *builtin_cache_create(void);
+void builtin_cache_destroy(builtin_cache *cache);
+
+#endif /* builtin_functions_h */
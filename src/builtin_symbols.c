@@ -67,11 +67,13 @@ static const value builtin_symbol_values[BUILTIN_NUMBER] =
 };
 
 string_htable *BUILTIN_SYMBOL_TABLE = NULL;
+static const htable_entry *current_pass_entry = NULL;
 
 void builtin_init(int case_sensitive)
 {
     if (!BUILTIN_SYMBOL_TABLE) {
         BUILTIN_SYMBOL_TABLE = string_htable_create_from_lists(builtin_symbol_names, (const htable_value_ptr)builtin_symbol_values, sizeof(value), BUILTIN_NUMBER, case_sensitive);
+        current_pass_entry = string_htable_find_bucket(BUILTIN_SYMBOL_TABLE, "CURRENT_PASS");
     }
 }
 
@@ -81,4 +83,10 @@ void builtin_cleanup()
         string_htable_destroy(BUILTIN_SYMBOL_TABLE);
     }
     BUILTIN_SYMBOL_TABLE = NULL;
+    current_pass_entry = NULL;
+}
+
+int builtin_is_current_pass(const htable_entry *entry)
+{
+    return entry == current_pass_entry;
 }
@@ -9,6 +9,7 @@
 #ifndef builtin_symbols_h
 #define builtin_symbols_h
 
+typedef struct htable_entry htable_entry;
 typedef struct string_htable string_htable;
 
 extern string_htable *BUILTIN_SYMBOL_TABLE;
@@ -16,4 +17,7 @@ extern string_htable *BUILTIN_SYMBOL_TABLE;
 void builtin_init(int case_sensitive);
 void builtin_cleanup(void);
 
+/* CURRENT_PASS is resolved per symbol table, since variants run concurrently */
+int builtin_is_current_pass(const htable_entry *entry);
+
 #endif /* builtin_symbols_h */
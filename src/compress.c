@@ -0,0 +1,467 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "assembly_context.h"
+#include "compress.h"
+#include "error.h"
+#include "memory.h"
+#include "output.h"
+#include "thread_pool.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ENTRY_EMPTY     0
+#define ENTRY_PENDING   1
+#define ENTRY_READY     2
+#define ENTRY_STORED    3
+
+#define MAX_LITERALS    0x7f
+#define MAX_MATCH       (0x7f + COMPRESS_MIN_MATCH)
+#define MAX_DISTANCE    0xffff
+#define HASH_BITS       12
+#define CHAIN_LIMIT     64
+
+/* changing the format changes every hash, so a cache file from before is not used */
+#define FORMAT_VERSION  2
+
+static const char cache_magic[4] = { 'T', '6', 'Z', FORMAT_VERSION };
+
+/* the cache file starts with the run that last wrote it; the first save of a run
+   rewrites the file and the saves of the other variants in the run add to it */
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t run_id;
+
+static uint64_t hash_bytes(const unsigned char *bytes, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL ^ FORMAT_VERSION;
+    for(size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static compress_entry *find_entry(compress_entry *entries, size_t capacity, uint64_t hash, size_t raw_length)
+{
+    size_t ix = (size_t)hash & (capacity - 1);
+    for(;;) {
+        compress_entry *entry = entries + ix;
+        if (entry->state == ENTRY_EMPTY || (entry->hash == hash && entry->raw_length == raw_length)) {
+            return entry;
+        }
+        ix = (ix + 1) & (capacity - 1);
+    }
+}
+
+static compress_entry *add_entry(compressor *compressor, uint64_t hash, size_t raw_length)
+{
+    if ((compressor->count + 1) * 2 >= compressor->capacity) {
+        size_t capacity = compressor->capacity * 2;
+        compress_entry *entries = tiny_calloc(capacity, sizeof(compress_entry));
+        for(size_t i = 0; i < compressor->capacity; i++) {
+            const compress_entry *entry = compressor->entries + i;
+            if (entry->state != ENTRY_EMPTY) {
+                *find_entry(entries, capacity, entry->hash, entry->raw_length) = *entry;
+            }
+        }
+        tiny_free(compressor->entries);
+        compressor->entries = entries;
+        compressor->capacity = capacity;
+    }
+    compress_entry *entry = find_entry(compressor->entries, compressor->capacity, hash, raw_length);
+    if (entry->state == ENTRY_EMPTY) {
+        compressor->count++;
+        entry->hash = hash;
+        entry->raw_length = raw_length;
+        entry->used_pass = -1;
+    }
+    return entry;
+}
+
+static void write_number(FILE *fp, uint64_t number, int size)
+{
+    for(int i = 0; i < size; i++) {
+        fputc((int)(number >> (i * 8)) & 0xff, fp);
+    }
+}
+
+static int read_number(FILE *fp, uint64_t *number, int size)
+{
+    *number = 0;
+    for(int i = 0; i < size; i++) {
+        int c = fgetc(fp);
+        if (c == EOF) {
+            return 0;
+        }
+        *number |= (uint64_t)c << (i * 8);
+    }
+    return 1;
+}
+
+static void load(compressor *compressor)
+{
+    FILE *fp = fopen(compressor->cache_file, "rb");
+    if (!fp) {
+        return;
+    }
+    char magic[sizeof cache_magic];
+    uint64_t writer;
+    if (fread(magic, 1, sizeof magic, fp) == sizeof magic && !memcmp(magic, cache_magic, sizeof magic) &&
+        read_number(fp, &writer, 8)) {
+        uint64_t hash, raw_length, length;
+        while (read_number(fp, &hash, 8) && read_number(fp, &raw_length, 4) && read_number(fp, &length, 4)) {
+            unsigned char *bytes = tiny_malloc(length ? length : 1);
+            if (fread(bytes, 1, length, fp) != length) {
+                /* a record cut short by a build that did not finish */
+                tiny_free(bytes);
+                break;
+            }
+            compress_entry *entry = add_entry(compressor, hash, raw_length);
+            tiny_free(entry->bytes);
+            entry->bytes = bytes;
+            entry->length = length;
+            entry->state = ENTRY_STORED;
+        }
+    }
+    fclose(fp);
+}
+
+compressor *compressor_create(const char *cache_file)
+{
+    compressor *compressor = tiny_calloc(1, sizeof(struct compressor));
+    compressor->capacity = 64;
+    compressor->entries = tiny_calloc(compressor->capacity, sizeof(compress_entry));
+    compressor->cache_file = cache_file;
+    compressor->counted_pass = -1;
+    if (cache_file) {
+        load(compressor);
+    }
+    return compressor;
+}
+
+void compressor_destroy(compressor *compressor)
+{
+    if (!compressor) {
+        return;
+    }
+    for(size_t i = 0; i < compressor->capacity; i++) {
+        tiny_free(compressor->entries[i].bytes);
+    }
+    for(size_t i = 0; i < compressor->job_count; i++) {
+        tiny_free(compressor->jobs[i].raw);
+    }
+    tiny_free(compressor->entries);
+    tiny_free(compressor->jobs);
+    tiny_free(compressor->scratch);
+    tiny_free(compressor);
+}
+
+void compress_begin(compressor *compressor, assembly_context *context, const token *directive)
+{
+    if (compressor->main) {
+        tiny_error(directive, ERROR_MODE_RECOVER, "Compressed blocks cannot be nested");
+        return;
+    }
+    if (!compressor->scratch) {
+        compressor->scratch = tiny_malloc(sizeof(output));
+    }
+    output *main = context->output;
+    output_reset(compressor->scratch);
+    compressor->scratch->pc = main->pc;
+    compressor->scratch->logical_pc = main->logical_pc;
+    compressor->scratch->pc_overflow_handler = main->pc_overflow_handler;
+    compressor->start = main->pc;
+    compressor->logical_start = main->logical_pc;
+    compressor->directive = directive;
+    compressor->main = main;
+    context->output = compressor->scratch;
+}
+
+/* whether the compressed bytes unpack to exactly the raw bytes; a copy matches
+   when each byte it covers equals the one the distance back, already checked */
+static int unpacks_to(const unsigned char *bytes, size_t length, const unsigned char *raw, size_t raw_length)
+{
+    size_t in = 0, out = 0;
+    while (in < length) {
+        size_t run = bytes[in++];
+        if (!run) {
+            return in == length && out == raw_length;
+        }
+        if (run <= MAX_LITERALS) {
+            if (run > length - in || run > raw_length - out || memcmp(bytes + in, raw + out, run)) {
+                return 0;
+            }
+            in += run;
+            out += run;
+            continue;
+        }
+        if (length - in < 2) {
+            return 0;
+        }
+        size_t distance = (size_t)bytes[in] | (size_t)bytes[in + 1] << 8;
+        size_t count = (run & 0x7f) + COMPRESS_MIN_MATCH;
+        in += 2;
+        if (!distance || distance > out || count > raw_length - out) {
+            return 0;
+        }
+        for(size_t end = out + count; out < end; out++) {
+            if (raw[out] != raw[out - distance]) {
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static void queue(compressor *compressor, uint64_t hash, const unsigned char *raw, size_t raw_length)
+{
+    if (compressor->job_count == compressor->job_capacity) {
+        compressor->job_capacity = compressor->job_capacity ? compressor->job_capacity * 2 : 16;
+        compressor->jobs = tiny_realloc(compressor->jobs, compressor->job_capacity * sizeof(compress_job));
+    }
+    compress_job *job = compressor->jobs + compressor->job_count++;
+    *job = (compress_job){ .hash = hash, .raw_length = raw_length };
+    job->raw = tiny_malloc(raw_length ? raw_length : 1);
+    memcpy(job->raw, raw, raw_length);
+}
+
+void compress_end(compressor *compressor, assembly_context *context, const token *directive)
+{
+    if (!compressor->main) {
+        tiny_error(directive, ERROR_MODE_RECOVER, "Directive \".endcompress\" without a matching \".compress\"");
+        return;
+    }
+    output *scratch = context->output;
+    output *main = compressor->main;
+    compressor->main = NULL;
+    context->output = main;
+    main->pc_overflow_handler = scratch->pc_overflow_handler;
+
+    /* the block's bytes are this directive's, once they are compressed */
+    context->start_pc = main->pc;
+    context->logical_start_pc = main->logical_pc;
+    if (scratch->pc < compressor->start) {
+        tiny_error(directive, ERROR_MODE_RECOVER, "Program counter moved back in a compressed block");
+        return;
+    }
+    const unsigned char *raw = (const unsigned char*)scratch->buffer + compressor->start;
+    size_t raw_length = (size_t)(scratch->pc - compressor->start);
+    uint64_t hash = hash_bytes(raw, raw_length);
+    compress_entry *entry = add_entry(compressor, hash, raw_length);
+    if (context->passes != compressor->counted_pass) {
+        compressor->counted_pass = context->passes;
+        compressor->blocks = compressor->raw_bytes = compressor->packed_bytes = 0;
+    }
+    compressor->blocks++;
+    compressor->raw_bytes += raw_length;
+    if (entry->state == ENTRY_EMPTY && context->passes) {
+        /* a block that changed after the first pass is compressed now, so the
+           addresses after it settle on its compressed size */
+        entry->bytes = tiny_malloc(raw_length + raw_length / MAX_LITERALS + 2);
+        entry->length = compress_lz(raw, raw_length, entry->bytes);
+        entry->state = ENTRY_READY;
+    }
+    if ((entry->state == ENTRY_READY || entry->state == ENTRY_STORED) &&
+        !unpacks_to(entry->bytes, entry->length, raw, raw_length)) {
+        unsigned char *bytes = tiny_malloc(raw_length + raw_length / MAX_LITERALS + 2);
+        size_t length = compress_lz(raw, raw_length, bytes);
+        if (entry->used_pass == context->passes) {
+            /* another block with the same hash used the entry in this pass, so this one is compressed for this use only */
+            compressor->packed_bytes += length;
+            output_add_values(main, (const char*)bytes, length);
+            tiny_free(bytes);
+            return;
+        }
+        /* the entry is from another block or a damaged cache file, and this block takes it over */
+        tiny_free(entry->bytes);
+        entry->bytes = bytes;
+        entry->length = length;
+        entry->state = ENTRY_READY;
+    }
+    if (entry->state == ENTRY_READY || entry->state == ENTRY_STORED) {
+        entry->used_pass = context->passes;
+        compressor->packed_bytes += entry->length;
+        output_add_values(main, (const char*)entry->bytes, entry->length);
+        return;
+    }
+    if (entry->state == ENTRY_EMPTY) {
+        entry->state = ENTRY_PENDING;
+        queue(compressor, hash, raw, raw_length);
+    }
+    /* assembled as it is until the pass ends and it is compressed */
+    compressor->packed_bytes += raw_length;
+    output_add_values(main, (const char*)raw, raw_length);
+    context->pass_needed = 1;
+}
+
+static void run_job(void *job_ptr)
+{
+    compress_job *job = (compress_job*)job_ptr;
+    job->bytes = tiny_malloc(job->raw_length + job->raw_length / MAX_LITERALS + 2);
+    job->length = compress_lz(job->raw, job->raw_length, job->bytes);
+}
+
+size_t compress_finish_pass(compressor *compressor, assembly_context *context)
+{
+    if (compressor->main) {
+        tiny_error(compressor->directive, ERROR_MODE_RECOVER, "Directive \".compress\" is missing \".endcompress\"");
+        context->output = compressor->main;
+        compressor->main = NULL;
+    }
+    size_t count = compressor->job_count;
+    if (!count) {
+        return 0;
+    }
+    void **args = tiny_malloc(count * sizeof(void*));
+    for(size_t i = 0; i < count; i++) {
+        args[i] = compressor->jobs + i;
+    }
+    thread_pool_run(run_job, args, count, thread_pool_default_size());
+    for(size_t i = 0; i < count; i++) {
+        compress_job *job = compressor->jobs + i;
+        compress_entry *entry = find_entry(compressor->entries, compressor->capacity, job->hash, job->raw_length);
+        entry->bytes = job->bytes;
+        entry->length = job->length;
+        entry->state = ENTRY_READY;
+        tiny_free(job->raw);
+    }
+    compressor->job_count = 0;
+    tiny_free(args);
+    return count;
+}
+
+static void add_literals(const unsigned char *in, size_t count, unsigned char *out, size_t *out_length)
+{
+    while (count) {
+        size_t run = count < MAX_LITERALS ? count : MAX_LITERALS;
+        out[(*out_length)++] = (unsigned char)run;
+        memcpy(out + *out_length, in, run);
+        *out_length += run;
+        in += run;
+        count -= run;
+    }
+}
+
+static size_t hash4(const unsigned char *in)
+{
+    uint32_t word = (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+    return (word * 2654435761U) >> (32 - HASH_BITS);
+}
+
+size_t compress_lz(const unsigned char *in, size_t length, unsigned char *out)
+{
+    int *head = tiny_malloc((1 << HASH_BITS) * sizeof(int));
+    int *prev = tiny_malloc((length ? length : 1) * sizeof(int));
+    for(int i = 0; i < (1 << HASH_BITS); i++) {
+        head[i] = -1;
+    }
+    size_t out_length = 0, literals = 0, i = 0;
+    while (i < length) {
+        size_t best = 0, distance = 0;
+        if (i + COMPRESS_MIN_MATCH <= length) {
+            size_t longest = length - i < MAX_MATCH ? length - i : MAX_MATCH;
+            int steps = 0;
+            for(int candidate = head[hash4(in + i)]; candidate >= 0 && i - candidate <= MAX_DISTANCE && steps < CHAIN_LIMIT;
+                candidate = prev[candidate], steps++) {
+                size_t match = 0;
+                while (match < longest && in[candidate + match] == in[i + match]) {
+                    match++;
+                }
+                if (match > best) {
+                    best = match;
+                    distance = i - candidate;
+                    if (match == longest) {
+                        break;
+                    }
+                }
+            }
+        }
+        size_t advance = best >= COMPRESS_MIN_MATCH ? best : 1;
+        if (best >= COMPRESS_MIN_MATCH) {
+            add_literals(in + literals, i - literals, out, &out_length);
+            out[out_length++] = (unsigned char)(0x80 | (best - COMPRESS_MIN_MATCH));
+            out[out_length++] = (unsigned char)(distance & 0xff);
+            out[out_length++] = (unsigned char)(distance >> 8);
+            literals = i + best;
+        }
+        for(size_t end = i + advance; i < end; i++) {
+            if (i + COMPRESS_MIN_MATCH <= length) {
+                size_t h = hash4(in + i);
+                prev[i] = head[h];
+                head[h] = (int)i;
+            }
+        }
+    }
+    add_literals(in + literals, length - literals, out, &out_length);
+    out[out_length++] = 0;
+    tiny_free(prev);
+    tiny_free(head);
+    return out_length;
+}
+
+/* whether the file was last written by this run */
+static int written_this_run(const char *file_name)
+{
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp) {
+        return 0;
+    }
+    char magic[sizeof cache_magic];
+    uint64_t writer;
+    int written = fread(magic, 1, sizeof magic, fp) == sizeof magic && !memcmp(magic, cache_magic, sizeof magic) &&
+        read_number(fp, &writer, 8) && writer == run_id;
+    fclose(fp);
+    return written;
+}
+
+void compressor_save(compressor *compressor)
+{
+    if (!compressor->cache_file) {
+        return;
+    }
+    pthread_mutex_lock(&save_lock);
+    if (!run_id) {
+        run_id = ((uint64_t)time(NULL) << 32 ^ (uint64_t)getpid()) | 1;
+    }
+    int append = written_this_run(compressor->cache_file);
+    FILE *fp = fopen(compressor->cache_file, append ? "ab" : "wb");
+    if (!fp) {
+        pthread_mutex_unlock(&save_lock);
+        tiny_warn(NULL, "Warning: Could not save compressed blocks to file '%s'.\n", compressor->cache_file);
+        return;
+    }
+    if (!append) {
+        fwrite(cache_magic, 1, sizeof cache_magic, fp);
+        write_number(fp, run_id, 8);
+    }
+    for(size_t i = 0; i < compressor->capacity; i++) {
+        compress_entry *entry = compressor->entries + i;
+        if ((entry->state != ENTRY_READY && entry->state != ENTRY_STORED) || entry->used_pass != compressor->counted_pass) {
+            continue;
+        }
+        write_number(fp, entry->hash, 8);
+        write_number(fp, entry->raw_length, 4);
+        write_number(fp, entry->length, 4);
+        fwrite(entry->bytes, 1, entry->length, fp);
+        entry->state = ENTRY_STORED;
+    }
+    fclose(fp);
+    pthread_mutex_unlock(&save_lock);
+}
+
+void compressor_report(const compressor *compressor, FILE *stream)
+{
+    if (!compressor->blocks) {
+        return;
+    }
+    fprintf(stream, "---------------------------------\n");
+    fprintf(stream, "Compression: %zu blocks, %zu bytes compressed to %zu\n",
+        compressor->blocks, compressor->raw_bytes, compressor->packed_bytes);
+}
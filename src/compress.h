@@ -0,0 +1,106 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef compress_h
+#define compress_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct assembly_context assembly_context;
+typedef struct output output;
+typedef struct token token;
+
+/*
+
+The bytes assembled between .compress and .endcompress are written to a
+scratch output and replaced by their compressed form. Compressed blocks
+are kept by a hash of their contents. On the first pass a block not
+compressed yet is assembled as it is for now, and forces another pass.
+When the pass ends, all such blocks are compressed together on a thread
+pool. A block that changes in a later pass is compressed at once. A block whose
+bytes do not change is compressed only once. With --compress-cache it is
+also compressed only once across builds. The cache file is rewritten with
+only the blocks the last pass used, and a block found by its hash is used
+only once it is checked to unpack to the block's bytes.
+
+The format is a series of runs ending with a zero byte. A byte from $01
+to $7f is followed by that many literal bytes. A byte from $80 up copies
+(byte & $7f) + 4 bytes from the output already written. The copy starts
+the distance back given by the next two bytes, low byte first.
+**/
+
+#define COMPRESS_MIN_MATCH  4
+
+typedef struct compress_entry
+{
+    uint64_t hash;
+    size_t raw_length;
+    unsigned char *bytes;
+    size_t length;
+    int state;
+    int used_pass;
+
+} compress_entry;
+
+/* a block to compress when the pass ends */
+typedef struct compress_job
+{
+    uint64_t hash;
+    unsigned char *raw;
+    size_t raw_length;
+    unsigned char *bytes;
+    size_t length;
+
+} compress_job;
+
+typedef struct compressor
+{
+    output *main;
+    output *scratch;
+    const token *directive;
+    int start;
+    int logical_start;
+    compress_entry *entries;
+    size_t count;
+    size_t capacity;
+    compress_job *jobs;
+    size_t job_count;
+    size_t job_capacity;
+    const char *cache_file;
+    int counted_pass;
+    size_t blocks;
+    size_t raw_bytes;
+    size_t packed_bytes;
+
+} compressor;
+
+/* a compressor that loads and saves its results in cache_file, if it is not NULL */
+compressor *compressor_create(const char *cache_file);
+void compressor_destroy(compressor *compressor);
+
+/* send the output to a scratch buffer until the block ends */
+void compress_begin(compressor *compressor, assembly_context *context, const token *directive);
+
+/* replace the bytes of the block with their compressed form */
+void compress_end(compressor *compressor, assembly_context *context, const token *directive);
+
+/* close a block left open and compress the blocks the pass could not find; returns the number compressed */
+size_t compress_finish_pass(compressor *compressor, assembly_context *context);
+
+/* compress length bytes to out, which must hold length + length / 127 + 2 bytes; returns the compressed length */
+size_t compress_lz(const unsigned char *in, size_t length, unsigned char *out);
+
+/* rewrite the cache file with the blocks the last pass used; variants of one run that share the file all keep theirs */
+void compressor_save(compressor *compressor);
+
+void compressor_report(const compressor *compressor, FILE *stream);
+
+#endif /* compress_h */
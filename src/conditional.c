@@ -0,0 +1,201 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "assembly_context.h"
+#include "conditional.h"
+#include "error.h"
+#include "evaluator.h"
+#include "expression.h"
+#include "memory.h"
+#include "operand.h"
+#include "program.h"
+#include "statement.h"
+#include "string_htable.h"
+#include "symbol_table.h"
+#include "token.h"
+
+conditional *conditional_create(int case_sensitive)
+{
+    conditional *conditions = tiny_calloc(1, sizeof(conditional));
+    conditions->address_symbols = string_htable_create(sizeof(int));
+    conditions->address_symbols->case_sensitive = case_sensitive;
+    return conditions;
+}
+
+void conditional_destroy(conditional *conditions)
+{
+    if (!conditions) {
+        return;
+    }
+    string_htable_destroy(conditions->address_symbols);
+    tiny_free(conditions->decisions);
+    tiny_free(conditions);
+}
+
+void conditional_add_address(conditional *conditions, const char *name)
+{
+    if (!string_htable_contains(conditions->address_symbols, name)) {
+        int present = 1;
+        string_htable_add(conditions->address_symbols, name, (const htable_value_ptr)&present);
+    }
+}
+
+void conditional_read_symbol(conditional *conditions, const char *name)
+{
+    if (!conditions->reads_address && conditions->address_symbols->count &&
+        string_htable_contains(conditions->address_symbols, name)) {
+        conditions->reads_address = 1;
+    }
+}
+
+int conditional_nesting(const statement *statement)
+{
+    if (!statement->instruction) {
+        return 0;
+    }
+    switch (statement->instruction->type) {
+        case TOKEN_IF:
+        case TOKEN_IFDEF:
+        case TOKEN_IFNDEF:  return 1;
+        case TOKEN_ENDIF:   return -1;
+        default:            return 0;
+    }
+}
+
+/* the outcome of the condition, or unknown if it cannot be evaluated */
+static int test(assembly_context *context, const statement *statement, int report)
+{
+    token_type directive = statement->instruction->type;
+    const operand *oper = statement->operand;
+    const pseudo_op_arg **args = oper ? (const pseudo_op_arg**)oper->pseudo_op_arg_args.args->data : NULL;
+    const expression *expr = NULL;
+    if (oper && oper->pseudo_op_arg_args.args->count == 1 && args[0]->arg_type == PSEUDO_OP_EXPRESSION) {
+        expr = args[0]->arg.expression;
+    }
+    if (directive == TOKEN_IF) {
+        if (!expr) {
+            if (report) {
+                tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".if\" expects a condition");
+            }
+            return CONDITIONAL_UNKNOWN;
+        }
+        value result = evaluate_expression(context, expr);
+        return result == VALUE_UNDEFINED ? CONDITIONAL_UNKNOWN : result != 0;
+    }
+    if (!expr || expr->type != TYPE_IDENT) {
+        if (report) {
+            tiny_error(statement->instruction, ERROR_MODE_RECOVER, directive == TOKEN_IFDEF ?
+                "Directive \".ifdef\" expects a symbol" : "Directive \".ifndef\" expects a symbol");
+        }
+        return CONDITIONAL_UNKNOWN;
+    }
+    TOKEN_GET_TEXT(expr->token, name);
+    int defined = symbol_exists(context->sym_tab, name);
+    return directive == TOKEN_IFDEF ? defined : !defined;
+}
+
+static const conditional_decision *find_decision(const conditional *conditions, const statement *statement)
+{
+    size_t lo = 0, hi = conditions->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (conditions->decisions[mid].index < statement->index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < conditions->count && conditions->decisions[lo].index == statement->index) {
+        return conditions->decisions + lo;
+    }
+    return NULL;
+}
+
+int conditional_decide(assembly_context *context, const statement *statement)
+{
+    context->conditions->reads_address = 0;
+    int taken = test(context, statement, 0);
+    if (taken == CONDITIONAL_UNKNOWN || context->conditions->reads_address) {
+        /* left to the executor, which sees the final addresses */
+        return CONDITIONAL_UNKNOWN;
+    }
+    conditional *conditions = context->conditions;
+    if (conditions->count == conditions->capacity) {
+        conditions->capacity = conditions->capacity ? conditions->capacity * 2 : 32;
+        conditions->decisions = tiny_realloc(conditions->decisions, conditions->capacity * sizeof(conditional_decision));
+    }
+    /* statements are parsed in the order of their indices, so the decisions stay sorted */
+    conditions->decisions[conditions->count].index = statement->index;
+    conditions->decisions[conditions->count++].taken = taken;
+    return taken;
+}
+
+int conditional_is_decided(const conditional *conditions, const statement *statement)
+{
+    return find_decision(conditions, statement) != NULL;
+}
+
+/* the statement after the matching .endif, or after the matching .else if to_else is set */
+static size_t skip_block(const program *program, size_t index, int to_else)
+{
+    int depth = 0;
+    for(size_t i = index + 1; i < program->count; i++) {
+        if (program->kinds[i] != PROGRAM_KIND_PSEUDO_OP) {
+            continue;
+        }
+        token_type directive = program->statements[i]->instruction->type;
+        if (conditional_nesting(program->statements[i]) > 0) {
+            depth++;
+        } else if ((directive == TOKEN_ELSE && !depth && to_else) || (directive == TOKEN_ENDIF && !depth--)) {
+            return i + 1;
+        }
+    }
+    return program->count;
+}
+
+/* anonymous labels are matched up by the order they are defined in, which must not change after the first pass */
+static void check_anonymous_labels(const program *program, size_t index)
+{
+    size_t end = skip_block(program, index, 0);
+    for(size_t i = index + 1; i < end; i++) {
+        const token *label = program->statements[i]->label;
+        if (label && (label->type == TOKEN_PLUS || label->type == TOKEN_HYPHEN)) {
+            tiny_error(label, ERROR_MODE_RECOVER, "Anonymous label in a block whose condition may change after the first pass");
+        }
+    }
+}
+
+size_t conditional_next(assembly_context *context, const program *program, size_t index)
+{
+    const statement *statement = program->statements[index];
+    token_type directive = statement->instruction->type;
+    if (directive == TOKEN_ELSE) {
+        /* the block before it was the one assembled */
+        return skip_block(program, index, 0);
+    }
+    if (directive == TOKEN_ENDIF) {
+        return index + 1;
+    }
+    const conditional_decision *decision = find_decision(context->conditions, statement);
+    context->conditions->reads_address = 0;
+    int taken = decision && directive != TOKEN_IF ? decision->taken : test(context, statement, 1);
+    if ((taken == CONDITIONAL_UNKNOWN || context->conditions->reads_address) && !context->passes) {
+        /* the next pass may assemble the block this one skips */
+        context->conditions->skipped_unknown = 1;
+        check_anonymous_labels(program, index);
+    }
+    if (decision && taken != decision->taken) {
+        /* the block not taken was never parsed */
+        if (taken != CONDITIONAL_UNKNOWN) {
+            tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Condition changed after the first pass");
+        }
+        taken = decision->taken;
+    }
+    return taken == CONDITIONAL_TRUE ? index + 1 : skip_block(program, index, 1);
+}
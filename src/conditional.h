@@ -0,0 +1,78 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef conditional_h
+#define conditional_h
+
+#include <stddef.h>
+
+typedef struct assembly_context assembly_context;
+typedef struct program program;
+typedef struct statement statement;
+typedef struct string_htable string_htable;
+
+#define CONDITIONAL_FALSE       0
+#define CONDITIONAL_TRUE        1
+#define CONDITIONAL_UNKNOWN     -1
+
+/*
+
+A condition that can be decided when the parser reaches it has its inactive
+block skipped by the lexer, so the block is never tokenized and is not part
+of the program. Any other condition, such as one that refers to a symbol
+defined later, has both blocks parsed and the executor decides between them
+on each pass. So does a condition that reads the program counter, a label or
+a symbol assigned from one, since its value in the first pass may still
+change in the passes after.
+**/
+
+/* a condition decided while parsing, by the index of its statement */
+typedef struct conditional_decision
+{
+    size_t index;
+    int taken;
+
+} conditional_decision;
+
+typedef struct conditional
+{
+    conditional_decision *decisions;
+    size_t count;
+    size_t capacity;
+    int skipped_unknown;
+
+    /* the symbols whose values depend on where code is placed, and whether the expressions
+       evaluated since reads_address was cleared read one */
+    string_htable *address_symbols;
+    int reads_address;
+
+} conditional;
+
+conditional *conditional_create(int case_sensitive);
+void conditional_destroy(conditional *conditions);
+
+/* note a symbol whose value depends on where code is placed */
+void conditional_add_address(conditional *conditions, const char *name);
+
+/* note the evaluation of a symbol, which sets reads_address if its value depends on where code is placed */
+void conditional_read_symbol(conditional *conditions, const char *name);
+
+/* 1 if the statement begins a conditional block, -1 if it ends one, otherwise 0 */
+int conditional_nesting(const statement *statement);
+
+/* decide the condition as the parser reaches it, remembering a decision for the passes after */
+int conditional_decide(assembly_context *context, const statement *statement);
+
+/* whether the condition was decided while parsing */
+int conditional_is_decided(const conditional *conditions, const statement *statement);
+
+/* run the conditional directive at index; returns the index of the statement to run next */
+size_t conditional_next(assembly_context *context, const program *program, size_t index);
+
+#endif /* conditional_h */
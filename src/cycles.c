@@ -0,0 +1,269 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "cycles.h"
+#include "error.h"
+#include "memory.h"
+#include "options.h"
+#include <stdio.h>
+
+/* base cycles of each opcode, for the NMOS 6502 including its illegal opcodes */
+static const unsigned char cycles_6502[256] =
+{
+    7,6,0,8,3,3,5,5,3,2,2,2,4,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7,
+    6,6,0,8,3,3,5,5,4,2,2,2,4,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7,
+    6,6,0,8,3,3,5,5,3,2,2,2,3,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7,
+    6,6,0,8,3,3,5,5,4,2,2,2,5,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7,
+    2,6,2,6,3,3,3,3,2,2,2,2,4,4,4,4,
+    2,6,0,6,4,4,4,4,2,5,2,5,5,5,5,5,
+    2,6,2,6,3,3,3,3,2,2,2,2,4,4,4,4,
+    2,5,0,5,4,4,4,4,2,4,2,4,4,4,4,4,
+    2,6,2,8,3,3,5,5,2,2,2,2,4,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7,
+    2,6,2,8,3,3,5,5,2,2,2,2,4,4,6,6,
+    2,5,0,8,4,4,6,6,2,4,2,7,4,4,7,7
+};
+
+static const unsigned char cycles_65c02[256] =
+{
+    7,6,2,1,5,3,5,5,3,2,2,1,6,4,6,5,
+    2,5,5,1,5,4,6,5,2,4,2,1,6,4,6,5,
+    6,6,2,1,3,3,5,5,4,2,2,1,4,4,6,5,
+    2,5,5,1,4,4,6,5,2,4,2,1,4,4,6,5,
+    6,6,2,1,3,3,5,5,3,2,2,1,3,4,6,5,
+    2,5,5,1,4,4,6,5,2,4,3,1,8,4,6,5,
+    6,6,2,1,3,3,5,5,4,2,2,1,6,4,6,5,
+    2,5,5,1,4,4,6,5,2,4,4,1,6,4,6,5,
+    3,6,2,1,3,3,3,5,2,2,2,1,4,4,4,5,
+    2,6,5,1,4,4,4,5,2,5,2,1,4,5,5,5,
+    2,6,2,1,3,3,3,5,2,2,2,1,4,4,4,5,
+    2,5,5,1,4,4,4,5,2,4,2,1,4,4,4,5,
+    2,6,2,1,3,3,5,5,2,2,2,3,4,4,6,5,
+    2,5,5,1,4,4,6,5,2,4,3,3,4,4,7,5,
+    2,6,2,1,3,3,5,5,2,2,2,1,4,4,6,5,
+    2,5,5,1,4,4,6,5,2,4,4,1,4,4,7,5
+};
+
+/* native mode with 8-bit registers and a page-aligned direct page */
+static const unsigned char cycles_65816[256] =
+{
+    8,6,8,4,5,3,5,6,3,2,2,4,6,4,6,5,
+    2,5,5,7,5,4,6,6,2,4,2,2,6,4,7,5,
+    6,6,8,4,3,3,5,6,4,2,2,5,4,4,6,5,
+    2,5,5,7,4,4,6,6,2,4,2,2,4,4,7,5,
+    7,6,2,4,7,3,5,6,3,2,2,3,3,4,6,5,
+    2,5,5,7,7,4,6,6,2,4,3,2,4,4,7,5,
+    6,6,6,4,3,3,5,6,4,2,2,6,5,4,6,5,
+    2,5,5,7,4,4,6,6,2,4,4,2,6,4,7,5,
+    3,6,4,4,3,3,3,6,2,2,2,3,4,4,4,5,
+    2,6,5,7,4,4,4,6,2,5,2,2,4,5,5,5,
+    2,6,2,4,3,3,3,6,2,2,2,4,4,4,4,5,
+    2,5,5,7,4,4,4,6,2,4,2,2,4,4,4,5,
+    2,6,3,4,3,3,5,6,2,2,2,3,4,4,6,5,
+    2,5,5,7,6,4,6,6,2,4,3,3,6,4,7,5,
+    2,6,3,4,3,3,5,6,2,2,2,3,4,4,6,5,
+    2,5,5,7,5,4,6,6,2,4,4,2,8,4,7,5
+};
+
+int cycles_reads_across_page(int cpu, int opcode)
+{
+    int nmos = cpu == CPU_6502 || cpu == CPU_6502I;
+    switch (opcode & 0x1f) {
+        case 0x11:
+        case 0x19:
+        case 0x1d: return opcode != 0x91 && opcode != 0x99 && opcode != 0x9d;
+        case 0x1c: return nmos ? opcode != 0x9c : opcode == 0x3c || opcode == 0xbc;
+        case 0x1e: return opcode == 0xbe || (cpu == CPU_65C02 && opcode < 0x80);
+        case 0x13:
+        case 0x1b:
+        case 0x1f: return nmos && (opcode == 0xb3 || opcode == 0xbb || opcode == 0xbf);
+        default: return 0;
+    }
+}
+
+/* the extra cycles a 65816 instruction takes with a 16-bit accumulator */
+static int accumulator_width_cycles(int opcode)
+{
+    switch (opcode) {
+        case 0x24: case 0x2c: case 0x34: case 0x3c: /* bit */
+        case 0x64: case 0x74: case 0x9c: case 0x9e: /* stz */
+        case 0x48: case 0x68:                       /* pha, pla */
+            return 1;
+        case 0x04: case 0x0c: case 0x14: case 0x1c: /* tsb, trb */
+            return 2;
+        default:
+            break;
+    }
+    if (((opcode & 0x01) && (opcode & 0x0f) != 0x0b) || (opcode & 0x1f) == 0x12) {
+        return 1;
+    }
+    /* read-modify-write of memory reads and writes the extra byte */
+    if (((opcode & 0x0f) == 0x06 || (opcode & 0x0f) == 0x0e) && (opcode < 0x80 || opcode >= 0xc0)) {
+        return 2;
+    }
+    return 0;
+}
+
+/* the extra cycle a 65816 instruction takes with 16-bit index registers */
+static int index_width_cycles(int opcode)
+{
+    switch (opcode) {
+        case 0xa0: case 0xa2: case 0xc0: case 0xe0:
+        case 0x84: case 0x8c: case 0x94:
+        case 0x86: case 0x8e: case 0x96:
+        case 0xa4: case 0xac: case 0xb4: case 0xbc:
+        case 0xa6: case 0xae: case 0xb6: case 0xbe:
+        case 0xc4: case 0xcc: case 0xe4: case 0xec:
+        case 0x5a: case 0x7a: case 0xda: case 0xfa:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int crosses_page(int from, int to)
+{
+    return ((from ^ to) & 0xff00) != 0;
+}
+
+int cycles_base(int cpu, int opcode)
+{
+    switch (cpu) {
+        case CPU_65816: return cycles_65816[opcode];
+        case CPU_65C02: return cycles_65c02[opcode];
+        default:        return cycles_6502[opcode];
+    }
+}
+
+cycle_range cycles_count(int cpu, const unsigned char *code, size_t length, int pc, int m16, int x16)
+{
+    int opcode = code[0];
+    cycle_range cycles = { cycles_base(cpu, opcode) };
+    if (!cycles.min) {
+        return cycles;
+    }
+    if (cpu == CPU_65816) {
+        cycles.min += m16 ? accumulator_width_cycles(opcode) : 0;
+        cycles.min += x16 ? index_width_cycles(opcode) : 0;
+    }
+    cycles.max = cycles.min;
+    if ((opcode & 0x1f) == 0x10 || (opcode == 0x80 && cpu != CPU_6502 && cpu != CPU_6502I)) {
+        /* a taken branch costs a cycle, and in emulation another to cross a page */
+        int next = pc + 2;
+        int target = next + (signed char)code[1];
+        int penalty = cpu != CPU_65816 && crosses_page(next, target);
+        if (length == 5 && code[1] == 3 && code[2] == 0x4c) {
+            /* a long branch is either the inverted branch taken or it and the jmp */
+            cycles.max = cycles.min + cycles_base(cpu, 0x4c);
+            cycles.min += 1 + penalty;
+            return cycles;
+        }
+        if (opcode != 0x80) {
+            cycles.max++;
+        }
+        cycles.min += opcode == 0x80 ? penalty : 0;
+        cycles.max += penalty;
+        return cycles;
+    }
+    if (cpu == CPU_65C02 && (opcode & 0x0f) == 0x0f) {
+        /* bbr, bbs */
+        int next = pc + 3;
+        cycles.max += 1 + crosses_page(next, next + (signed char)code[2]);
+        return cycles;
+    }
+    if (cycles_reads_across_page(cpu, opcode)) {
+        /* a 16-bit index always takes the extra cycle */
+        if (cpu == CPU_65816 && x16) {
+            cycles.min++;
+        }
+        cycles.max++;
+    }
+    return cycles;
+}
+
+void cycles_format(cycle_range cycles, char dest[CYCLE_RANGE_FORMAT_LEN])
+{
+    if (cycles.min == cycles.max) {
+        snprintf(dest, CYCLE_RANGE_FORMAT_LEN, "%d", cycles.min);
+    } else {
+        snprintf(dest, CYCLE_RANGE_FORMAT_LEN, "%d-%d", cycles.min, cycles.max);
+    }
+}
+
+cycle_log *cycle_log_create(void)
+{
+    return tiny_calloc(1, sizeof(cycle_log));
+}
+
+void cycle_log_reset(cycle_log *log)
+{
+    log->count = 0;
+    log->budget_count = 0;
+}
+
+void cycle_log_destroy(cycle_log *log)
+{
+    if (!log) {
+        return;
+    }
+    tiny_free(log->budgets);
+    tiny_free(log->entries);
+    tiny_free(log);
+}
+
+void cycle_log_add(cycle_log *log, int pc, cycle_range cycles)
+{
+    if (log->count == log->capacity) {
+        log->capacity = log->capacity ? log->capacity * 2 : 256;
+        log->entries = tiny_realloc(log->entries, log->capacity * sizeof(cycle_log_entry));
+    }
+    log->entries[log->count].pc = pc;
+    log->entries[log->count++].cycles = cycles;
+}
+
+void cycle_log_add_budget(cycle_log *log, const token *directive, int start, int end, int budget, int exact)
+{
+    if (log->budget_count == log->budget_capacity) {
+        log->budget_capacity = log->budget_capacity ? log->budget_capacity * 2 : 8;
+        log->budgets = tiny_realloc(log->budgets, log->budget_capacity * sizeof(cycle_budget));
+    }
+    cycle_budget *entry = log->budgets + log->budget_count++;
+    entry->directive = directive;
+    entry->start = start;
+    entry->end = end;
+    entry->budget = budget;
+    entry->exact = exact;
+}
+
+void cycle_log_check(const cycle_log *log)
+{
+    for(size_t i = 0; i < log->budget_count; i++) {
+        const cycle_budget *budget = log->budgets + i;
+        cycle_range total = {};
+        for(size_t j = 0; j < log->count; j++) {
+            if (log->entries[j].pc >= budget->start && log->entries[j].pc < budget->end) {
+                total.min += log->entries[j].cycles.min;
+                total.max += log->entries[j].cycles.max;
+            }
+        }
+        char cycles[CYCLE_RANGE_FORMAT_LEN] = {};
+        cycles_format(total, cycles);
+        if (budget->exact && (total.min != budget->budget || total.max != budget->budget)) {
+            tiny_error(budget->directive, ERROR_MODE_RECOVER,
+                "Region takes %s cycles but must take exactly %d", cycles, budget->budget);
+        } else if (!budget->exact && total.max > budget->budget) {
+            tiny_error(budget->directive, ERROR_MODE_RECOVER,
+                "Region takes %s cycles which exceeds the budget of %d", cycles, budget->budget);
+        }
+    }
+}
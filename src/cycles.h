@@ -0,0 +1,77 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef cycles_h
+#define cycles_h
+
+#include <stddef.h>
+
+typedef struct token token;
+
+/* the fewest and most cycles an instruction can take */
+typedef struct cycle_range
+{
+    int min;
+    int max;
+
+} cycle_range;
+
+#define CYCLE_RANGE_FORMAT_LEN  24
+
+typedef struct cycle_log_entry
+{
+    int pc;
+    cycle_range cycles;
+
+} cycle_log_entry;
+
+typedef struct cycle_budget
+{
+    const token *directive;
+    int start;
+    int end;
+    int budget;
+    int exact;
+
+} cycle_budget;
+
+/* the cycles of every instruction assembled in a pass, and the budgets
+   the source asserts over them */
+typedef struct cycle_log
+{
+    cycle_log_entry *entries;
+    size_t count;
+    size_t capacity;
+    cycle_budget *budgets;
+    size_t budget_count;
+    size_t budget_capacity;
+
+} cycle_log;
+
+/* the cycles of an opcode before any penalty, 0 if it halts the cpu */
+int cycles_base(int cpu, int opcode);
+
+/* whether an indexed read takes another cycle when the index crosses a page */
+int cycles_reads_across_page(int cpu, int opcode);
+
+/* the cycles of the instruction at the start of code, or of a long branch if length is its size */
+cycle_range cycles_count(int cpu, const unsigned char *code, size_t length, int pc, int m16, int x16);
+void cycles_format(cycle_range cycles, char dest[CYCLE_RANGE_FORMAT_LEN]);
+
+cycle_log *cycle_log_create(void);
+void cycle_log_reset(cycle_log *log);
+void cycle_log_destroy(cycle_log *log);
+
+void cycle_log_add(cycle_log *log, int pc, cycle_range cycles);
+void cycle_log_add_budget(cycle_log *log, const token *directive, int start, int end, int budget, int exact);
+
+/* report every budget the assembled code does not keep */
+void cycle_log_check(const cycle_log *log);
+
+#endif /* cycles_h */
@@ -0,0 +1,810 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "assembly_context.h"
+#include "dataflow.h"
+#include "error.h"
+#include "expression.h"
+#include "loop.h"
+#include "memory.h"
+#include "operand.h"
+#include "output.h"
+#include "program.h"
+#include "statement.h"
+#include "string_htable.h"
+#include "token.h"
+#include "value.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* the negative flag is only tracked so that a load is not removed when it would change it */
+enum { REG_A, REG_X, REG_Y, FLAG_C, FLAG_D, FLAG_Z, FLAG_N, TRACKED };
+
+#define UNREACHED           -2
+#define UNKNOWN             -1
+
+/* flag operations, transfers and immediate loads all take two cycles */
+#define REDUNDANT_CYCLES    2
+
+/* how code can arrive at a statement other than from the one before it or a known branch */
+#define ENTRY_ANYWHERE      1
+#define ENTRY_PATCHABLE     2
+
+typedef struct machine_state
+{
+    int values[TRACKED];
+
+} machine_state;
+
+typedef struct flow_scan
+{
+    dataflow *dataflow;
+    program *program;
+    assembly_context *context;
+    string_htable *constants;
+    value *targets;
+    unsigned char *entries;
+    machine_state *joins;
+    size_t *by_pc;
+    size_t by_pc_count;
+    value *exposed;
+    size_t exposed_count;
+    size_t exposed_capacity;
+
+} flow_scan;
+
+static const char *register_names[TRACKED] = { "a", "x", "y" };
+
+dataflow *dataflow_create(int remove)
+{
+    dataflow *dataflow = tiny_calloc(1, sizeof(struct dataflow));
+    dataflow->remove = remove;
+    return dataflow;
+}
+
+void dataflow_destroy(dataflow *dataflow)
+{
+    if (!dataflow) {
+        return;
+    }
+    tiny_free(dataflow->findings);
+    tiny_free(dataflow);
+}
+
+static machine_state uniform(int v)
+{
+    machine_state state;
+    for(int r = 0; r < TRACKED; r++) {
+        state.values[r] = v;
+    }
+    return state;
+}
+
+static int known(int v)
+{
+    return v >= 0;
+}
+
+/* merge the state arriving from another path, returns whether anything changed */
+static int meet(machine_state *into, const machine_state *from)
+{
+    int changed = 0;
+    for(int r = 0; r < TRACKED; r++) {
+        int v = into->values[r], w = from->values[r];
+        int met = v == UNREACHED ? w : (w == UNREACHED || v == w) ? v : UNKNOWN;
+        if (met != v) {
+            into->values[r] = met;
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+static value anonymous_pc(const program *program, size_t index, int forward)
+{
+    const token *label = program->statements[index]->label;
+    if (forward) {
+        if (label && label->type == TOKEN_PLUS) {
+            return VALUE_UNDEFINED;
+        }
+        for(size_t i = index + 1; i < program->count; i++) {
+            label = program->statements[i]->label;
+            if (label && label->type == TOKEN_PLUS) {
+                return program->pcs[i];
+            }
+        }
+        return VALUE_UNDEFINED;
+    }
+    for(size_t i = index + 1; i-- > 0; ) {
+        label = program->statements[i]->label;
+        if (label && label->type == TOKEN_HYPHEN) {
+            return program->pcs[i];
+        }
+    }
+    return VALUE_UNDEFINED;
+}
+
+static value resolve_ident(const flow_scan *scan, const expression *expr, size_t index, const char *scope, int constants_only)
+{
+    if (expr->token->type == TOKEN_ASTERISK) {
+        return constants_only ? VALUE_UNDEFINED : scan->program->pcs[index];
+    }
+    TOKEN_GET_TEXT(expr->token, name);
+    if (name[0] == '+' || name[0] == '-') {
+        return constants_only || name[1] ? VALUE_UNDEFINED : anonymous_pc(scan->program, index, name[0] == '+');
+    }
+    char scoped_name[TOKEN_TEXT_MAX_LEN * 2 + 2] = {};
+    if (name[0] == '_' && scope) {
+        snprintf(scoped_name, TOKEN_TEXT_MAX_LEN * 2, "%s.%s", scope, name);
+    }
+    if (constants_only) {
+        const int *constant = string_htable_get(scan->constants, name);
+        if (!constant && *scoped_name) {
+            constant = string_htable_get(scan->constants, scoped_name);
+        }
+        return constant ? *constant : VALUE_UNDEFINED;
+    }
+    symbol_table *sym_tab = scan->context->sym_tab;
+    if (symbol_exists(sym_tab, name)) {
+        return symbol_table_lookup(sym_tab, name);
+    }
+    if (*scoped_name && symbol_exists(sym_tab, scoped_name)) {
+        return symbol_table_lookup(sym_tab, scoped_name);
+    }
+    return VALUE_UNDEFINED;
+}
+
+/* the value of an expression as of the first pass, or with constants_only
+   only if no later pass can change it */
+static value resolve(const flow_scan *scan, const expression *expr, size_t index, const char *scope, int constants_only)
+{
+    if (expr->value != VALUE_UNDEFINED) {
+        return expr->value;
+    }
+    value lhs, rhs;
+    switch (expr->type) {
+        case TYPE_IDENT:
+            return resolve_ident(scan, expr, index, scope, constants_only);
+        case TYPE_UNARY:
+            lhs = resolve(scan, expr->unary.expr, index, scope, constants_only);
+            if (lhs == VALUE_UNDEFINED) {
+                return lhs;
+            }
+            switch (expr->token->type) {
+                case TOKEN_LANGLE:  return lhs & 0xff;
+                case TOKEN_RANGLE:  return (lhs >> 8) & 0xff;
+                case TOKEN_HYPHEN:  return -lhs;
+                default:            return VALUE_UNDEFINED;
+            }
+        case TYPE_BINARY:
+            lhs = resolve(scan, expr->binary.lhs, index, scope, constants_only);
+            rhs = resolve(scan, expr->binary.rhs, index, scope, constants_only);
+            if (lhs == VALUE_UNDEFINED || rhs == VALUE_UNDEFINED) {
+                return VALUE_UNDEFINED;
+            }
+            switch (expr->token->type) {
+                case TOKEN_PLUS:    return lhs + rhs;
+                case TOKEN_HYPHEN:  return lhs - rhs;
+                default:            return VALUE_UNDEFINED;
+            }
+        default:
+            return VALUE_UNDEFINED;
+    }
+}
+
+static void add_exposed(flow_scan *scan, value address)
+{
+    if (scan->exposed_count == scan->exposed_capacity) {
+        scan->exposed_capacity = scan->exposed_capacity ? scan->exposed_capacity * 2 : 64;
+        scan->exposed = tiny_realloc(scan->exposed, scan->exposed_capacity * sizeof(value));
+    }
+    scan->exposed[scan->exposed_count++] = address;
+}
+
+typedef struct exposure
+{
+    flow_scan *scan;
+    const expression *target;
+    size_t index;
+    const char *scope;
+
+} exposure;
+
+/* record every address an expression names, code there can be reached or changed some other way */
+static expression_visit_result expose_address(const expression *expr, void *exposure_ptr)
+{
+    const exposure *exp = (const exposure*)exposure_ptr;
+    if (expr == exp->target) {
+        return EXPRESSION_VISIT_SKIP;
+    }
+    if (expr->type != TYPE_LITERAL && expr->type != TYPE_FCN_CALL) {
+        value address = resolve(exp->scan, expr, exp->index, exp->scope, 0);
+        if (address != VALUE_UNDEFINED) {
+            add_exposed(exp->scan, address);
+        }
+    }
+    return EXPRESSION_VISIT_CHILDREN;
+}
+
+/* the operand of a branch, jmp or jsr to a known place */
+static const expression *branch_target(token_type mnemonic, const operand *oper)
+{
+    if (!oper) {
+        return NULL;
+    }
+    switch (mnemonic) {
+        case TOKEN_BBR:
+        case TOKEN_BBS:
+            return oper->form == FORM_BIT_OFFS_ZP ? oper->bit_offset_expression.expr : NULL;
+        case TOKEN_BCC: case TOKEN_BCS: case TOKEN_BEQ: case TOKEN_BMI: case TOKEN_BNE:
+        case TOKEN_BPL: case TOKEN_BRA: case TOKEN_BVC: case TOKEN_BVS: case TOKEN_JMP:
+        case TOKEN_JSR:
+            return oper->form == FORM_ZP_ABSOLUTE ? oper->single_expression.expr : NULL;
+        default:
+            return NULL;
+    }
+}
+
+/* expose the addresses an operand names, other than the place it branches to */
+static void expose_operand(flow_scan *scan, const operand *oper, const expression *target, size_t index, const char *scope)
+{
+    exposure exp = { scan, target, index, scope };
+    operand_visit(oper, expose_address, &exp);
+}
+
+/* directives that neither output anything nor move the program counter */
+static int is_silent(token_type directive)
+{
+    switch (directive) {
+        case TOKEN_CYCLEEXACT: case TOKEN_CYCLELIMIT: case TOKEN_ENDTEST: case TOKEN_EXPECT:
+        case TOKEN_GIVEN: case TOKEN_OPTOFF: case TOKEN_OPTON: case TOKEN_PROFF:
+        case TOKEN_PRON: case TOKEN_TEST: case TOKEN_ZPRANGE: case TOKEN_ZPVAR:
+        case TOKEN_ENDPAGESAFE: case TOKEN_PAGEREGION: case TOKEN_ENDPAGEREGION:
+        case TOKEN_INLINE: case TOKEN_ENDINLINE: case TOKEN_PROC: case TOKEN_ENDPROC: case TOKEN_EXPORT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int compare_values(const void *lhs, const void *rhs)
+{
+    value l = *(const value*)lhs, r = *(const value*)rhs;
+    return l < r ? -1 : l > r;
+}
+
+static const program *sorting_program;
+
+static int compare_by_pc(const void *lhs, const void *rhs)
+{
+    size_t l = *(const size_t*)lhs, r = *(const size_t*)rhs;
+    int l_pc = sorting_program->pcs[l], r_pc = sorting_program->pcs[r];
+    if (l_pc != r_pc) {
+        return l_pc < r_pc ? -1 : 1;
+    }
+    return l < r ? -1 : l > r;
+}
+
+static void collect_constants(flow_scan *scan)
+{
+    const program *program = scan->program;
+    for(size_t i = 0; i < program->count; i++) {
+        if (program->kinds[i] != PROGRAM_KIND_ASSIGN || program->labels[i] == PROGRAM_NO_LABEL) {
+            continue;
+        }
+        value v = program->operands[i]->single_expression.expr->value;
+        if (v >= INT16_MIN && v <= UINT16_MAX) {
+            int constant = (int)v;
+            string_htable_add(scan->constants, program->label_names[PROGRAM_LABEL_ID(program->labels[i])], (const htable_value_ptr)&constant);
+        }
+    }
+}
+
+/* resolve where each branch goes and find every place code can arrive at from elsewhere */
+static void prepare(flow_scan *scan)
+{
+    program *program = scan->program;
+    const char *scope = NULL;
+    int unresolved = 0, loop_depth = 0;
+    for(size_t i = 0; i < program->count; i++) {
+        int label = program->labels[i];
+        int kind = program->kinds[i];
+        const statement *statement = program->statements[i];
+        const operand *oper = program->operands[i];
+        if (label != PROGRAM_NO_LABEL && !PROGRAM_LABEL_IS_LOCAL(label)) {
+            scope = program->label_names[PROGRAM_LABEL_ID(label)];
+        }
+        scan->targets[i] = VALUE_UNDEFINED;
+        scan->joins[i] = uniform(UNREACHED);
+        /* a non-local label is a routine anything could call */
+        if ((label != PROGRAM_NO_LABEL && !PROGRAM_LABEL_IS_LOCAL(label) && kind != PROGRAM_KIND_ASSIGN) ||
+            (kind == PROGRAM_KIND_ASSIGN && statement->label->type == TOKEN_ASTERISK) ||
+            (kind == PROGRAM_KIND_PSEUDO_OP && !is_silent(statement->instruction->type))) {
+            scan->entries[i] = ENTRY_ANYWHERE;
+        }
+        if (kind == PROGRAM_KIND_INSTRUCTION) {
+            const expression *target = branch_target(statement->instruction->type, oper);
+            if (target) {
+                scan->targets[i] = resolve(scan, target, i, scope, 0);
+                unresolved |= scan->targets[i] == VALUE_UNDEFINED;
+            }
+            expose_operand(scan, oper, target, i, scope);
+            scan->by_pc[scan->by_pc_count++] = i;
+        } else if (kind == PROGRAM_KIND_ASSIGN) {
+            expose_operand(scan, oper, NULL, i, scope);
+        } else if (kind == PROGRAM_KIND_PSEUDO_OP) {
+            expose_operand(scan, oper, NULL, i, scope);
+            loop_depth += loop_nesting(statement);
+        }
+        if (loop_depth) {
+            /* a loop body is shared by every iteration, so nothing in it is known or removed */
+            scan->entries[i] |= ENTRY_ANYWHERE | ENTRY_PATCHABLE;
+        }
+    }
+    qsort(scan->exposed, scan->exposed_count, sizeof(value), compare_values);
+    sorting_program = program;
+    qsort(scan->by_pc, scan->by_pc_count, sizeof(size_t), compare_by_pc);
+    for(size_t b = 0; b < scan->by_pc_count; b++) {
+        size_t i = scan->by_pc[b];
+        size_t lo = 0, hi = scan->exposed_count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (scan->exposed[mid] < program->pcs[i]) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < scan->exposed_count && scan->exposed[lo] < program->pcs[i] + program->sizes[i]) {
+            scan->entries[i] = ENTRY_ANYWHERE | ENTRY_PATCHABLE;
+        }
+    }
+    if (unresolved) {
+        /* a branch could go to any label */
+        for(size_t i = 0; i < program->count; i++) {
+            if (program->statements[i]->label && program->kinds[i] != PROGRAM_KIND_ASSIGN) {
+                scan->entries[i] |= ENTRY_ANYWHERE;
+            }
+        }
+    }
+}
+
+static void set_nz(machine_state *state, int v)
+{
+    state->values[FLAG_Z] = known(v) ? v == 0 : UNKNOWN;
+    state->values[FLAG_N] = known(v) ? (v >> 7) & 1 : UNKNOWN;
+}
+
+static int add8(int v, int delta)
+{
+    return known(v) ? (v + delta) & 0xff : UNKNOWN;
+}
+
+static void transfer_register(machine_state *state, int from, int to)
+{
+    state->values[to] = state->values[from];
+    set_nz(state, state->values[to]);
+}
+
+static void shift(machine_state *state, token_type mnemonic)
+{
+    int *v = state->values, a = v[REG_A], c = v[FLAG_C];
+    if (!known(a)) {
+        v[REG_A] = v[FLAG_C] = UNKNOWN;
+        set_nz(state, UNKNOWN);
+        return;
+    }
+    int rotates = mnemonic == TOKEN_ROL || mnemonic == TOKEN_ROR;
+    if (mnemonic == TOKEN_ASL || mnemonic == TOKEN_ROL) {
+        v[FLAG_C] = a >> 7;
+        a = (a << 1) & 0xff;
+        if (rotates) {
+            a = known(c) ? a | c : UNKNOWN;
+        }
+    } else {
+        v[FLAG_C] = a & 1;
+        a >>= 1;
+        if (rotates) {
+            a = known(c) ? a | (c << 7) : UNKNOWN;
+        }
+    }
+    v[REG_A] = a;
+    set_nz(state, a);
+}
+
+static void add_with_carry(machine_state *state, token_type mnemonic, int operand_value)
+{
+    int *v = state->values;
+    if (v[FLAG_D] != 0 || !known(v[REG_A]) || !known(v[FLAG_C]) || !known(operand_value)) {
+        v[REG_A] = v[FLAG_C] = UNKNOWN;
+        set_nz(state, UNKNOWN);
+        return;
+    }
+    int result = mnemonic == TOKEN_ADC ? v[REG_A] + operand_value + v[FLAG_C] :
+                                         v[REG_A] - operand_value - (1 - v[FLAG_C]);
+    v[FLAG_C] = mnemonic == TOKEN_ADC ? result > 0xff : result >= 0;
+    v[REG_A] = result & 0xff;
+    set_nz(state, v[REG_A]);
+}
+
+static void compare(machine_state *state, int reg, int operand_value)
+{
+    int *v = state->values;
+    if (!known(v[reg]) || !known(operand_value)) {
+        v[FLAG_C] = v[FLAG_Z] = v[FLAG_N] = UNKNOWN;
+        return;
+    }
+    v[FLAG_C] = v[reg] >= operand_value;
+    v[FLAG_Z] = v[reg] == operand_value;
+    v[FLAG_N] = ((v[reg] - operand_value) >> 7) & 1;
+}
+
+static int logic(token_type mnemonic, int a, int operand_value)
+{
+    if (mnemonic == TOKEN_AND && operand_value == 0) {
+        return 0;
+    }
+    if (mnemonic == TOKEN_ORA && operand_value == 0xff) {
+        return 0xff;
+    }
+    if (!known(a) || !known(operand_value)) {
+        return UNKNOWN;
+    }
+    switch (mnemonic) {
+        case TOKEN_AND: return a & operand_value;
+        case TOKEN_ORA: return a | operand_value;
+        default:        return a ^ operand_value;
+    }
+}
+
+/* the effect of an instruction on the tracked registers and flags */
+static void transfer(machine_state *state, token_type mnemonic, const operand *oper, int immediate)
+{
+    int *v = state->values;
+    int accumulator = !oper || oper->form == FORM_ACCUMULATOR;
+    switch (mnemonic) {
+        case TOKEN_LDA: v[REG_A] = immediate; set_nz(state, immediate); break;
+        case TOKEN_LDX: v[REG_X] = immediate; set_nz(state, immediate); break;
+        case TOKEN_LDY: v[REG_Y] = immediate; set_nz(state, immediate); break;
+        case TOKEN_LAX: v[REG_A] = v[REG_X] = immediate; set_nz(state, immediate); break;
+        case TOKEN_TAX: transfer_register(state, REG_A, REG_X); break;
+        case TOKEN_TAY: transfer_register(state, REG_A, REG_Y); break;
+        case TOKEN_TXA: transfer_register(state, REG_X, REG_A); break;
+        case TOKEN_TYA: transfer_register(state, REG_Y, REG_A); break;
+        case TOKEN_INX: v[REG_X] = add8(v[REG_X], 1); set_nz(state, v[REG_X]); break;
+        case TOKEN_DEX: v[REG_X] = add8(v[REG_X], -1); set_nz(state, v[REG_X]); break;
+        case TOKEN_INY: v[REG_Y] = add8(v[REG_Y], 1); set_nz(state, v[REG_Y]); break;
+        case TOKEN_DEY: v[REG_Y] = add8(v[REG_Y], -1); set_nz(state, v[REG_Y]); break;
+        case TOKEN_INC:
+        case TOKEN_DEC:
+            if (accumulator) {
+                v[REG_A] = add8(v[REG_A], mnemonic == TOKEN_INC ? 1 : -1);
+                set_nz(state, v[REG_A]);
+            } else {
+                set_nz(state, UNKNOWN);
+            }
+            break;
+        case TOKEN_AND:
+        case TOKEN_ORA:
+        case TOKEN_EOR:
+            v[REG_A] = logic(mnemonic, v[REG_A], immediate);
+            set_nz(state, v[REG_A]);
+            break;
+        case TOKEN_ASL:
+        case TOKEN_LSR:
+        case TOKEN_ROL:
+        case TOKEN_ROR:
+            if (accumulator) {
+                shift(state, mnemonic);
+            } else {
+                v[FLAG_C] = UNKNOWN;
+                set_nz(state, UNKNOWN);
+            }
+            break;
+        case TOKEN_ADC:
+        case TOKEN_SBC: add_with_carry(state, mnemonic, immediate); break;
+        case TOKEN_CMP: compare(state, REG_A, immediate); break;
+        case TOKEN_CPX: compare(state, REG_X, immediate); break;
+        case TOKEN_CPY: compare(state, REG_Y, immediate); break;
+        case TOKEN_BIT:
+            if (oper && oper->form == FORM_IMMEDIATE) {
+                /* bit immediate only sets zero */
+                v[FLAG_Z] = known(v[REG_A]) && known(immediate) ? (v[REG_A] & immediate) == 0 : UNKNOWN;
+            } else {
+                set_nz(state, UNKNOWN);
+            }
+            break;
+        case TOKEN_CLC: v[FLAG_C] = 0; break;
+        case TOKEN_SEC: v[FLAG_C] = 1; break;
+        case TOKEN_CLD: v[FLAG_D] = 0; break;
+        case TOKEN_SED: v[FLAG_D] = 1; break;
+        case TOKEN_PLA: v[REG_A] = UNKNOWN; set_nz(state, UNKNOWN); break;
+        case TOKEN_PLX: v[REG_X] = UNKNOWN; set_nz(state, UNKNOWN); break;
+        case TOKEN_PLY: v[REG_Y] = UNKNOWN; set_nz(state, UNKNOWN); break;
+        case TOKEN_TSX: v[REG_X] = UNKNOWN; set_nz(state, UNKNOWN); break;
+        case TOKEN_PLP: v[FLAG_C] = v[FLAG_D] = v[FLAG_Z] = v[FLAG_N] = UNKNOWN; break;
+        case TOKEN_TRB:
+        case TOKEN_TSB: v[FLAG_Z] = UNKNOWN; break;
+        case TOKEN_BCC: case TOKEN_BCS: case TOKEN_BEQ: case TOKEN_BMI: case TOKEN_BNE:
+        case TOKEN_BPL: case TOKEN_BRA: case TOKEN_BVC: case TOKEN_BVS: case TOKEN_BBR:
+        case TOKEN_BBS: case TOKEN_CLI: case TOKEN_CLV: case TOKEN_JMP: case TOKEN_NOP:
+        case TOKEN_PHA: case TOKEN_PHP: case TOKEN_PHX: case TOKEN_PHY: case TOKEN_RMB:
+        case TOKEN_SAX: case TOKEN_SEI: case TOKEN_SMB: case TOKEN_STA: case TOKEN_STX:
+        case TOKEN_STY: case TOKEN_STZ: case TOKEN_TXS:
+            break;
+        case TOKEN_BRK:
+        case TOKEN_JSR:
+            /* the routine or handler can change anything, including decimal mode */
+            *state = uniform(UNKNOWN);
+            break;
+        default:
+            v[REG_A] = v[REG_X] = v[REG_Y] = v[FLAG_C] = UNKNOWN;
+            set_nz(state, UNKNOWN);
+    }
+}
+
+/* 1 if a branch is always taken, 0 if never and -1 if it depends */
+static int branch_taken(token_type mnemonic, const machine_state *state)
+{
+    int flag, when;
+    switch (mnemonic) {
+        case TOKEN_BCC: flag = FLAG_C; when = 0; break;
+        case TOKEN_BCS: flag = FLAG_C; when = 1; break;
+        case TOKEN_BNE: flag = FLAG_Z; when = 0; break;
+        case TOKEN_BEQ: flag = FLAG_Z; when = 1; break;
+        case TOKEN_BPL: flag = FLAG_N; when = 0; break;
+        case TOKEN_BMI: flag = FLAG_N; when = 1; break;
+        case TOKEN_BBR:
+        case TOKEN_BBS:
+        case TOKEN_BVC:
+        case TOKEN_BVS: return -1;
+        default:        return 1;
+    }
+    if (!known(state->values[flag])) {
+        return -1;
+    }
+    return state->values[flag] == when;
+}
+
+static int falls_through(token_type mnemonic, int taken)
+{
+    switch (mnemonic) {
+        case TOKEN_BRA:
+        case TOKEN_JMP:
+        case TOKEN_RTI:
+        case TOKEN_RTS: return 0;
+        case TOKEN_BCC: case TOKEN_BCS: case TOKEN_BEQ: case TOKEN_BMI:
+        case TOKEN_BNE: case TOKEN_BPL: case TOKEN_BVC: case TOKEN_BVS:
+            return taken != 1;
+        default:        return 1;
+    }
+}
+
+/* the immediate operand if it is a constant byte */
+static int immediate_value(const flow_scan *scan, const operand *oper, size_t index, const char *scope)
+{
+    if (!oper || oper->form != FORM_IMMEDIATE || oper->single_expression.bitwidth) {
+        return UNKNOWN;
+    }
+    value v = resolve(scan, oper->single_expression.expr, index, scope, 1);
+    if (v < INT8_MIN || v > UINT8_MAX) {
+        return UNKNOWN;
+    }
+    return (int)(v & 0xff);
+}
+
+static int loads_same(const machine_state *state, int reg, int v)
+{
+    return known(v) && state->values[reg] == v &&
+           state->values[FLAG_Z] == (v == 0) && state->values[FLAG_N] == ((v >> 7) & 1);
+}
+
+/* whether an instruction leaves everything it sets as it was, with the reason why */
+static int is_redundant(const machine_state *state, token_type mnemonic, int immediate, char *reason)
+{
+    const int *v = state->values;
+    int reg = -1, source = immediate;
+    switch (mnemonic) {
+        case TOKEN_LDA: reg = REG_A; break;
+        case TOKEN_LDX: reg = REG_X; break;
+        case TOKEN_LDY: reg = REG_Y; break;
+        case TOKEN_TAX: reg = REG_X; source = v[REG_A]; break;
+        case TOKEN_TAY: reg = REG_Y; source = v[REG_A]; break;
+        case TOKEN_TXA: reg = REG_A; source = v[REG_X]; break;
+        case TOKEN_TYA: reg = REG_A; source = v[REG_Y]; break;
+        case TOKEN_CLC:
+        case TOKEN_SEC:
+            if (v[FLAG_C] != (mnemonic == TOKEN_SEC)) {
+                return 0;
+            }
+            snprintf(reason, DATAFLOW_REASON_LEN, "carry is already %s", v[FLAG_C] ? "set" : "clear");
+            return 1;
+        case TOKEN_CLD:
+        case TOKEN_SED:
+            if (v[FLAG_D] != (mnemonic == TOKEN_SED)) {
+                return 0;
+            }
+            snprintf(reason, DATAFLOW_REASON_LEN, "decimal is already %s", v[FLAG_D] ? "set" : "clear");
+            return 1;
+        default:
+            return 0;
+    }
+    if (!loads_same(state, reg, source)) {
+        return 0;
+    }
+    snprintf(reason, DATAFLOW_REASON_LEN, "%s is already $%02x", register_names[reg], source);
+    return 1;
+}
+
+static void add_finding(flow_scan *scan, size_t index, const char *reason)
+{
+    dataflow *dataflow = scan->dataflow;
+    if (dataflow->count == dataflow->capacity) {
+        dataflow->capacity = dataflow->capacity ? dataflow->capacity * 2 : 64;
+        dataflow->findings = tiny_realloc(dataflow->findings, dataflow->capacity * sizeof(dataflow_finding));
+    }
+    dataflow_finding *finding = dataflow->findings + dataflow->count++;
+    finding->index = index;
+    finding->statement_index = scan->program->statements[index]->index;
+    finding->loc = scan->program->statements[index]->instruction->loc;
+    strncpy(finding->reason, reason, DATAFLOW_REASON_LEN - 1);
+    finding->reason[DATAFLOW_REASON_LEN - 1] = '\0';
+    finding->bytes = scan->program->sizes[index];
+    finding->cycles = REDUNDANT_CYCLES;
+}
+
+/* walk the program once, merging the state each branch carries into where it goes;
+   returns whether any of those states changed */
+static int flow(flow_scan *scan, int record)
+{
+    program *program = scan->program;
+    machine_state state = uniform(UNKNOWN);
+    const char *scope = NULL;
+    int changed = 0, enabled = 1;
+    for(size_t i = 0; i < program->count; i++) {
+        int label = program->labels[i];
+        if (label != PROGRAM_NO_LABEL && !PROGRAM_LABEL_IS_LOCAL(label)) {
+            scope = program->label_names[PROGRAM_LABEL_ID(label)];
+        }
+        if (scan->entries[i]) {
+            state = uniform(UNKNOWN);
+        } else {
+            meet(&state, scan->joins + i);
+        }
+        if (program->kinds[i] == PROGRAM_KIND_PSEUDO_OP) {
+            token_type directive = program->statements[i]->instruction->type;
+            if (directive == TOKEN_OPTON || directive == TOKEN_OPTOFF) {
+                enabled = directive == TOKEN_OPTON;
+            }
+            continue;
+        }
+        if (program->kinds[i] != PROGRAM_KIND_INSTRUCTION) {
+            continue;
+        }
+        token_type mnemonic = program->statements[i]->instruction->type;
+        const operand *oper = program->operands[i];
+        int patchable = scan->entries[i] & ENTRY_PATCHABLE;
+        int immediate = patchable ? UNKNOWN : immediate_value(scan, oper, i, scope);
+        char reason[DATAFLOW_REASON_LEN] = {};
+        if (record && enabled && !patchable && is_redundant(&state, mnemonic, immediate, reason)) {
+            add_finding(scan, i, reason);
+        }
+        int taken = branch_taken(mnemonic, &state);
+        value target = scan->targets[i];
+        if (target != VALUE_UNDEFINED && taken) {
+            /* every instruction starting at the target, more than one if code is relocated */
+            size_t lo = 0, hi = scan->by_pc_count;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (program->pcs[scan->by_pc[mid]] < target) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            for(; lo < scan->by_pc_count && program->pcs[scan->by_pc[lo]] == target; lo++) {
+                changed |= meet(scan->joins + scan->by_pc[lo], &state);
+            }
+        }
+        transfer(&state, mnemonic, oper, immediate);
+        if (patchable) {
+            state = uniform(UNKNOWN);
+        }
+        if (!falls_through(mnemonic, taken)) {
+            state = uniform(UNREACHED);
+        }
+    }
+    return changed;
+}
+
+size_t dataflow_analyze(dataflow *dataflow, program *program, assembly_context *context)
+{
+    if (context->options.cpu == CPU_65816) {
+        tiny_error(NULL, ERROR_MODE_RECOVER, "Redundant instruction analysis is not supported for the selected CPU.\n");
+        return 0;
+    }
+    size_t count = program->count ? program->count : 1;
+    flow_scan scan = {
+        .dataflow = dataflow,
+        .program = program,
+        .context = context,
+        .constants = string_htable_create(sizeof(int)),
+        .targets = tiny_calloc(count, sizeof(value)),
+        .entries = tiny_calloc(count, sizeof(unsigned char)),
+        .joins = tiny_calloc(count, sizeof(machine_state)),
+        .by_pc = tiny_calloc(count, sizeof(size_t))
+    };
+    scan.constants->case_sensitive = context->options.case_sensitive;
+    collect_constants(&scan);
+    prepare(&scan);
+    while (flow(&scan, 0)) {
+        /* the states at the joins only ever lose what is known, so this ends */
+    }
+    size_t first_finding = dataflow->count;
+    flow(&scan, 1);
+    if (dataflow->remove) {
+        for(size_t f = first_finding; f < dataflow->count; f++) {
+            /* only its label, if it has one, is still executed */
+            program->kinds[dataflow->findings[f].index] = PROGRAM_KIND_LABEL;
+        }
+    }
+    tiny_free(scan.exposed);
+    tiny_free(scan.by_pc);
+    tiny_free(scan.joins);
+    tiny_free(scan.entries);
+    tiny_free(scan.targets);
+    string_htable_destroy(scan.constants);
+    return dataflow->remove ? dataflow->count - first_finding : 0;
+}
+
+void dataflow_list(const dataflow *dataflow, assembly_context *context, const program *program, size_t index)
+{
+    /* look up by the statement, as the page layout may have moved it since */
+    const statement *statement = program->statements[index];
+    size_t lo = 0, hi = dataflow->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (dataflow->findings[mid].statement_index < statement->index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == dataflow->count || dataflow->findings[lo].statement_index != statement->index) {
+        return;
+    }
+    const dataflow_finding *finding = dataflow->findings + lo;
+    char note[64] = {};
+    snprintf(note, sizeof note, "%s, %s: %d bytes, %d cycles", dataflow->remove ? "removed" : "redundant",
+        finding->reason, finding->bytes, finding->cycles);
+    /* a removed instruction's source is only listed here if it has no label line */
+    const char *src_line = dataflow->remove && !statement->label ? token_get_line(statement->instruction) : "";
+    context->logical_start_pc = context->output->logical_pc;
+    context->start_pc = context->output->pc;
+    context->cycles = (cycle_range){};
+    assembly_context_add_disasm_opt_pc(context, note, src_line, ';', 0);
+}
+
+void dataflow_report(const dataflow *dataflow, FILE *stream)
+{
+    fputs("---------------------------------\nRedundant instructions:\n", stream);
+    int bytes = 0, cycles = 0;
+    for(size_t i = 0; i < dataflow->count; i++) {
+        const dataflow_finding *finding = dataflow->findings + i;
+        source_location where = source_manager_decode(finding->loc);
+        if (where.file_name) {
+            fprintf(stream, "%s(%d): ", where.file_name, where.line);
+        }
+        fprintf(stream, "%s, %d bytes and %d cycles\n", finding->reason, finding->bytes, finding->cycles);
+        bytes += finding->bytes;
+        cycles += finding->cycles;
+    }
+    fprintf(stream, "%zu instructions %s %d bytes and %d cycles\n", dataflow->count,
+        dataflow->remove ? "removed, saving" : "found, which could save", bytes, cycles);
+}
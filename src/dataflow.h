@@ -0,0 +1,56 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef dataflow_h
+#define dataflow_h
+
+#include "source_manager.h"
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct assembly_context assembly_context;
+typedef struct program program;
+
+#define DATAFLOW_REASON_LEN 32
+
+/* an instruction that cannot change the registers or flags it sets */
+typedef struct dataflow_finding
+{
+    size_t index;
+    size_t statement_index;
+    source_loc loc;
+    char reason[DATAFLOW_REASON_LEN];
+    int bytes;
+    int cycles;
+
+} dataflow_finding;
+
+/* the redundant loads and flag operations of a program (--find-redundant, --remove-redundant) */
+typedef struct dataflow
+{
+    dataflow_finding *findings;
+    size_t count;
+    size_t capacity;
+    int remove;
+
+} dataflow;
+
+dataflow *dataflow_create(int remove);
+void dataflow_destroy(dataflow *dataflow);
+
+/* track the known values of a, x, y and the carry, decimal and zero flags through the
+   program as laid out by the first pass; returns the number of instructions removed */
+size_t dataflow_analyze(dataflow *dataflow, program *program, assembly_context *context);
+
+/* add the finding for the statement at index, if any, to the listing */
+void dataflow_list(const dataflow *dataflow, assembly_context *context, const program *program, size_t index);
+
+void dataflow_report(const dataflow *dataflow, FILE *stream);
+
+#endif /* dataflow_h */
@@ -0,0 +1,242 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "dead_code.h"
+#include "memory.h"
+#include "program.h"
+#include "statement.h"
+#include "string_htable.h"
+#include "symbol_table.h"
+#include "token.h"
+#include <stdlib.h>
+
+/* the block is not entered by code falling into it */
+#define NOT_ENTERED -2
+
+dead_code *dead_code_create(int case_sensitive)
+{
+    dead_code *dead = tiny_calloc(1, sizeof(dead_code));
+    dead->current = DEAD_CODE_NO_PROC;
+    dead->names = string_htable_create(sizeof(int));
+    dead->names->case_sensitive = case_sensitive;
+    return dead;
+}
+
+void dead_code_destroy(dead_code *dead)
+{
+    if (!dead) {
+        return;
+    }
+    string_htable_destroy(dead->names);
+    tiny_free(dead->references);
+    tiny_free(dead->procs);
+    tiny_free(dead);
+}
+
+int dead_code_begin(dead_code *dead, const token *directive)
+{
+    if (dead->current != DEAD_CODE_NO_PROC) {
+        return 0;
+    }
+    if (dead->count == dead->capacity) {
+        dead->capacity = dead->capacity ? dead->capacity * 2 : 32;
+        dead->procs = tiny_realloc(dead->procs, dead->capacity * sizeof(dead_code_proc));
+    }
+    dead->current = (int)dead->count;
+    dead->procs[dead->count++] = (dead_code_proc){ .directive = directive, .falls_from = NOT_ENTERED };
+    return 1;
+}
+
+int dead_code_end(dead_code *dead)
+{
+    if (dead->current == DEAD_CODE_NO_PROC) {
+        return 0;
+    }
+    dead->current = DEAD_CODE_NO_PROC;
+    return 1;
+}
+
+void dead_code_add_reference(dead_code *dead, const char *name, int exported)
+{
+    int from = exported ? DEAD_CODE_NO_PROC : dead->current;
+    const int *found = string_htable_get(dead->names, name);
+    int id = found ? *found : (int)dead->names->count;
+    if (!found) {
+        string_htable_add(dead->names, name, (const htable_value_ptr)&id);
+    } else if (dead->reference_count) {
+        /* an operand often refers to what the one before it did */
+        const dead_code_reference *last = dead->references + dead->reference_count - 1;
+        if (last->from == from && last->name == id) {
+            return;
+        }
+    }
+    if (dead->reference_count == dead->reference_capacity) {
+        dead->reference_capacity = dead->reference_capacity ? dead->reference_capacity * 2 : 256;
+        dead->references = tiny_realloc(dead->references, dead->reference_capacity * sizeof(dead_code_reference));
+    }
+    dead->references[dead->reference_count].from = from;
+    dead->references[dead->reference_count++].name = id;
+}
+
+static int compare_references(const void *lhs, const void *rhs)
+{
+    return ((const dead_code_reference*)lhs)->from - ((const dead_code_reference*)rhs)->from;
+}
+
+static int is_terminal(token_type mnemonic)
+{
+    return mnemonic == TOKEN_RTS || mnemonic == TOKEN_RTI || mnemonic == TOKEN_RTL ||
+           mnemonic == TOKEN_JMP || mnemonic == TOKEN_JML || mnemonic == TOKEN_BRA || mnemonic == TOKEN_BRL;
+}
+
+static int is_directive(const program *program, size_t index, token_type type)
+{
+    return program->kinds[index] == PROGRAM_KIND_PSEUDO_OP && program->statements[index]->instruction->type == type;
+}
+
+/* find each block's statements and size, which block owns each symbol, and what code falls into each block */
+static void locate(dead_code *dead, const program *program, int *owners)
+{
+    size_t next = 0;
+    int scope = DEAD_CODE_NO_PROC, falls = 0, falls_scope = DEAD_CODE_NO_PROC;
+    for(size_t i = 0; i < program->count; i++) {
+        if (next < dead->count && is_directive(program, i, TOKEN_PROC) && dead->procs[next].directive == program->statements[i]->instruction) {
+            dead_code_proc *proc = dead->procs + next;
+            proc->label = program->statements[i]->label;
+            proc->first = i;
+            proc->falls_from = falls ? falls_scope : NOT_ENTERED;
+            scope = (int)next++;
+        }
+        int label = program->labels[i];
+        if (scope != DEAD_CODE_NO_PROC) {
+            dead->procs[scope].size += program->sizes[i];
+            if (label != PROGRAM_NO_LABEL) {
+                const int *id = string_htable_get(dead->names, program->label_names[PROGRAM_LABEL_ID(label)]);
+                if (id) {
+                    owners[*id] = scope;
+                }
+            }
+        }
+        if (program->kinds[i] == PROGRAM_KIND_INSTRUCTION) {
+            falls = !is_terminal(program->statements[i]->instruction->type);
+            falls_scope = scope;
+        } else if (program->kinds[i] == PROGRAM_KIND_PSEUDO_OP && program->sizes[i]) {
+            /* data is not executed into whatever follows */
+            falls = 0;
+        }
+        if (scope != DEAD_CODE_NO_PROC && is_directive(program, i, TOKEN_ENDPROC)) {
+            dead->procs[scope].end = i + 1;
+            scope = DEAD_CODE_NO_PROC;
+        }
+    }
+}
+
+static void mark(dead_code *dead, int *stack, size_t *top, int proc)
+{
+    if (proc != DEAD_CODE_NO_PROC && !dead->procs[proc].reachable) {
+        dead->procs[proc].reachable = 1;
+        stack[(*top)++] = proc;
+    }
+}
+
+size_t dead_code_prune(dead_code *dead, program *program, symbol_table *symbols)
+{
+    dead->dropped = 0;
+    dead->saved = 0;
+    if (!dead->count) {
+        return 0;
+    }
+    size_t name_count = dead->names->count;
+    int *owners = tiny_malloc((name_count ? name_count : 1) * sizeof(int));
+    for(size_t n = 0; n < name_count; n++) {
+        owners[n] = DEAD_CODE_NO_PROC;
+    }
+    locate(dead, program, owners);
+
+    /* index the references by the block they are made from, those outside any block first */
+    qsort(dead->references, dead->reference_count, sizeof(dead_code_reference), compare_references);
+    size_t *first_reference = tiny_calloc(dead->count + 2, sizeof(size_t));
+    for(size_t r = 0; r < dead->reference_count; r++) {
+        first_reference[dead->references[r].from + 2]++;
+    }
+    for(size_t p = 0; p <= dead->count; p++) {
+        first_reference[p + 1] += first_reference[p];
+    }
+    int *stack = tiny_malloc(dead->count * sizeof(int));
+    size_t top = 0;
+    for(size_t p = 0; p < dead->count; p++) {
+        if (dead->procs[p].falls_from == DEAD_CODE_NO_PROC || dead->procs[p].end <= dead->procs[p].first) {
+            mark(dead, stack, &top, (int)p);
+        }
+    }
+    for(size_t r = first_reference[0]; r < first_reference[1]; r++) {
+        mark(dead, stack, &top, owners[dead->references[r].name]);
+    }
+    while (top) {
+        int proc = stack[--top];
+        for(size_t r = first_reference[proc + 1]; r < first_reference[proc + 2]; r++) {
+            mark(dead, stack, &top, owners[dead->references[r].name]);
+        }
+        for(size_t p = proc + 1; p < dead->count; p++) {
+            if (dead->procs[p].falls_from == proc) {
+                mark(dead, stack, &top, (int)p);
+            }
+        }
+    }
+    for(size_t p = 0; p < dead->count; p++) {
+        const dead_code_proc *proc = dead->procs + p;
+        if (proc->reachable) {
+            continue;
+        }
+        for(size_t i = proc->first; i < proc->end; i++) {
+            /* only its labels are still defined, all at the same address as what follows,
+               so they are listed only as dropped */
+            program->kinds[i] = PROGRAM_KIND_LABEL;
+            if (program->labels[i] != PROGRAM_NO_LABEL) {
+                symbol_table_hide(symbols, program->label_names[PROGRAM_LABEL_ID(program->labels[i])]);
+            }
+        }
+        dead->dropped++;
+        dead->saved += proc->size;
+    }
+    tiny_free(stack);
+    tiny_free(first_reference);
+    tiny_free(owners);
+    return dead->dropped;
+}
+
+void dead_code_list(const dead_code *dead, FILE *stream)
+{
+    if (!dead->dropped) {
+        return;
+    }
+    fprintf(stream, ";; DROPPED                        BYTES\n");
+    for(size_t p = 0; p < dead->count; p++) {
+        const dead_code_proc *proc = dead->procs + p;
+        if (proc->reachable) {
+            continue;
+        }
+        if (proc->label) {
+            TOKEN_GET_TEXT(proc->label, name);
+            fprintf(stream, ";; %-30s %d\n", name, proc->size);
+        } else {
+            fprintf(stream, ";; %-30s %d\n", "(unnamed)", proc->size);
+        }
+    }
+    fprintf(stream, ";; %zu blocks dropped, %d bytes saved\n", dead->dropped, dead->saved);
+}
+
+void dead_code_report(const dead_code *dead, FILE *stream)
+{
+    if (!dead->count) {
+        return;
+    }
+    fprintf(stream, "---------------------------------\n");
+    fprintf(stream, "Dead code: %zu of %zu blocks dropped, saving %d bytes\n", dead->dropped, dead->count, dead->saved);
+}
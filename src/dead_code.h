@@ -0,0 +1,89 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef dead_code_h
+#define dead_code_h
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct program program;
+typedef struct string_htable string_htable;
+typedef struct symbol_table symbol_table;
+typedef struct token token;
+
+#define DEAD_CODE_NO_PROC   -1
+
+/*
+
+Code and data between .proc and .endproc are only assembled if something
+that is assembled refers to them. While the first pass evaluates operands it
+notes each symbol the open block (or the code outside any block) refers to.
+After the first pass the blocks that nothing outside a block, no .export and
+no block kept before reaches are dropped from the program.
+**/
+
+/* a block between .proc and .endproc */
+typedef struct dead_code_proc
+{
+    const token *directive;
+    const token *label;
+    size_t first;
+    size_t end;
+    int size;
+    int falls_from;
+    int reachable;
+
+} dead_code_proc;
+
+/* a symbol referred to from within a block, or from outside any block */
+typedef struct dead_code_reference
+{
+    int from;
+    int name;
+
+} dead_code_reference;
+
+typedef struct dead_code
+{
+    dead_code_proc *procs;
+    size_t count;
+    size_t capacity;
+    int current;
+    string_htable *names;
+    dead_code_reference *references;
+    size_t reference_count;
+    size_t reference_capacity;
+    size_t dropped;
+    int saved;
+
+} dead_code;
+
+dead_code *dead_code_create(int case_sensitive);
+void dead_code_destroy(dead_code *dead);
+
+/* open a block at its .proc; returns 0 if a block is already open */
+int dead_code_begin(dead_code *dead, const token *directive);
+
+/* close the open block; returns 0 if no block is open */
+int dead_code_end(dead_code *dead);
+
+/* note a symbol the open block refers to, or that is always kept if exported */
+void dead_code_add_reference(dead_code *dead, const char *name, int exported);
+
+/* drop the blocks nothing kept refers to from the program and leave their labels out of the
+   symbol report; returns the number dropped */
+size_t dead_code_prune(dead_code *dead, program *program, symbol_table *symbols);
+
+/* list the dropped blocks and the bytes they would have taken */
+void dead_code_list(const dead_code *dead, FILE *stream);
+
+void dead_code_report(const dead_code *dead, FILE *stream);
+
+#endif /* dead_code_h */
@@ -0,0 +1,286 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "encoding.h"
+#include "error.h"
+#include "evaluator.h"
+#include "memory.h"
+#include "string_htable.h"
+#include "token.h"
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+/* the encoded string literals, which the parser appends to and the passes only read,
+   possibly while the parser is still appending to it on another thread */
+typedef struct encoded_pool
+{
+    unsigned char *bytes;
+    size_t start;
+    size_t size;
+    size_t capacity;
+    unsigned char **blocks;
+    size_t block_count;
+    size_t block_capacity;
+    chunked_array strings;
+
+} encoded_pool;
+
+static encoded_pool pool = { .strings = { .elem_size = sizeof(encoded_string) } };
+
+static void encoding_destructor(htable_value_ptr encoding_ptr)
+{
+    encoding *enc = (encoding*)encoding_ptr;
+    tiny_free(enc->wide);
+    tiny_free(enc);
+}
+
+encoding_set *encoding_set_create(int case_sensitive)
+{
+    encoding_set *set = tiny_calloc(1, sizeof(encoding_set));
+    set->encodings = string_htable_create(sizeof(encoding));
+    set->encodings->dtor = encoding_destructor;
+    set->encodings->case_sensitive = case_sensitive;
+    return set;
+}
+
+void encoding_set_destroy(encoding_set *set)
+{
+    if (!set) {
+        return;
+    }
+    string_htable_destroy(set->encodings);
+    tiny_free(set);
+}
+
+void encoding_select(encoding_set *set, const char *name)
+{
+    if (!strcasecmp(name, "none")) {
+        set->current = NULL;
+        return;
+    }
+    if (!string_htable_contains(set->encodings, name)) {
+        encoding created = {};
+        for(int i = 0; i < 256; i++) {
+            created.bytes[i] = ENCODING_UNMAPPED;
+        }
+        string_htable_add(set->encodings, name, (const htable_value_ptr)&created);
+    }
+    set->current = (encoding*)string_htable_get(set->encodings, name);
+}
+
+static encoding_wide *find_wide(const encoding *encoding, long code)
+{
+    size_t lo = 0, hi = encoding->wide_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (encoding->wide[mid].code < code) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return encoding->wide + lo;
+}
+
+static void map_wide(encoding *encoding, long code, int byte)
+{
+    encoding_wide *at = find_wide(encoding, code);
+    if (at < encoding->wide + encoding->wide_count && at->code == code) {
+        at->byte = byte;
+        return;
+    }
+    size_t index = at - encoding->wide;
+    if (encoding->wide_count == encoding->wide_capacity) {
+        encoding->wide_capacity = encoding->wide_capacity ? encoding->wide_capacity * 2 : 64;
+        encoding->wide = tiny_realloc(encoding->wide, encoding->wide_capacity * sizeof(encoding_wide));
+    }
+    memmove(encoding->wide + index + 1, encoding->wide + index, (encoding->wide_count - index) * sizeof(encoding_wide));
+    encoding->wide[index] = (encoding_wide){ .code = code, .byte = byte };
+    encoding->wide_count++;
+}
+
+int encoding_map(encoding *encoding, long first, long last, int byte)
+{
+    if (first < 0 || last < first || last > 0x10ffff || byte < 0 || byte + (last - first) > UINT8_MAX) {
+        return 0;
+    }
+    for(long code = first; code <= last; code++, byte++) {
+        if (code < 256) {
+            encoding->bytes[code] = (short)byte;
+        } else {
+            map_wide(encoding, code, byte);
+        }
+    }
+    return 1;
+}
+
+static int lookup(const encoding *encoding, long code)
+{
+    if (code < 256) {
+        return code < 0 ? ENCODING_UNMAPPED : encoding->bytes[code];
+    }
+    const encoding_wide *at = find_wide(encoding, code);
+    return at < encoding->wide + encoding->wide_count && at->code == code ? at->byte : ENCODING_UNMAPPED;
+}
+
+/* the character a UTF-8 sequence in the source begins, or -1 if it is not one */
+static long decode_utf8(const char *s, const char **next)
+{
+    unsigned char lead = (unsigned char)*s;
+    int count = lead >= 0xf0 ? 3 : lead >= 0xe0 ? 2 : lead >= 0xc0 ? 1 : 0;
+    if (!count || lead >= 0xf8) {
+        return -1;
+    }
+    long code = lead & (0x3f >> count);
+    for(int i = 1; i <= count; i++) {
+        unsigned char continuation = (unsigned char)s[i];
+        if ((continuation & 0xc0) != 0x80) {
+            return -1;
+        }
+        code = (code << 6) | (continuation & 0x3f);
+    }
+    *next = s + count + 1;
+    return code;
+}
+
+/* the next character of a string literal, as written in the source or as an escape sequence */
+static long next_character(const char *s, const char **next)
+{
+    if (*s == '\\') {
+        return evaluate_char_literal(s, next);
+    }
+    long code = decode_utf8(s, next);
+    if (code < 0) {
+        *next = s + 1;
+        code = (unsigned char)*s;
+    }
+    return code;
+}
+
+static int is_valid(long code)
+{
+    return code >= 0 && code <= 0x10ffff && (code < 0xd800 || code > 0xdbff);
+}
+
+int encoding_characters(const token *string_literal, long *characters, int max)
+{
+    const char *s = token_get_text(string_literal) + 1; /* skip the quote */
+    int count = 0;
+    while (*s != '"') {
+        long code = next_character(s, &s);
+        if (!is_valid(code)) {
+            return -1;
+        }
+        if (count < max) {
+            characters[count] = code;
+        }
+        count++;
+    }
+    return count;
+}
+
+static void add_byte(int byte)
+{
+    if (pool.size == pool.capacity) {
+        /* move the string so far to a new block, leaving the strings before it where they are */
+        size_t partial = pool.size - pool.start;
+        pool.capacity = partial * 2 > 4096 ? partial * 2 : 4096;
+        unsigned char *block = tiny_malloc(pool.capacity);
+        if (partial) {
+            memcpy(block, pool.bytes + pool.start, partial);
+        }
+        if (pool.block_count == pool.block_capacity) {
+            pool.block_capacity = pool.block_capacity ? pool.block_capacity * 2 : 16;
+            pool.blocks = tiny_realloc(pool.blocks, pool.block_capacity * sizeof(unsigned char*));
+        }
+        pool.blocks[pool.block_count++] = block;
+        pool.bytes = block;
+        pool.start = 0;
+        pool.size = partial;
+    }
+    pool.bytes[pool.size++] = (unsigned char)byte;
+}
+
+static void add_utf8(long c)
+{
+    if (c >= 0x800) {
+        if (c >= 0x10000) {
+            add_byte(((c >> 18) & 0x07) | 0xF0);
+            add_byte(((c >> 12) & 0x3F) | 0x80);
+        } else {
+            add_byte(((c >> 12) & 0x0F) | 0xE0);
+        }
+        add_byte(((c >> 6) & 0x3F) | 0x80);
+    } else {
+        add_byte(((c >> 6) & 0x1F) | 0xC0);
+    }
+    add_byte((c & 0x3F) | 0x80);
+}
+
+int encoding_encode(const encoding_set *set, token *string_literal)
+{
+    const encoding *current = set ? set->current : NULL;
+    encoded_string encoded = {};
+    pool.start = pool.size;
+    const char *string = token_get_text(string_literal) + 1; /* skip the quote */
+    string_literal->payload = 0;
+    while (*string != '"') {
+        const char *start = string;
+        value c = evaluate_char_literal(string, &string);
+        if (current) {
+            const char *next;
+            int byte = lookup(current, next_character(start, &next));
+            if (byte != ENCODING_UNMAPPED) {
+                add_byte(byte);
+                encoded.high_bit |= byte > INT8_MAX;
+                string = next;
+                continue;
+            }
+        }
+        if (c <= UINT8_MAX) {
+            add_byte((int)c);
+            encoded.high_bit |= c > INT8_MAX;
+            continue;
+        }
+        if (!is_valid(c)) {
+            tiny_error(string_literal, ERROR_MODE_RECOVER, "Illegal quantity (codepoint is not valid)");
+            pool.size = pool.start;
+            return 0;
+        }
+        add_utf8(c);
+    }
+    encoded.bytes = pool.bytes ? pool.bytes + pool.start : NULL;
+    encoded.length = pool.size - pool.start;
+    *(encoded_string*)chunked_array_next(&pool.strings) = encoded;
+    string_literal->payload = (unsigned int)chunked_array_publish(&pool.strings) + 1;
+    return 1;
+}
+
+const encoded_string *encoding_get(const token *string_literal)
+{
+    return string_literal->payload ? CHUNKED_ARRAY_AT(&pool.strings, encoded_string, string_literal->payload - 1) : NULL;
+}
+
+const unsigned char *encoding_bytes(const encoded_string *encoded)
+{
+    return encoded->bytes;
+}
+
+void encoding_cleanup(void)
+{
+    for(size_t i = 0; i < pool.block_count; i++) {
+        tiny_free(pool.blocks[i]);
+    }
+    tiny_free(pool.blocks);
+    chunked_array_cleanup(&pool.strings);
+    pool.bytes = NULL;
+    pool.blocks = NULL;
+    pool.start = pool.size = pool.capacity = pool.block_count = pool.block_capacity = 0;
+}
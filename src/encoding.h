@@ -0,0 +1,86 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef encoding_h
+#define encoding_h
+
+#include <stddef.h>
+
+typedef struct string_htable string_htable;
+typedef struct token token;
+
+#define ENCODING_UNMAPPED   -1
+
+/*
+
+An encoding translates the characters of string literals to bytes. The
+parser applies .encoding and .map as it reaches them, and encodes each
+string literal of a string directive for the encoding then in effect. The
+bytes are kept in a side table the token's payload indexes, so on every
+pass the directive only copies them to the output. The default encoding,
+"none", leaves characters below 256 as they are and writes the others as
+UTF-8, as does any encoding for the characters it does not map.
+**/
+
+/* a character from 256 up and the byte it maps to */
+typedef struct encoding_wide
+{
+    long code;
+    int byte;
+
+} encoding_wide;
+
+typedef struct encoding
+{
+    short bytes[256];
+    encoding_wide *wide;
+    size_t wide_count;
+    size_t wide_capacity;
+
+} encoding;
+
+typedef struct encoding_set
+{
+    string_htable *encodings;
+    encoding *current;
+
+} encoding_set;
+
+/* the bytes of a string literal */
+typedef struct encoded_string
+{
+    const unsigned char *bytes;
+    size_t length;
+    int high_bit;
+
+} encoded_string;
+
+encoding_set *encoding_set_create(int case_sensitive);
+void encoding_set_destroy(encoding_set *set);
+
+/* make the named encoding current, creating it if it is new; "none" is the default */
+void encoding_select(encoding_set *set, const char *name);
+
+/* map the characters first through last to bytes from byte up; returns 0 if they do not fit in a byte */
+int encoding_map(encoding *encoding, long first, long last, int byte);
+
+/* the characters of a string literal, up to max; returns how many there are, or -1 if one is not valid */
+int encoding_characters(const token *string_literal, long *characters, int max);
+
+/* encode the string literal for the current encoding and attach its bytes to the token;
+   returns 0 if it has a character that is not valid */
+int encoding_encode(const encoding_set *set, token *string_literal);
+
+/* the bytes attached to a string literal, or NULL if it was not encoded */
+const encoded_string *encoding_get(const token *string_literal);
+const unsigned char *encoding_bytes(const encoded_string *encoded);
+
+void encoding_cleanup(void);
+
+#endif /* encoding_h */
@@ -8,6 +8,8 @@
 */
 
 #include "error.h"
+#include "memory.h"
+#include "source_manager.h"
 #include "statement.h"
 #include "token.h"
 #include <stdio.h>
@@ -16,19 +18,88 @@
 
 static const int MAX_ENTRIES = 1000;
 
-static int errors = 0;
-static int warnings = 0;
+/* counted per thread so each assembled variant reports its own */
+static _Thread_local int errors = 0;
+static _Thread_local int warnings = 0;
+
+/* messages held on this thread to be printed by another, and how many of them are errors and warnings */
+typedef struct held_messages
+{
+    int holding;
+    char *text;
+    size_t length;
+    size_t capacity;
+    int errors;
+    int warnings;
+
+} held_messages;
+
+static _Thread_local held_messages held;
+
+static void vemit(const char *fmt, va_list ap)
+{
+    if (!held.holding) {
+        vfprintf(stdout, fmt, ap);
+        return;
+    }
+    va_list copy;
+    va_copy(copy, ap);
+    int size = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (size <= 0) {
+        return;
+    }
+    if (held.length + (size_t)size + 1 > held.capacity) {
+        held.capacity = (held.length + (size_t)size + 1) * 2;
+        held.text = tiny_realloc(held.text, held.capacity);
+    }
+    vsnprintf(held.text + held.length, (size_t)size + 1, fmt, ap);
+    held.length += (size_t)size;
+}
+
+static void emit(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vemit(fmt, ap);
+    va_end(ap);
+}
 
 static void output_error_type(int is_error, error_mode mode)
 {
     if (is_error) {
-        fprintf(stdout, ERROR_TEXT);
+        emit(ERROR_TEXT);
         if (mode == ERROR_MODE_PANIC) {
-            fprintf(stdout, "fatal ");
+            emit("fatal ");
         }
-        fprintf(stdout, "error: " DEFAULT_TEXT);
+        emit("error: " DEFAULT_TEXT);
     } else {
-        fprintf(stdout, WARNING_TEXT "warning: " DEFAULT_TEXT);
+        emit(WARNING_TEXT "warning: " DEFAULT_TEXT);
+    }
+}
+
+static void print_backtrace(source_loc loc)
+{
+    /* walk the include and macro expansion chain from innermost to outermost */
+    int is_expansion;
+    source_loc parent;
+    while ((parent = source_manager_parent(loc, &is_expansion)) != SOURCE_LOC_INVALID) {
+        source_location from = source_manager_decode(parent);
+        if (is_expansion) {
+            char macro_name[64] = {};
+            size_t name_len = strcspn(source_manager_text(parent), " \t\n");
+            if (name_len > 63) {
+                name_len = 63;
+            }
+            strncpy(macro_name, source_manager_text(parent), name_len);
+            if (name_len > 61) {
+                macro_name[60] = macro_name[61] = macro_name[62] = '.';
+            }
+            emit("Expanded from macro '%s'(%d):\n", macro_name, from.line);
+        } else {
+            emit("Included from %s(%d):\n", from.file_name, from.line);
+        }
+        loc = parent;
     }
 }
 
@@ -36,13 +107,17 @@ static void tiny_log_message(const token *token, int is_error, error_mode mode,
 {
     if (errors + warnings >= MAX_ENTRIES) return;
     if (is_error) errors++; else warnings++;
+    if (held.holding) {
+        if (is_error) held.errors++; else held.warnings++;
+    }
     if (errors + warnings > MAX_ENTRIES) {
-        fprintf(stdout, "Too many errors");
+        emit("Too many errors");
         return;
     }
-    if (!token || !token->src_filename) {
+    source_location where = source_manager_decode(token ? token->loc : SOURCE_LOC_INVALID);
+    if (!where.file_name) {
         output_error_type(is_error, mode);
-        vfprintf(stdout, msg, ap);
+        vemit(msg, ap);
         return;
     }
     char source_line[LINE_DISPLAY_LEN * 2 + 1] = {};
@@ -57,28 +132,18 @@ static void tiny_log_message(const token *token, int is_error, error_mode mode,
     while (*c == '\n') {
         c++;
     }
-    size_t line_pos = token->src_line_pos - 1;
+    size_t line_pos = where.column - 1;
     while (line_pos--) {
         *c = ' ';
         c++;
     }
-    if (token->expanded_macro) {
-        char macro_name[64] = {};
-        size_t name_len = token_copy_text_to_buffer(token->expanded_macro, macro_name, 64);
-        if (name_len > 61) {
-            macro_name[60] = macro_name[61] = macro_name[62] = '.';
-        }
-        fprintf(stdout, "Expanded from macro '%s'(%d):\n", macro_name, token->expanded_macro->src_line+1);
-    }
-    if (token->include_filename) {
-        fprintf(stdout, "Included from %s(%d):\n", token->include_filename, token->include_line+1);
-    }
-    fprintf(stdout, "%s(%d:%d): ", token->src_filename, token->src_line, token->src_line_pos);
+    print_backtrace(token->loc);
+    emit("%s(%d:%d): ", where.file_name, where.line, where.column);
     output_error_type(is_error, mode);
     const char *fmt = "%s.\n%s" HIGHLIGHT_TEXT "%s" DEFAULT_TEXT "\n";
     char formatted[200] = {};
     vsnprintf(formatted, 199, msg, ap);
-    fprintf(stdout, fmt, formatted, source_line, "^~~");
+    emit(fmt, formatted, source_line, "^~~");
 }
 
 void tiny_error(const token *token, error_mode mode, const char *error_msg, ...)
@@ -93,6 +158,9 @@ void tiny_verror(const token *token, error_mode mode, const char *error_msg, va_
 {
     tiny_log_message(token, 1, mode, error_msg, ap);
     if (mode == ERROR_MODE_PANIC){
+        if (held.length) {
+            fputs(held.text, stdout);
+        }
         va_end(ap);
         exit(1);
     }
@@ -125,3 +193,31 @@ void tiny_reset_errors_warnings()
 {
     errors = warnings = 0;
 }
+
+void tiny_hold_messages(int hold)
+{
+    held.holding = hold;
+}
+
+char *tiny_take_messages(int *error_count, int *warn_count)
+{
+    char *text = held.length ? held.text : NULL;
+    if (text) {
+        held.text = NULL;
+        held.length = held.capacity = 0;
+    }
+    *error_count = held.errors;
+    *warn_count = held.warnings;
+    held.errors = held.warnings = 0;
+    return text;
+}
+
+void tiny_print_messages(char *messages, int error_count, int warn_count)
+{
+    if (messages) {
+        fputs(messages, stdout);
+        tiny_free(messages);
+    }
+    errors += error_count;
+    warnings += warn_count;
+}
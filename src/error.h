@@ -33,4 +33,13 @@ int tiny_warn_count(void);
 
 void tiny_reset_errors_warnings(void);
 
+/* keep the messages logged on this thread instead of printing them, until they are taken */
+void tiny_hold_messages(int hold);
+
+/* the messages held since they were last taken, or NULL, with the number of errors and warnings among them */
+char *tiny_take_messages(int *error_count, int *warn_count);
+
+/* print messages taken from another thread and count them on this one */
+void tiny_print_messages(char *messages, int error_count, int warn_count);
+
 #endif /* error_h */
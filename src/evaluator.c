@@ -9,11 +9,15 @@
 
 #include "assembly_context.h"
 #include "anonymous_label.h"
+#include "builtin_functions.h"
+#include "conditional.h"
+#include "dead_code.h"
 #include "expression.h"
 #include "error.h"
 #include "evaluator.h"
 #include "memory.h"
 #include "output.h"
+#include "pass_trace.h"
 #include "token.h"
 #include <limits.h>
 #include <math.h>
@@ -88,10 +92,16 @@ static void eval_scoped_identifier(assembly_context *context, const expression *
     size_t scope_size = strlen(root) + TOKEN_TEXT_MAX_LEN + 2;
     char *scoped_name = tiny_calloc(scope_size, sizeof(char));
     snprintf(scoped_name, scope_size, "%s.%s", root, target);
+    if (!context->passes) {
+        dead_code_add_reference(context->procs, scoped_name, 0);
+    }
     value v = VALUE_UNDEFINED;
     if (!symbol_exists(context->sym_tab, scoped_name)) {
         if (!context->pass_needed) {
             if (!context->passes) {
+                if (context->trace) {
+                    pass_trace_unresolved(context->trace, ASSEMBLY_CONTEXT_PASS(context), scoped_name, expr->binary.lhs->token->loc);
+                }
                 context->pass_needed = 1;
             }
             else {
@@ -101,6 +111,9 @@ static void eval_scoped_identifier(assembly_context *context, const expression *
     }
     else {
         v = symbol_table_lookup(context->sym_tab, scoped_name);
+        if (!context->passes) {
+            conditional_read_symbol(context->conditions, scoped_name);
+        }
     }
     stack_push(stack, v);
     tiny_free(root);
@@ -137,15 +150,21 @@ static void eval_binary(assembly_context *context, const expression *expression,
         if (lhs_token->type != TOKEN_IDENT) {
             tiny_error(lhs_token, ERROR_MODE_RECOVER, "Invalid lvalue in assignment");
         }
+        int reads_address = context->conditions->reads_address;
+        context->conditions->reads_address = 0;
         stack_evaluate_expression(context, expression->binary.rhs, stack);
         if (stack_peek(stack) != VALUE_UNDEFINED) {
             TOKEN_GET_TEXT(lhs_token, token_text);
             if (!symbol_exists(context->sym_tab, token_text)) {
+                if (context->conditions->reads_address) {
+                    conditional_add_address(context->conditions, token_text);
+                }
                 symbol_table_define(context->sym_tab, token_text, stack_peek(stack));
             } else {
                 tiny_error(lhs_token, ERROR_MODE_RECOVER, "Symbol '%s' previously defined");
             }
         }
+        context->conditions->reads_address |= reads_address;
         return;
     }
     stack_evaluate_expression(context, expression->binary.lhs, stack);
@@ -155,7 +174,7 @@ static void eval_binary(assembly_context *context, const expression *expression,
             (lhs < 0 || lhs > 1))
         {
             tiny_warn(expression->token, "Consider using the '%c' operator instead", 
-            expression->token->src.ref[expression->token->src.start]);
+            *token_get_text(expression->token));
         }
         if ((oper == TOKEN_DOUBLEAMPERSAND && !lhs) || 
             (oper == TOKEN_DOUBLEPIPE && lhs))
@@ -244,6 +263,19 @@ static void eval_unary(assembly_context *context, const expression *expression,
     }
 }
 
+/* the first pass notes what each .proc block refers to, so that blocks nothing refers to can be dropped */
+static void note_reference(assembly_context *context, const char *name)
+{
+    if (name[0] != '_' || !context->local_label) {
+        dead_code_add_reference(context->procs, name, 0);
+        return;
+    }
+    char scoped_name[TOKEN_TEXT_MAX_LEN*2+1] = {};
+    TOKEN_GET_TEXT(context->local_label, local_label);
+    snprintf(scoped_name, TOKEN_TEXT_MAX_LEN*2, "%s.%s", local_label, name);
+    dead_code_add_reference(context->procs, scoped_name, 0);
+}
+
 static void lookup_ident(assembly_context *context, const expression *expression, value_stack *stack)
 {
     if (!context) {
@@ -252,12 +284,17 @@ static void lookup_ident(assembly_context *context, const expression *expression
     }
     const token *token = expression->token;
     if (token->type == TOKEN_ASTERISK) {
+        context->conditions->reads_address = 1;
         stack_push(stack, context->output->logical_pc);
         return;
     }
     TOKEN_GET_TEXT(token, name);
     if (name[0] == '+' || name[0] == '-') {
+        context->conditions->reads_address = 1;
         if (name[0] == '+' && !context->passes) {
+            if (context->trace) {
+                pass_trace_unresolved(context->trace, ASSEMBLY_CONTEXT_PASS(context), name, token->loc);
+            }
             context->pass_needed = 1;
             stack_push(stack, VALUE_UNDEFINED);
             return;
@@ -269,7 +306,13 @@ static void lookup_ident(assembly_context *context, const expression *expression
         stack_push(stack, v);
         return;
     }
+    if (!context->passes) {
+        note_reference(context, name);
+    }
     if (symbol_exists(context->sym_tab, name)) {
+        if (!context->passes) {
+            conditional_read_symbol(context->conditions, name);
+        }
         stack_push(stack, symbol_table_lookup(context->sym_tab, name));
         return;
     }
@@ -278,11 +321,23 @@ static void lookup_ident(assembly_context *context, const expression *expression
         TOKEN_GET_TEXT(context->local_label, local_label);
         snprintf(scoped_name, TOKEN_TEXT_MAX_LEN*2, "%s.%s", local_label, name);
         if (symbol_exists(context->sym_tab, scoped_name)) {
+            if (!context->passes) {
+                conditional_read_symbol(context->conditions, scoped_name);
+            }
             stack_push(stack, symbol_table_lookup(context->sym_tab, scoped_name));
             return;
         }
     }
     if (!context->passes) {
+        if (context->trace) {
+            pass_trace_unresolved(context->trace, ASSEMBLY_CONTEXT_PASS(context), name, token->loc);
+        }
+        context->pass_needed = 1;
+        stack_push(stack, VALUE_UNDEFINED);
+        return;
+    }
+    if (context->passes && context->conditions->skipped_unknown) {
+        /* it may be defined in a block the first pass skipped */
         context->pass_needed = 1;
         stack_push(stack, VALUE_UNDEFINED);
         return;
@@ -293,13 +348,13 @@ static void lookup_ident(assembly_context *context, const expression *expression
 
 static void stack_evaluate_token_value(const token *token, value_stack *stack)
 {
-    if (token->src.end - token->src.start > 65) {
+    if (token->length > 65) {
         tiny_error(token, ERROR_MODE_RECOVER, "Illegal quantity");
         stack_push(stack, VALUE_UNDEFINED);
     }
     if (token->type == TOKEN_CHARLITERAL) {
         const char *end_ptr;
-        value chr = evaluate_char_literal(token->src.ref + token->src.start + 1, &end_ptr);
+        value chr = evaluate_char_literal(token_get_text(token) + 1, &end_ptr);
         if (*end_ptr != '\'' || chr > UINT8_MAX) {
             if (chr > UINT8_MAX) {
                 tiny_error(token, ERROR_MODE_RECOVER, "Escape sequence out of range");
@@ -313,8 +368,8 @@ static void stack_evaluate_token_value(const token *token, value_stack *stack)
     }
     char num_buffer[66] = {};
     char *n = num_buffer;
-    const char *tk = token->src.ref + token->src.start;
-    const char *tk_end = token->src.ref + token->src.end;
+    const char *tk = token_get_text(token);
+    const char *tk_end = tk + token->length;
     if (token->type == TOKEN_HEXLITERAL || token->type == TOKEN_BINLITERAL) {
         ++tk;
     }
@@ -347,6 +402,44 @@ static void stack_evaluate_token_value(const token *token, value_stack *stack)
     stack_push(stack, v);
 }
 
+static void eval_fcn_call(assembly_context *context, const expression *expression, value_stack *stack)
+{
+    TOKEN_GET_TEXT(expression->token, name);
+    const builtin_function *function = builtin_function_lookup(name);
+    if (!function) {
+        if (context && symbol_exists(context->sym_tab, name)) {
+            tiny_error(expression->token, ERROR_MODE_RECOVER, "Symbol is not a function");
+        } else {
+            tiny_error(expression->token, ERROR_MODE_RECOVER, "Function '%s' not defined", name);
+        }
+        stack_push(stack, VALUE_UNDEFINED);
+        return;
+    }
+    const expression_array *params = expression->fcn_call.params;
+    size_t count = params ? params->count : 0;
+    if (count < function->min_args || count > function->max_args) {
+        tiny_error(expression->token, ERROR_MODE_RECOVER, "Function '%s' does not take %zu arguments", name, count);
+        stack_push(stack, VALUE_UNDEFINED);
+        return;
+    }
+    value args[BUILTIN_FUNCTION_MAX_ARGS];
+    for(size_t i = 0; i < count; i++) {
+        const struct expression *param = (const struct expression*)params->data[i];
+        if (param->type == TYPE_LITERAL && param->token->type == TOKEN_STRINGLITERAL && function->string_arg) {
+            args[i] = builtin_string_length(param->token);
+        } else {
+            args[i] = evaluate_expression(context, param);
+        }
+        if (args[i] == VALUE_UNDEFINED) {
+            stack_push(stack, VALUE_UNDEFINED);
+            return;
+        }
+    }
+    /* report errors once the arguments are final, and remember results for later passes */
+    int report = !context || !context->pass_needed;
+    stack_push(stack, builtin_function_call(context ? context->functions : NULL, function, args, count, expression->token, report));
+}
+
 static void stack_evaluate_expression(assembly_context *context, const expression *expression, value_stack *stack)
 {
     if (expression->value != VALUE_UNDEFINED) {
@@ -366,14 +459,8 @@ static void stack_evaluate_expression(assembly_context *context, const expressio
         case TYPE_BINARY:
             eval_binary(context, expression, stack);
             break;
-        case TYPE_FCN_CALL: {
-                TOKEN_GET_TEXT(expression->token, symbol_name);
-                if (symbol_exists(context->sym_tab, symbol_name)) {
-                    tiny_error(expression->token, ERROR_MODE_RECOVER, "Symbol is not a function");
-                } else {
-                    tiny_error(expression->token, ERROR_MODE_RECOVER, "Symbol '%s' not defined", symbol_name);
-                }
-            }
+        case TYPE_FCN_CALL:
+            eval_fcn_call(context, expression, stack);
             break;
         default:
             eval_ternary(context, expression, stack);
@@ -9,25 +9,76 @@
 
 #include "assembly_context.h"
 #include "anonymous_label.h"
+#include "compress.h"
+#include "conditional.h"
+#include "cycles.h"
+#include "dataflow.h"
 #include "error.h"
 #include "executor.h"
 #include "expression.h"
+#include "loop.h"
 #include "evaluator.h"
 #include "m6502.h"
 #include "operand.h"
 #include "output.h"
+#include "page_layout.h"
+#include "pass_trace.h"
+#include "profile.h"
+#include "program.h"
 #include "pseudo_op.h"
 #include "statement.h"
+#include "string_pool.h"
 #include "token.h"
 #include "value.h"
+#include "zp_allocator.h"
 #include <stdio.h>
 #include <string.h>
 
+static void count_cycles(assembly_context *context)
+{
+    if (context->output->pc <= context->start_pc) {
+        return;
+    }
+    const unsigned char *code = (const unsigned char*)context->output->buffer + context->start_pc;
+    size_t length = (size_t)(context->output->pc - context->start_pc);
+    context->cycles = cycles_count(context->options.cpu, code, length, context->logical_start_pc, context->m16, context->x16);
+    if (context->cycles.max) {
+        cycle_log_add(context->cycle_log, context->logical_start_pc, context->cycles);
+    }
+}
+
+static void mark_indexed_read(assembly_context *context)
+{
+    if (context->output->pc - context->start_pc != 3) {
+        return;
+    }
+    const unsigned char *code = (const unsigned char*)context->output->buffer + context->start_pc;
+    if (cycles_reads_across_page(context->options.cpu, code[0])) {
+        page_layout_add_read(context->pages, code[1] | (code[2] << 8), context->start_pc);
+    }
+}
+
+static void mark_profile(assembly_context *context, const statement *statement)
+{
+    if (!context->profile || context->pass_needed || context->output->pc <= context->start_pc) {
+        return;
+    }
+    /* the listing line just added ends with the instruction's newline */
+    size_t listing_offset = PROFILE_NO_LISTING;
+    if (context->options.list && !context->print_off && context->disassembly_length) {
+        listing_offset = context->disassembly_length - 1;
+    }
+    profile_mark_instruction(context->profile, context->start_pc, listing_offset, statement->instruction->loc);
+}
+
 static void assemble(assembly_context *context, const statement *statement)
 {
     char disassembly[16];
     m6502_gen(context, statement->instruction, statement->operand, disassembly);
-    assembly_context_add_disasm(context, disassembly, statement->instruction->src.ref, '.');
+    count_cycles(context);
+    mark_indexed_read(context);
+    assembly_context_add_disasm(context, disassembly, token_get_line(statement->instruction), '.');
+    mark_profile(context, statement);
 }
 
 static void pseudo_op(assembly_context *context, const statement *statement)
@@ -35,7 +86,7 @@ static void pseudo_op(assembly_context *context, const statement *statement)
     pseudo_op_gen(context, statement->instruction, statement->operand);
     if (context->start_pc < context->output->pc) {
         /* only disassemble pseudo-ops that output*/
-        assembly_context_add_disasm(context, NULL, statement->instruction->src.ref, '>');
+        assembly_context_add_disasm(context, NULL, token_get_line(statement->instruction), '>');
     }
 }
 
@@ -63,17 +114,18 @@ static void disassemble_label(assembly_context *context, const statement *statem
     }
     if (statement->label->type == TOKEN_IDENT &&
         statement->instruction &&
-        statement->instruction->type == TOKEN_EQUAL) {
+        (statement->instruction->type == TOKEN_EQUAL || statement->instruction->type == TOKEN_ZPVAR)) {
         char disasm[16] = {};
         snprintf(disasm, 16, "$%x", (int)label_value);
-        assembly_context_add_disasm_opt_pc(context, disasm, statement->label->src.ref, '=', 0);
+        assembly_context_add_disasm_opt_pc(context, disasm, token_get_line(statement->label), '=', 0);
         return;
     }
-    assembly_context_add_disasm(context, NULL, statement->label->src.ref, '.');
+    assembly_context_add_disasm(context, NULL, token_get_line(statement->label), '.');
 }
 
-static void create_or_update_label(assembly_context *context, const statement *statement)
+static void create_or_update_label(assembly_context *context, const statement *statement, const char *resolved_name, int is_local, value label_val)
 {
+    size_t at_index = anonymous_label_next_index(context->anonymous_labels_new);
     if (!context->passes && (!statement->label ||
         (statement->label->type != TOKEN_PLUS && statement->label->type != TOKEN_HYPHEN))) {
         anonymous_label_add(context->anonymous_labels_new);
@@ -81,8 +133,16 @@ static void create_or_update_label(assembly_context *context, const statement *s
     if (!statement->label) {
             return;
     }
-    value label_val = context->output->logical_pc;
-    if (statement->instruction && statement->instruction->type == TOKEN_EQUAL) {
+    if (statement->label->type == TOKEN_IDENT && context->loops->count) {
+        /* a body runs many times, but a symbol can only have one value */
+        if (!context->passes && loop_stack_first_iteration(context->loops)) {
+            tiny_error(statement->label, ERROR_MODE_RECOVER, "Symbols cannot be defined inside a loop");
+        }
+        return;
+    }
+    int is_assignment = statement->instruction && statement->instruction->type == TOKEN_EQUAL;
+    if (is_assignment) {
+        context->conditions->reads_address = 0;
         label_val = evaluate_expression(context, statement->operand->single_expression.expr);
         if (statement->label->type == TOKEN_ASTERISK) {
             if (label_val < INT16_MIN || label_val > UINT16_MAX) {
@@ -101,28 +161,43 @@ static void create_or_update_label(assembly_context *context, const statement *s
             tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Invalid operation");
         }
         disassemble_label(context, statement, label_val);
+    } else if (statement->instruction && statement->instruction->type == TOKEN_ZPVAR) {
+        /* placed by the allocator once the first pass has seen every variable */
+        label_val = zp_allocator_address(context->zp_vars, statement);
+        if (label_val == VALUE_UNDEFINED && !context->passes) {
+            context->pass_needed = 1;
+        }
+        disassemble_label(context, statement, label_val);
     }
     if (statement->label->type == TOKEN_IDENT) {
         char label_name[TOKEN_TEXT_MAX_LEN * 2 + 2] = {};
-        const char *label_start = statement->label->src.ref + statement->label->src.start;
-        if (*label_start == '_') {
-            TOKEN_GET_TEXT(statement->label, label_text);
-            if (context->local_label) {
-                TOKEN_GET_TEXT(context->local_label, local_label);
-                snprintf(label_name, TOKEN_TEXT_MAX_LEN, "%s.%s", local_label, label_text);
-            }
-            else {
-                strncpy(label_name, label_text, TOKEN_TEXT_MAX_LEN);
-            }
+        if (resolved_name) {
+            strncpy(label_name, resolved_name, TOKEN_TEXT_MAX_LEN * 2);
         } else {
-            token_copy_text_to_buffer(statement->label, label_name, TOKEN_TEXT_MAX_LEN);
+            statement_get_label_name(statement, context->local_label, label_name);
+            is_local = *token_get_text(statement->label) == '_';
+        }
+        if (!is_local) {
             context->local_label = statement->label;
         }
         if (context->passes && symbol_table_lookup(context->sym_tab, label_name) != label_val) {
+            if (context->trace) {
+                pass_trace_symbol(context->trace, ASSEMBLY_CONTEXT_PASS(context), label_name,
+                    symbol_table_lookup(context->sym_tab, label_name), label_val, statement->label->loc);
+            }
             context->pass_needed = 1;
-            symbol_table_update(context->sym_tab, label_name, label_val);
+            if (!symbol_exists(context->sym_tab, label_name)) {
+                /* in a block a condition skipped on the passes before */
+                symbol_table_define(context->sym_tab, label_name, label_val);
+            } else {
+                symbol_table_update(context->sym_tab, label_name, label_val);
+            }
         } else if (!context->passes) {
             if (!symbol_exists(context->sym_tab, label_name)) {
+                if (!is_assignment || context->conditions->reads_address) {
+                    /* a condition on it cannot be decided until the addresses settle */
+                    conditional_add_address(context->conditions, label_name);
+                }
                 symbol_table_define(context->sym_tab, label_name, label_val);
             }
             else {
@@ -133,8 +208,15 @@ static void create_or_update_label(assembly_context *context, const statement *s
     }
     
     if (context->passes > 0) {
-        context->pass_needed |= label_val != anonymous_label_get_current(context->anonymous_labels_new, statement->index);
-        anonymous_label_update_current(context->anonymous_labels_new, statement->index, label_val);
+        value anon_val = anonymous_label_get_current(context->anonymous_labels_new, at_index);
+        if (label_val != anon_val) {
+            if (context->trace) {
+                pass_trace_symbol(context->trace, ASSEMBLY_CONTEXT_PASS(context),
+                    statement->label->type == TOKEN_PLUS ? "+" : "-", anon_val, label_val, statement->label->loc);
+            }
+            context->pass_needed = 1;
+        }
+        anonymous_label_update_current(context->anonymous_labels_new, at_index, label_val);
     }
     if (statement->label->type == TOKEN_PLUS) {
         anonymous_label_add_forward(context->anonymous_labels_new, label_val);
@@ -151,21 +233,145 @@ void statement_execute(assembly_context *context, const statement *statement)
 {
     context->logical_start_pc = context->output->logical_pc;
     context->start_pc = context->output->pc;
-    create_or_update_label(context, statement);
-    if (statement->instruction &&
-        ((statement->instruction->type >= TOKEN_ANC && statement->instruction->type <= TOKEN_TOP) ||
-         (statement->instruction->type >= TOKEN_BBR && statement->instruction->type <= TOKEN_XCE) ||
-        statement->instruction->type >= TOKEN_ADC)) {
+    context->cycles = (cycle_range){};
+    program_kind kind = program_statement_kind(statement);
+    if (kind == PROGRAM_KIND_PSEUDO_OP) {
+        output_fill(context->output, pseudo_op_label_padding(context, statement->instruction, statement->operand));
+    }
+    create_or_update_label(context, statement, NULL, 0, context->output->logical_pc);
+    if (kind == PROGRAM_KIND_INSTRUCTION || kind == PROGRAM_KIND_PSEUDO_OP) {
         /* set up program counter overflow handler */
         overflow_context overflow_ctx = {
             .asm_context = context,
             .statement = statement
         };
         output_set_overflow_handler(context->output, pc_overflow_handler, &overflow_ctx);
-        if (statement->instruction->type <= TOKEN_TYA) {
+        if (kind == PROGRAM_KIND_INSTRUCTION) {
             assemble(context, statement);
         } else {
             pseudo_op(context, statement);
         }
     }
 }
+
+typedef void (*program_handler)(assembly_context *context, const program *program, size_t index);
+
+static void define_label(assembly_context *context, const program *program, size_t index, value address)
+{
+    int label = program->labels[index];
+    const char *label_name = label == PROGRAM_NO_LABEL ? NULL : program->label_names[PROGRAM_LABEL_ID(label)];
+    create_or_update_label(context, program->statements[index], label_name, label != PROGRAM_NO_LABEL && PROGRAM_LABEL_IS_LOCAL(label), address);
+}
+
+static void execute_label(assembly_context *context, const program *program, size_t index)
+{
+    define_label(context, program, index, context->output->logical_pc);
+}
+
+static void execute_instruction(assembly_context *context, const program *program, size_t index)
+{
+    const statement *statement = program->statements[index];
+    execute_label(context, program, index);
+    overflow_context overflow_ctx = {
+        .asm_context = context,
+        .statement = statement
+    };
+    output_set_overflow_handler(context->output, pc_overflow_handler, &overflow_ctx);
+    char disassembly[16];
+    m6502_gen_form(context, statement->instruction, program->opcode_rows[index], program->forms[index], program->operands[index], disassembly);
+    count_cycles(context);
+    mark_indexed_read(context);
+    assembly_context_add_disasm(context, disassembly, token_get_line(statement->instruction), '.');
+    mark_profile(context, statement);
+}
+
+static void execute_pseudo_op(assembly_context *context, const program *program, size_t index)
+{
+    const statement *statement = program->statements[index];
+    int offset;
+    int host = context->strings ? string_pool_host(context->strings, index, &offset) : STRING_POOL_NOT_MERGED;
+    if (host != STRING_POOL_NOT_MERGED) {
+        /* the string is the tail of one assembled elsewhere, which may be later in the program */
+        define_label(context, program, index, program->pcs[host] + offset);
+        return;
+    }
+    overflow_context overflow_ctx = {
+        .asm_context = context,
+        .statement = statement
+    };
+    output_set_overflow_handler(context->output, pc_overflow_handler, &overflow_ctx);
+    output_fill(context->output, pseudo_op_label_padding(context, statement->instruction, statement->operand));
+    execute_label(context, program, index);
+    pseudo_op(context, statement);
+}
+
+static const program_handler program_handlers[PROGRAM_KIND_COUNT] =
+{
+    execute_label,          /* PROGRAM_KIND_LABEL */
+    execute_label,          /* PROGRAM_KIND_ASSIGN */
+    execute_instruction,    /* PROGRAM_KIND_INSTRUCTION */
+    execute_pseudo_op       /* PROGRAM_KIND_PSEUDO_OP */
+};
+
+/* a loop directive moves on to its body, past its end or back to its start, a condition past the block not taken */
+static size_t next_statement(assembly_context *context, const program *program, size_t index)
+{
+    if (program->kinds[index] != PROGRAM_KIND_PSEUDO_OP) {
+        return index + 1;
+    }
+    const statement *statement = program->statements[index];
+    if (loop_nesting(statement)) {
+        return loop_next(context, program, index);
+    }
+    token_type directive = statement->instruction->type;
+    if (conditional_nesting(statement) || directive == TOKEN_ELSE) {
+        return conditional_next(context, program, index);
+    }
+    return index + 1;
+}
+
+unsigned short statement_size(const assembly_context *context)
+{
+    if (context->compress->main) {
+        return 0;
+    }
+    return (unsigned short)(context->output->pc - context->start_pc);
+}
+
+void program_run(assembly_context *context, program *program, size_t first, size_t end)
+{
+    size_t i = first;
+    while (i < end) {
+        context->logical_start_pc = context->output->logical_pc;
+        context->start_pc = context->output->pc;
+        context->cycles = (cycle_range){};
+        program->pcs[i] = context->logical_start_pc;
+        program_handlers[program->kinds[i]](context, program, i);
+        unsigned short size = statement_size(context);
+        if (size != program->sizes[i]) {
+            if (context->trace && context->passes) {
+                const statement *statement = program->statements[i];
+                const token *where = statement->instruction ? statement->instruction : statement->label;
+                pass_trace_size(context->trace, ASSEMBLY_CONTEXT_PASS(context), program->sizes[i], size,
+                    where ? where->loc : SOURCE_LOC_INVALID);
+            }
+            program->sizes[i] = size;
+        }
+        if (context->dataflow) {
+            dataflow_list(context->dataflow, context, program, i);
+        }
+        i = next_statement(context, program, i);
+    }
+}
+
+void program_execute(assembly_context *context, program *program)
+{
+    program_run(context, program, 0, program->count);
+    if (!anonymous_label_collection_is_complete(context->anonymous_labels_new) && !tiny_error_count()) {
+        tiny_error(NULL, ERROR_MODE_RECOVER, "Anonymous labels in a conditional block or loop changed after the first pass");
+    }
+    if (context->passes) {
+        /* only the pass after the first can meet symbols defined in a block the first skipped */
+        context->conditions->skipped_unknown = 0;
+    }
+}
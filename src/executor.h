@@ -11,8 +11,16 @@
 #define executor_h
 
 typedef struct assembly_context assembly_context;
+typedef struct program program;
 typedef struct statement statement;
 
 void statement_execute(assembly_context *context, const statement *statement);
+void program_execute(assembly_context *context, program *program);
+
+/* the bytes the statement just executed added; none in a compressed block, whose .endcompress adds its compressed bytes */
+unsigned short statement_size(const assembly_context *context);
+
+/* run the statements from first up to end, running each loop body as many times as the loop says */
+void program_run(assembly_context *context, program *program, size_t first, size_t end);
 
 #endif /* executor_h */
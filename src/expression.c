@@ -7,6 +7,7 @@
 *
 */
 
+#include "builtin_functions.h"
 #include "memory.h"
 #include "expression.h"
 #include "evaluator.h"
@@ -99,9 +100,31 @@ expression *expression_fcn_call(const token *ident, expression_array *params)
 {
     expression *fcn_call = create_with_type(ident, TYPE_FCN_CALL);
     fcn_call->fcn_call.params = params;
+    TOKEN_GET_TEXT(ident, name);
+    if (!params || !builtin_function_lookup(name)) {
+        return fcn_call;
+    }
+    for(size_t i = 0; i < params->count; i++) {
+        const expression *param = (const expression*)params->data[i];
+        if (param->value == VALUE_UNDEFINED && param->token->type != TOKEN_STRINGLITERAL) {
+            return fcn_call;
+        }
+    }
+    /* a call with constant arguments is only ever made once */
+    fcn_call->value = evaluate_expression(NULL, fcn_call);
     return fcn_call;
 }
 
+static expression_array *copy_params(const expression_array *params)
+{
+    expression_array *copy;
+    DYNAMIC_ARRAY_CREATE_WITH_CAPACITY(copy, expression*, params->count);
+    for(size_t i = 0; i < params->count; i++) {
+        dynamic_array_add(copy, expression_copy((const expression*)params->data[i]));
+    }
+    return copy;
+}
+
 expression *expression_copy(const expression *expr)
 {
     expression *copy = create_with_type(expr->token, expr->type);
@@ -117,6 +140,10 @@ expression *expression_copy(const expression *expr)
             copy->ternary.cond = expression_copy(expr->ternary.cond);
             copy->ternary.then = expression_copy(expr->ternary.then);
             copy->ternary.else_= expression_copy(expr->ternary.else_);
+            break;
+        case TYPE_FCN_CALL:
+            copy->fcn_call.params = copy_params(expr->fcn_call.params);
+            break;
         default:
             break;
     }
@@ -138,4 +165,35 @@ const token *expression_get_lhs_token(const expression *expr)
         default:
             return expression_get_lhs_token(expr->ternary.cond);
     }
-}
\ No newline at end of file
+}
+
+int expression_visit(const expression *expr, expression_visitor visitor, void *data)
+{
+    if (!expr) {
+        return 0;
+    }
+    expression_visit_result result = visitor(expr, data);
+    if (result != EXPRESSION_VISIT_CHILDREN) {
+        return result == EXPRESSION_VISIT_STOP;
+    }
+    switch (expr->type) {
+        case TYPE_UNARY:
+            return expression_visit(expr->unary.expr, visitor, data);
+        case TYPE_BINARY:
+            return expression_visit(expr->binary.lhs, visitor, data) ||
+                   expression_visit(expr->binary.rhs, visitor, data);
+        case TYPE_TERNARY:
+            return expression_visit(expr->ternary.cond, visitor, data) ||
+                   expression_visit(expr->ternary.then, visitor, data) ||
+                   expression_visit(expr->ternary.else_, visitor, data);
+        case TYPE_FCN_CALL:
+            for(size_t i = 0; expr->fcn_call.params && i < expr->fcn_call.params->count; i++) {
+                if (expression_visit((const expression*)expr->fcn_call.params->data[i], visitor, data)) {
+                    return 1;
+                }
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
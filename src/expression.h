@@ -64,4 +64,19 @@ expression *expression_ternary(const token *oper, expression *cond, expression *
 expression *expression_fcn_call(const token *ident, expression_array *params);
 
 const token *expression_get_lhs_token(const expression *expr);
+
+/* what a walk does after visiting an expression */
+typedef enum
+{
+    EXPRESSION_VISIT_CHILDREN,
+    EXPRESSION_VISIT_SKIP,
+    EXPRESSION_VISIT_STOP
+
+} expression_visit_result;
+
+typedef expression_visit_result (*expression_visitor)(const expression *expr, void *data);
+
+/* visit expr and every expression in it, each before the ones inside it and function call
+   arguments included; returns 1 if the visitor stopped the walk */
+int expression_visit(const expression *expr, expression_visitor visitor, void *data);
 #endif /* expression_h */
@@ -11,7 +11,6 @@
 #include "memory.h"
 #include "value.h"
 #include <limits.h>
-#include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -74,7 +73,6 @@ binary_file binary_file_read(const char *path)
 source_file source_file_read(const char *path)
 {
     source_file f = {};
-    setlocale(LC_CTYPE, "en_US.UTF-8"); /* try to read source file as UTF8 */
     FILE *fp = fopen(path, "r");
     if (fp) {
         f.file_name = strdup(path);
@@ -0,0 +1,225 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "expression.h"
+#include "inline_proc.h"
+#include "m6502.h"
+#include "macro.h"
+#include "memory.h"
+#include "operand.h"
+#include "program.h"
+#include "statement.h"
+#include "string_htable.h"
+#include "token.h"
+#include <string.h>
+
+inline_proc *inline_proc_create(const token *name, int case_sensitive)
+{
+    inline_proc *proc = tiny_calloc(1, sizeof(inline_proc));
+    proc->name = name;
+    proc->locals = string_htable_create(sizeof(int));
+    proc->locals->case_sensitive = case_sensitive;
+    proc->targets = string_htable_create(sizeof(int));
+    proc->targets->case_sensitive = case_sensitive;
+    return proc;
+}
+
+void inline_proc_destroy(inline_proc *proc)
+{
+    if (!proc) {
+        return;
+    }
+    if (proc->body) {
+        /* the body owns the local labels once it is made */
+        macro_destroy(proc->body);
+    } else {
+        string_htable_destroy(proc->locals);
+    }
+    string_htable_destroy(proc->targets);
+    tiny_free(proc);
+}
+
+void inline_proc_reject(inline_proc *proc, const char *reason)
+{
+    if (!proc->rejection) {
+        proc->rejection = reason;
+    }
+}
+
+static int is_small_constant(const expression *expr)
+{
+    return expr->value != VALUE_UNDEFINED && expr->value >= 0 && expr->value <= UINT8_MAX;
+}
+
+/* the most bytes an instruction can assemble to, as the parser cannot yet tell zero page from absolute */
+static int estimate_size(const statement *statement)
+{
+    const operand *oper = statement->operand;
+    switch (m6502_classify(statement->instruction->type, oper)) {
+        case M6502_FORM_IMPLIED:
+        case M6502_FORM_ACCUMULATOR:    return 1;
+        case M6502_FORM_RELATIVE:       return statement->instruction->type == TOKEN_BRL ? 3 : 2;
+        case M6502_FORM_TWO_OPERANDS:
+        case M6502_FORM_BIT:            return 3;
+        default: break;
+    }
+    if (oper->single_expression.bitwidth) {
+        return 4;
+    }
+    switch (oper->form) {
+        case FORM_INDIRECT_S:
+        case FORM_INDIRECT_X:
+        case FORM_INDIRECT_Y:
+        case FORM_INDEX_S:
+        case FORM_DIRECT:
+        case FORM_DIRECT_Y:     return 2;
+        case FORM_IMMEDIATE:    return oper->single_expression.expr->value > UINT8_MAX ? 3 : 2;
+        default:                return is_small_constant(oper->single_expression.expr) ? 2 : 3;
+    }
+}
+
+/* an inlined '+' or '-' label would also capture the caller's references that span the call */
+#define ANONYMOUS_REJECTION "it uses anonymous labels, which the caller's branches could resolve to"
+
+static void add_label(inline_proc *proc, const token *label)
+{
+    if (label->type == TOKEN_PLUS || label->type == TOKEN_HYPHEN) {
+        inline_proc_reject(proc, ANONYMOUS_REJECTION);
+    } else if (label->type == TOKEN_IDENT) {
+        TOKEN_GET_TEXT(label, name);
+        if (name[0] != '_') {
+            inline_proc_reject(proc, "it defines a label that is not local");
+            return;
+        }
+        string_htable_add(proc->locals, name, (const htable_value_ptr)&proc->size);
+    }
+}
+
+/* a branch or jump must stay within the body, as an inlined call cannot return from elsewhere */
+static void add_target(inline_proc *proc, const expression *target)
+{
+    if (target->type != TYPE_IDENT) {
+        inline_proc_reject(proc, "it jumps to a computed address");
+        return;
+    }
+    TOKEN_GET_TEXT(target->token, name);
+    if (name[0] == '-' || name[0] == '+') {
+        inline_proc_reject(proc, ANONYMOUS_REJECTION);
+    } else if (name[0] == '_') {
+        string_htable_add(proc->targets, name, (const htable_value_ptr)&proc->size);
+    } else {
+        inline_proc_reject(proc, "it branches or jumps outside its body");
+    }
+}
+
+void inline_proc_add_statement(inline_proc *proc, const statement *statement)
+{
+    if (proc->rts) {
+        inline_proc_reject(proc, "it returns before its end");
+    }
+    if (statement->label) {
+        add_label(proc, statement->label);
+    }
+    program_kind kind = program_statement_kind(statement);
+    if (kind == PROGRAM_KIND_LABEL) {
+        return;
+    }
+    if (kind != PROGRAM_KIND_INSTRUCTION) {
+        inline_proc_reject(proc, "it contains a directive or assignment");
+        return;
+    }
+    const operand *oper = statement->operand;
+    switch (statement->instruction->type) {
+        case TOKEN_RTS:
+            proc->rts = statement->instruction;
+            proc->rts_labeled = statement->label != NULL;
+            return;
+        case TOKEN_BRK: case TOKEN_COP: case TOKEN_RTI: case TOKEN_RTL:
+        case TOKEN_STP: case TOKEN_TSX: case TOKEN_TXS: case TOKEN_WAI:
+            inline_proc_reject(proc, "it uses the stack or interrupts in a way a call cannot be replaced");
+            return;
+        case TOKEN_JMP:
+        case TOKEN_JML:
+            if (oper->form != FORM_ZP_ABSOLUTE) {
+                inline_proc_reject(proc, "it jumps to a computed address");
+                return;
+            }
+            add_target(proc, oper->single_expression.expr);
+            break;
+        case TOKEN_BBR:
+        case TOKEN_BBS:
+            if (oper->form == FORM_BIT_OFFS_ZP) {
+                add_target(proc, oper->bit_offset_expression.expr);
+            }
+            break;
+        default:
+            if (m6502_classify(statement->instruction->type, oper) == M6502_FORM_RELATIVE) {
+                add_target(proc, oper->single_expression.expr);
+            }
+            break;
+    }
+    proc->size += estimate_size(statement);
+}
+
+static int locals_defined(inline_proc *proc)
+{
+    for(size_t i = 0; i < proc->targets->capacity; i++) {
+        htable_entry *entry = proc->targets->buckets + i;
+        if (entry->used && !string_htable_contains(proc->locals, entry->original_key)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int is_outside_local(inline_proc *proc, const token *t)
+{
+    TOKEN_GET_TEXT(t, name);
+    return name[0] == '_' && !string_htable_contains(proc->locals, name);
+}
+
+int inline_proc_finish(inline_proc *proc, dynamic_array *tokens, size_t first, size_t end)
+{
+    if (!proc->rts) {
+        inline_proc_reject(proc, "it does not end with rts");
+    } else if (!locals_defined(proc)) {
+        inline_proc_reject(proc, "it branches or jumps outside its body");
+    } else if (!proc->size) {
+        inline_proc_reject(proc, "it has no body besides rts");
+    }
+    if (proc->rejection) {
+        return 0;
+    }
+    dynamic_array *block_tokens;
+    DYNAMIC_ARRAY_CREATE(block_tokens, struct token*);
+    for(size_t i = first; i < end; i++) {
+        token *t = (token*)tokens->data[i];
+        if (t == proc->rts) {
+            /* an inlined body falls through to the code after the call */
+            if (!proc->rts_labeled && i + 1 < end) {
+                i++;
+            }
+            continue;
+        }
+        if (t->type == TOKEN_INCLUDE || t->type == TOKEN_MACRO || t->type == TOKEN_MACRO_NAME) {
+            inline_proc_reject(proc, "it includes a file or uses a macro");
+        } else if (t->type == TOKEN_IDENT && is_outside_local(proc, t)) {
+            inline_proc_reject(proc, "it refers to a local label outside its body");
+        }
+        if (proc->rejection) {
+            dynamic_array_destroy(block_tokens);
+            return 0;
+        }
+        dynamic_array_add(block_tokens, t);
+    }
+    proc->body = macro_create(NULL, block_tokens);
+    proc->body->define_token = (token*)proc->name;
+    proc->body->locals = proc->locals;
+    return 1;
+}
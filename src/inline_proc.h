@@ -0,0 +1,64 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef inline_proc_h
+#define inline_proc_h
+
+#include <stddef.h>
+
+typedef struct dynamic_array dynamic_array;
+typedef struct macro macro;
+typedef struct statement statement;
+typedef struct string_htable string_htable;
+typedef struct token token;
+
+/* the cycles a call saves when it is inlined, a jsr and its rts */
+#define INLINE_PROC_CYCLES_SAVED    12
+
+/* bytes of the jsr an inlined call replaces */
+#define INLINE_PROC_CALL_SIZE       3
+
+/*
+
+An inline procedure is an ordinary subroutine between .inline and .endinline
+that the parser may also expand in place of a jsr to it, as it would a macro.
+While the parser reads the procedure it notes each statement, estimating the
+size of the body and checking that the body can run in place of a call: it
+must end with its only rts and may only branch or jump to its own local
+labels.
+**/
+
+typedef struct inline_proc
+{
+    const token *name;
+    macro *body;
+    const token *rts;
+    int rts_labeled;
+    int size;
+    const char *rejection;
+    string_htable *locals;
+    string_htable *targets;
+    size_t calls;
+    size_t inlined;
+
+} inline_proc;
+
+inline_proc *inline_proc_create(const token *name, int case_sensitive);
+void inline_proc_destroy(inline_proc *proc);
+
+/* note a statement of the procedure's body as it is parsed */
+void inline_proc_add_statement(inline_proc *proc, const statement *statement);
+
+/* the body cannot be inlined for a reason the statements alone do not show */
+void inline_proc_reject(inline_proc *proc, const char *reason);
+
+/* make the procedure's body from its tokens; returns 0 if it cannot be inlined */
+int inline_proc_finish(inline_proc *proc, dynamic_array *tokens, size_t first, size_t end);
+
+#endif /* inline_proc_h */
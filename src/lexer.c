@@ -10,6 +10,8 @@
 #include "file.h"
 #include "lexer.h"
 #include "memory.h"
+#include "prefetch.h"
+#include "source_manager.h"
 #include "string_htable.h"
 #include "token.h"
 #include <ctype.h>
@@ -98,6 +100,40 @@ static const char *token_reserved_names[TOKEN_RESERVED_NUM] = {
     ".dp",
     ".pron",
     ".proff",
+    ".cyclelimit",
+    ".cycleexact",
+    ".test",
+    ".given",
+    ".expect",
+    ".endtest",
+    ".opton",
+    ".optoff",
+    ".zpvar",
+    ".zprange",
+    ".pagesafe",
+    ".endpagesafe",
+    ".pageregion",
+    ".endpageregion",
+    ".inline",
+    ".endinline",
+    ".proc",
+    ".endproc",
+    ".export",
+    ".repeat",
+    ".endrepeat",
+    ".for",
+    ".endfor",
+    ".if",
+    ".ifdef",
+    ".ifndef",
+    ".else",
+    ".endif",
+    ".encoding",
+    ".map",
+    ".compress",
+    ".endcompress",
+    ".jumptable",
+    ".rtstable",
     ".string",
     ".cstring",
     ".lstring",
@@ -189,6 +225,40 @@ static const token_type token_reserved_types[TOKEN_RESERVED_NUM] = {
     TOKEN_DP,
     TOKEN_PRON,
     TOKEN_PROFF,
+    TOKEN_CYCLELIMIT,
+    TOKEN_CYCLEEXACT,
+    TOKEN_TEST,
+    TOKEN_GIVEN,
+    TOKEN_EXPECT,
+    TOKEN_ENDTEST,
+    TOKEN_OPTON,
+    TOKEN_OPTOFF,
+    TOKEN_ZPVAR,
+    TOKEN_ZPRANGE,
+    TOKEN_PAGESAFE,
+    TOKEN_ENDPAGESAFE,
+    TOKEN_PAGEREGION,
+    TOKEN_ENDPAGEREGION,
+    TOKEN_INLINE,
+    TOKEN_ENDINLINE,
+    TOKEN_PROC,
+    TOKEN_ENDPROC,
+    TOKEN_EXPORT,
+    TOKEN_REPEAT,
+    TOKEN_ENDREPEAT,
+    TOKEN_FOR,
+    TOKEN_ENDFOR,
+    TOKEN_IF,
+    TOKEN_IFDEF,
+    TOKEN_IFNDEF,
+    TOKEN_ELSE,
+    TOKEN_ENDIF,
+    TOKEN_ENCODING,
+    TOKEN_MAP,
+    TOKEN_COMPRESS,
+    TOKEN_ENDCOMPRESS,
+    TOKEN_JUMPTABLE,
+    TOKEN_RTSTABLE,
     TOKEN_STRING,
     TOKEN_CSTRING,
     TOKEN_LSTRING,
@@ -227,6 +297,8 @@ typedef struct source_file_state
     source_file source;
     position curr_position;
     int end_of_file;
+    int context;
+    source_loc line_loc;
 
 } source_file_state;
 
@@ -242,6 +314,9 @@ typedef struct lexer
 {
     position start_position;
     position curr_position;
+    source_loc start_line_loc;
+    source_loc line_loc;
+    int context;
     int end_of_file;
     token *previous_token;
     char *curr_line;
@@ -254,6 +329,19 @@ typedef struct lexer
     
 } lexer;
 
+static void register_line(lexer *lexer)
+{
+    lexer->line_loc = source_manager_add_line(lexer->context, lexer->curr_line, lexer->curr_position.line_number + 1, lexer->buffer_len + 1);
+}
+
+static source_loc current_loc(const lexer *lexer, long position)
+{
+    if (position > (long)lexer->buffer_len) {
+        position = (long)lexer->buffer_len;
+    }
+    return lexer->line_loc + (source_loc)(position > 0 ? position : 0);
+}
+
 static void set_newline(lexer *lexer)
 {
     if (++lexer->curr_position.line_number >= lexer->source.line_numbers) {
@@ -264,6 +352,8 @@ static void set_newline(lexer *lexer)
         source_file_state *state = lexer->files.file_states + --lexer->files.top;
         lexer->curr_position = state->curr_position;
         lexer->source = state->source;
+        lexer->context = state->context;
+        lexer->line_loc = state->line_loc;
         if (lexer->curr_position.line_number < lexer->source.line_numbers) {
             lexer->curr_line = lexer->source.lines[lexer->curr_position.line_number];
             lexer->buffer_len = strlen(lexer->curr_line);
@@ -273,6 +363,7 @@ static void set_newline(lexer *lexer)
     }
     lexer->curr_line = lexer->source.lines[lexer->curr_position.line_number];
     lexer->buffer_len = strlen(lexer->curr_line);
+    register_line(lexer);
     lexer->curr_position.position = 0;
     lexer->curr_position.line_position = 1;
 }
@@ -315,6 +406,7 @@ static void cleanup_include_files(void *include_ptr)
     tiny_free(incl);
 }
 
+static void prefetch_files(lexer *lexer, const source_file *source);
 
 lexer *lexer_create(const source_file *source, int case_sensitive)
 {
@@ -325,8 +417,11 @@ lexer *lexer_create(const source_file *source, int case_sensitive)
     lex->source = *source;
     lex->curr_line = lex->source.lines[0];
     lex->buffer_len = strlen(lex->curr_line);
+    lex->context = source_manager_add_file(source->file_name, SOURCE_LOC_INVALID);
+    register_line(lex);
     DYNAMIC_ARRAY_CREATE(lex->include_files, source_file);
     lex->include_files->dtor = cleanup_include_files;
+    prefetch_files(lex, source);
     get_char(lex); /* prime the lookahead character */
     return lex;
 }
@@ -361,13 +456,19 @@ void lexer_include(lexer *lexer, const source_file *include)
     state->curr_position = lexer->curr_position;
     state->source = lexer->source;
     state->end_of_file = lexer->end_of_file;
+    state->context = lexer->context;
+    state->line_loc = lexer->line_loc;
     
+    prefetch_files(lexer, include);
+
     /* push new file state */
+    lexer->context = source_manager_add_file(include->file_name, current_loc(lexer, lexer->curr_position.position));
     lexer->source = *include;
     if (lexer->source.line_numbers) {
         lexer->curr_line = lexer->source.lines[0];
         lexer->buffer_len = strlen(lexer->curr_line);
         lexer->curr_position.line_number = 0;
+        register_line(lexer);
         lexer->curr_position.position = 0;
         lexer->curr_position.line_position = 1;
         lexer->end_of_file = 0;
@@ -407,16 +508,9 @@ static token *create_token(token_type type, lexer *lexer)
 {
     token *t = tiny_calloc(1, sizeof(token));
     t->type = type;
-    t->src.ref = lexer->curr_line;
-    t->src_filename = lexer->source.file_name;
-    t->src_line = lexer->start_position.line_number + 1;
-    t->src_line_pos = lexer->start_position.line_position;
-    t->src.start = (int)lexer->start_position.position;
-    t->src.end = (int)lexer->curr_position.position;
-    if (lexer->files.top) {
-        source_file_state *include = lexer->files.file_states + (lexer->files.top - 1);
-        t->include_filename = include->source.file_name;
-        t->include_line = include->curr_position.line_number;
+    t->loc = lexer->start_line_loc + (source_loc)lexer->start_position.position;
+    if (lexer->line_loc == lexer->start_line_loc && lexer->curr_position.position > lexer->start_position.position) {
+        t->length = (unsigned int)(lexer->curr_position.position - lexer->start_position.position);
     }
     lexer->previous_token = t;
     if (t->type == TOKEN_END) {
@@ -779,11 +873,97 @@ const source_file *lexer_get_source(lexer *lexer)
     return &lexer->source;
 }
 
+/* the directive a line of source has after any label, if it is one of the reserved words */
+static token_type line_directive(lexer *lexer, const char *line)
+{
+    const char *c = line;
+    while (*c == ' ' || *c == '\t') {
+        c++;
+    }
+    if (*c != '.') {
+        while (*c && *c != ':' && *c != ';' && !isspace((unsigned char)*c)) {
+            c++;
+        }
+        if (*c == ':') {
+            c++;
+        }
+        while (*c == ' ' || *c == '\t') {
+            c++;
+        }
+        if (*c != '.') {
+            return TOKEN_UNRECOGNIZED;
+        }
+    }
+    char word[16] = {};
+    for(size_t i = 0; i < sizeof word - 1 && (c[i] == '.' || isalnum((unsigned char)c[i])); i++) {
+        word[i] = c[i];
+    }
+    return token_type_from_token_text(lexer, word);
+}
+
+/* queue the files the source includes, so they are read by the time they are parsed */
+static void prefetch_files(lexer *lexer, const source_file *source)
+{
+    for(size_t line = 0; line < source->line_numbers; line++) {
+        token_type directive = line_directive(lexer, source->lines[line]);
+        if (directive != TOKEN_INCLUDE && directive != TOKEN_BINARY) {
+            continue;
+        }
+        const char *name = strchr(source->lines[line], '"');
+        const char *end = name ? strchr(name + 1, '"') : NULL;
+        if (!end || end - name > TOKEN_TEXT_MAX_LEN) {
+            continue;
+        }
+        char path[TOKEN_TEXT_MAX_LEN + 1] = {};
+        memcpy(path, name + 1, (size_t)(end - name - 1));
+        prefetch_file(path, directive == TOKEN_BINARY);
+    }
+}
+
+int lexer_skip_block(lexer *lexer)
+{
+    size_t first = (size_t)lexer->curr_position.line_number, line = first;
+    token_type type = TOKEN_EOF;
+    int depth = 0;
+    for(; line < lexer->source.line_numbers; line++) {
+        token_type directive = line_directive(lexer, lexer->source.lines[line]);
+        if (directive == TOKEN_IF || directive == TOKEN_IFDEF || directive == TOKEN_IFNDEF) {
+            depth++;
+        } else if ((directive == TOKEN_ELSE && !depth) || (directive == TOKEN_ENDIF && !depth--)) {
+            type = directive;
+            break;
+        }
+    }
+    if (line >= lexer->source.line_numbers) {
+        /* as after the last newline of the source */
+        lexer->curr_position.line_number = (int)lexer->source.line_numbers;
+        if (lexer->source.line_numbers) {
+            lexer->curr_line = lexer->source.lines[lexer->source.line_numbers - 1];
+            lexer->buffer_len = strlen(lexer->curr_line);
+        }
+        lexer->curr_position.position = (long)lexer->buffer_len;
+        return type;
+    }
+    if (line != first) {
+        lexer->curr_position.line_number = (int)line;
+        lexer->curr_line = lexer->source.lines[line];
+        lexer->buffer_len = strlen(lexer->curr_line);
+        register_line(lexer);
+    }
+    lexer->curr_position.position = 0;
+    lexer->curr_position.line_position = 1;
+    return type;
+}
+
 token *next_token(lexer *lexer)
 {
     skip_whitespace(lexer);
     char c = current_char(lexer);
     lexer->start_position = lexer->curr_position;
+    lexer->start_line_loc = lexer->line_loc;
+    if (lexer->start_position.position > (long)lexer->buffer_len) {
+        lexer->start_position.position = (long)lexer->buffer_len;
+    }
     token_type type = TOKEN_UNRECOGNIZED;
     switch (c){
         case '0' ... '9':
@@ -32,4 +32,8 @@ int lexer_is_reserved_word(const lexer *lexer, const char *word);
 int lexer_is_case_sensitive(const lexer *lexer);
 token *next_token(lexer *lexer);
 
+/* skip whole lines of source from the start of the current one up to the line with the .else or .endif
+   that ends the block, recognizing only the directives that nest, and return which one it was */
+int lexer_skip_block(lexer *lexer);
+
 #endif /* lexer_h */
@@ -0,0 +1,207 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "assembly_context.h"
+#include "error.h"
+#include "evaluator.h"
+#include "expression.h"
+#include "loop.h"
+#include "memory.h"
+#include "operand.h"
+#include "program.h"
+#include "statement.h"
+#include "string_htable.h"
+#include "symbol_table.h"
+#include "token.h"
+
+loop_stack *loop_stack_create(int case_sensitive)
+{
+    loop_stack *loops = tiny_calloc(1, sizeof(loop_stack));
+    loops->variables = string_htable_create(sizeof(int));
+    loops->variables->case_sensitive = case_sensitive;
+    return loops;
+}
+
+void loop_stack_destroy(loop_stack *loops)
+{
+    if (!loops) {
+        return;
+    }
+    string_htable_destroy(loops->variables);
+    tiny_free(loops->frames);
+    tiny_free(loops);
+}
+
+void loop_stack_reset(loop_stack *loops)
+{
+    loops->count = 0;
+}
+
+int loop_stack_first_iteration(const loop_stack *loops)
+{
+    for(size_t i = 0; i < loops->count; i++) {
+        if (loops->frames[i].iteration) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int loop_nesting(const statement *statement)
+{
+    if (!statement->instruction) {
+        return 0;
+    }
+    switch (statement->instruction->type) {
+        case TOKEN_REPEAT:
+        case TOKEN_FOR:         return 1;
+        case TOKEN_ENDREPEAT:
+        case TOKEN_ENDFOR:      return -1;
+        default:                return 0;
+    }
+}
+
+static size_t skip_body(const program *program, size_t index)
+{
+    int depth = 0;
+    for(size_t i = index; i < program->count; i++) {
+        if (program->kinds[i] == PROGRAM_KIND_PSEUDO_OP) {
+            depth += loop_nesting(program->statements[i]);
+            if (!depth) {
+                return i + 1;
+            }
+        }
+    }
+    return program->count;
+}
+
+/* a loop's count, start and condition must be known when it is reached */
+static value evaluate(assembly_context *context, const expression *expr)
+{
+    value result = evaluate_expression(context, expr);
+    if (result == VALUE_UNDEFINED && !context->passes) {
+        tiny_error(expr->token, ERROR_MODE_RECOVER, "Loop expression refers to a symbol not yet defined");
+    }
+    return result;
+}
+
+/* define the loop variable, or reuse it if an earlier loop defined it */
+static int bind(assembly_context *context, const token *variable, value val)
+{
+    if (!variable || val == VALUE_UNDEFINED) {
+        return val != VALUE_UNDEFINED;
+    }
+    TOKEN_GET_TEXT(variable, name);
+    if (string_htable_contains(context->loops->variables, name)) {
+        symbol_table_update(context->sym_tab, name, val);
+        return 1;
+    }
+    if (!symbol_table_define(context->sym_tab, name, val)) {
+        tiny_error(variable, ERROR_MODE_RECOVER, "Symbol '%s' already exists", name);
+        return 0;
+    }
+    int defined = 1;
+    string_htable_add(context->loops->variables, name, (const htable_value_ptr)&defined);
+    return 1;
+}
+
+static int read_operand(assembly_context *context, const statement *statement, loop_frame *frame)
+{
+    const pseudo_op_arg **args = (const pseudo_op_arg**)statement->operand->pseudo_op_arg_args.args->data;
+    size_t count = statement->operand->pseudo_op_arg_args.args->count;
+    for(size_t i = 0; i < count; i++) {
+        if (args[i]->arg_type != PSEUDO_OP_EXPRESSION) {
+            count = 0;
+        }
+    }
+    if (statement->instruction->type == TOKEN_REPEAT) {
+        if (count < 1 || count > 2 || (count == 2 && args[1]->arg.expression->type != TYPE_IDENT)) {
+            tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".repeat\" expects a count and an optional variable");
+            return 0;
+        }
+        frame->count = evaluate(context, args[0]->arg.expression);
+        frame->variable = count == 2 ? args[1]->arg.expression->token : NULL;
+        return bind(context, frame->variable, frame->count == VALUE_UNDEFINED ? VALUE_UNDEFINED : 0);
+    }
+    const expression *start = count == 3 ? args[0]->arg.expression : NULL;
+    if (!start || start->type != TYPE_BINARY || start->token->type != TOKEN_EQUAL || start->binary.lhs->type != TYPE_IDENT) {
+        tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".for\" expects an assignment, a condition and a next value");
+        return 0;
+    }
+    frame->variable = start->binary.lhs->token;
+    frame->condition = args[1]->arg.expression;
+    frame->next = args[2]->arg.expression;
+    return bind(context, frame->variable, evaluate(context, start->binary.rhs));
+}
+
+/* whether the loop runs its body again */
+static int test(assembly_context *context, const loop_frame *frame)
+{
+    if (tiny_error_count() > frame->errors) {
+        /* an error in the body would only be reported again */
+        return 0;
+    }
+    if (frame->iteration >= LOOP_MAX_ITERATIONS) {
+        tiny_error(frame->directive, ERROR_MODE_RECOVER, "Loop does not end after %d iterations", LOOP_MAX_ITERATIONS);
+        return 0;
+    }
+    if (frame->directive->type == TOKEN_REPEAT) {
+        return frame->iteration < frame->count;
+    }
+    value condition = evaluate(context, frame->condition);
+    return condition != VALUE_UNDEFINED && condition;
+}
+
+static size_t begin(assembly_context *context, const program *program, size_t index)
+{
+    const statement *statement = program->statements[index];
+    loop_frame frame = { .first = index, .directive = statement->instruction, .errors = tiny_error_count() };
+    if (!read_operand(context, statement, &frame) || !test(context, &frame)) {
+        return skip_body(program, index);
+    }
+    loop_stack *loops = context->loops;
+    if (loops->count == loops->capacity) {
+        loops->capacity = loops->capacity ? loops->capacity * 2 : 8;
+        loops->frames = tiny_realloc(loops->frames, loops->capacity * sizeof(loop_frame));
+    }
+    loops->frames[loops->count++] = frame;
+    return index + 1;
+}
+
+static size_t end(assembly_context *context, const program *program, size_t index)
+{
+    const token *directive = program->statements[index]->instruction;
+    loop_stack *loops = context->loops;
+    loop_frame *frame = loops->count ? loops->frames + loops->count - 1 : NULL;
+    token_type begins = directive->type == TOKEN_ENDFOR ? TOKEN_FOR : TOKEN_REPEAT;
+    if (!frame || frame->directive->type != begins) {
+        tiny_error(directive, ERROR_MODE_RECOVER, begins == TOKEN_FOR ?
+            "Directive \".endfor\" without a matching \".for\"" :
+            "Directive \".endrepeat\" without a matching \".repeat\"");
+        if (frame) {
+            loops->count--;
+        }
+        return index + 1;
+    }
+    frame->iteration++;
+    value val = frame->directive->type == TOKEN_FOR ? evaluate(context, frame->next) : frame->iteration;
+    if (bind(context, frame->variable, val) && test(context, frame)) {
+        return frame->first + 1;
+    }
+    loops->count--;
+    return index + 1;
+}
+
+size_t loop_next(assembly_context *context, const program *program, size_t index)
+{
+    if (loop_nesting(program->statements[index]) > 0) {
+        return begin(context, program, index);
+    }
+    return end(context, program, index);
+}
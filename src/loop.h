@@ -0,0 +1,69 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef loop_h
+#define loop_h
+
+#include "value.h"
+#include <stddef.h>
+
+typedef struct assembly_context assembly_context;
+typedef struct expression expression;
+typedef struct program program;
+typedef struct statement statement;
+typedef struct string_htable string_htable;
+typedef struct token token;
+
+/* a loop that runs more times than this is taken never to end */
+#define LOOP_MAX_ITERATIONS (1 << 20)
+
+/*
+
+The body of a .repeat or .for loop is parsed once into statements of the
+program. The executor runs the body's statements again for each iteration,
+with the loop variable bound in the symbol table, on every pass.
+**/
+
+/* a loop being run */
+typedef struct loop_frame
+{
+    size_t first;
+    const token *directive;
+    const token *variable;
+    const expression *condition;
+    const expression *next;
+    value count;
+    value iteration;
+    int errors;
+
+} loop_frame;
+
+typedef struct loop_stack
+{
+    loop_frame *frames;
+    size_t count;
+    size_t capacity;
+    string_htable *variables;
+
+} loop_stack;
+
+loop_stack *loop_stack_create(int case_sensitive);
+void loop_stack_destroy(loop_stack *loops);
+void loop_stack_reset(loop_stack *loops);
+
+/* whether every loop being run is in its first iteration */
+int loop_stack_first_iteration(const loop_stack *loops);
+
+/* 1 if the statement begins a loop, -1 if it ends one, otherwise 0 */
+int loop_nesting(const statement *statement);
+
+/* run the loop directive at index; returns the index of the statement to run next */
+size_t loop_next(assembly_context *context, const program *program, size_t index);
+
+#endif /* loop_h */
@@ -12,6 +12,7 @@
 #include "evaluator.h"
 #include "expression.h"
 #include "m6502.h"
+#include "memory.h"
 #include "output.h"
 #include "operand.h"
 #include "statement.h"
@@ -68,36 +69,7 @@ typedef enum addressing_mode {
     
 } addressing_mode;
 
-enum {
-    MODES_IMP,
-    MODES_ZIP,
-    MODES_IMM,
-    MODES_IMM_ABS,
-    MODES_ZPS,
-    MODES_ZPX,
-    MODES_ZPY,
-    MODES_ABS,
-    MODES_ABSX,
-    MODES_ABSY,
-    MODES_LONG,
-    MODES_LONG_X,
-    MODES_IND_ZP,
-    MODES_INDS,
-    MODES_INDX,
-    MODES_INDY,
-    MODES_IND_ABS,
-    MODES_IND_ABS_X,
-    MODES_DIR,
-    MODES_DIR_Y,
-    MODES_ACC,
-    MODES_REL,
-    MODES_REL_ABS,
-    MODES_TWO_OPS,
-    MODES_BIT,
-    MODES_BIT_OFFS,
-    MODES_ALL,
-    BAD =-1
-};
+enum { BAD = -1 };
 
 const char *m6502i_mnemonics[M6502I_WORDS] =
 {
@@ -269,32 +241,41 @@ const int w65c02_types[W65C02_WORDS] =
     TOKEN_WAI
 };
 
-static token_type acc_mnemonics[] = 
+static int is_acc_mnemonic(token_type mnemonic)
 {
-    TOKEN_ADC,
-    TOKEN_AND,
-    TOKEN_CMP,
-    TOKEN_EOR,
-    TOKEN_LDA,
-    TOKEN_ORA,
-    TOKEN_SBC
-};
+    switch (mnemonic) {
+        case TOKEN_ADC:
+        case TOKEN_AND:
+        case TOKEN_CMP:
+        case TOKEN_EOR:
+        case TOKEN_LDA:
+        case TOKEN_ORA:
+        case TOKEN_SBC: return 1;
+        default:        return 0;
+    }
+}
 
-static token_type ix_mnemonics[] = 
+static int is_ix_mnemonic(token_type mnemonic)
 {
-    TOKEN_CPX,
-    TOKEN_CPY,
-    TOKEN_LDX,
-    TOKEN_LDY
-};
+    switch (mnemonic) {
+        case TOKEN_CPX:
+        case TOKEN_CPY:
+        case TOKEN_LDX:
+        case TOKEN_LDY: return 1;
+        default:        return 0;
+    }
+}
 
-static token_type jmp_mnemonics[] =
+static int is_jmp_mnemonic(token_type mnemonic)
 {
-    TOKEN_JML,
-    TOKEN_JMP,
-    TOKEN_JSL,
-    TOKEN_JSR
-};
+    switch (mnemonic) {
+        case TOKEN_JML:
+        case TOKEN_JMP:
+        case TOKEN_JSL:
+        case TOKEN_JSR: return 1;
+        default:        return 0;
+    }
+}
 
 static unsigned long modes_map[] = {
     ADDR_MODE_IMPLIED,
@@ -325,6 +306,134 @@ static unsigned long modes_map[] = {
     ADDR_MODE_BIT_OFS
 };
 
+/* the disassembled name of each mnemonic token type from TOKEN_ANC, so that
+   an instruction is listed by what it encodes rather than its source text */
+static const char *mnemonic_names[TOKEN_TYA - TOKEN_ANC + 1] =
+{
+    "anc",
+    "ane",
+    "arr",
+    "asr",
+    "dcp",
+    "dop",
+    "isb",
+    "jam",
+    "las",
+    "lax",
+    "rla",
+    "rra",
+    "sax",
+    "sha",
+    "shx",
+    "shy",
+    "slo",
+    "sre",
+    "stp",
+    "tas",
+    "top",
+    NULL,
+    "bbr",
+    "bbs",
+    "bra",
+    "brl",
+    "cop",
+    "jml",
+    "jsl",
+    "mvn",
+    "mvp",
+    "pea",
+    "pei",
+    "per",
+    "phb",
+    "phd",
+    "phk",
+    "phx",
+    "phy",
+    "plb",
+    "pld",
+    "plx",
+    "ply",
+    "rep",
+    "rmb",
+    "rtl",
+    "sep",
+    "smb",
+    "stp",
+    "stz",
+    "tcd",
+    "tcs",
+    "tdc",
+    "trb",
+    "tsb",
+    "tsc",
+    "txy",
+    "tyx",
+    "wai",
+    "wdm",
+    "xba",
+    "xce",
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    "adc",
+    "and",
+    "asl",
+    "bcc",
+    "bcs",
+    "beq",
+    "bit",
+    "bmi",
+    "bne",
+    "bpl",
+    "brk",
+    "bvc",
+    "bvs",
+    "clc",
+    "cld",
+    "cli",
+    "clv",
+    "cmp",
+    "cpx",
+    "cpy",
+    "dec",
+    "dex",
+    "dey",
+    "eor",
+    "inc",
+    "inx",
+    "iny",
+    "jmp",
+    "jsr",
+    "lda",
+    "ldx",
+    "ldy",
+    "lsr",
+    "nop",
+    "ora",
+    "pha",
+    "php",
+    "pla",
+    "plp",
+    "rol",
+    "ror",
+    "rti",
+    "rts",
+    "sbc",
+    "sec",
+    "sed",
+    "sei",
+    "sta",
+    "stx",
+    "sty",
+    "tax",
+    "tay",
+    "tsx",
+    "txa",
+    "txs",
+    "tya"
+};
+
 static int map_6502[][MODES_ALL] = 
 {/*        IMP    ZP  IMM   IMMA   ZPS   ZPX   ZPY   ABS  ABSX  ABSY  LONG LONGX INDZP  INDS  INDX  INDY   IND INDAX   DIR  DIRY   ACC   REL  RELA   TWO BITZP BITOF*/
 /* bra */{ BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD,  BAD},
@@ -698,29 +807,94 @@ static void disassemble(addressing_mode mode, char *disassembly, ...)
     va_end(ap);
 }
 
-static int lookup_opcode(token_type mnemonic, int cpu, addressing_mode mode)
+/* rows at or above this index are in the illegal (6502i) opcode map */
+#define ILLEGAL_ROW 0x100
+
+int m6502_opcode_row(int mnemonic)
 {
-    size_t mnem_index;
     if (mnemonic <= TOKEN_TOP) {
-        mnem_index = mnemonic - TOKEN_ANC;
+        return mnemonic - TOKEN_ANC + ILLEGAL_ROW;
     }
-    else if (mnemonic <= TOKEN_XCE) {
-        mnem_index = mnemonic - TOKEN_BRA;
-    } else {
-        mnem_index = mnemonic - TOKEN_ADC + (W65816_WORDS + 1);
+    if (mnemonic <= TOKEN_XCE) {
+        return mnemonic - TOKEN_BRA;
     }
-    const int *mnem_modes;
-    switch (cpu) {
-        case CPU_65C02: mnem_modes = map_65c02[mnem_index]; break;
-        case CPU_65816: mnem_modes = map_65816[mnem_index]; break;
-        default:        mnem_modes = map_6502[mnem_index]; break;
+    return mnemonic - TOKEN_ADC + (W65816_WORDS + 1);
+}
+
+m6502_form m6502_classify(int mnemonic, const operand *oper)
+{
+    if (!oper) {
+        return M6502_FORM_IMPLIED;
+    }
+    switch (oper->form) {
+        case FORM_BIT_ZP:
+        case FORM_BIT_OFFS_ZP:  return M6502_FORM_BIT;
+        case FORM_TWO_OPERANDS: return M6502_FORM_TWO_OPERANDS;
+        case FORM_ACCUMULATOR:  return M6502_FORM_ACCUMULATOR;
+        default: break;
+    }
+    switch (mnemonic) {
+        case TOKEN_BCC:
+        case TOKEN_BCS:
+        case TOKEN_BEQ:
+        case TOKEN_BMI:
+        case TOKEN_BNE:
+        case TOKEN_BPL:
+        case TOKEN_BRA:
+        case TOKEN_BRL:
+        case TOKEN_BVC:
+        case TOKEN_BVS: return M6502_FORM_RELATIVE;
+        default:        return M6502_FORM_SINGLE;
+    }
+}
+
+/* whether a branch was made long in an earlier pass, once long it stays long so that passes converge */
+static int is_long_branch(const assembly_context *context, const token *mnemonic_token)
+{
+    size_t lo = 0, hi = context->long_branch_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (context->long_branches[mid] == mnemonic_token->loc) {
+            return 1;
+        }
+        if (context->long_branches[mid] < mnemonic_token->loc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return 0;
+}
+
+static void add_long_branch(assembly_context *context, const token *mnemonic_token)
+{
+    if (is_long_branch(context, mnemonic_token)) {
+        return;
+    }
+    if (context->long_branch_count == context->long_branch_capacity) {
+        context->long_branch_capacity = context->long_branch_capacity ? context->long_branch_capacity * 2 : 16;
+        context->long_branches = tiny_realloc(context->long_branches, context->long_branch_capacity * sizeof(source_loc));
     }
-    size_t mode_ix = mode_index(mode);
-    int opc = mnem_modes[mode_ix];
-    if (opc == BAD && mnemonic <= TOKEN_TOP) {
-        return map_6502i[mnem_index][mode_ix];
+    size_t i = context->long_branch_count++;
+    while (i > 0 && context->long_branches[i - 1] > mnemonic_token->loc) {
+        context->long_branches[i] = context->long_branches[i - 1];
+        i--;
     }
-    return opc;
+    context->long_branches[i] = mnemonic_token->loc;
+}
+
+/* a branch out of range as the inverted branch over a jmp, or as a jmp for bra (--long-branches) */
+static addressing_mode gen_long_branch(assembly_context *context, const token *mnemonic_token, int opcode, value target, char *disassembly)
+{
+    add_long_branch(context, mnemonic_token);
+    if (opcode != 0x80) {
+        output_add(context->output, opcode ^ 0x20, 1);
+        output_add(context->output, 3, 1);
+    }
+    output_add(context->output, 0x4c, 1);
+    output_add(context->output, target & 0xffff, 2);
+    if (!context->pass_needed) snprintf(disassembly, 12, "$%04x long", (unsigned)(target & 0xffff));
+    return ADDR_MODE_REL_ABS;
 }
 
 static int convert_to_relative(addressing_mode mode, value *val, int pc)
@@ -740,44 +914,7 @@ static int convert_to_relative(addressing_mode mode, value *val, int pc)
     return 1;
 }
 
-static addressing_mode gen_implied(assembly_context *context, const token *mnemonic_token, const operand *operand, char *disassembly)
-{
-    addressing_mode mode = operand ? ADDR_MODE_ACCUM : ADDR_MODE_IMPLIED;
-    int opc = lookup_opcode(mnemonic_token->type, context->options.cpu, mode);
-    if (opc != BAD) {
-        output_add(context->output, opc, 1);
-        return mode;
-    }
-    return ADDR_MODE_ILLEGAL;
-}
-
-static addressing_mode gen_two_operand(assembly_context *context, const token *mnemonic_token, const operand *operand, char *disassembly)
-{
-    value op0 = evaluate_expression(context, operand->two_expression.expr0);
-    value op1 = evaluate_expression(context, operand->two_expression.expr1);
-    if (op0 < INT8_MIN || op0 > UINT8_MAX || op1 < INT8_MIN  || op1 > UINT8_MAX) {
-        if (context->pass_needed || VALUE_UNDEFINED == op0 || VALUE_UNDEFINED == op1) {
-            output_fill(context->output, 3);
-            return ADDR_MODE_TWO_OPER;
-        }
-        const token *offending = (op0 < INT8_MIN || op0 > UINT8_MAX) ?
-                        operand->two_expression.expr0->token :
-                        operand->two_expression.expr1->token;
-        tiny_error(offending, ERROR_MODE_RECOVER, "Illegal quantity");
-        return ADDR_MODE_TWO_OPER;
-    }
-    int opc = lookup_opcode(mnemonic_token->type, context->options.cpu, ADDR_MODE_TWO_OPER);
-    if (opc != BAD) {
-        output_add(context->output, opc, 1);
-        output_add(context->output, op0, 1);
-        output_add(context->output, op1, 1);
-        if (!context->pass_needed) disassemble(ADDR_MODE_TWO_OPER, disassembly, op0 & 0xff, op1 & 0xff);
-        return ADDR_MODE_TWO_OPER;
-    }
-    return ADDR_MODE_ILLEGAL;
-}
-
-static addressing_mode gen_bit_operand(assembly_context *context, const token *mnemonic_token, const operand *operand, char *disassembly)
+static addressing_mode gen_bit_operand(assembly_context *context, const token *mnemonic_token, int row, const operand *operand, char *disassembly)
 {
     addressing_mode mode = operand->form == FORM_BIT_ZP ? ADDR_MODE_BIT_ZP : ADDR_MODE_BIT_OFS;
     expression *bit;
@@ -834,261 +971,113 @@ static addressing_mode gen_bit_operand(assembly_context *context, const token *m
     return mode;
 }
 
-static addressing_mode gen_relative(assembly_context *context, const token *mnemonic_token, const operand *operand, char *disassembly)
+static void finish_encoding(assembly_context *context, const token *mnemonic_token, m6502_form form, addressing_mode mode, const char *disasm, char *disassembly)
 {
-    addressing_mode mode = ADDR_MODE_RELATIVE;
-    if (operand->single_expression.bitwidth) {
-        switch (operand->single_expression.bitwidth->value) {
-            case  8: break;
-            case 16: mode = ADDR_MODE_REL_ABS; break;
-            default:
-                tiny_error(operand->single_expression.bitwidth->token, ERROR_MODE_RECOVER, "Invalid bitwidth modifier");
-                return mode;
-        }
-    }
-    value rel = evaluate_expression(context, operand->single_expression.expr);
-    if (rel < INT16_MIN || rel > UINT16_MAX) {
-        if (context->pass_needed || VALUE_UNDEFINED == rel) {
-            output_fill(context->output, MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) ? 3 : 2);
-        } else {
-            tiny_error(operand->single_expression.expr->token, ERROR_MODE_RECOVER, "Relative branch too far from $%04x", context->output->logical_pc);
-        }
-        return mode;
-    }
-    rel &= 0xffff;
-    value displ = rel;
-    if (!convert_to_relative(mode, &rel, context->output->logical_pc)) {
-        mode = ADDR_MODE_REL_ABS;
-        convert_to_relative(mode, &rel, context->output->logical_pc);
+    if (mode == ADDR_MODE_ILLEGAL) {
+        tiny_error(mnemonic_token, ERROR_MODE_RECOVER, "Mode not supported");
+        return;
     }
-    int opc = lookup_opcode(mnemonic_token->type, context->options.cpu, mode);
-    if (opc == BAD) {
-        if (context->pass_needed) {
-            output_fill(context->output, 2);
-        }
-        else {
-            tiny_error(operand->single_expression.expr->token, ERROR_MODE_RECOVER, "Relative branch too far from $%04x", context->output->logical_pc);
+    if (!context->pass_needed) {
+        const char *mnemonic_text = mnemonic_names[mnemonic_token->type - TOKEN_ANC];
+        if (form == M6502_FORM_IMPLIED || form == M6502_FORM_ACCUMULATOR) {
+            strcpy(disassembly, mnemonic_text);
+            return;
         }
-        return mode;
-    }
-    output_add(context->output, opc, 1);
-    if (MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG)) {
-        output_add(context->output, rel, 2);
-    } else {
-        output_add(context->output, rel & 0xff, 1);
+        snprintf(disassembly, 16, "%s %s", mnemonic_text, disasm);
     }
-    if (!context->pass_needed) disassemble(mode, disassembly, displ);
-    return mode;
 }
 
-static addressing_mode gen_single_operand(assembly_context *context, const token *mnemonic_token, const operand* oper, char *disassembly)
+/* one specialized encoder per CPU, see m6502_encoder.h */
+#define ENCODER_SUFFIX  6502
+#define ENCODER_MAP     map_6502
+#define ENCODER_ILLEGAL 0
+#define ENCODER_65816   0
+#include "m6502_encoder.h"
+
+#define ENCODER_SUFFIX  6502i
+#define ENCODER_MAP     map_6502
+#define ENCODER_ILLEGAL 1
+#define ENCODER_65816   0
+#include "m6502_encoder.h"
+
+#define ENCODER_SUFFIX  65c02
+#define ENCODER_MAP     map_65c02
+#define ENCODER_ILLEGAL 0
+#define ENCODER_65816   0
+#include "m6502_encoder.h"
+
+#define ENCODER_SUFFIX  65816
+#define ENCODER_MAP     map_65816
+#define ENCODER_ILLEGAL 0
+#define ENCODER_65816   1
+#include "m6502_encoder.h"
+
+m6502_encoder m6502_select_encoder(int cpu)
 {
-    addressing_mode mode = ADDR_MODE_ZP;
-    switch (oper->form) {
-        case FORM_IMMEDIATE:    mode = ADDR_MODE_IMMEDIATE; break;
-        case FORM_DIRECT:       mode = ADDR_MODE_DIRECT; break;
-        case FORM_DIRECT_Y:     mode = ADDR_MODE_DIR_ZP_Y; break;
-        case FORM_INDEX_S:      mode = ADDR_MODE_ZP_S; break;
-        case FORM_INDEX_X:      mode = ADDR_MODE_ZP_X; break;
-        case FORM_INDEX_Y:      mode = ADDR_MODE_ZP_Y; break;
-        case FORM_INDIRECT_S:   mode = ADDR_MODE_IND_ZP_S; break;
-        case FORM_INDIRECT_X:   mode = ADDR_MODE_IND_ZP_X; break;
-        case FORM_INDIRECT_Y:   mode = ADDR_MODE_IND_ZP_Y; break;
-        case FORM_INDIRECT:     mode = ADDR_MODE_IND_ZP; break;
-        default: break;
-    }
-    value oper_val = evaluate_expression(context, oper->single_expression.expr), orig_val = oper_val;
-    token_type mnemonic = mnemonic_token->type;
-    value page = (oper_val >> 8);
-    if (context->options.cpu == CPU_65816 &&
-        !MODE_HAS_FLAG(mode, ADDR_MODE_IMM_FLAG) &&
-        !token_is_of_type(mnemonic_token, jmp_mnemonics, sizeof jmp_mnemonics) &&
-        !context->pass_needed && 
-        oper_val >= INT16_MIN && oper_val <= UINT16_MAX) {
-        /* truncate values to byte if they are the same page as
-           current and the mnemonic is a direct page mnemonic */
-        if (page == context->page) {
-            oper_val &= 0xff;
-        }
-    }
-    if (oper_val < INT8_MIN || oper_val > UINT8_MAX) {
-        if (oper_val < INT16_MIN || oper_val > UINT16_MAX) {
-            if (oper_val < INT24_MIN || oper_val > UINT24_MAX) {
-                if (context->pass_needed || VALUE_UNDEFINED == oper_val) {
-                    /* guestimate the actual instruction size */
-                    int size = context->output->logical_pc > UINT8_MAX ? 3 : 2;
-                    if (mnemonic == TOKEN_JML || mnemonic == TOKEN_JML) {
-                        size = 4;
-                    } else if (mnemonic == TOKEN_JMP || mnemonic == TOKEN_JSR) {
-                        size = 3;
-                    }
-                    else if (MODE_HAS_FLAG(mode, ADDR_MODE_IND_FLAG) ||
-                            MODE_HAS_FLAG(mode, ADDR_MODE_DIR_FLAG) ||
-                            MODE_HAS_FLAG(mode, ADDR_MODE_IMM_FLAG)) {
-                        size = 2;
-                    }
-                    output_fill(context->output, size);
-                    return mode;
-                }
-                tiny_error(oper->single_expression.expr->token, ERROR_MODE_RECOVER, "Illegal quantity");
-                return mode;
-            }
-            oper_val &= 0xffffff;
-            mode |= ADDR_MODE_LONG;
-        } else {
-            oper_val &= 0xffff;
-            mode |= ADDR_MODE_ABS_FLAG;
-        }
-    } else {
-        oper_val &= 0xff;
-    }
-    expression *bitwidth = oper->single_expression.bitwidth;
-    if (bitwidth) {
-        switch (bitwidth->value) {
-            case 8:
-                if (MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) || MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG)) {
-                    tiny_error(oper->single_expression.expr->token, ERROR_MODE_RECOVER, "Illegal quantity");
-                    return mode;
-                }
-                break;
-            case 16:
-                oper_val = orig_val; /* restore from page truncation */
-                if (MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG)) {
-                    tiny_error(oper->single_expression.expr->token, ERROR_MODE_RECOVER, "Illegal quantity");
-                    return mode;
-                }
-                mode |= ADDR_MODE_ABS_FLAG;
-                break;
-            case 24:
-                oper_val = orig_val; /* restore from page truncation */
-                mode |= ADDR_MODE_LONG;
-                break;
-            default:
-                tiny_error(bitwidth->token, ERROR_MODE_RECOVER, "Invalid bitwidth specifier");
-                return mode;
-        }
+    switch (cpu) {
+        case CPU_6502I: return encode_6502i;
+        case CPU_65C02: return encode_65c02;
+        case CPU_65816: return encode_65816;
+        default:        return encode_6502;
     }
-    else if (MODE_HAS_FLAG(mode, ADDR_MODE_IMM_FLAG) && context->options.cpu == CPU_65816) {
-        if (token_is_of_type(mnemonic_token, acc_mnemonics, sizeof acc_mnemonics)) {
-            if (!context->m16 && (MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) || MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG))) {
-                tiny_error(oper->single_expression.expr->token, ERROR_MODE_RECOVER,
-                "Illegal quantity (8-bit immediate mode accumulator specified)");
-                return mode;
-            }
-            if (context->m16) {
-                mode |= ADDR_MODE_ABS_FLAG;
-            }
-        }
-        else if (token_is_of_type(mnemonic_token, ix_mnemonics, sizeof ix_mnemonics)) {
-            if (!context->x16 && (MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) || MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG))) {
-                tiny_error(oper->single_expression.expr->token, ERROR_MODE_RECOVER,
-                "Illegal quantity (8-bit index register mode specified)");
-                return mode;
-            }
-            if (context->x16) {
-                mode |= ADDR_MODE_ABS_FLAG;
-            }
-        }
+}
+
+void m6502_gen(assembly_context *context, const token *mnemonic_token, const operand *oper, char *disassembly)
+{
+    m6502_gen_form(context, mnemonic_token,
+                   m6502_opcode_row(mnemonic_token->type),
+                   m6502_classify(mnemonic_token->type, oper),
+                   oper, disassembly);
+}
+
+void m6502_gen_form(assembly_context *context, const token *mnemonic_token, int row, m6502_form form, const operand *oper, char *disassembly)
+{
+    context->encode(context, mnemonic_token, row, form, oper, disassembly);
+}
+
+static int row_mnemonic(int row)
+{
+    if (row < W65816_WORDS + 1) {
+        return TOKEN_BRA + row;
     }
-    int size = MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG) ? 3 :
-               MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) ? 2 :
-               1;
-    int opc = lookup_opcode(mnemonic, context->options.cpu, mode);
-    if (opc == BAD) {
-        size = 2;
-        oper_val = orig_val; /* restore from page truncation */
-        if ((mnemonic == TOKEN_JMP || mnemonic == TOKEN_JML) && MODE_HAS_FLAG(mode, ADDR_MODE_DIR_FLAG) && !MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG)) {
-            opc =lookup_opcode(mnemonic, context->options.cpu, ADDR_MODE_DIRECT);
-        } else {
-            if (MODE_HAS_FLAG(mode, ADDR_MODE_ZP) &&
-                !MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) &&
-                (!bitwidth || bitwidth->value > 8)) {
-                mode |= ADDR_MODE_ABS_FLAG;
-                opc = lookup_opcode(mnemonic, context->options.cpu, mode);
-            }
-            if (opc == BAD &&
-                MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) &&
-                !MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG) &&
-                (!bitwidth || bitwidth->value > 16)) {
-                mode |= ADDR_MODE_LNG_FLAG;
-                opc = lookup_opcode(mnemonic, context->options.cpu, mode);
-                size = 3;
-            }
-        }
-        if (opc == BAD) {
-            if (context->pass_needed) {
-                output_fill(context->output, size + 1);
-                return mode;
+    return TOKEN_ADC + row - (W65816_WORDS + 1);
+}
+
+static void decode_map(int map[][MODES_ALL], size_t rows, int illegal, m6502_decoding table[256])
+{
+    for(size_t row = 0; row < rows; row++) {
+        for(int mode_ix = 0; mode_ix < MODES_ALL; mode_ix++) {
+            int opcode = map[row][mode_ix];
+            /* where two modes share an opcode the first one wins */
+            if (opcode != BAD && !table[opcode].mnemonic) {
+                table[opcode].mnemonic = illegal ? TOKEN_ANC + (int)row : row_mnemonic((int)row);
+                table[opcode].mode = (m6502_mode)mode_ix;
             }
-            return ADDR_MODE_ILLEGAL;
         }
     }
-    output_add(context->output, opc, 1);
-    output_add(context->output, oper_val, size);
-    if ((mnemonic == TOKEN_JMP || mnemonic == TOKEN_JML) && MODE_HAS_FLAG(mode, ADDR_MODE_DIR_FLAG)) {
-        snprintf(disassembly, 8, "[$%04llx]", oper_val & 0xffff);
-    } else {
-        disassemble(mode, disassembly, oper_val);
-    }
-    return mode;
 }
 
-void m6502_gen(assembly_context *context, const token *mnemonic_token, const operand *oper, char *disassembly)
+void m6502_decode_table(int cpu, m6502_decoding table[256])
 {
-    token_type mnemonic = mnemonic_token->type;
-    addressing_mode mode;
-    char disasm[13] = {};
-    if (oper) {
-        switch (oper->form) {
-            case FORM_BIT_ZP:
-            case FORM_BIT_OFFS_ZP:
-                mode = gen_bit_operand(context, mnemonic_token, oper, disasm);
-                break;
-            case FORM_TWO_OPERANDS:
-                mode = gen_two_operand(context, mnemonic_token, oper, disasm);
-                break;
-            case FORM_ACCUMULATOR:
-                mode = gen_implied(context, mnemonic_token, oper, disasm);
-                break;
-            default:
-                if (mnemonic == TOKEN_BCC ||
-                    mnemonic == TOKEN_BCS ||
-                    mnemonic == TOKEN_BEQ ||
-                    mnemonic == TOKEN_BMI ||
-                    mnemonic == TOKEN_BNE ||
-                    mnemonic == TOKEN_BPL ||
-                    mnemonic == TOKEN_BRA ||
-                    mnemonic == TOKEN_BRL ||
-                    mnemonic == TOKEN_BVC ||
-                    mnemonic == TOKEN_BVS) {
-                    mode = gen_relative(context, mnemonic_token, oper, disasm);
-                }
-                else {
-                    mode = gen_single_operand(context, mnemonic_token, oper, disasm);
-                }
-        }
-    }
-    else {
-        mode = gen_implied(context, mnemonic_token, oper, disasm);
-    }
-    if (mode == ADDR_MODE_ILLEGAL) {
-        tiny_error(mnemonic_token, ERROR_MODE_RECOVER, "Mode not supported");
-        return;
-    }
-    if (!context->pass_needed) {
-        TOKEN_GET_TEXT(mnemonic_token, mnemonic_text);
-        /* lowercase mnemonic for output */
-        mnemonic_text[0] |= 0x60;
-        mnemonic_text[1] |= 0x60;
-        mnemonic_text[2] |= 0x60;
-        if (!oper || oper->form == FORM_ACCUMULATOR) {
-            char *m = mnemonic_text;
-            *disassembly++ = *m++;
-            *disassembly++ = *m++;
-            *disassembly++ = *m;
-            *disassembly = '\0';
-            return;
-        }
-        snprintf(disassembly, 16, "%s %s", mnemonic_text, disasm);
+    memset(table, 0, 256 * sizeof(m6502_decoding));
+    switch (cpu) {
+        case CPU_65816:
+            decode_map(map_65816, sizeof map_65816 / sizeof map_65816[0], 0, table);
+            break;
+        case CPU_65C02:
+            decode_map(map_65c02, sizeof map_65c02 / sizeof map_65c02[0], 0, table);
+            /* the bit instructions encode the bit number in the opcode */
+            for(int bit = 0; bit < 8; bit++) {
+                table[0x07 + bit * 0x10] = (m6502_decoding){ TOKEN_RMB, MODES_BIT };
+                table[0x87 + bit * 0x10] = (m6502_decoding){ TOKEN_SMB, MODES_BIT };
+                table[0x0f + bit * 0x10] = (m6502_decoding){ TOKEN_BBR, MODES_BIT_OFFS };
+                table[0x8f + bit * 0x10] = (m6502_decoding){ TOKEN_BBS, MODES_BIT_OFFS };
+            }
+            break;
+        default:
+            decode_map(map_6502, sizeof map_6502 / sizeof map_6502[0], 0, table);
+            if (cpu == CPU_6502I) {
+                decode_map(map_6502i, sizeof map_6502i / sizeof map_6502i[0], 1, table);
+            }
     }
 }
@@ -27,7 +27,72 @@ extern const int w65816_types[W65816_WORDS];
 extern const char *w65c02_mnemonics[W65C02_WORDS];
 extern const int w65c02_types[W65C02_WORDS];
 
+/* the columns of the opcode maps */
+typedef enum m6502_mode
+{
+    MODES_IMP,
+    MODES_ZIP,
+    MODES_IMM,
+    MODES_IMM_ABS,
+    MODES_ZPS,
+    MODES_ZPX,
+    MODES_ZPY,
+    MODES_ABS,
+    MODES_ABSX,
+    MODES_ABSY,
+    MODES_LONG,
+    MODES_LONG_X,
+    MODES_IND_ZP,
+    MODES_INDS,
+    MODES_INDX,
+    MODES_INDY,
+    MODES_IND_ABS,
+    MODES_IND_ABS_X,
+    MODES_DIR,
+    MODES_DIR_Y,
+    MODES_ACC,
+    MODES_REL,
+    MODES_REL_ABS,
+    MODES_TWO_OPS,
+    MODES_BIT,
+    MODES_BIT_OFFS,
+    MODES_ALL
+
+} m6502_mode;
+
+/* what an opcode decodes to: the mnemonic's token type and its operand mode */
+typedef struct m6502_decoding
+{
+    int mnemonic;
+    m6502_mode mode;
+
+} m6502_decoding;
+
+/* how an instruction's operand is encoded, resolved once per statement */
+typedef enum m6502_form
+{
+    M6502_FORM_IMPLIED,
+    M6502_FORM_ACCUMULATOR,
+    M6502_FORM_SINGLE,
+    M6502_FORM_RELATIVE,
+    M6502_FORM_TWO_OPERANDS,
+    M6502_FORM_BIT
+
+} m6502_form;
+
+typedef void (*m6502_encoder)(assembly_context *context, const token *mnemonic_token, int row, m6502_form form, const operand *operand, char *disassembly);
+
+int m6502_opcode_row(int mnemonic);
+m6502_form m6502_classify(int mnemonic, const operand *operand);
+
+/* the encoder specialized for the cpu, chosen once per assembly context */
+m6502_encoder m6502_select_encoder(int cpu);
+
+/* invert the cpu's opcode maps, undefined opcodes decode to mnemonic 0 */
+void m6502_decode_table(int cpu, m6502_decoding table[256]);
+
 void m6502_gen(assembly_context *context, const token *mnemonic_token, const operand *operand, char *disassembly);
+void m6502_gen_form(assembly_context *context, const token *mnemonic_token, int row, m6502_form form, const operand *operand, char *disassembly);
 void set_instruction_set(assembly_context *context);
 
 
@@ -0,0 +1,315 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+/*
+
+Encoder template, included by m6502.c once per CPU. Before including define:
+
+ENCODER_SUFFIX  the suffix for the generated function names
+ENCODER_MAP     the CPU's opcode table
+ENCODER_ILLEGAL 1 if the undocumented (6502i) table is available
+ENCODER_65816   1 to compile in direct page and register width handling
+
+Each inclusion produces an encode_<suffix> function for m6502_encoders.
+**/
+
+#define ENCODER_CAT_(a, b)  a##_##b
+#define ENCODER_CAT(a, b)   ENCODER_CAT_(a, b)
+#define ENCODER_FN(name)    ENCODER_CAT(name, ENCODER_SUFFIX)
+
+static int ENCODER_FN(lookup_opcode)(int row, addressing_mode mode)
+{
+    size_t mode_ix = mode_index(mode);
+    if (row >= ILLEGAL_ROW) {
+#if ENCODER_ILLEGAL
+        return map_6502i[row - ILLEGAL_ROW][mode_ix];
+#else
+        return BAD;
+#endif
+    }
+    return ENCODER_MAP[row][mode_ix];
+}
+
+static addressing_mode ENCODER_FN(gen_implied)(assembly_context *context, const token *mnemonic_token, int row, const operand *operand, char *disassembly)
+{
+    addressing_mode mode = operand ? ADDR_MODE_ACCUM : ADDR_MODE_IMPLIED;
+    int opc = ENCODER_FN(lookup_opcode)(row, mode);
+    if (opc != BAD) {
+        output_add(context->output, opc, 1);
+        return mode;
+    }
+    return ADDR_MODE_ILLEGAL;
+}
+
+static addressing_mode ENCODER_FN(gen_two_operand)(assembly_context *context, const token *mnemonic_token, int row, const operand *operand, char *disassembly)
+{
+    value op0 = evaluate_expression(context, operand->two_expression.expr0);
+    value op1 = evaluate_expression(context, operand->two_expression.expr1);
+    if (op0 < INT8_MIN || op0 > UINT8_MAX || op1 < INT8_MIN  || op1 > UINT8_MAX) {
+        if (context->pass_needed || VALUE_UNDEFINED == op0 || VALUE_UNDEFINED == op1) {
+            output_fill(context->output, 3);
+            return ADDR_MODE_TWO_OPER;
+        }
+        const token *offending = (op0 < INT8_MIN || op0 > UINT8_MAX) ?
+                        operand->two_expression.expr0->token :
+                        operand->two_expression.expr1->token;
+        tiny_error(offending, ERROR_MODE_RECOVER, "Illegal quantity");
+        return ADDR_MODE_TWO_OPER;
+    }
+    int opc = ENCODER_FN(lookup_opcode)(row, ADDR_MODE_TWO_OPER);
+    if (opc != BAD) {
+        output_add(context->output, opc, 1);
+        output_add(context->output, op0, 1);
+        output_add(context->output, op1, 1);
+        if (!context->pass_needed) disassemble(ADDR_MODE_TWO_OPER, disassembly, op0 & 0xff, op1 & 0xff);
+        return ADDR_MODE_TWO_OPER;
+    }
+    return ADDR_MODE_ILLEGAL;
+}
+
+static addressing_mode ENCODER_FN(gen_relative)(assembly_context *context, const token *mnemonic_token, int row, const operand *operand, char *disassembly)
+{
+    addressing_mode mode = ADDR_MODE_RELATIVE;
+    if (operand->single_expression.bitwidth) {
+        switch (operand->single_expression.bitwidth->value) {
+            case  8: break;
+            case 16: mode = ADDR_MODE_REL_ABS; break;
+            default:
+                tiny_error(operand->single_expression.bitwidth->token, ERROR_MODE_RECOVER, "Invalid bitwidth modifier");
+                return mode;
+        }
+    }
+    value rel = evaluate_expression(context, operand->single_expression.expr);
+    int long_branch = context->options.long_branches && is_long_branch(context, mnemonic_token);
+    if (rel < INT16_MIN || rel > UINT16_MAX) {
+        if (context->pass_needed || VALUE_UNDEFINED == rel) {
+            output_fill(context->output, long_branch ? (mnemonic_token->type == TOKEN_BRA ? 3 : 5) :
+                                         MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) ? 3 : 2);
+        } else {
+            tiny_error(operand->single_expression.expr->token, ERROR_MODE_RECOVER, "Relative branch too far from $%04x", context->output->logical_pc);
+        }
+        return mode;
+    }
+    rel &= 0xffff;
+    value displ = rel;
+    if (!convert_to_relative(mode, &rel, context->output->logical_pc)) {
+        mode = ADDR_MODE_REL_ABS;
+        convert_to_relative(mode, &rel, context->output->logical_pc);
+    }
+    int opc = ENCODER_FN(lookup_opcode)(row, mode);
+    if (context->options.long_branches && (long_branch || (opc == BAD && mode == ADDR_MODE_REL_ABS))) {
+        int short_opc = ENCODER_FN(lookup_opcode)(row, ADDR_MODE_RELATIVE);
+        if (short_opc != BAD) {
+            return gen_long_branch(context, mnemonic_token, short_opc, displ, disassembly);
+        }
+    }
+    if (opc == BAD) {
+        if (context->pass_needed) {
+            output_fill(context->output, 2);
+        }
+        else {
+            tiny_error(operand->single_expression.expr->token, ERROR_MODE_RECOVER, "Relative branch too far from $%04x", context->output->logical_pc);
+        }
+        return mode;
+    }
+    output_add(context->output, opc, 1);
+    if (MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG)) {
+        output_add(context->output, rel, 2);
+    } else {
+        output_add(context->output, rel & 0xff, 1);
+    }
+    if (!context->pass_needed) disassemble(mode, disassembly, displ);
+    return mode;
+}
+
+static addressing_mode ENCODER_FN(gen_single_operand)(assembly_context *context, const token *mnemonic_token, int row, const operand* oper, char *disassembly)
+{
+    addressing_mode mode = ADDR_MODE_ZP;
+    switch (oper->form) {
+        case FORM_IMMEDIATE:    mode = ADDR_MODE_IMMEDIATE; break;
+        case FORM_DIRECT:       mode = ADDR_MODE_DIRECT; break;
+        case FORM_DIRECT_Y:     mode = ADDR_MODE_DIR_ZP_Y; break;
+        case FORM_INDEX_S:      mode = ADDR_MODE_ZP_S; break;
+        case FORM_INDEX_X:      mode = ADDR_MODE_ZP_X; break;
+        case FORM_INDEX_Y:      mode = ADDR_MODE_ZP_Y; break;
+        case FORM_INDIRECT_S:   mode = ADDR_MODE_IND_ZP_S; break;
+        case FORM_INDIRECT_X:   mode = ADDR_MODE_IND_ZP_X; break;
+        case FORM_INDIRECT_Y:   mode = ADDR_MODE_IND_ZP_Y; break;
+        case FORM_INDIRECT:     mode = ADDR_MODE_IND_ZP; break;
+        default: break;
+    }
+    value oper_val = evaluate_expression(context, oper->single_expression.expr), orig_val = oper_val;
+    token_type mnemonic = mnemonic_token->type;
+#if ENCODER_65816
+    value page = (oper_val >> 8);
+    if (!MODE_HAS_FLAG(mode, ADDR_MODE_IMM_FLAG) &&
+        !is_jmp_mnemonic(mnemonic) &&
+        !context->pass_needed && 
+        oper_val >= INT16_MIN && oper_val <= UINT16_MAX) {
+        /* truncate values to byte if they are the same page as
+           current and the mnemonic is a direct page mnemonic */
+        if (page == context->page) {
+            oper_val &= 0xff;
+        }
+    }
+#endif
+    if (oper_val < INT8_MIN || oper_val > UINT8_MAX) {
+        if (oper_val < INT16_MIN || oper_val > UINT16_MAX) {
+            if (oper_val < INT24_MIN || oper_val > UINT24_MAX) {
+                if (context->pass_needed || VALUE_UNDEFINED == oper_val) {
+                    /* guestimate the actual instruction size */
+                    int size = context->output->logical_pc > UINT8_MAX ? 3 : 2;
+                    if (mnemonic == TOKEN_JML || mnemonic == TOKEN_JML) {
+                        size = 4;
+                    } else if (mnemonic == TOKEN_JMP || mnemonic == TOKEN_JSR) {
+                        size = 3;
+                    }
+                    else if (MODE_HAS_FLAG(mode, ADDR_MODE_IND_FLAG) ||
+                            MODE_HAS_FLAG(mode, ADDR_MODE_DIR_FLAG) ||
+                            MODE_HAS_FLAG(mode, ADDR_MODE_IMM_FLAG)) {
+                        size = 2;
+                    }
+                    output_fill(context->output, size);
+                    return mode;
+                }
+                tiny_error(oper->single_expression.expr->token, ERROR_MODE_RECOVER, "Illegal quantity");
+                return mode;
+            }
+            oper_val &= 0xffffff;
+            mode |= ADDR_MODE_LONG;
+        } else {
+            oper_val &= 0xffff;
+            mode |= ADDR_MODE_ABS_FLAG;
+        }
+    } else {
+        oper_val &= 0xff;
+    }
+    expression *bitwidth = oper->single_expression.bitwidth;
+    if (bitwidth) {
+        switch (bitwidth->value) {
+            case 8:
+                if (MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) || MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG)) {
+                    tiny_error(oper->single_expression.expr->token, ERROR_MODE_RECOVER, "Illegal quantity");
+                    return mode;
+                }
+                break;
+            case 16:
+                oper_val = orig_val; /* restore from page truncation */
+                if (MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG)) {
+                    tiny_error(oper->single_expression.expr->token, ERROR_MODE_RECOVER, "Illegal quantity");
+                    return mode;
+                }
+                mode |= ADDR_MODE_ABS_FLAG;
+                break;
+            case 24:
+                oper_val = orig_val; /* restore from page truncation */
+                mode |= ADDR_MODE_LONG;
+                break;
+            default:
+                tiny_error(bitwidth->token, ERROR_MODE_RECOVER, "Invalid bitwidth specifier");
+                return mode;
+        }
+    }
+#if ENCODER_65816
+    else if (MODE_HAS_FLAG(mode, ADDR_MODE_IMM_FLAG)) {
+        if (is_acc_mnemonic(mnemonic)) {
+            if (!context->m16 && (MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) || MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG))) {
+                tiny_error(oper->single_expression.expr->token, ERROR_MODE_RECOVER,
+                "Illegal quantity (8-bit immediate mode accumulator specified)");
+                return mode;
+            }
+            if (context->m16) {
+                mode |= ADDR_MODE_ABS_FLAG;
+            }
+        }
+        else if (is_ix_mnemonic(mnemonic)) {
+            if (!context->x16 && (MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) || MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG))) {
+                tiny_error(oper->single_expression.expr->token, ERROR_MODE_RECOVER,
+                "Illegal quantity (8-bit index register mode specified)");
+                return mode;
+            }
+            if (context->x16) {
+                mode |= ADDR_MODE_ABS_FLAG;
+            }
+        }
+    }
+#endif
+    int size = MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG) ? 3 :
+               MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) ? 2 :
+               1;
+    int opc = ENCODER_FN(lookup_opcode)(row, mode);
+    if (opc == BAD) {
+        size = 2;
+        oper_val = orig_val; /* restore from page truncation */
+        if ((mnemonic == TOKEN_JMP || mnemonic == TOKEN_JML) && MODE_HAS_FLAG(mode, ADDR_MODE_DIR_FLAG) && !MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG)) {
+            opc =ENCODER_FN(lookup_opcode)(row, ADDR_MODE_DIRECT);
+        } else {
+            if (MODE_HAS_FLAG(mode, ADDR_MODE_ZP) &&
+                !MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) &&
+                (!bitwidth || bitwidth->value > 8)) {
+                mode |= ADDR_MODE_ABS_FLAG;
+                opc = ENCODER_FN(lookup_opcode)(row, mode);
+            }
+            if (opc == BAD &&
+                MODE_HAS_FLAG(mode, ADDR_MODE_ABS_FLAG) &&
+                !MODE_HAS_FLAG(mode, ADDR_MODE_LNG_FLAG) &&
+                (!bitwidth || bitwidth->value > 16)) {
+                mode |= ADDR_MODE_LNG_FLAG;
+                opc = ENCODER_FN(lookup_opcode)(row, mode);
+                size = 3;
+            }
+        }
+        if (opc == BAD) {
+            if (context->pass_needed) {
+                output_fill(context->output, size + 1);
+                return mode;
+            }
+            return ADDR_MODE_ILLEGAL;
+        }
+    }
+    output_add(context->output, opc, 1);
+    output_add(context->output, oper_val, size);
+    if ((mnemonic == TOKEN_JMP || mnemonic == TOKEN_JML) && MODE_HAS_FLAG(mode, ADDR_MODE_DIR_FLAG)) {
+        snprintf(disassembly, 12, "[$%04x]", (unsigned)(oper_val & 0xffff));
+    } else {
+        disassemble(mode, disassembly, oper_val);
+    }
+    return mode;
+}
+
+static void ENCODER_FN(encode)(assembly_context *context, const token *mnemonic_token, int row, m6502_form form, const operand *oper, char *disassembly)
+{
+    addressing_mode mode;
+    char disasm[13] = {};
+    switch (form) {
+        case M6502_FORM_BIT:
+            mode = gen_bit_operand(context, mnemonic_token, row, oper, disasm);
+            break;
+        case M6502_FORM_TWO_OPERANDS:
+            mode = ENCODER_FN(gen_two_operand)(context, mnemonic_token, row, oper, disasm);
+            break;
+        case M6502_FORM_RELATIVE:
+            mode = ENCODER_FN(gen_relative)(context, mnemonic_token, row, oper, disasm);
+            break;
+        case M6502_FORM_SINGLE:
+            mode = ENCODER_FN(gen_single_operand)(context, mnemonic_token, row, oper, disasm);
+            break;
+        default:
+            mode = ENCODER_FN(gen_implied)(context, mnemonic_token, row, oper, disasm);
+    }
+    finish_encoding(context, mnemonic_token, form, mode, disasm, disassembly);
+}
+
+#undef ENCODER_FN
+#undef ENCODER_CAT
+#undef ENCODER_CAT_
+#undef ENCODER_SUFFIX
+#undef ENCODER_MAP
+#undef ENCODER_ILLEGAL
+#undef ENCODER_65816
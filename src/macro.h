@@ -31,6 +31,9 @@ typedef struct macro
     dynamic_array *block_tokens;
     dynamic_array *sources;
     token *define_token;
+    /* local labels given a unique name in each expansion */
+    string_htable *locals;
+    int expansions;
 
 } macro;
 
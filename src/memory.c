@@ -80,6 +80,39 @@ void dynamic_array_insert_range(dynamic_array *dest, const dynamic_array *src, s
     memcpy(dest->data + index, src->data, src->count * sizeof(void*));
 }
 
+void *chunked_array_next(chunked_array *arr)
+{
+    /* only the thread adding elements changes the count, so it can read it plainly */
+    size_t count = atomic_load_explicit(&arr->count, memory_order_relaxed);
+    size_t chunk = count >> CHUNKED_ARRAY_CHUNK_BITS;
+    if (chunk >= CHUNKED_ARRAY_MAX_CHUNKS) {
+        tiny_error(NULL, ERROR_MODE_PANIC, "Too many items to track.");
+    }
+    if (!arr->chunks[chunk]) {
+        arr->chunks[chunk] = tiny_malloc(CHUNKED_ARRAY_CHUNK_SIZE * arr->elem_size);
+    }
+    return arr->chunks[chunk] + (count & (CHUNKED_ARRAY_CHUNK_SIZE - 1)) * arr->elem_size;
+}
+
+size_t chunked_array_publish(chunked_array *arr)
+{
+    return atomic_fetch_add_explicit(&arr->count, 1, memory_order_release);
+}
+
+size_t chunked_array_count(const chunked_array *arr)
+{
+    return atomic_load_explicit(&((chunked_array*)arr)->count, memory_order_acquire);
+}
+
+void chunked_array_cleanup(chunked_array *arr)
+{
+    for(size_t i = 0; i < CHUNKED_ARRAY_MAX_CHUNKS && arr->chunks[i]; i++) {
+        tiny_free(arr->chunks[i]);
+        arr->chunks[i] = NULL;
+    }
+    atomic_store(&arr->count, 0);
+}
+
 #ifdef CHECK_LEAKS
 
 void tiny_memory_report()
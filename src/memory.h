@@ -11,6 +11,7 @@
 #define memory_h
 
 #include <ctype.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 
 typedef void(*element_dtor)(void*);
@@ -32,6 +33,31 @@ void dynamic_array_insert_range(dynamic_array *dest, const dynamic_array *src, s
 void dynamic_array_destroy(dynamic_array * arr);
 void dynamic_array_cleanup_and_destroy(dynamic_array *arr);
 
+#define CHUNKED_ARRAY_CHUNK_BITS    12
+#define CHUNKED_ARRAY_CHUNK_SIZE    (1 << CHUNKED_ARRAY_CHUNK_BITS)
+#define CHUNKED_ARRAY_MAX_CHUNKS    4096
+
+/* an array whose elements never move as it grows, so one thread can read the
+   elements another has published while that thread adds more */
+typedef struct chunked_array
+{
+    char *chunks[CHUNKED_ARRAY_MAX_CHUNKS];
+    size_t elem_size;
+    atomic_size_t count;
+} chunked_array;
+
+/* the slot after the last element, to fill in before it is published */
+void *chunked_array_next(chunked_array *arr);
+
+/* make the element in the next slot visible to other threads; returns its index */
+size_t chunked_array_publish(chunked_array *arr);
+
+size_t chunked_array_count(const chunked_array *arr);
+void chunked_array_cleanup(chunked_array *arr);
+
+#define CHUNKED_ARRAY_AT(arr, type, index)\
+((type*)(arr)->chunks[(index) >> CHUNKED_ARRAY_CHUNK_BITS] + ((index) & (CHUNKED_ARRAY_CHUNK_SIZE - 1)))
+
 #ifdef CHECK_LEAKS
 void tiny_memory_report(void);
 #endif
@@ -114,3 +114,46 @@ void operand_destroy(operand *operand)
     }
     tiny_free(operand);
  }
+
+static int visit_list(const dynamic_array *list, int is_args, expression_visitor visitor, void *data)
+{
+    for(size_t i = 0; i < list->count; i++) {
+        const expression *expr = (const expression*)list->data[i];
+        if (is_args) {
+            const pseudo_op_arg *arg = (const pseudo_op_arg*)list->data[i];
+            expr = arg->arg_type == PSEUDO_OP_EXPRESSION ? arg->arg.expression : NULL;
+        }
+        if (expression_visit(expr, visitor, data)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int operand_visit(const operand *operand, expression_visitor visitor, void *data)
+{
+    if (!operand) {
+        return 0;
+    }
+    switch (operand->form) {
+        case FORM_EXPRESSION_LIST:
+            return visit_list(operand->expression_list.expressions, 0, visitor, data);
+        case FORM_PSEUDO_OP_LIST:
+            return visit_list(operand->pseudo_op_arg_args.args, 1, visitor, data);
+        case FORM_BIT_ZP:
+            return expression_visit(operand->bit_expression.bit, visitor, data) ||
+                   expression_visit(operand->bit_expression.expr, visitor, data);
+        case FORM_BIT_OFFS_ZP:
+            return expression_visit(operand->bit_offset_expression.bit, visitor, data) ||
+                   expression_visit(operand->bit_offset_expression.offs, visitor, data) ||
+                   expression_visit(operand->bit_offset_expression.expr, visitor, data);
+        case FORM_TWO_OPERANDS:
+            return expression_visit(operand->two_expression.expr0, visitor, data) ||
+                   expression_visit(operand->two_expression.expr1, visitor, data);
+        case FORM_ACCUMULATOR:
+            return 0;
+        default:
+            return expression_visit(operand->single_expression.bitwidth, visitor, data) ||
+                   expression_visit(operand->single_expression.expr, visitor, data);
+    }
+}
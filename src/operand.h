@@ -10,8 +10,8 @@
 #ifndef operand_h
 #define operand_h
 
-typedef struct expression expression;
-typedef struct dynamic_array expression_array;
+#include "expression.h"
+
 typedef struct dynamic_array pseudo_op_arg_array;
 typedef struct token token;
 typedef struct pseudo_op_arg {
@@ -79,4 +79,7 @@ operand *operand_pseudo_op_args(pseudo_op_arg_array *args);
 
 void operand_destroy(operand *operand);
 
+/* visit every expression of the operand as expression_visit does; returns 1 if the visitor stopped the walk */
+int operand_visit(const operand *operand, expression_visitor visitor, void *data);
+
 #endif /* operand_h */
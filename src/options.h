@@ -21,6 +21,9 @@ typedef struct options
     const char *label;
     const char *list;
     const char *format;
+    const char *variants;
+    const char *profile;
+    const char *compress_cache;
     enum {
             CPU_UNSPECIFIED,
             CPU_6502,
@@ -29,6 +32,18 @@ typedef struct options
             CPU_65816
     } cpu;
     int case_sensitive;
+    int trace_passes;
+    int test;
+    int optimize;
+    int pool_strings;
+    int long_branches;
+    int inline_limit;
+    int inline_budget;
+    enum {
+            REDUNDANT_OFF,
+            REDUNDANT_FIND,
+            REDUNDANT_REMOVE
+    } redundant;
     const char **argv;
     int argc;
     
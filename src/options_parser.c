@@ -9,6 +9,8 @@
 
 #include "memory.h"
 #include "options_parser.h"
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -19,15 +21,30 @@ static const char *help =
  "Usage: tiny6502 [Options] file...\n"
  "Options:\n"
  "--case-sensitive, -C              Specificy case-sensitivity\n"
+ "--compress-cache=<file>           Keep compressed blocks in <file> between builds\n"
  "--cpu=<arg>, -c <arg>             Specificy the target CPU\n"
  "--define=<arg>, -D <arg>          Define one or more symbols\n"
+ "--find-redundant                  Report loads and flag operations that change nothing\n"
  "--format=<arg>, -f <arg>          The output format\n"
+ "--inline-budget=<bytes>           The most bytes inlining procedures may add\n"
+ "--inline-limit=<bytes>            The largest procedure body to inline\n"
  "--label=<file>, -l <file>         The label listing\n"
  "--list=<file>, -L <file>          The disassembly listing\n"
+ "--long-branches                   Assemble branches out of range as a branch over a jmp\n"
+ "--optimize                        Apply peephole optimizations and report them\n"
  "--output=<file>, -o <fil>         The output file\n"
+ "--pool-strings                    Assemble each .cstring that ends another only once\n"
+ "--profile=<label>                 Run the program from <label> and report its hot spots\n"
+ "--remove-redundant                Remove loads and flag operations that change nothing\n"
+ "--test                            Run the program's .test blocks on the simulator\n"
+ "--trace-passes                    Report what caused each additional pass\n"
+ "--variants=<file>                 Assemble each line of options in <file> as a variant\n"
  "--version, -v                     Print the version number\n"
  "--help, -h, -?                    This help message";
 
+#define INLINE_LIMIT_DEFAULT    8
+#define INLINE_BUDGET_DEFAULT   256
+
 const char *get_arg(const char *option_arg, int *i, int argc, const char * option_name, const char *short_name, const char * argv[]) {
     if (option_arg) {
         fprintf(stderr, "option %s already defined.\n", option_name);
@@ -53,12 +70,21 @@ const char *get_arg(const char *option_arg, int *i, int argc, const char * optio
     return argv[*i];
 }
 
-options options_parse(int argc, const char * argv[])
+static int get_bytes_arg(int option_value, int *i, int argc, const char *option_name, const char *argv[])
 {
-    options opt = {
-        .argc = argc,
-        .argv = argv
-    };
+    const char *arg = get_arg(option_value >= 0 ? option_name : NULL, i, argc, option_name, option_name, argv);
+    char *end;
+    long bytes = strtol(arg, &end, 0);
+    if (!*arg || *end || bytes < 0 || bytes > UINT16_MAX) {
+        fprintf(stderr, "Option %s expects a number of bytes.\n", option_name);
+        exit(1);
+    }
+    return (int)bytes;
+}
+
+static void parse_arguments(options *options, int argc, const char * argv[])
+{
+    struct options opt = *options;
     for(int i = 1; i < argc; i++) {
         const char *arg = argv[i];
         if (arg[0] != '-') {
@@ -144,6 +170,44 @@ options options_parse(int argc, const char * argv[])
                      strcmp(arg, "-L") == 0) {
                 opt.list = get_arg(opt.list, &i, argc, "--list", "-L", argv);
             }
+            else if (strstr(arg, "--profile")) {
+                opt.profile = get_arg(opt.profile, &i, argc, "--profile", "--profile", argv);
+            }
+            else if (strstr(arg, "--compress-cache")) {
+                opt.compress_cache = get_arg(opt.compress_cache, &i, argc, "--compress-cache", "--compress-cache", argv);
+            }
+            else if (strstr(arg, "--variants")) {
+                opt.variants = get_arg(opt.variants, &i, argc, "--variants", "--variants", argv);
+            }
+            else if (strstr(arg, "--inline-limit")) {
+                opt.inline_limit = get_bytes_arg(opt.inline_limit, &i, argc, "--inline-limit", argv);
+            }
+            else if (strstr(arg, "--inline-budget")) {
+                opt.inline_budget = get_bytes_arg(opt.inline_budget, &i, argc, "--inline-budget", argv);
+            }
+            else if (strcmp(arg, "--long-branches") == 0) {
+                opt.long_branches = 1;
+            }
+            else if (strcmp(arg, "--optimize") == 0) {
+                opt.optimize = 1;
+            }
+            else if (strcmp(arg, "--pool-strings") == 0) {
+                opt.pool_strings = 1;
+            }
+            else if (strcmp(arg, "--find-redundant") == 0) {
+                if (opt.redundant < REDUNDANT_FIND) {
+                    opt.redundant = REDUNDANT_FIND;
+                }
+            }
+            else if (strcmp(arg, "--remove-redundant") == 0) {
+                opt.redundant = REDUNDANT_REMOVE;
+            }
+            else if (strcmp(arg, "--test") == 0) {
+                opt.test = 1;
+            }
+            else if (strcmp(arg, "--trace-passes") == 0) {
+                opt.trace_passes = 1;
+            }
             else if (strcmp(arg, "--version") == 0 ||
                      strcmp(arg, "-V") == 0) {
                 puts("Version 0.01");
@@ -159,8 +223,66 @@ options options_parse(int argc, const char * argv[])
             }
         }
     }
+    *options = opt;
+}
+
+options options_parse(int argc, const char * argv[])
+{
+    options opt = {
+        .argc = argc,
+        .argv = argv,
+        .inline_limit = -1,
+        .inline_budget = -1
+    };
+    parse_arguments(&opt, argc, argv);
     if (!opt.output) opt.output = "a.out";
+    if (opt.inline_limit < 0) opt.inline_limit = INLINE_LIMIT_DEFAULT;
+    if (opt.inline_budget < 0) opt.inline_budget = INLINE_BUDGET_DEFAULT;
     if (!opt.format) opt.format = "cbm";
     if (opt.cpu == CPU_UNSPECIFIED) opt.cpu = CPU_6502;
     return opt;
 }
+
+options options_parse_variant(const options *base, int argc, const char * argv[])
+{
+    options opt = {
+        .argc = argc,
+        .argv = argv,
+        .inline_limit = -1,
+        .inline_budget = -1
+    };
+    parse_arguments(&opt, argc, argv);
+    if (opt.input || opt.variants) {
+        fputs("Input and variants files cannot be specified in a variant\n", stderr);
+        exit(1);
+    }
+    if (opt.case_sensitive && !base->case_sensitive) {
+        fputs("Case sensitivity cannot differ between variants\n", stderr);
+        exit(1);
+    }
+    if (!opt.output) {
+        fputs("Each variant must specify its own --output\n", stderr);
+        exit(1);
+    }
+    if ((opt.inline_limit >= 0 && opt.inline_limit != base->inline_limit) ||
+        (opt.inline_budget >= 0 && opt.inline_budget != base->inline_budget)) {
+        /* the source is parsed once for all variants */
+        fputs("Inlining cannot differ between variants\n", stderr);
+        exit(1);
+    }
+    opt.inline_limit = base->inline_limit;
+    opt.inline_budget = base->inline_budget;
+    opt.input = base->input;
+    opt.case_sensitive = base->case_sensitive;
+    opt.trace_passes |= base->trace_passes;
+    opt.test |= base->test;
+    opt.optimize |= base->optimize;
+    opt.pool_strings |= base->pool_strings;
+    opt.long_branches |= base->long_branches;
+    if (opt.redundant < base->redundant) opt.redundant = base->redundant;
+    if (!opt.format) opt.format = base->format;
+    if (!opt.profile) opt.profile = base->profile;
+    if (!opt.compress_cache) opt.compress_cache = base->compress_cache;
+    if (opt.cpu == CPU_UNSPECIFIED) opt.cpu = base->cpu;
+    return opt;
+}
@@ -14,4 +14,7 @@
 
 options options_parse(int argc, const char *argv []);
 
+/* parse one line of a --variants file, taking anything unspecified from base */
+options options_parse_variant(const options *base, int argc, const char *argv []);
+
 #endif /* options_parser_h */
@@ -41,19 +41,27 @@ void output_fill(output *output, int amount)
 
 void output_fill_value(output *output, int amount, value value)
 {
-    char bytes[sizeof(value) + 1] = {};
-    memcpy(bytes, &value, sizeof(value));
+    char *span = output_reserve(output, amount);
+    if (!span || !amount) {
+        return;
+    }
     size_t size = value_size(value);
-    while (amount) {
-        if (amount < size) {
-            size = amount;
-        }
-        output_add_values(output, bytes, size);
-        amount -= size;
+    if (size == 1) {
+        memset(span, (int)value & 0xff, amount);
+        return;
+    }
+    /* write the pattern once, then keep doubling what is written */
+    size_t total = (size_t)amount;
+    size_t written = size < total ? size : total;
+    memcpy(span, &value, written);
+    while (written < total) {
+        size_t copy = written < total - written ? written : total - written;
+        memcpy(span + written, span, copy);
+        written += copy;
     }
 }
 
-void output_add_values(output *output, const char *values, size_t size)
+char *output_reserve(output *output, size_t size)
 {
     if (output->pc < output->start) {
         output->start = output->pc;
@@ -61,16 +69,25 @@ void output_add_values(output *output, const char *values, size_t size)
     if (output->pc + size >= 0x10000) {
         if (output->pc_overflow_handler.callback) {
             output->pc_overflow_handler.callback(output, output->pc_overflow_handler.data);
-            return;
+            return NULL;
         }
         tiny_error(NULL, ERROR_MODE_PANIC, "Program counter overflow.");
     }
-    memcpy(output->buffer + output->pc, values, size);
+    char *span = output->buffer + output->pc;
     output->pc += size;
     output->logical_pc += size;
     if (output->pc > output->end) {
         output->end = output->pc;
     }
+    return span;
+}
+
+void output_add_values(output *output, const char *values, size_t size)
+{
+    char *span = output_reserve(output, size);
+    if (span) {
+        memcpy(span, values, size);
+    }
 }
 
 void output_set_overflow_handler(output *out, overflow_handler_callback callback, void *user_data)
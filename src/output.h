@@ -42,4 +42,8 @@ void output_fill(output *output, int amount);
 void output_fill_value(output *output, int amount, value value);
 void output_add_values(output *output, const char *values, size_t size);
 
+/* move the program counter past size bytes at once and return them for writing in place,
+   or NULL if they would overflow */
+char *output_reserve(output *output, size_t size);
+
 #endif /* output_h */
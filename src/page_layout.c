@@ -0,0 +1,477 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "assembly_context.h"
+#include "error.h"
+#include "expression.h"
+#include "memory.h"
+#include "operand.h"
+#include "page_layout.h"
+#include "program.h"
+#include "simulator.h"
+#include "source_manager.h"
+#include "statement.h"
+#include "token.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE_SIZE   256
+
+/* a run of a region's statements, either a block or the statements between blocks */
+typedef struct region_slot
+{
+    size_t first;
+    size_t last;
+    int block;
+
+} region_slot;
+
+typedef struct region_scan
+{
+    page_layout *layout;
+    program *program;
+    region_slot *slots;
+    size_t count;
+    size_t capacity;
+
+} region_scan;
+
+page_layout *page_layout_create(void)
+{
+    page_layout *layout = tiny_calloc(1, sizeof(page_layout));
+    layout->open = PAGE_LAYOUT_NO_BLOCK;
+    return layout;
+}
+
+void page_layout_destroy(page_layout *layout)
+{
+    if (!layout) {
+        return;
+    }
+    tiny_free(layout->reads);
+    tiny_free(layout->blocks);
+    tiny_free(layout);
+}
+
+void page_layout_reset(page_layout *layout)
+{
+    layout->current = 0;
+    layout->open = PAGE_LAYOUT_NO_BLOCK;
+    layout->read_count = 0;
+}
+
+static int padding(int pc, int need)
+{
+    int offset = pc & (PAGE_SIZE - 1);
+    if (!need || need > PAGE_SIZE || offset + need <= PAGE_SIZE) {
+        return 0;
+    }
+    return PAGE_SIZE - offset;
+}
+
+int page_layout_begin(page_layout *layout, const token *directive, int span, int pc)
+{
+    if (layout->open != PAGE_LAYOUT_NO_BLOCK) {
+        return -1;
+    }
+    if (layout->current == layout->count) {
+        /* the first pass finds the blocks */
+        if (layout->count == layout->capacity) {
+            layout->capacity = layout->capacity ? layout->capacity * 2 : 16;
+            layout->blocks = tiny_realloc(layout->blocks, layout->capacity * sizeof(page_block));
+        }
+        layout->blocks[layout->count++] = (page_block){ .directive = directive };
+    }
+    page_block *block = layout->blocks + layout->current;
+    layout->open = (int)layout->current++;
+    block->span = span;
+    block->padding = padding(pc, span ? span : block->size);
+    block->address = pc + block->padding;
+    return block->padding;
+}
+
+int page_layout_end(page_layout *layout, int pc, int *size)
+{
+    if (layout->open == PAGE_LAYOUT_NO_BLOCK) {
+        return -1;
+    }
+    page_block *block = layout->blocks + layout->open;
+    layout->open = PAGE_LAYOUT_NO_BLOCK;
+    *size = pc - block->address;
+    int resized = *size != block->size;
+    block->size = *size;
+    return resized;
+}
+
+void page_layout_add_read(page_layout *layout, int address, int pc)
+{
+    if (layout->read_count == layout->read_capacity) {
+        layout->read_capacity = layout->read_capacity ? layout->read_capacity * 2 : 64;
+        layout->reads = tiny_realloc(layout->reads, layout->read_capacity * sizeof(page_read));
+    }
+    layout->reads[layout->read_count++] = (page_read){ address, pc };
+}
+
+static int directive_at(const program *program, size_t index)
+{
+    if (program->kinds[index] != PROGRAM_KIND_PSEUDO_OP) {
+        return 0;
+    }
+    return program->statements[index]->instruction->type;
+}
+
+static void add_slot(region_scan *scan, size_t first, size_t last, int block)
+{
+    if (scan->count == scan->capacity) {
+        scan->capacity = scan->capacity ? scan->capacity * 2 : 16;
+        scan->slots = tiny_realloc(scan->slots, scan->capacity * sizeof(region_slot));
+    }
+    scan->slots[scan->count++] = (region_slot){ first, last, block };
+}
+
+static int slot_size(const program *program, const region_slot *slot)
+{
+    int size = 0;
+    for(size_t i = slot->first; i <= slot->last; i++) {
+        size += program->sizes[i];
+    }
+    return size;
+}
+
+static int block_need(const page_block *block)
+{
+    return block->span ? block->span : block->size;
+}
+
+/* stops at a '+' or '-' label, which a block can only refer to outside it */
+static expression_visit_result find_anonymous(const expression *expr, void *unused)
+{
+    if (expr->type == TYPE_IDENT) {
+        TOKEN_GET_TEXT(expr->token, name);
+        if (name[0] == '+' || name[0] == '-') {
+            return EXPRESSION_VISIT_STOP;
+        }
+    }
+    return EXPRESSION_VISIT_CHILDREN;
+}
+
+/* moving blocks must not change how their labels resolve */
+static int can_reorder(const region_scan *scan, const token *region_directive)
+{
+    const program *program = scan->program;
+    for(size_t s = 0; s < scan->count; s++) {
+        const region_slot *slot = scan->slots + s;
+        int scoped = 0;
+        for(size_t i = slot->first; i <= slot->last; i++) {
+            int directive = directive_at(program, i);
+            if (directive == TOKEN_COMPRESS || directive == TOKEN_ENDCOMPRESS) {
+                /* a compressed block is not laid out where it runs, and moving one would move its bytes */
+                tiny_warn(region_directive, "Page region has a compressed block and is kept in order");
+                return 0;
+            }
+            if (slot->block == PAGE_LAYOUT_NO_BLOCK) {
+                continue;
+            }
+            if (operand_visit(program->operands[i], find_anonymous, NULL)) {
+                tiny_warn(region_directive, "Page region has a block that refers to anonymous labels outside it and is kept in order");
+                return 0;
+            }
+            const token *label = program->statements[i]->label;
+            if (!label) {
+                continue;
+            }
+            if (label->type == TOKEN_PLUS || label->type == TOKEN_HYPHEN) {
+                tiny_warn(region_directive, "Page region has a block with anonymous labels and is kept in order");
+                return 0;
+            }
+            if (program->labels[i] == PROGRAM_NO_LABEL) {
+                continue;
+            }
+            if (PROGRAM_LABEL_IS_LOCAL(program->labels[i]) && !scoped) {
+                tiny_warn(region_directive, "Page region has a block whose local labels belong to the code before it and is kept in order");
+                return 0;
+            }
+            scoped = 1;
+        }
+    }
+    return 1;
+}
+
+/* lay the region out from pc, choosing for each block slot the block that needs the least padding
+   and of those the largest, and return the total padding */
+static int place_blocks(const region_scan *scan, int pc, int *chosen)
+{
+    const page_layout *layout = scan->layout;
+    int total = 0;
+    size_t blocks = 0;
+    for(size_t s = 0; s < scan->count; s++) {
+        if (scan->slots[s].block != PAGE_LAYOUT_NO_BLOCK) {
+            chosen[blocks++] = PAGE_LAYOUT_NO_BLOCK;
+        }
+    }
+    size_t slot_block = 0;
+    for(size_t s = 0; s < scan->count; s++) {
+        const region_slot *slot = scan->slots + s;
+        if (slot->block == PAGE_LAYOUT_NO_BLOCK) {
+            pc += slot_size(scan->program, slot);
+            continue;
+        }
+        int best = PAGE_LAYOUT_NO_BLOCK, best_padding = 0;
+        for(size_t s2 = 0; s2 < scan->count; s2++) {
+            int candidate = scan->slots[s2].block;
+            if (candidate == PAGE_LAYOUT_NO_BLOCK) {
+                continue;
+            }
+            int placed = 0;
+            for(size_t c = 0; c < slot_block && !placed; c++) {
+                placed = chosen[c] == (int)s2;
+            }
+            if (placed) {
+                continue;
+            }
+            int pad = padding(pc, block_need(layout->blocks + candidate));
+            if (best == PAGE_LAYOUT_NO_BLOCK || pad < best_padding ||
+                (pad == best_padding && layout->blocks[candidate].size > layout->blocks[scan->slots[best].block].size)) {
+                best = (int)s2;
+                best_padding = pad;
+            }
+        }
+        chosen[slot_block++] = best;
+        total += best_padding;
+        pc += best_padding + layout->blocks[scan->slots[best].block].size;
+    }
+    return total;
+}
+
+static int source_padding(const region_scan *scan, int pc)
+{
+    int total = 0;
+    for(size_t s = 0; s < scan->count; s++) {
+        const region_slot *slot = scan->slots + s;
+        if (slot->block != PAGE_LAYOUT_NO_BLOCK) {
+            int pad = padding(pc, block_need(scan->layout->blocks + slot->block));
+            total += pad;
+            pc += pad;
+        }
+        pc += slot_size(scan->program, slot);
+    }
+    return total;
+}
+
+static void arrange_region(region_scan *scan, size_t first, size_t end, const token *region_directive)
+{
+    page_layout *layout = scan->layout;
+    program *program = scan->program;
+    size_t block_count = 0;
+    for(size_t s = 0; s < scan->count; s++) {
+        block_count += scan->slots[s].block != PAGE_LAYOUT_NO_BLOCK;
+    }
+    if (block_count < 2 || !can_reorder(scan, region_directive)) {
+        return;
+    }
+    int *chosen = tiny_malloc(block_count * sizeof(int));
+    if (place_blocks(scan, program->pcs[first], chosen) >= source_padding(scan, program->pcs[first])) {
+        tiny_free(chosen);
+        return;
+    }
+    size_t *order = tiny_malloc((end - first) * sizeof(size_t));
+    page_block *blocks = tiny_malloc(block_count * sizeof(page_block));
+    size_t n = 0, b = 0;
+    int first_block = PAGE_LAYOUT_NO_BLOCK;
+    for(size_t s = 0; s < scan->count; s++) {
+        const region_slot *slot = scan->slots + s;
+        if (slot->block != PAGE_LAYOUT_NO_BLOCK) {
+            if (first_block == PAGE_LAYOUT_NO_BLOCK) {
+                first_block = slot->block;
+            }
+            /* the block slots take the chosen blocks in turn */
+            if (chosen[b] != (int)s) {
+                layout->moved++;
+            }
+            slot = scan->slots + chosen[b];
+            blocks[b++] = layout->blocks[slot->block];
+        }
+        for(size_t i = slot->first; i <= slot->last; i++) {
+            order[n++] = i;
+        }
+    }
+    /* the blocks are assembled in their new order */
+    memcpy(layout->blocks + first_block, blocks, block_count * sizeof(page_block));
+    program_unshare(program);
+    program_reorder(program, first, order, n);
+    tiny_free(blocks);
+    tiny_free(order);
+    tiny_free(chosen);
+}
+
+size_t page_layout_arrange(page_layout *layout, program *program, assembly_context *context)
+{
+    region_scan scan = { .layout = layout, .program = program };
+    size_t region_first = 0, block_first = 0, fixed_first = 0;
+    const token *region_directive = NULL, *block_directive = NULL;
+    int next_block = 0;
+    for(size_t i = 0; i < program->count; i++) {
+        int directive = directive_at(program, i);
+        const token *directive_token = directive ? program->statements[i]->instruction : NULL;
+        switch (directive) {
+            case TOKEN_PAGEREGION:
+                if (region_directive) {
+                    tiny_error(directive_token, ERROR_MODE_RECOVER, "Page regions cannot be nested");
+                    continue;
+                }
+                region_directive = directive_token;
+                region_first = fixed_first = i + 1;
+                scan.count = 0;
+                continue;
+            case TOKEN_ENDPAGEREGION:
+                if (!region_directive) {
+                    tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive \".endpageregion\" without a matching \".pageregion\"");
+                    continue;
+                }
+                if (block_directive) {
+                    tiny_error(block_directive, ERROR_MODE_RECOVER, "Page-sensitive block is missing \".endpagesafe\"");
+                    block_directive = NULL;
+                }
+                if (fixed_first < i) {
+                    add_slot(&scan, fixed_first, i - 1, PAGE_LAYOUT_NO_BLOCK);
+                }
+                if (!tiny_error_count()) {
+                    arrange_region(&scan, region_first, i, region_directive);
+                }
+                region_directive = NULL;
+                continue;
+            case TOKEN_PAGESAFE:
+                if (region_directive && fixed_first < i) {
+                    add_slot(&scan, fixed_first, i - 1, PAGE_LAYOUT_NO_BLOCK);
+                }
+                if (program->statements[i]->label) {
+                    tiny_warn(program->statements[i]->label, "Label is placed before any padding, so it should follow \".pagesafe\"");
+                }
+                block_directive = directive_token;
+                block_first = i;
+                continue;
+            case TOKEN_ENDPAGESAFE:
+                if (block_directive && region_directive) {
+                    add_slot(&scan, block_first, i, next_block);
+                }
+                next_block++;
+                block_directive = NULL;
+                fixed_first = i + 1;
+                continue;
+            default:
+                continue;
+        }
+    }
+    if (block_directive) {
+        tiny_error(block_directive, ERROR_MODE_RECOVER, "Page-sensitive block is missing \".endpagesafe\"");
+    }
+    if (region_directive) {
+        tiny_error(region_directive, ERROR_MODE_RECOVER, "Page region is missing \".endpageregion\"");
+    }
+    tiny_free(scan.slots);
+    return layout->moved;
+}
+
+static int is_data(int directive)
+{
+    switch (directive) {
+        case TOKEN_BINARY: case TOKEN_BYTE: case TOKEN_CSTRING: case TOKEN_DWORD:
+        case TOKEN_FILL: case TOKEN_JUMPTABLE: case TOKEN_LONG: case TOKEN_LSTRING: case TOKEN_NSTRING:
+        case TOKEN_PSTRING: case TOKEN_RTSTABLE: case TOKEN_STRING: case TOKEN_WORD:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int compare_reads(const void *lhs, const void *rhs)
+{
+    int l = ((const page_read*)lhs)->address, r = ((const page_read*)rhs)->address;
+    return l < r ? -1 : l > r;
+}
+
+/* the extra cycles the profiled run spent on indexed reads of the table crossing a page */
+static unsigned long hot_crossings(const page_layout *layout, const simulator *profiled, int start, int end)
+{
+    size_t lo = 0, hi = layout->read_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (layout->reads[mid].address < start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    unsigned long crossings = 0;
+    for(; lo < layout->read_count && layout->reads[lo].address < end; lo++) {
+        crossings += profiled->page_crossings[layout->reads[lo].pc & 0xffff];
+    }
+    return crossings;
+}
+
+void page_layout_check(page_layout *layout, const program *program, const simulator *profiled)
+{
+    if (!layout->read_count || !profiled || !profiled->page_crossings) {
+        return;
+    }
+    qsort(layout->reads, layout->read_count, sizeof(page_read), compare_reads);
+    int in_block = 0;
+    for(size_t i = 0; i < program->count; i++) {
+        int directive = directive_at(program, i);
+        if (directive == TOKEN_PAGESAFE || directive == TOKEN_ENDPAGESAFE) {
+            in_block = directive == TOKEN_PAGESAFE;
+            continue;
+        }
+        const token *label = program->statements[i]->label;
+        if (in_block || !label || label->type != TOKEN_IDENT ||
+            (program->kinds[i] != PROGRAM_KIND_LABEL && !is_data(directive))) {
+            continue;
+        }
+        /* the table runs until the next label or anything that is not data */
+        size_t first = program->kinds[i] == PROGRAM_KIND_LABEL ? i + 1 : i, last = first;
+        while (last < program->count && is_data(directive_at(program, last)) &&
+               (last == i || !program->statements[last]->label)) {
+            last++;
+        }
+        if (last == first) {
+            continue;
+        }
+        int start = program->pcs[first];
+        int end = program->pcs[last - 1] + program->sizes[last - 1];
+        if (end - start > PAGE_SIZE || start / PAGE_SIZE == (end - 1) / PAGE_SIZE) {
+            continue;
+        }
+        unsigned long crossings = hot_crossings(layout, profiled, start, end);
+        if (!crossings) {
+            continue;
+        }
+        TOKEN_GET_TEXT(label, name);
+        tiny_warn(label, "Table '%s' crosses a page boundary at $%04x and its indexed reads crossed it %lu times while profiling",
+            name, (end - 1) & 0xff00, crossings);
+    }
+}
+
+void page_layout_report(const page_layout *layout, FILE *stream)
+{
+    if (!layout->count) {
+        return;
+    }
+    fputs("---------------------------------\nPage-sensitive blocks:\n", stream);
+    int padding = 0;
+    for(size_t i = 0; i < layout->count; i++) {
+        const page_block *block = layout->blocks + i;
+        source_location where = source_manager_decode(block->directive->loc);
+        if (where.file_name) {
+            fprintf(stream, "%s(%d): ", where.file_name, where.line);
+        }
+        fprintf(stream, "%d bytes at $%04x, %d bytes of padding\n", block->size, block->address & 0xffff, block->padding);
+        padding += block->padding;
+    }
+    fprintf(stream, "%zu blocks, %zu moved, %d bytes of padding\n", layout->count, layout->moved, padding);
+}
@@ -0,0 +1,85 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef page_layout_h
+#define page_layout_h
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct assembly_context assembly_context;
+typedef struct program program;
+typedef struct simulator simulator;
+typedef struct token token;
+
+#define PAGE_LAYOUT_NO_BLOCK    -1
+
+/* a table or block of code between .pagesafe and .endpagesafe */
+typedef struct page_block
+{
+    const token *directive;
+    int span;
+    int size;
+    int address;
+    int padding;
+
+} page_block;
+
+/* an absolute indexed read of address by the instruction at pc */
+typedef struct page_read
+{
+    int address;
+    int pc;
+
+} page_read;
+
+/* the page-sensitive blocks of a program, in the order they are assembled */
+typedef struct page_layout
+{
+    page_block *blocks;
+    size_t count;
+    size_t capacity;
+    size_t current;
+    int open;
+    size_t moved;
+    page_read *reads;
+    size_t read_count;
+    size_t read_capacity;
+
+} page_layout;
+
+page_layout *page_layout_create(void);
+void page_layout_destroy(page_layout *layout);
+
+/* start the blocks and the indexed reads over for a new pass */
+void page_layout_reset(page_layout *layout);
+
+/* open the next block at pc, where span is the number of bytes that must share a page or 0 for
+   the whole block; returns the padding needed before it, or -1 if a block is already open */
+int page_layout_begin(page_layout *layout, const token *directive, int span, int pc);
+
+/* close the open block at pc and set its size; returns 1 if the size changed since the last pass,
+   or -1 if no block is open */
+int page_layout_end(page_layout *layout, int pc, int *size);
+
+/* note an absolute indexed read of an address by the instruction at pc that costs a cycle when
+   it crosses a page */
+void page_layout_add_read(page_layout *layout, int address, int pc);
+
+/* reorder the blocks of each .pageregion using the sizes of the first pass so that they
+   need the least padding; returns the number of blocks moved */
+size_t page_layout_arrange(page_layout *layout, program *program, assembly_context *context);
+
+/* warn about tables outside any block that cross a page and whose indexed reads crossed it
+   while profiling */
+void page_layout_check(page_layout *layout, const program *program, const simulator *profiled);
+
+void page_layout_report(const page_layout *layout, FILE *stream);
+
+#endif /* page_layout_h */
@@ -7,14 +7,19 @@
 *
 */
 
+#include "conditional.h"
+#include "encoding.h"
 #include "error.h"
 #include "expression.h"
 #include "file.h"
+#include "inline_proc.h"
 #include "lexer.h"
 #include "macro.h"
 #include "memory.h"
 #include "operand.h"
 #include "parser.h"
+#include "prefetch.h"
+#include "source_manager.h"
 #include "statement.h"
 #include "string_htable.h"
 #include "token.h"
@@ -229,6 +234,42 @@ static const char *token_type_names[TOKEN_TYPE_NUM] =
     ".relocate",
     ".endrelocate",
     ".dp",
+    ".pron",
+    ".proff",
+    ".cyclelimit",
+    ".cycleexact",
+    ".test",
+    ".given",
+    ".expect",
+    ".endtest",
+    ".opton",
+    ".optoff",
+    ".zpvar",
+    ".zprange",
+    ".pagesafe",
+    ".endpagesafe",
+    ".pageregion",
+    ".endpageregion",
+    ".inline",
+    ".endinline",
+    ".proc",
+    ".endproc",
+    ".export",
+    ".repeat",
+    ".endrepeat",
+    ".for",
+    ".endfor",
+    ".if",
+    ".ifdef",
+    ".ifndef",
+    ".else",
+    ".endif",
+    ".encoding",
+    ".map",
+    ".compress",
+    ".endcompress",
+    ".jumptable",
+    ".rtstable",
     ".string",
     ".cstring",
     ".lstring",
@@ -271,17 +312,38 @@ static op_descriptor BINARY_OPERATORS[] =
 
 static const token_type pseudo_op_no_operand[] =
 {
+    TOKEN_ELSE,
+    TOKEN_ENDCOMPRESS,
+    TOKEN_ENDFOR,
+    TOKEN_ENDIF,
+    TOKEN_ENDINLINE,
+    TOKEN_ENDPAGEREGION,
+    TOKEN_ENDPAGESAFE,
+    TOKEN_ENDPROC,
     TOKEN_ENDRELOCATE,
+    TOKEN_ENDREPEAT,
+    TOKEN_ENDTEST,
+    TOKEN_INLINE,
     TOKEN_M8,
     TOKEN_M16,
     TOKEN_MX8,
     TOKEN_MX16,
+    TOKEN_OPTOFF,
+    TOKEN_OPTON,
+    TOKEN_PAGEREGION,
+    TOKEN_PROC,
     TOKEN_PROFF,
     TOKEN_PRON,
     TOKEN_X8,
     TOKEN_X16
 };
 
+static const token_type pseudo_op_optional_operand[] =
+{
+    TOKEN_COMPRESS,
+    TOKEN_PAGESAFE
+};
+
 static const token_type byte_extractors[] =
 {
     TOKEN_AMPERSAND, TOKEN_CARET, TOKEN_LANGLE, TOKEN_RANGLE
@@ -308,6 +370,15 @@ const token_type expression_types[] =
     TOKEN_TILDE
 };
 
+/* a conditional block being parsed */
+typedef struct parser_condition
+{
+    token *directive;
+    int state;
+    int else_seen;
+
+} parser_condition;
+
 typedef struct parser
 {
     size_t start_position;
@@ -318,6 +389,20 @@ typedef struct parser
     dynamic_array *token_buffer;
     token *current_token;
     string_htable *macro_defs;
+    string_htable *inline_procs;
+    inline_proc *inline_open;
+    size_t inline_first;
+    int inline_limit;
+    int inline_budget;
+    int inline_growth;
+    parser_condition *conditions;
+    size_t condition_count;
+    size_t condition_capacity;
+    parser_condition_callback decide;
+    void *decide_data;
+    int skip_tokens;
+    encoding_set *encodings;
+    token default_value;
     lexer *lexer;
 } parser;
 
@@ -448,6 +533,8 @@ static pseudo_op_arg_array *parse_pseudo_op_args(parser *parser)
             }
             arg->arg.expression = expr;
         }
+        /* only a leading argument can be an assignment */
+        parser->expect_assignment = 0;
         dynamic_array_add(args, arg);
         if (!match(parser, TOKEN_COMMA)) {
             break;
@@ -810,6 +897,9 @@ static statement *macro_expand(parser *parser, statement *statement)
         error(parser, statement->instruction, "Macro definition requires more parameters than provided");
         goto destroy_and_parse;
     }
+    if (parser->inline_open) {
+        inline_proc_reject(parser->inline_open, "it includes a file or uses a macro");
+    }
     dynamic_array *expanded = macro_expand_macro(statement->label, statement->instruction, params, m, parser->lexer);
     eos(parser);
     if (expanded->count) {
@@ -923,6 +1013,9 @@ static statement *macro_def(parser *parser, statement *statement)
 
 static statement *include(parser *parser, statement *statement)
 {
+    if (parser->inline_open) {
+        inline_proc_reject(parser->inline_open, "it includes a file or uses a macro");
+    }
     token *inc_name = parser->current_token;
     if (!match(parser, TOKEN_STRINGLITERAL)) {
         expect(parser, TOKEN_STRINGLITERAL);
@@ -938,7 +1031,7 @@ static statement *include(parser *parser, statement *statement)
         statement_destroy(statement);
         return parse_statement(parser);
     }
-    source_file sf = source_file_read(include_file + 1);
+    source_file sf = prefetch_source_read(include_file + 1);
     if (sf.lines) {
         dynamic_array *included = lexer_include_and_process(parser->lexer, &sf);
         eat(parser);
@@ -975,15 +1068,15 @@ expression *assign_expression(parser *parser, statement *assign)
         static token equal = {
             .type = TOKEN_EQUAL
         };
-        static token default_val = {
-            .src = {
-                .ref = "1",
-                .start = 0,
-                .end = 1
-            },
-            .type = TOKEN_DECLITERAL
-        };
-        return expression_binary(&equal, expression_literal_ident(assign->label, 1), expression_literal_ident(&default_val, 0));
+        if (parser->default_value.loc == SOURCE_LOC_INVALID) {
+            /* each parser adds the text of its "1" once; it lives no longer than the source manager */
+            parser->default_value = (token){
+                .type = TOKEN_DECLITERAL,
+                .length = 1,
+                .loc = source_manager_add_line(source_manager_add_file(NULL, SOURCE_LOC_INVALID), "1", 0, 2)
+            };
+        }
+        return expression_binary(&equal, expression_literal_ident(assign->label, 1), expression_literal_ident(&parser->default_value, 0));
     }
     return NULL;
 }
@@ -1016,9 +1109,260 @@ statement *parse_assignment(parser *parser)
     }
     eos(parser);
     stat->index = parser->statements++;
+    if (parser->inline_open) {
+        inline_proc_add_statement(parser->inline_open, stat);
+    }
     return stat;
 }
 
+static void begin_inline(parser *parser, const statement *statement)
+{
+    if (parser->inline_open) {
+        tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Inline procedures cannot be nested");
+        return;
+    }
+    if (!statement->label || statement->label->type != TOKEN_IDENT || *token_get_text(statement->label) == '_') {
+        tiny_error(statement->instruction, ERROR_MODE_RECOVER, "\".inline\" directive requires a label that is not local");
+        return;
+    }
+    parser->inline_open = inline_proc_create(statement->label, parser->inline_procs->case_sensitive);
+    /* the body starts with the token after the directive's line */
+    parser->inline_first = parser->position - 1;
+}
+
+static void end_inline(parser *parser, const statement *statement)
+{
+    inline_proc *proc = parser->inline_open;
+    if (!proc) {
+        tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".endinline\" without a matching \".inline\"");
+        return;
+    }
+    parser->inline_open = NULL;
+    const token *first_token = statement->label ? statement->label : statement->instruction;
+    size_t end = parser->position;
+    while (end > parser->inline_first && parser->token_buffer->data[end - 1] != first_token) {
+        end--;
+    }
+    TOKEN_GET_TEXT(proc->name, name);
+    if (end > parser->inline_first && inline_proc_finish(proc, parser->token_buffer, parser->inline_first, end - 1)) {
+        if (!string_htable_contains(parser->inline_procs, name)) {
+            string_htable_add(parser->inline_procs, name, (const htable_value_ptr)proc);
+            /* the table holds a copy of the procedure, not its contents */
+            tiny_free(proc);
+            return;
+        }
+    } else {
+        tiny_warn(proc->name, "Procedure '%s' is never inlined because %s", name,
+            proc->rejection ? proc->rejection : "it is empty");
+    }
+    inline_proc_destroy(proc);
+}
+
+/* skip a block the lexer has already tokenized, as from an include or a macro, up to its .else or .endif */
+static void skip_tokens(parser *parser)
+{
+    parser->skip_tokens = 0;
+    int depth = 0;
+    while (!match(parser, TOKEN_EOF)) {
+        token_type type = parser->current_token->type;
+        if (type == TOKEN_IF || type == TOKEN_IFDEF || type == TOKEN_IFNDEF) {
+            depth++;
+        } else if ((type == TOKEN_ELSE && !depth) || (type == TOKEN_ENDIF && !depth--)) {
+            return;
+        }
+        eat(parser);
+    }
+}
+
+static void skip_block(parser *parser)
+{
+    if (match(parser, TOKEN_NEWLINE) && parser->position == parser->token_buffer->count) {
+        /* the rest of the block is still only source text, so it is skipped line by line */
+        lexer_skip_block(parser->lexer);
+        return;
+    }
+    parser->skip_tokens = 1;
+}
+
+static void track_condition(parser *parser, const statement *statement)
+{
+    parser_condition *open = parser->condition_count ? parser->conditions + parser->condition_count - 1 : NULL;
+    switch (statement->instruction->type) {
+        case TOKEN_IF:
+        case TOKEN_IFDEF:
+        case TOKEN_IFNDEF: {
+            int state = CONDITIONAL_UNKNOWN;
+            if (parser->decide && statement->operand && (!open || open->state != CONDITIONAL_UNKNOWN)) {
+                state = parser->decide(parser->decide_data, statement);
+            }
+            if (parser->condition_count == parser->condition_capacity) {
+                parser->condition_capacity = parser->condition_capacity ? parser->condition_capacity * 2 : 16;
+                parser->conditions = tiny_realloc(parser->conditions, parser->condition_capacity * sizeof(parser_condition));
+            }
+            parser->conditions[parser->condition_count++] = (parser_condition){ .directive = statement->instruction, .state = state };
+            if (state == CONDITIONAL_FALSE) {
+                skip_block(parser);
+            }
+            break;
+        }
+        case TOKEN_ELSE:
+            if (!open) {
+                tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".else\" without a matching \".if\"");
+            } else if (open->else_seen) {
+                tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".else\" already seen for this \".if\"");
+            } else {
+                open->else_seen = 1;
+                if (open->state == CONDITIONAL_TRUE) {
+                    skip_block(parser);
+                }
+            }
+            break;
+        case TOKEN_ENDIF:
+            if (!open) {
+                tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".endif\" without a matching \".if\"");
+            } else {
+                parser->condition_count--;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static const pseudo_op_arg *string_arg(const statement *statement, size_t index)
+{
+    const pseudo_op_arg *arg = (const pseudo_op_arg*)statement->operand->pseudo_op_arg_args.args->data[index];
+    if (arg->arg_type != PSEUDO_OP_EXPRESSION || arg->arg.expression->type != TYPE_LITERAL ||
+        arg->arg.expression->token->type != TOKEN_STRINGLITERAL) {
+        return NULL;
+    }
+    return arg;
+}
+
+static void select_encoding(parser *parser, const statement *statement)
+{
+    const pseudo_op_arg *arg = string_arg(statement, 0);
+    if (statement->operand->pseudo_op_arg_args.args->count != 1 || !arg) {
+        tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".encoding\" expects the name of an encoding");
+        return;
+    }
+    char name[TOKEN_TEXT_MAX_LEN] = {};
+    size_t len = token_copy_text_to_buffer(arg->arg.expression->token, name, TOKEN_TEXT_MAX_LEN);
+    name[len - 1] = '\0';
+    encoding_select(parser->encodings, name + 1);
+}
+
+static void map_encoding(parser *parser, const statement *statement)
+{
+    const pseudo_op_arg_array *args = statement->operand->pseudo_op_arg_args.args;
+    if (!parser->encodings->current) {
+        tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".map\" requires an encoding other than \"none\"");
+        return;
+    }
+    const pseudo_op_arg *first = args->data[0];
+    const pseudo_op_arg *byte = args->count == 2 ? args->data[1] : NULL;
+    long range[2] = { -1, -1 };
+    int count = 0;
+    if (string_arg(statement, 0)) {
+        count = encoding_characters(first->arg.expression->token, range, 2);
+    } else if (first->arg_type == PSEUDO_OP_EXPRESSION && first->arg.expression->value != VALUE_UNDEFINED) {
+        range[0] = (long)first->arg.expression->value;
+        count = 1;
+    }
+    if (count == 1) {
+        range[1] = range[0];
+    }
+    if (!byte || byte->arg_type != PSEUDO_OP_EXPRESSION || byte->arg.expression->value == VALUE_UNDEFINED ||
+        count < 1 || count > 2) {
+        tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".map\" expects a character or a range of two and a constant byte");
+        return;
+    }
+    value byte_value = byte->arg.expression->value;
+    if (byte_value < 0 || byte_value > UINT8_MAX || !encoding_map(parser->encodings->current, range[0], range[1], (int)byte_value)) {
+        tiny_error(expression_get_lhs_token(byte->arg.expression), ERROR_MODE_RECOVER, "Illegal quantity");
+    }
+}
+
+/* apply .encoding and .map as they are parsed, and encode the strings of string directives for the encoding in effect */
+static void track_encoding(parser *parser, const statement *statement)
+{
+    token_type type = statement->instruction->type;
+    if (!statement->operand || (type != TOKEN_ENCODING && type != TOKEN_MAP && type != TOKEN_STRINGIFY &&
+        (type < TOKEN_STRING || type > TOKEN_PSTRING))) {
+        return;
+    }
+    if (type == TOKEN_ENCODING || type == TOKEN_MAP) {
+        if (parser->condition_count && parser->conditions[parser->condition_count - 1].state == CONDITIONAL_UNKNOWN) {
+            tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Encodings cannot change in a block whose condition is not known while parsing");
+        } else if (type == TOKEN_ENCODING) {
+            select_encoding(parser, statement);
+        } else {
+            map_encoding(parser, statement);
+        }
+        return;
+    }
+    for(size_t i = 0; i < statement->operand->pseudo_op_arg_args.args->count; i++) {
+        const pseudo_op_arg *arg = string_arg(statement, i);
+        if (arg) {
+            encoding_encode(parser->encodings, (token*)arg->arg.expression->token);
+        }
+    }
+}
+
+static void track_inline(parser *parser, const statement *statement)
+{
+    if (statement->instruction && statement->instruction->type == TOKEN_INLINE) {
+        begin_inline(parser, statement);
+    } else if (statement->instruction && statement->instruction->type == TOKEN_ENDINLINE) {
+        end_inline(parser, statement);
+    } else if (parser->inline_open) {
+        inline_proc_add_statement(parser->inline_open, statement);
+    }
+}
+
+/* the inline procedure a jsr calls, if the call is small enough to inline */
+static inline_proc *inline_target(parser *parser, const statement *statement)
+{
+    const operand *oper = statement->operand;
+    if (!parser->inline_procs->count || !oper || oper->form != FORM_ZP_ABSOLUTE ||
+        oper->single_expression.bitwidth || oper->single_expression.expr->type != TYPE_IDENT) {
+        return NULL;
+    }
+    TOKEN_GET_TEXT(oper->single_expression.expr->token, name);
+    inline_proc *proc = (inline_proc*)string_htable_get(parser->inline_procs, name);
+    if (!proc) {
+        return NULL;
+    }
+    proc->calls++;
+    int growth = proc->size - INLINE_PROC_CALL_SIZE;
+    if (proc->size > parser->inline_limit ||
+        (growth > 0 && parser->inline_growth + growth > parser->inline_budget)) {
+        return NULL;
+    }
+    if (growth > 0) {
+        parser->inline_growth += growth;
+    }
+    proc->inlined++;
+    return proc;
+}
+
+static statement *inline_expand(parser *parser, statement *statement, inline_proc *proc)
+{
+    if (parser->inline_open) {
+        inline_proc_reject(parser->inline_open, "it calls a procedure that was inlined");
+    }
+    dynamic_array *expanded = macro_expand_macro(statement->label, statement->instruction, NULL, proc->body, parser->lexer);
+    eos(parser);
+    if (expanded->count) {
+        parser->position--;
+        dynamic_array_insert_range(parser->token_buffer, expanded, parser->position);
+        eat(parser);
+    }
+    dynamic_array_destroy(expanded);
+    statement_destroy(statement);
+    return parse_statement(parser);
+}
+
 /*stat :: eos? **/
 statement *parse_statement(parser *parser)
 {
@@ -1027,6 +1371,15 @@ statement *parse_statement(parser *parser)
     token *instruction = NULL;
     if (is_eos(parser)) {
         if (match(parser, TOKEN_EOF)) {
+            if (parser->inline_open) {
+                tiny_error(parser->inline_open->name, ERROR_MODE_RECOVER, "Inline procedure is missing \".endinline\"");
+                inline_proc_destroy(parser->inline_open);
+                parser->inline_open = NULL;
+            }
+            for(size_t i = 0; i < parser->condition_count; i++) {
+                tiny_error(parser->conditions[i].directive, ERROR_MODE_RECOVER, "Conditional block is missing \".endif\"");
+            }
+            parser->condition_count = 0;
             return NULL;
         }
         eos(parser);
@@ -1081,6 +1434,10 @@ statement *parse_statement(parser *parser)
             token_type mnemonic = statement->instruction->type;
             statement->operand = parse_operand(parser,
                 mnemonic == TOKEN_BBR || mnemonic == TOKEN_BBS || mnemonic == TOKEN_RMB || mnemonic == TOKEN_SMB);
+            inline_proc *proc = mnemonic == TOKEN_JSR ? inline_target(parser, statement) : NULL;
+            if (proc) {
+                return inline_expand(parser, statement, proc);
+            }
         } else {
             int no_operand = token_is_of_type(statement->instruction, pseudo_op_no_operand, sizeof pseudo_op_no_operand);
             if (!is_eos(parser)) {
@@ -1088,17 +1445,18 @@ statement *parse_statement(parser *parser)
                     error(parser, parser->current_token, "Unexpected expression");
                     goto finish;
                 }
+                parser->expect_assignment = statement->instruction->type == TOKEN_FOR;
                 statement->operand = operand_pseudo_op_args(parse_pseudo_op_args(parser));
-            } else if (!no_operand) {
+            } else if (!no_operand &&
+                !token_is_of_type(statement->instruction, pseudo_op_optional_operand, sizeof pseudo_op_optional_operand)) {
                 error(parser, parser->current_token, "Expression expected");
             }
         }
         goto finish;
     }
     if (instruction->type == TOKEN_DOT && match(parser, TOKEN_IDENT)) {
-        if (parser->current_token->src_line == instruction->src_line &&
-            parser->current_token->src_line_pos == instruction->src_line_pos + 1) {
-            instruction->src.end = parser->current_token->src.end;
+        if (parser->current_token->loc == instruction->loc + 1) {
+            instruction->length = parser->current_token->loc + parser->current_token->length - instruction->loc;
             eat(parser);
             return macro_expand(parser, statement);
         }
@@ -1107,8 +1465,16 @@ statement *parse_statement(parser *parser)
     error(parser, instruction, "Expected mnemonic or directive but found '%s'", instruction_text);
     instruction = NULL;
 finish:
-    eos(parser);
     statement->index = parser->statements++;
+    if (statement->instruction) {
+        track_encoding(parser, statement);
+        track_condition(parser, statement);
+    }
+    eos(parser);
+    if (parser->skip_tokens) {
+        skip_tokens(parser);
+    }
+    track_inline(parser, statement);
     return statement;
 }
 
@@ -1118,14 +1484,36 @@ static void macro_destructor(htable_value_ptr macro_ptr)
     macro_destroy(m);
 }
 
+static void inline_proc_destructor(htable_value_ptr proc_ptr)
+{
+    inline_proc *proc = (inline_proc*)proc_ptr;
+    inline_proc_destroy(proc);
+}
+
 void parser_destroy(parser *parser)
 {
     if (!parser) return;
     string_htable_destroy(parser->macro_defs);
+    string_htable_destroy(parser->inline_procs);
+    inline_proc_destroy(parser->inline_open);
+    encoding_set_destroy(parser->encodings);
+    tiny_free(parser->conditions);
     dynamic_array_cleanup_and_destroy(parser->token_buffer);
     tiny_free(parser);
 }
 
+void parser_set_inlining(parser *parser, int limit, int budget)
+{
+    parser->inline_limit = limit;
+    parser->inline_budget = budget;
+}
+
+void parser_set_condition_callback(parser *parser, parser_condition_callback decide, void *data)
+{
+    parser->decide = decide;
+    parser->decide_data = data;
+}
+
 parser *parser_create(lexer *lexer, int case_sensitive)
 {
     parser *parser = tiny_calloc(1, sizeof(struct parser));
@@ -1133,6 +1521,10 @@ parser *parser_create(lexer *lexer, int case_sensitive)
     parser->macro_defs = string_htable_create(sizeof(macro));
     parser->macro_defs->dtor = macro_destructor;
     parser->macro_defs->case_sensitive = case_sensitive;
+    parser->inline_procs = string_htable_create(sizeof(inline_proc));
+    parser->inline_procs->dtor = inline_proc_destructor;
+    parser->inline_procs->case_sensitive = case_sensitive;
+    parser->encodings = encoding_set_create(case_sensitive);
     parser->lexer = lexer;
     eat(parser);
     return parser;
@@ -19,6 +19,15 @@ parser *parser_create(lexer*,int);
 expression *assign_expression(parser*,statement*);
 statement *parse_assignment(parser*);
 statement *parse_statement(parser*);
+
+/* inline calls to procedures of at most limit bytes, until they have added budget bytes */
+void parser_set_inlining(parser*,int,int);
+
+/* decide a condition as it is parsed: 1 if true, 0 if false, or -1 if it is not known yet */
+typedef int (*parser_condition_callback)(void*,const statement*);
+
+/* skip the inactive blocks of conditions the callback decides */
+void parser_set_condition_callback(parser*,parser_condition_callback,void*);
 void parser_destroy(parser*);
 
 #endif /* parser_h */
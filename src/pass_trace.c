@@ -0,0 +1,122 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "memory.h"
+#include "pass_trace.h"
+#include <inttypes.h>
+#include <string.h>
+
+pass_trace *pass_trace_create(void)
+{
+    return tiny_calloc(1, sizeof(pass_trace));
+}
+
+void pass_trace_destroy(pass_trace *trace)
+{
+    if (!trace) {
+        return;
+    }
+    for(size_t i = 0; i < trace->count; i++) {
+        tiny_free(trace->entries[i].name);
+    }
+    tiny_free(trace->entries);
+    tiny_free(trace);
+}
+
+static void add_entry(pass_trace *trace, int kind, int pass, const char *name, value old_value, value new_value, source_loc loc)
+{
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 32;
+        trace->entries = tiny_realloc(trace->entries, trace->capacity * sizeof(pass_trace_entry));
+    }
+    pass_trace_entry *entry = trace->entries + trace->count++;
+    entry->kind = kind;
+    entry->pass = pass;
+    entry->name = name ? strdup(name) : NULL;
+    entry->old_value = old_value;
+    entry->new_value = new_value;
+    entry->loc = loc;
+}
+
+void pass_trace_unresolved(pass_trace *trace, int pass, const char *name, source_loc loc)
+{
+    /* a forward reference is usually made from many places, only keep the first */
+    for(size_t i = trace->count; i-- > 0 && trace->entries[i].pass == pass; ) {
+        if (trace->entries[i].kind == PASS_TRACE_UNRESOLVED && strcmp(trace->entries[i].name, name) == 0) {
+            return;
+        }
+    }
+    add_entry(trace, PASS_TRACE_UNRESOLVED, pass, name, VALUE_UNDEFINED, VALUE_UNDEFINED, loc);
+}
+
+void pass_trace_symbol(pass_trace *trace, int pass, const char *name, value old_value, value new_value, source_loc loc)
+{
+    add_entry(trace, PASS_TRACE_SYMBOL, pass, name, old_value, new_value, loc);
+}
+
+void pass_trace_size(pass_trace *trace, int pass, int old_size, int new_size, source_loc loc)
+{
+    add_entry(trace, PASS_TRACE_SIZE, pass, NULL, old_size, new_size, loc);
+}
+
+static void print_value(value val, FILE *stream)
+{
+    if (val == VALUE_UNDEFINED) {
+        fputs("?", stream);
+    } else {
+        fprintf(stream, "$%" PRIx64, (uint64_t)val & 0xffffff);
+    }
+}
+
+static void print_entry(const pass_trace_entry *entry, FILE *stream)
+{
+    source_location where = source_manager_decode(entry->loc);
+    switch (entry->kind) {
+        case PASS_TRACE_UNRESOLVED:
+            fprintf(stream, "unresolved '%s'", entry->name);
+            break;
+        case PASS_TRACE_SYMBOL:
+            fprintf(stream, "'%s' ", entry->name);
+            print_value(entry->old_value, stream);
+            fputs(" -> ", stream);
+            print_value(entry->new_value, stream);
+            break;
+        default:
+            fprintf(stream, "size %d -> %d bytes", (int)entry->old_value, (int)entry->new_value);
+    }
+    if (where.file_name) {
+        fprintf(stream, " at %s(%d)", where.file_name, where.line);
+    }
+    fputc('\n', stream);
+}
+
+void pass_trace_report(const pass_trace *trace, int passes, FILE *stream)
+{
+    fputs("---------------------------------\nPass trace:\n", stream);
+    size_t i = 0;
+    for(int pass = 1; pass <= passes; pass++) {
+        size_t counts[3] = {};
+        size_t first = i;
+        for(; i < trace->count && trace->entries[i].pass == pass; i++) {
+            counts[trace->entries[i].kind]++;
+        }
+        if (first == i) {
+            fprintf(stream, "pass %d: converged\n", pass);
+            continue;
+        }
+        fprintf(stream, "pass %d: %zu unresolved, %zu symbols changed, %zu sizes changed\n",
+            pass, counts[PASS_TRACE_UNRESOLVED], counts[PASS_TRACE_SYMBOL], counts[PASS_TRACE_SIZE]);
+        fputs("    first: ", stream);
+        print_entry(trace->entries + first, stream);
+        for(size_t j = first; j < i; j++) {
+            fputs("    ", stream);
+            print_entry(trace->entries + j, stream);
+        }
+    }
+}
@@ -0,0 +1,50 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef pass_trace_h
+#define pass_trace_h
+
+#include "source_manager.h"
+#include "value.h"
+#include <stdio.h>
+
+typedef struct pass_trace_entry
+{
+    enum {
+        PASS_TRACE_UNRESOLVED,
+        PASS_TRACE_SYMBOL,
+        PASS_TRACE_SIZE
+    } kind;
+    int pass;
+    char *name;
+    value old_value;
+    value new_value;
+    source_loc loc;
+
+} pass_trace_entry;
+
+/* records why each pass asked for another one (--trace-passes) */
+typedef struct pass_trace
+{
+    pass_trace_entry *entries;
+    size_t count;
+    size_t capacity;
+
+} pass_trace;
+
+pass_trace *pass_trace_create(void);
+void pass_trace_destroy(pass_trace *trace);
+
+void pass_trace_unresolved(pass_trace *trace, int pass, const char *name, source_loc loc);
+void pass_trace_symbol(pass_trace *trace, int pass, const char *name, value old_value, value new_value, source_loc loc);
+void pass_trace_size(pass_trace *trace, int pass, int old_size, int new_size, source_loc loc);
+
+void pass_trace_report(const pass_trace *trace, int passes, FILE *stream);
+
+#endif /* pass_trace_h */
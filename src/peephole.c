@@ -0,0 +1,488 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "assembly_context.h"
+#include "expression.h"
+#include "loop.h"
+#include "m6502.h"
+#include "memory.h"
+#include "operand.h"
+#include "peephole.h"
+#include "program.h"
+#include "value.h"
+#include <string.h>
+
+/* how far ahead a rewrite looks for the flags it clobbers to be set again */
+#define PEEPHOLE_LOOKAHEAD  16
+
+#define CPU_MASK(cpu)       (1 << (cpu))
+#define ALL_CPUS            (CPU_MASK(CPU_6502) | CPU_MASK(CPU_6502I) | CPU_MASK(CPU_65C02) | CPU_MASK(CPU_65816))
+
+typedef struct peephole_scan
+{
+    peephole *peephole;
+    program *program;
+    assembly_context *context;
+    const char *scope;
+    int decimal;
+
+} peephole_scan;
+
+/* try to rewrite the statements starting at index, returns 0 if they do not match */
+typedef int (*peephole_matcher)(peephole_scan *scan, size_t index);
+
+typedef struct peephole_rule
+{
+    int cpus;
+    peephole_matcher match;
+
+} peephole_rule;
+
+static const operand accumulator_operand = { .form = FORM_ACCUMULATOR };
+
+peephole *peephole_create(void)
+{
+    return tiny_calloc(1, sizeof(peephole));
+}
+
+void peephole_destroy(peephole *peephole)
+{
+    if (!peephole) {
+        return;
+    }
+    for(size_t i = 0; i < peephole->rewrite_count; i++) {
+        tiny_free(peephole->rewrites[i]);
+    }
+    tiny_free(peephole->rewrites);
+    tiny_free(peephole->changes);
+    tiny_free(peephole);
+}
+
+static int mnemonic_at(const program *program, size_t index)
+{
+    if (index >= program->count || program->kinds[index] != PROGRAM_KIND_INSTRUCTION) {
+        return 0;
+    }
+    return program->statements[index]->instruction->type;
+}
+
+static int is_labeled(const program *program, size_t index)
+{
+    return program->statements[index]->label != NULL;
+}
+
+/* the operand's expression if it has the form and no bitwidth modifier */
+static const expression *operand_expression(const program *program, size_t index, int form)
+{
+    const operand *oper = program->operands[index];
+    if (!oper || oper->form != form || oper->single_expression.bitwidth) {
+        return NULL;
+    }
+    return oper->single_expression.expr;
+}
+
+static int is_constant(const program *program, size_t index, int form, value constant)
+{
+    const expression *expr = operand_expression(program, index, form);
+    return expr && expr->value == constant;
+}
+
+static value anonymous_target(const program *program, size_t index, int forward)
+{
+    const token *label = program->statements[index]->label;
+    if (forward) {
+        /* whether '+' on its own line is itself or the next one is not worth guessing */
+        if (label && label->type == TOKEN_PLUS) {
+            return VALUE_UNDEFINED;
+        }
+        for(size_t i = index + 1; i < program->count; i++) {
+            label = program->statements[i]->label;
+            if (label && label->type == TOKEN_PLUS) {
+                return program->pcs[i];
+            }
+        }
+        return VALUE_UNDEFINED;
+    }
+    for(size_t i = index + 1; i-- > 0; ) {
+        label = program->statements[i]->label;
+        if (label && label->type == TOKEN_HYPHEN) {
+            return program->pcs[i];
+        }
+    }
+    return VALUE_UNDEFINED;
+}
+
+/* the value of an operand as of the first pass, if it is a constant or names a label */
+static value resolve(const peephole_scan *scan, const expression *expr, size_t index)
+{
+    if (expr->type != TYPE_IDENT) {
+        return expr->value;
+    }
+    if (expr->token->type == TOKEN_ASTERISK) {
+        return scan->program->pcs[index];
+    }
+    TOKEN_GET_TEXT(expr->token, name);
+    if (name[0] == '+' || name[0] == '-') {
+        return name[1] ? VALUE_UNDEFINED : anonymous_target(scan->program, index, name[0] == '+');
+    }
+    symbol_table *sym_tab = scan->context->sym_tab;
+    if (symbol_exists(sym_tab, name)) {
+        return symbol_table_lookup(sym_tab, name);
+    }
+    if (name[0] == '_' && scan->scope) {
+        char scoped_name[TOKEN_TEXT_MAX_LEN * 2 + 2] = {};
+        snprintf(scoped_name, TOKEN_TEXT_MAX_LEN * 2, "%s.%s", scan->scope, name);
+        if (symbol_exists(sym_tab, scoped_name)) {
+            return symbol_table_lookup(sym_tab, scoped_name);
+        }
+    }
+    return VALUE_UNDEFINED;
+}
+
+static int in_branch_range(int pc, value target)
+{
+    if (target == VALUE_UNDEFINED) {
+        return 0;
+    }
+    value offset = target - (pc + 2);
+    return offset >= INT8_MIN && offset <= INT8_MAX;
+}
+
+/* the next instruction loads the accumulator and its flags without reading them */
+static int reloads_accumulator(const program *program, size_t index)
+{
+    switch (mnemonic_at(program, index)) {
+        case TOKEN_LAX:
+        case TOKEN_LDA:
+        case TOKEN_PLA:
+        case TOKEN_TXA:
+        case TOKEN_TYA: return 1;
+        default:        return 0;
+    }
+}
+
+/* carry and overflow are both set again before the straight-line code from index reads them */
+static int carry_overflow_dead(const program *program, size_t index)
+{
+    int carry = 1, overflow = 1;
+    for(size_t i = index; i < index + PEEPHOLE_LOOKAHEAD && (carry || overflow); i++) {
+        switch (mnemonic_at(program, i)) {
+            case TOKEN_ASL:
+            case TOKEN_CLC:
+            case TOKEN_CMP:
+            case TOKEN_CPX:
+            case TOKEN_CPY:
+            case TOKEN_LSR:
+            case TOKEN_SEC:
+                carry = 0;
+                break;
+            case TOKEN_CLV:
+                overflow = 0;
+                break;
+            case TOKEN_BIT:
+                /* bit immediate only sets zero */
+                if (program->operands[i]->form != FORM_IMMEDIATE) {
+                    overflow = 0;
+                }
+                break;
+            case TOKEN_ADC:
+            case TOKEN_SBC:
+                if (carry) {
+                    return 0;
+                }
+                overflow = 0;
+                break;
+            case TOKEN_ROL:
+            case TOKEN_ROR:
+                if (carry) {
+                    return 0;
+                }
+                break;
+            case TOKEN_PLP:
+                return 1;
+            case TOKEN_AND: case TOKEN_CLD: case TOKEN_CLI: case TOKEN_DEC: case TOKEN_DEX:
+            case TOKEN_DEY: case TOKEN_EOR: case TOKEN_INC: case TOKEN_INX: case TOKEN_INY:
+            case TOKEN_LDA: case TOKEN_LDX: case TOKEN_LDY: case TOKEN_NOP: case TOKEN_ORA:
+            case TOKEN_PHA: case TOKEN_PHX: case TOKEN_PHY: case TOKEN_PLA: case TOKEN_PLX:
+            case TOKEN_PLY: case TOKEN_SEI: case TOKEN_STA: case TOKEN_STX: case TOKEN_STY:
+            case TOKEN_STZ: case TOKEN_TAX: case TOKEN_TAY: case TOKEN_TRB: case TOKEN_TSB:
+            case TOKEN_TSX: case TOKEN_TXA: case TOKEN_TXS: case TOKEN_TYA:
+                break;
+            default:
+                /* control flow, data or a flag read */
+                return 0;
+        }
+    }
+    return !carry && !overflow;
+}
+
+static void rewrite(peephole_scan *scan, size_t index, int mnemonic, const operand *oper)
+{
+    peephole *peephole = scan->peephole;
+    program *program = scan->program;
+    if (peephole->rewrite_count == peephole->rewrite_capacity) {
+        peephole->rewrite_capacity = peephole->rewrite_capacity ? peephole->rewrite_capacity * 2 : 64;
+        peephole->rewrites = tiny_realloc(peephole->rewrites, peephole->rewrite_capacity * sizeof(peephole_rewrite*));
+    }
+    peephole_rewrite *rw = tiny_malloc(sizeof(peephole_rewrite));
+    peephole->rewrites[peephole->rewrite_count++] = rw;
+
+    /* keep the label and source location, only the mnemonic and operand change */
+    rw->statement = *program->statements[index];
+    rw->mnemonic = *rw->statement.instruction;
+    rw->mnemonic.type = mnemonic;
+    rw->statement.instruction = &rw->mnemonic;
+    rw->statement.operand = (operand*)oper;
+    program->statements[index] = &rw->statement;
+    program->operands[index] = oper;
+    program->opcode_rows[index] = (short)m6502_opcode_row(mnemonic);
+    program->forms[index] = (unsigned char)m6502_classify(mnemonic, oper);
+}
+
+static void remove_instruction(program *program, size_t index)
+{
+    /* only its label, if it has one, is still executed */
+    program->kinds[index] = PROGRAM_KIND_LABEL;
+}
+
+static void log_change(peephole_scan *scan, size_t index, const char *description, int bytes, int cycles)
+{
+    peephole *peephole = scan->peephole;
+    if (peephole->count == peephole->capacity) {
+        peephole->capacity = peephole->capacity ? peephole->capacity * 2 : 64;
+        peephole->changes = tiny_realloc(peephole->changes, peephole->capacity * sizeof(peephole_change));
+    }
+    peephole_change *change = peephole->changes + peephole->count++;
+    change->loc = scan->program->statements[index]->instruction->loc;
+    change->description = description;
+    change->bytes = bytes;
+    change->cycles = cycles;
+}
+
+/* jsr sub / rts -> jmp sub */
+static int tail_call(peephole_scan *scan, size_t index)
+{
+    program *program = scan->program;
+    if (mnemonic_at(program, index) != TOKEN_JSR ||
+        !operand_expression(program, index, FORM_ZP_ABSOLUTE) ||
+        mnemonic_at(program, index + 1) != TOKEN_RTS ||
+        program->operands[index + 1] ||
+        is_labeled(program, index + 1)) {
+        return 0;
+    }
+    rewrite(scan, index, TOKEN_JMP, program->operands[index]);
+    remove_instruction(program, index + 1);
+    log_change(scan, index, "jsr + rts -> jmp", program->sizes[index + 1], 9);
+    return 1;
+}
+
+static int inverted_branch(int mnemonic)
+{
+    switch (mnemonic) {
+        case TOKEN_BCC: return TOKEN_BCS;
+        case TOKEN_BCS: return TOKEN_BCC;
+        case TOKEN_BEQ: return TOKEN_BNE;
+        case TOKEN_BNE: return TOKEN_BEQ;
+        case TOKEN_BMI: return TOKEN_BPL;
+        case TOKEN_BPL: return TOKEN_BMI;
+        case TOKEN_BVC: return TOKEN_BVS;
+        case TOKEN_BVS: return TOKEN_BVC;
+        default:        return 0;
+    }
+}
+
+/* bne skip / jmp target / skip -> beq target */
+static int branch_over_jump(peephole_scan *scan, size_t index)
+{
+    program *program = scan->program;
+    int inverse = inverted_branch(mnemonic_at(program, index));
+    const expression *skip = operand_expression(program, index, FORM_ZP_ABSOLUTE);
+    if (!inverse || !skip ||
+        mnemonic_at(program, index + 1) != TOKEN_JMP ||
+        is_labeled(program, index + 1)) {
+        return 0;
+    }
+    const expression *target = operand_expression(program, index + 1, FORM_ZP_ABSOLUTE);
+    if (!target || resolve(scan, skip, index) != program->pcs[index + 1] + program->sizes[index + 1]) {
+        return 0;
+    }
+    /* the jump's operand is evaluated from the branch once rewritten */
+    value destination = resolve(scan, target, index + 1);
+    if (destination != resolve(scan, target, index) || !in_branch_range(program->pcs[index], destination)) {
+        return 0;
+    }
+    rewrite(scan, index, inverse, program->operands[index + 1]);
+    remove_instruction(program, index + 1);
+    log_change(scan, index, "branch over jmp -> inverted branch", program->sizes[index + 1], 2);
+    return 1;
+}
+
+/* jmp near -> bra near */
+static int jump_to_branch(peephole_scan *scan, size_t index)
+{
+    program *program = scan->program;
+    const expression *target = operand_expression(program, index, FORM_ZP_ABSOLUTE);
+    if (mnemonic_at(program, index) != TOKEN_JMP || !target ||
+        !in_branch_range(program->pcs[index], resolve(scan, target, index))) {
+        return 0;
+    }
+    rewrite(scan, index, TOKEN_BRA, program->operands[index]);
+    log_change(scan, index, "jmp -> bra", program->sizes[index] - 2, 0);
+    return 1;
+}
+
+/* lda #0 / sta m... / lda -> stz m... / lda */
+static int store_zero(peephole_scan *scan, size_t index)
+{
+    program *program = scan->program;
+    if (mnemonic_at(program, index) != TOKEN_LDA || !is_constant(program, index, FORM_IMMEDIATE, 0)) {
+        return 0;
+    }
+    size_t end = index + 1;
+    while (mnemonic_at(program, end) == TOKEN_STA && !is_labeled(program, end) &&
+           (operand_expression(program, end, FORM_ZP_ABSOLUTE) || operand_expression(program, end, FORM_INDEX_X))) {
+        end++;
+    }
+    if (end == index + 1 || !reloads_accumulator(program, end)) {
+        return 0;
+    }
+    log_change(scan, index, "lda #0 + sta -> stz", program->sizes[index], 2);
+    remove_instruction(program, index);
+    for(size_t i = index + 1; i < end; i++) {
+        rewrite(scan, i, TOKEN_STZ, program->operands[i]);
+    }
+    return 1;
+}
+
+/* clc / adc #1 -> inc a, sec / sbc #1 -> dec a */
+static int add_one(peephole_scan *scan, size_t index)
+{
+    program *program = scan->program;
+    int flag = mnemonic_at(program, index), operation = mnemonic_at(program, index + 1);
+    int replacement = flag == TOKEN_CLC && operation == TOKEN_ADC ? TOKEN_INC :
+                      flag == TOKEN_SEC && operation == TOKEN_SBC ? TOKEN_DEC : 0;
+    if (!replacement || scan->decimal || is_labeled(program, index + 1) ||
+        !is_constant(program, index + 1, FORM_IMMEDIATE, 1) ||
+        !carry_overflow_dead(program, index + 2)) {
+        return 0;
+    }
+    int bytes = program->sizes[index] + program->sizes[index + 1] - 1;
+    rewrite(scan, index, replacement, &accumulator_operand);
+    remove_instruction(program, index + 1);
+    log_change(scan, index, replacement == TOKEN_INC ? "clc + adc #1 -> inc a" : "sec + sbc #1 -> dec a", bytes, 2);
+    return 1;
+}
+
+/* lda m / tax -> lax m, ldx m / txa -> lax m */
+static int load_both(peephole_scan *scan, size_t index)
+{
+    program *program = scan->program;
+    int load = mnemonic_at(program, index), transfer = mnemonic_at(program, index + 1);
+    int fuses = (load == TOKEN_LDA && transfer == TOKEN_TAX &&
+                (operand_expression(program, index, FORM_ZP_ABSOLUTE) ||
+                 operand_expression(program, index, FORM_INDIRECT_X) ||
+                 operand_expression(program, index, FORM_INDIRECT_Y))) ||
+                (load == TOKEN_LDX && transfer == TOKEN_TXA &&
+                (operand_expression(program, index, FORM_ZP_ABSOLUTE) ||
+                 operand_expression(program, index, FORM_INDEX_Y)));
+    if (!fuses || is_labeled(program, index + 1)) {
+        return 0;
+    }
+    rewrite(scan, index, TOKEN_LAX, program->operands[index]);
+    remove_instruction(program, index + 1);
+    log_change(scan, index, load == TOKEN_LDA ? "lda + tax -> lax" : "ldx + txa -> lax", program->sizes[index + 1], 2);
+    return 1;
+}
+
+/* txa / and m / sta d / lda -> lda m / sax d / lda */
+static int and_store(peephole_scan *scan, size_t index)
+{
+    program *program = scan->program;
+    if (mnemonic_at(program, index) != TOKEN_TXA ||
+        mnemonic_at(program, index + 1) != TOKEN_AND || is_labeled(program, index + 1) ||
+        mnemonic_at(program, index + 2) != TOKEN_STA || is_labeled(program, index + 2) ||
+        !(operand_expression(program, index + 2, FORM_ZP_ABSOLUTE) || operand_expression(program, index + 2, FORM_INDIRECT_X)) ||
+        !reloads_accumulator(program, index + 3)) {
+        return 0;
+    }
+    int bytes = program->sizes[index];
+    rewrite(scan, index, TOKEN_LDA, program->operands[index + 1]);
+    remove_instruction(program, index + 1);
+    rewrite(scan, index + 2, TOKEN_SAX, program->operands[index + 2]);
+    log_change(scan, index, "txa + and + sta -> lda + sax", bytes, 2);
+    return 1;
+}
+
+static const peephole_rule peephole_rules[] =
+{
+    { ALL_CPUS,             tail_call },
+    { ALL_CPUS,             branch_over_jump },
+    { CPU_MASK(CPU_65C02),  jump_to_branch },
+    { CPU_MASK(CPU_65C02),  store_zero },
+    { CPU_MASK(CPU_65C02),  add_one },
+    { CPU_MASK(CPU_6502I),  load_both },
+    { CPU_MASK(CPU_6502I),  and_store }
+};
+
+size_t peephole_optimize(peephole *peephole, program *program, assembly_context *context)
+{
+    peephole_scan scan = {
+        .peephole = peephole,
+        .program = program,
+        .context = context
+    };
+    /* adc and sbc are not the same as inc and dec in decimal mode */
+    for(size_t i = 0; i < program->count && !scan.decimal; i++) {
+        scan.decimal = mnemonic_at(program, i) == TOKEN_SED;
+    }
+    size_t first_change = peephole->count;
+    int cpu = CPU_MASK(context->options.cpu), enabled = 1, loop_depth = 0;
+    for(size_t i = 0; i < program->count; i++) {
+        int label = program->labels[i];
+        if (label != PROGRAM_NO_LABEL && !PROGRAM_LABEL_IS_LOCAL(label)) {
+            scan.scope = program->label_names[PROGRAM_LABEL_ID(label)];
+        }
+        if (program->kinds[i] == PROGRAM_KIND_PSEUDO_OP) {
+            token_type directive = program->statements[i]->instruction->type;
+            if (directive == TOKEN_OPTON || directive == TOKEN_OPTOFF) {
+                enabled = directive == TOKEN_OPTON;
+            }
+            /* a loop body is shared by every iteration */
+            loop_depth += loop_nesting(program->statements[i]);
+            continue;
+        }
+        if (!enabled || loop_depth || program->kinds[i] != PROGRAM_KIND_INSTRUCTION) {
+            continue;
+        }
+        /* a rewritten instruction may match another rule, every rewrite makes the code smaller */
+        for(size_t r = 0; r < sizeof peephole_rules / sizeof peephole_rules[0]; r++) {
+            if ((peephole_rules[r].cpus & cpu) && peephole_rules[r].match(&scan, i)) {
+                r = (size_t)-1;
+            }
+        }
+    }
+    return peephole->count - first_change;
+}
+
+void peephole_report(const peephole *peephole, FILE *stream)
+{
+    fputs("---------------------------------\nPeephole optimizations:\n", stream);
+    int bytes = 0, cycles = 0;
+    for(size_t i = 0; i < peephole->count; i++) {
+        const peephole_change *change = peephole->changes + i;
+        source_location where = source_manager_decode(change->loc);
+        if (where.file_name) {
+            fprintf(stream, "%s(%d): ", where.file_name, where.line);
+        }
+        fprintf(stream, "%s, %d bytes and %d cycles\n", change->description, change->bytes, change->cycles);
+        bytes += change->bytes;
+        cycles += change->cycles;
+    }
+    fprintf(stream, "%zu rewrites saved %d bytes and %d cycles\n", peephole->count, bytes, cycles);
+}
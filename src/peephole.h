@@ -0,0 +1,59 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef peephole_h
+#define peephole_h
+
+#include "source_manager.h"
+#include "statement.h"
+#include "token.h"
+#include <stdio.h>
+
+typedef struct assembly_context assembly_context;
+typedef struct program program;
+
+/* a statement put in place of a source statement, encoding another mnemonic */
+typedef struct peephole_rewrite
+{
+    statement statement;
+    token mnemonic;
+
+} peephole_rewrite;
+
+typedef struct peephole_change
+{
+    source_loc loc;
+    const char *description;
+    int bytes;
+    int cycles;
+
+} peephole_change;
+
+/* the rewrites applied to a program after its first pass (--optimize) */
+typedef struct peephole
+{
+    peephole_change *changes;
+    size_t count;
+    size_t capacity;
+    peephole_rewrite **rewrites;
+    size_t rewrite_count;
+    size_t rewrite_capacity;
+
+} peephole;
+
+peephole *peephole_create(void);
+void peephole_destroy(peephole *peephole);
+
+/* rewrite the program in place using the layout and symbols of the first pass,
+   outside regions between .optoff and .opton; returns the number of changes */
+size_t peephole_optimize(peephole *peephole, program *program, assembly_context *context);
+
+void peephole_report(const peephole *peephole, FILE *stream);
+
+#endif /* peephole_h */
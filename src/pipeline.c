@@ -0,0 +1,164 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "error.h"
+#include "memory.h"
+#include "pipeline.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* the parser is waiting for the executor to decide a condition */
+#define PIPELINE_UNDECIDED  -2
+
+typedef struct pipeline_item
+{
+    statement *statement;
+    int decide;
+    char *messages;
+    int errors;
+    int warnings;
+
+} pipeline_item;
+
+typedef struct pipeline_batch
+{
+    pipeline_item items[PIPELINE_BATCH_SIZE];
+    size_t count;
+
+} pipeline_batch;
+
+struct pipeline
+{
+    parser *parser;
+    parser_condition_callback decide;
+    void *decide_data;
+    pthread_t thread;
+    pipeline_batch batches[PIPELINE_BATCHES];
+    atomic_size_t head;
+    atomic_size_t tail;
+    size_t read;
+    atomic_int decision;
+    int ended;
+
+};
+
+/* spin briefly, then yield, then sleep, so a side waiting on a slow file does not hold a cpu */
+static void wait_turn(int *spins)
+{
+    if (++*spins < 64) {
+        return;
+    }
+    if (*spins < 1024) {
+        sched_yield();
+        return;
+    }
+    struct timespec pause = { .tv_nsec = 50000 };
+    nanosleep(&pause, NULL);
+}
+
+/* the batch the parser is filling, once the executor has a free one */
+static pipeline_batch *filling(pipeline *pipeline)
+{
+    size_t tail = atomic_load_explicit(&pipeline->tail, memory_order_relaxed);
+    int spins = 0;
+    while (tail - atomic_load_explicit(&pipeline->head, memory_order_acquire) == PIPELINE_BATCHES) {
+        wait_turn(&spins);
+    }
+    return pipeline->batches + tail % PIPELINE_BATCHES;
+}
+
+static void add_item(pipeline *pipeline, statement *statement, int decide)
+{
+    pipeline_batch *batch = filling(pipeline);
+    pipeline_item *item = batch->items + batch->count++;
+    item->statement = statement;
+    item->decide = decide;
+    item->messages = tiny_take_messages(&item->errors, &item->warnings);
+    if (batch->count == PIPELINE_BATCH_SIZE || decide || !statement) {
+        atomic_fetch_add_explicit(&pipeline->tail, 1, memory_order_release);
+    }
+}
+
+static int request_decision(void *pipeline_ptr, const statement *statement)
+{
+    pipeline *pipeline = (struct pipeline*)pipeline_ptr;
+    atomic_store_explicit(&pipeline->decision, PIPELINE_UNDECIDED, memory_order_relaxed);
+    add_item(pipeline, (struct statement*)statement, 1);
+    int decision, spins = 0;
+    while ((decision = atomic_load_explicit(&pipeline->decision, memory_order_acquire)) == PIPELINE_UNDECIDED) {
+        wait_turn(&spins);
+    }
+    return decision;
+}
+
+static void *parse_source(void *pipeline_ptr)
+{
+    pipeline *pipeline = (struct pipeline*)pipeline_ptr;
+    tiny_hold_messages(1);
+    parser_set_condition_callback(pipeline->parser, request_decision, pipeline);
+    statement *statement;
+    do {
+        statement = parse_statement(pipeline->parser);
+        add_item(pipeline, statement, 0);
+    } while (statement);
+    parser_set_condition_callback(pipeline->parser, NULL, NULL);
+    tiny_hold_messages(0);
+    return NULL;
+}
+
+pipeline *pipeline_start(parser *parser, parser_condition_callback decide, void *decide_data)
+{
+    pipeline *pipeline = tiny_calloc(1, sizeof(struct pipeline));
+    pipeline->parser = parser;
+    pipeline->decide = decide;
+    pipeline->decide_data = decide_data;
+    if (pthread_create(&pipeline->thread, NULL, parse_source, pipeline)) {
+        tiny_free(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+statement *pipeline_next(pipeline *pipeline)
+{
+    while (!pipeline->ended) {
+        size_t head = atomic_load_explicit(&pipeline->head, memory_order_relaxed);
+        int spins = 0;
+        while (atomic_load_explicit(&pipeline->tail, memory_order_acquire) == head) {
+            wait_turn(&spins);
+        }
+        pipeline_batch *batch = pipeline->batches + head % PIPELINE_BATCHES;
+        pipeline_item item = batch->items[pipeline->read++];
+        if (pipeline->read == batch->count) {
+            /* hand the batch back to the parser */
+            batch->count = 0;
+            pipeline->read = 0;
+            atomic_store_explicit(&pipeline->head, head + 1, memory_order_release);
+        }
+        tiny_print_messages(item.messages, item.errors, item.warnings);
+        if (item.decide) {
+            atomic_store_explicit(&pipeline->decision, pipeline->decide(pipeline->decide_data, item.statement), memory_order_release);
+            continue;
+        }
+        pipeline->ended = !item.statement;
+        return item.statement;
+    }
+    return NULL;
+}
+
+void pipeline_finish(pipeline *pipeline)
+{
+    if (!pipeline) {
+        return;
+    }
+    pthread_join(pipeline->thread, NULL);
+    tiny_free(pipeline);
+}
@@ -0,0 +1,46 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef pipeline_h
+#define pipeline_h
+
+#include "expression.h"
+#include "parser.h"
+
+/*
+
+The first pass parses on a thread of its own while the statements already
+parsed are executed. The parser hands its statements over in batches
+through a bounded ring with one writer and one reader, so neither side
+takes a lock. The lexer stays on the parser's thread, since macros,
+includes and skipped blocks change what it reads next at the token the
+parser is on. The only round trip is a condition the parser needs decided
+as it parses: it is sent through the ring like a statement, and the parser
+waits until the executor has run every statement before it and decided it.
+The messages the parser logs travel with the statement they belong to and
+are printed as it is taken, in the same order as parsing and executing
+one statement at a time.
+**/
+
+#define PIPELINE_BATCH_SIZE     64
+#define PIPELINE_BATCHES        16
+
+typedef struct pipeline pipeline;
+
+/* start parsing on another thread, deciding conditions with decide on the thread taking
+   the statements; NULL if no thread could be started */
+pipeline *pipeline_start(parser *parser, parser_condition_callback decide, void *decide_data);
+
+/* the next statement parsed, or NULL at the end of the source */
+statement *pipeline_next(pipeline *pipeline);
+
+/* wait for the parser's thread, which is done once pipeline_next returns NULL */
+void pipeline_finish(pipeline *pipeline);
+
+#endif /* pipeline_h */
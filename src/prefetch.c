@@ -0,0 +1,238 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "memory.h"
+#include "prefetch.h"
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+
+typedef enum
+{
+    PREFETCH_QUEUED,
+    PREFETCH_READING,
+    PREFETCH_READ,
+    PREFETCH_TAKEN
+
+} prefetch_state;
+
+typedef struct prefetched
+{
+    char *path;
+    int is_binary;
+    off_t size;
+    prefetch_state state;
+    source_file source;
+    binary_file binary;
+
+} prefetched;
+
+typedef struct prefetcher
+{
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t read;
+    prefetched **files;
+    size_t count;
+    off_t binary_bytes;
+    size_t capacity;
+    size_t next;
+    pthread_t threads[PREFETCH_THREADS];
+    size_t thread_count;
+    int stopping;
+
+} prefetcher;
+
+static prefetcher prefetch = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .read = PTHREAD_COND_INITIALIZER
+};
+
+static void read_file(prefetched *file)
+{
+    if (file->is_binary) {
+        file->binary = binary_file_read(file->path);
+        if (file->binary.data) {
+            /* hold only the bytes read, not the whole buffer read into */
+            file->binary.data = tiny_realloc(file->binary.data, file->binary.length ? file->binary.length : 1);
+        }
+    } else {
+        file->source = source_file_read(file->path);
+    }
+}
+
+static void *io_worker(void *unused)
+{
+    pthread_mutex_lock(&prefetch.lock);
+    for(;;) {
+        /* skip the files a reader claimed before a thread got to them */
+        while (prefetch.next < prefetch.count && prefetch.files[prefetch.next]->state != PREFETCH_QUEUED) {
+            prefetch.next++;
+        }
+        if (prefetch.next == prefetch.count) {
+            if (prefetch.stopping) {
+                break;
+            }
+            pthread_cond_wait(&prefetch.queued, &prefetch.lock);
+            continue;
+        }
+        prefetched *file = prefetch.files[prefetch.next++];
+        file->state = PREFETCH_READING;
+        pthread_mutex_unlock(&prefetch.lock);
+        struct stat info;
+        off_t size = 0;
+        if (file->is_binary) {
+            size = stat(file->path, &info) ? -1 : info.st_size;
+        }
+        pthread_mutex_lock(&prefetch.lock);
+        if (size < 0 || size > PREFETCH_MAX_BINARY_BYTES - prefetch.binary_bytes) {
+            /* a .binary may sit in a block that is never assembled, so only so many bytes are
+               read ahead; this one is left to the directive to read, if it is ever assembled */
+            file->state = PREFETCH_TAKEN;
+            pthread_cond_broadcast(&prefetch.read);
+            continue;
+        }
+        prefetch.binary_bytes += size;
+        file->size = size;
+        pthread_mutex_unlock(&prefetch.lock);
+        read_file(file);
+        pthread_mutex_lock(&prefetch.lock);
+        file->state = PREFETCH_READ;
+        pthread_cond_broadcast(&prefetch.read);
+    }
+    pthread_mutex_unlock(&prefetch.lock);
+    return NULL;
+}
+
+/* the file queued for path, if any; the lock must be held */
+static prefetched *find(const char *path, int is_binary)
+{
+    for(size_t i = prefetch.count; i-- > 0;) {
+        prefetched *file = prefetch.files[i];
+        if (file->is_binary == is_binary && !strcmp(file->path, path)) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+void prefetch_file(const char *path, int is_binary)
+{
+    pthread_mutex_lock(&prefetch.lock);
+    if (prefetch.stopping || find(path, is_binary)) {
+        pthread_mutex_unlock(&prefetch.lock);
+        return;
+    }
+    if (prefetch.count == prefetch.capacity) {
+        prefetch.capacity = prefetch.capacity ? prefetch.capacity * 2 : 16;
+        prefetch.files = tiny_realloc(prefetch.files, prefetch.capacity * sizeof(prefetched*));
+    }
+    prefetched *file = tiny_calloc(1, sizeof(prefetched));
+    size_t len = strlen(path);
+    file->path = tiny_malloc(len + 1);
+    memcpy(file->path, path, len + 1);
+    file->is_binary = is_binary;
+    prefetch.files[prefetch.count++] = file;
+    if (prefetch.thread_count < PREFETCH_THREADS &&
+        !pthread_create(prefetch.threads + prefetch.thread_count, NULL, io_worker, NULL)) {
+        prefetch.thread_count++;
+    }
+    pthread_cond_signal(&prefetch.queued);
+    pthread_mutex_unlock(&prefetch.lock);
+}
+
+/* take the file at path once it is read, or claim it to read now; NULL if it was not queued or is taken */
+static prefetched *take(const char *path, int is_binary, int *claimed)
+{
+    pthread_mutex_lock(&prefetch.lock);
+    prefetched *file = find(path, is_binary);
+    *claimed = 0;
+    while (file && file->state == PREFETCH_READING) {
+        pthread_cond_wait(&prefetch.read, &prefetch.lock);
+    }
+    if (file && file->state == PREFETCH_QUEUED) {
+        /* the threads are busy with earlier files, or none could be started */
+        file->state = PREFETCH_READING;
+        *claimed = 1;
+    }
+    if (file && file->state == PREFETCH_TAKEN) {
+        file = NULL;
+    } else if (file) {
+        /* the taker owns the bytes from here, so they no longer count as read ahead */
+        prefetch.binary_bytes -= file->size;
+        if (!*claimed) {
+            file->state = PREFETCH_TAKEN;
+        }
+    }
+    pthread_mutex_unlock(&prefetch.lock);
+    return file;
+}
+
+static void mark_taken(prefetched *file)
+{
+    pthread_mutex_lock(&prefetch.lock);
+    file->state = PREFETCH_TAKEN;
+    pthread_cond_broadcast(&prefetch.read);
+    pthread_mutex_unlock(&prefetch.lock);
+}
+
+source_file prefetch_source_read(const char *path)
+{
+    int claimed;
+    prefetched *file = take(path, 0, &claimed);
+    if (!file) {
+        return source_file_read(path);
+    }
+    if (claimed) {
+        read_file(file);
+        mark_taken(file);
+    }
+    source_file source = file->source;
+    file->source = (source_file){};
+    return source;
+}
+
+binary_file prefetch_binary_read(const char *path)
+{
+    int claimed;
+    prefetched *file = take(path, 1, &claimed);
+    if (!file) {
+        return binary_file_read(path);
+    }
+    if (claimed) {
+        read_file(file);
+        mark_taken(file);
+    }
+    binary_file binary = file->binary;
+    file->binary = (binary_file){};
+    return binary;
+}
+
+void prefetch_cleanup(void)
+{
+    pthread_mutex_lock(&prefetch.lock);
+    prefetch.stopping = 1;
+    pthread_cond_broadcast(&prefetch.queued);
+    pthread_mutex_unlock(&prefetch.lock);
+    for(size_t i = 0; i < prefetch.thread_count; i++) {
+        pthread_join(prefetch.threads[i], NULL);
+    }
+    for(size_t i = 0; i < prefetch.count; i++) {
+        prefetched *file = prefetch.files[i];
+        source_file_cleanup(&file->source);
+        tiny_free(file->binary.data);
+        tiny_free(file->path);
+        tiny_free(file);
+    }
+    tiny_free(prefetch.files);
+    prefetch.files = NULL;
+    prefetch.count = prefetch.capacity = prefetch.next = prefetch.thread_count = 0;
+    prefetch.binary_bytes = 0;
+}
@@ -0,0 +1,46 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef prefetch_h
+#define prefetch_h
+
+#include "file.h"
+
+/*
+
+When the lexer takes in a source file it scans its lines for .include and
+.binary directives and queues the files they name, so background I/O
+threads read them while the lines before them are still being parsed.
+The parser and the .binary directive then take the file that was read,
+waiting for it if a thread is still reading it, or read it themselves if
+no thread has started to. A prefetched file is handed out once; the
+prefetch is only a guess, so a file nothing takes is freed at cleanup.
+Binary files are read ahead only up to a total size, since the .binary
+directives found may be in blocks that are never assembled.
+**/
+
+/* the most threads reading files at once */
+#define PREFETCH_THREADS    4
+
+/* the most bytes of binary files read ahead */
+#define PREFETCH_MAX_BINARY_BYTES   (4 << 20)
+
+/* queue a file to be read in the background, if it is not queued already */
+void prefetch_file(const char *path, int is_binary);
+
+/* the source file at path, prefetched or read now */
+source_file prefetch_source_read(const char *path);
+
+/* the binary file at path, prefetched or read now */
+binary_file prefetch_binary_read(const char *path);
+
+/* wait for the threads and free the files nothing took */
+void prefetch_cleanup(void);
+
+#endif /* prefetch_h */
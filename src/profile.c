@@ -0,0 +1,133 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "memory.h"
+#include "options.h"
+#include "profile.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_HOT_SPOTS       10
+#define PROFILE_LISTING_COLUMN  80
+
+profile *profile_create(void)
+{
+    return tiny_calloc(1, sizeof(profile));
+}
+
+void profile_reset(profile *profile)
+{
+    profile->count = 0;
+}
+
+void profile_destroy(profile *profile)
+{
+    if (!profile) {
+        return;
+    }
+    simulator_destroy(profile->sim);
+    tiny_free(profile->marks);
+    tiny_free(profile);
+}
+
+void profile_mark_instruction(profile *profile, int pc, size_t listing_offset, source_loc loc)
+{
+    if (profile->count == profile->capacity) {
+        profile->capacity = profile->capacity ? profile->capacity * 2 : 256;
+        profile->marks = tiny_realloc(profile->marks, profile->capacity * sizeof(profile_mark));
+    }
+    profile_mark *mark = profile->marks + profile->count++;
+    mark->pc = pc;
+    mark->listing_offset = listing_offset;
+    mark->loc = loc;
+}
+
+int profile_run(profile *profile, int cpu, const char *image, int entry)
+{
+    if (cpu == CPU_65816) {
+        return 0;
+    }
+    simulator_destroy(profile->sim);
+    profile->sim = simulator_create(cpu, image);
+    simulator_enable_profile(profile->sim);
+    profile->stop = simulator_call(profile->sim, entry, PROFILE_MAX_CYCLES);
+    return 1;
+}
+
+typedef struct hot_spot
+{
+    unsigned long long cycles;
+    const profile_mark *mark;
+
+} hot_spot;
+
+static int by_cycles(const void *lhs, const void *rhs)
+{
+    unsigned long long l = ((const hot_spot*)lhs)->cycles;
+    unsigned long long r = ((const hot_spot*)rhs)->cycles;
+    return l < r ? 1 : l > r ? -1 : 0;
+}
+
+void profile_report(const profile *profile, FILE *stream)
+{
+    const simulator *sim = profile->sim;
+    fputs("---------------------------------\nProfile:\n", stream);
+    if (profile->stop == SIMULATOR_RETURNED) {
+        fprintf(stream, "returned after %llu cycles\n", sim->cycles);
+    } else {
+        fprintf(stream, "%s at $%04x after %llu cycles\n", simulator_stop_reason(profile->stop), sim->pc, sim->cycles);
+    }
+    if (!sim->cycles || !profile->count) {
+        return;
+    }
+    hot_spot *hot = tiny_malloc(profile->count * sizeof(hot_spot));
+    for(size_t i = 0; i < profile->count; i++) {
+        hot[i].cycles = sim->address_cycles[profile->marks[i].pc];
+        hot[i].mark = profile->marks + i;
+    }
+    qsort(hot, profile->count, sizeof(hot_spot), by_cycles);
+    fputs("     cycles      %  executions  source\n", stream);
+    for(size_t i = 0; i < profile->count && i < PROFILE_HOT_SPOTS && hot[i].cycles; i++) {
+        fprintf(stream, "%11llu %5.1f%% %11lu  ", hot[i].cycles, 100.0 * hot[i].cycles / sim->cycles, sim->executions[hot[i].mark->pc]);
+        source_location where = source_manager_decode(hot[i].mark->loc);
+        if (where.file_name) {
+            const char *text = where.line_text;
+            while (*text && isspace((unsigned char)*text)) {
+                text++;
+            }
+            fprintf(stream, "%s(%d): %.*s", where.file_name, where.line, (int)strcspn(text, "\r\n"), text);
+        }
+        fputc('\n', stream);
+    }
+    tiny_free(hot);
+}
+
+void profile_write_listing(const profile *profile, const char *listing, size_t length, FILE *stream)
+{
+    const simulator *sim = profile->sim;
+    size_t written = 0;
+    for(size_t i = 0; i < profile->count; i++) {
+        const profile_mark *mark = profile->marks + i;
+        if (mark->listing_offset == PROFILE_NO_LISTING || mark->listing_offset < written ||
+            mark->listing_offset >= length || !sim->executions[mark->pc]) {
+            continue;
+        }
+        fwrite(listing + written, 1, mark->listing_offset - written, stream);
+        size_t line_start = mark->listing_offset;
+        while (line_start > 0 && listing[line_start - 1] != '\n') {
+            line_start--;
+        }
+        int column = (int)(mark->listing_offset - line_start);
+        fprintf(stream, "%*s; %lux %llu cycles", column < PROFILE_LISTING_COLUMN ? PROFILE_LISTING_COLUMN - column : 1, "",
+            sim->executions[mark->pc], sim->address_cycles[mark->pc]);
+        written = mark->listing_offset;
+    }
+    fwrite(listing + written, 1, length - written, stream);
+}
@@ -0,0 +1,55 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef profile_h
+#define profile_h
+
+#include "simulator.h"
+#include "source_manager.h"
+#include <stdio.h>
+
+#define PROFILE_MAX_CYCLES      100000000ULL
+
+#define PROFILE_NO_LISTING      ((size_t)-1)
+
+/* an assembled instruction, where it ends in the listing and what source it came from */
+typedef struct profile_mark
+{
+    int pc;
+    size_t listing_offset;
+    source_loc loc;
+
+} profile_mark;
+
+/* the hot spots of the assembled program when run from an entry point (--profile) */
+typedef struct profile
+{
+    profile_mark *marks;
+    size_t count;
+    size_t capacity;
+    simulator *sim;
+    simulator_stop stop;
+
+} profile;
+
+profile *profile_create(void);
+void profile_reset(profile *profile);
+void profile_destroy(profile *profile);
+
+void profile_mark_instruction(profile *profile, int pc, size_t listing_offset, source_loc loc);
+
+/* simulate the image from entry, returns 0 if the cpu cannot be simulated */
+int profile_run(profile *profile, int cpu, const char *image, int entry);
+
+void profile_report(const profile *profile, FILE *stream);
+
+/* write the listing with each executed instruction's count and cycles appended */
+void profile_write_listing(const profile *profile, const char *listing, size_t length, FILE *stream);
+
+#endif /* profile_h */
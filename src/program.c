@@ -0,0 +1,174 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "m6502.h"
+#include "memory.h"
+#include "program.h"
+#include "statement.h"
+#include "token.h"
+#include <string.h>
+
+program_kind program_statement_kind(const statement *statement)
+{
+    const token *instruction = statement->instruction;
+    if (!instruction) {
+        return PROGRAM_KIND_LABEL;
+    }
+    if ((instruction->type >= TOKEN_ANC && instruction->type <= TOKEN_TOP) ||
+        (instruction->type >= TOKEN_BBR && instruction->type <= TOKEN_XCE) ||
+        instruction->type >= TOKEN_ADC) {
+        return instruction->type <= TOKEN_TYA ? PROGRAM_KIND_INSTRUCTION : PROGRAM_KIND_PSEUDO_OP;
+    }
+    return instruction->type == TOKEN_EQUAL ? PROGRAM_KIND_ASSIGN : PROGRAM_KIND_LABEL;
+}
+
+static int add_label(program *program, const statement *statement)
+{
+    if (!statement->label || statement->label->type != TOKEN_IDENT) {
+        return PROGRAM_NO_LABEL;
+    }
+    char label_name[TOKEN_TEXT_MAX_LEN * 2 + 2] = {};
+    statement_get_label_name(statement, program->scope, label_name);
+    int is_local = *token_get_text(statement->label) == '_';
+    if (!is_local) {
+        program->scope = statement->label;
+    }
+    program->label_names[program->label_count] = strdup(label_name);
+    return (int)(program->label_count++ << 1) | is_local;
+}
+
+static void grow(program *program)
+{
+    size_t capacity = program->capacity ? program->capacity * 2 : 128;
+    program->kinds = tiny_realloc(program->kinds, capacity * sizeof(unsigned char));
+    program->opcode_rows = tiny_realloc(program->opcode_rows, capacity * sizeof(short));
+    program->forms = tiny_realloc(program->forms, capacity * sizeof(unsigned char));
+    program->operands = tiny_realloc(program->operands, capacity * sizeof(operand*));
+    program->labels = tiny_realloc(program->labels, capacity * sizeof(int));
+    program->sizes = tiny_realloc(program->sizes, capacity * sizeof(unsigned short));
+    program->pcs = tiny_realloc(program->pcs, capacity * sizeof(int));
+    program->statements = tiny_realloc(program->statements, capacity * sizeof(statement*));
+    program->label_names = tiny_realloc(program->label_names, capacity * sizeof(char*));
+    program->capacity = capacity;
+}
+
+program *program_create(void)
+{
+    return tiny_calloc(1, sizeof(program));
+}
+
+size_t program_add(program *program, const statement *statement)
+{
+    if (program->count == program->capacity) {
+        grow(program);
+    }
+    size_t i = program->count++;
+    program_kind kind = program_statement_kind(statement);
+    program->kinds[i] = (unsigned char)kind;
+    program->statements[i] = statement;
+    program->operands[i] = statement->operand;
+    /* labels are scoped in the order the first pass sees them */
+    program->labels[i] = add_label(program, statement);
+    program->opcode_rows[i] = 0;
+    program->forms[i] = 0;
+    program->sizes[i] = 0;
+    program->pcs[i] = 0;
+    if (kind == PROGRAM_KIND_INSTRUCTION) {
+        program->opcode_rows[i] = (short)m6502_opcode_row(statement->instruction->type);
+        program->forms[i] = (unsigned char)m6502_classify(statement->instruction->type, statement->operand);
+    }
+    return i;
+}
+
+program *program_share(const program *program)
+{
+    struct program *view = tiny_malloc(sizeof(struct program));
+    *view = *program;
+    view->shared = program;
+    view->sizes = tiny_calloc(program->count ? program->count : 1, sizeof(unsigned short));
+    view->pcs = tiny_calloc(program->count ? program->count : 1, sizeof(int));
+    return view;
+}
+
+static void *copy_array(const void *src, size_t count, size_t elem_size)
+{
+    void *dest = tiny_malloc((count ? count : 1) * elem_size);
+    memcpy(dest, src, count * elem_size);
+    return dest;
+}
+
+void program_unshare(program *view)
+{
+    if (!view->shared || view->kinds != view->shared->kinds) {
+        return;
+    }
+    view->kinds = copy_array(view->shared->kinds, view->count, sizeof(*view->kinds));
+    view->opcode_rows = copy_array(view->shared->opcode_rows, view->count, sizeof(*view->opcode_rows));
+    view->forms = copy_array(view->shared->forms, view->count, sizeof(*view->forms));
+    view->operands = copy_array(view->shared->operands, view->count, sizeof(*view->operands));
+    view->statements = copy_array(view->shared->statements, view->count, sizeof(*view->statements));
+    view->labels = copy_array(view->shared->labels, view->count, sizeof(*view->labels));
+}
+
+#define REORDER(array) \
+    do { \
+        for(size_t i = 0; i < count; i++) { \
+            memcpy((char*)scratch + i * sizeof(*(array)), (array) + order[i], sizeof(*(array))); \
+        } \
+        memcpy((array) + first, scratch, count * sizeof(*(array))); \
+    } while (0)
+
+void program_reorder(program *program, size_t first, const size_t *order, size_t count)
+{
+    /* big enough for an element of any of the arrays */
+    void *scratch = tiny_malloc((count ? count : 1) * sizeof(void*));
+    REORDER(program->kinds);
+    REORDER(program->opcode_rows);
+    REORDER(program->forms);
+    REORDER(program->operands);
+    REORDER(program->labels);
+    REORDER(program->sizes);
+    REORDER(program->pcs);
+    REORDER(program->statements);
+    tiny_free(scratch);
+}
+
+void program_destroy(program *program)
+{
+    if (!program) {
+        return;
+    }
+    if (program->shared) {
+        if (program->kinds != program->shared->kinds) {
+            tiny_free(program->labels);
+            tiny_free(program->statements);
+            tiny_free(program->operands);
+            tiny_free(program->forms);
+            tiny_free(program->opcode_rows);
+            tiny_free(program->kinds);
+        }
+        tiny_free(program->pcs);
+        tiny_free(program->sizes);
+        tiny_free(program);
+        return;
+    }
+    for(size_t i = 0; i < program->label_count; i++) {
+        tiny_free(program->label_names[i]);
+    }
+    tiny_free(program->label_names);
+    tiny_free(program->statements);
+    tiny_free(program->pcs);
+    tiny_free(program->sizes);
+    tiny_free(program->labels);
+    tiny_free(program->operands);
+    tiny_free(program->forms);
+    tiny_free(program->opcode_rows);
+    tiny_free(program->kinds);
+    tiny_free(program);
+}
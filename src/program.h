@@ -0,0 +1,78 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef program_h
+#define program_h
+
+#include <stddef.h>
+
+typedef struct operand operand;
+typedef struct statement statement;
+typedef struct token token;
+
+/*
+
+A program is the lowered form of the parsed statements, kept as parallel
+arrays so that later passes walk it linearly. Everything the executor would
+otherwise re-derive from the token graph on each pass (what kind of
+statement it is, its opcode row and operand form, its scoped label name)
+is resolved once here. The statements are kept only for diagnostics and
+the listing.
+**/
+
+typedef enum program_kind
+{
+    PROGRAM_KIND_LABEL,
+    PROGRAM_KIND_ASSIGN,
+    PROGRAM_KIND_INSTRUCTION,
+    PROGRAM_KIND_PSEUDO_OP,
+    PROGRAM_KIND_COUNT
+
+} program_kind;
+
+#define PROGRAM_NO_LABEL        -1
+
+#define PROGRAM_LABEL_ID(l)         ((l) >> 1)
+#define PROGRAM_LABEL_IS_LOCAL(l)   ((l) & 1)
+
+typedef struct program
+{
+    size_t count;
+    unsigned char *kinds;
+    short *opcode_rows;
+    unsigned char *forms;
+    const operand **operands;
+    int *labels;
+    unsigned short *sizes;
+    int *pcs;
+    const statement **statements;
+    char **label_names;
+    size_t label_count;
+    size_t capacity;
+    const token *scope;
+    const struct program *shared;
+
+} program;
+
+program_kind program_statement_kind(const statement *statement);
+
+program *program_create(void);
+size_t program_add(program *program, const statement *statement);
+
+/* a view of a lowered program with its own sizes, for assembling it concurrently */
+program *program_share(const program *program);
+
+/* give a view its own copy of the lowered statements, so that they can be rewritten */
+void program_unshare(program *view);
+
+/* move the statements from first on into the given order, where order holds their current indices */
+void program_reorder(program *program, size_t first, const size_t *order, size_t count);
+void program_destroy(program *program);
+
+#endif /* program_h */
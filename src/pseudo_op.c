@@ -8,17 +8,26 @@
 */
 
 #include "assembly_context.h"
+#include "compress.h"
+#include "cycles.h"
+#include "dead_code.h"
+#include "encoding.h"
 #include "error.h"
 #include "expression.h"
 #include "evaluator.h"
 #include "memory.h"
 #include "operand.h"
 #include "output.h"
+#include "page_layout.h"
+#include "prefetch.h"
 #include "pseudo_op.h"
 #include "string_htable.h"
 #include "symbol_table.h"
+#include "test_suite.h"
 #include "token.h"
 #include "value.h"
+#include "zp_allocator.h"
+#include <ctype.h>
 #include <stdio.h>
 #include <limits.h>
 #include <string.h>
@@ -40,13 +49,40 @@ static value get_expr_value(assembly_context *context, const operand *operand, v
     return v;
 }
 
+/* output the values, each run of known values as one span and each run of the others left as it is */
+static void emit_values(output *output, const char *bytes, const char *known, size_t count, int size)
+{
+    size_t first = 0;
+    while (first < count) {
+        size_t run = first;
+        while (run < count && known[run] == known[first]) {
+            run++;
+        }
+        size_t length = (run - first) * size;
+        if (!known[first]) {
+            output_fill(output, (int)length);
+        } else {
+            char *span = output_reserve(output, length);
+            if (!span) {
+                return;
+            }
+            memcpy(span, bytes + first * size, length);
+        }
+        first = run;
+    }
+}
+
 static void gen_values(assembly_context *context, const operand *operand, int size)
 {
     const pseudo_op_arg **values = (const pseudo_op_arg**)operand->pseudo_op_arg_args.args->data;
     size_t count = operand->pseudo_op_arg_args.args->count;
-    for(size_t i = 0; i < count; i++) {
+    char *bytes = tiny_malloc(count ? count * size : 1);
+    char *known = tiny_calloc(count ? count : 1, sizeof(char));
+    /* the whole list is evaluated first, each value with '*' at its own address */
+    int logical_pc = context->output->logical_pc;
+    size_t i;
+    for(i = 0; i < count; i++) {
         if (values[i]->arg_type == PSEUDO_OP_QUERY) {
-            output_fill(context->output, size);
             continue;
         }
         value v;
@@ -54,59 +90,43 @@ static void gen_values(assembly_context *context, const operand *operand, int si
         if (expr->value != VALUE_UNDEFINED) {
             v = expr->value;
         } else {
+            context->output->logical_pc = logical_pc + (int)(i * size);
             v = evaluate_expression(context, expr);
         }
         if (value_size(v) > size) {
             if (context->pass_needed || v == VALUE_UNDEFINED) {
-                output_fill(context->output, size);
                 continue;
             }
             tiny_error(expr->token, ERROR_MODE_RECOVER, "Illegal quantity %lld", v);
-            return;
-         }
-         output_add(context->output, v, size);
+            break;
+        }
+        memcpy(bytes + i * size, &v, size);
+        known[i] = 1;
     }
+    context->output->logical_pc = logical_pc;
+    /* the values before an illegal one are still output */
+    emit_values(context->output, bytes, known, i, size);
+    tiny_free(known);
+    tiny_free(bytes);
 }
 
+/* copy the bytes the parser encoded the string literal to */
 static size_t gen_string(assembly_context *context, const token *str_token, int no_high_bit)
 {
-    size_t len = 0;
-    size_t str_start = str_token->src.start + 1; /* skip the quote */
-    const char *string = str_token->src.ref + str_start;
-    while (*string != '"') {
-        long c = evaluate_char_literal(string, &string);
-        len++;
-        if (c <= UINT8_MAX) {
-            if (no_high_bit && c > INT8_MAX) {
-                tiny_error(str_token, ERROR_MODE_RECOVER, "One or more string bytes invalid for directive");
-                return 0;
-            }
-            output_add(context->output, c, 1);
-        } else {
-            if (c > 0x10ffff || (c >= 0xd800 && c <= 0xdbff)) {
-                tiny_error(str_token, ERROR_MODE_RECOVER, "Illegal quantity (codepoint is not valid)");
-                return 0;
-            }
-            if (c >= 0x800) {
-                if (c >= 0x10000) {
-                    len++;
-                    output_add(context->output, (((c >> 18) & 0x07) | 0xF0), 1);
-                    output_add(context->output, (((c >> 12) & 0x3F) | 0x80), 1);
-                } else {
-                    output_add(context->output, (((c >> 12) & 0x0F) | 0xE0), 1);
-                }
-                len++;
-                output_add(context->output, (((c >> 6) & 0x3F) | 0x80), 1);
-                output_add(context->output, (((c     ) & 0x3F) | 0x80), 1);
-            } else {
-                len++;
-                output_add(context->output, (((c >> 6) & 0x1F) | 0xC0), 1);
-            }
-            len++;
-            output_add(context->output, ((c & 0x3F) | 0x80), 1);
-        }
+    const encoded_string *encoded = encoding_get(str_token);
+    if (!encoded) {
+        /* it has a character that is not valid, which the parser reported */
+        return 0;
+    }
+    if (no_high_bit && encoded->high_bit) {
+        tiny_error(str_token, ERROR_MODE_RECOVER, "One or more string bytes invalid for directive");
+        return 0;
+    }
+    char *span = output_reserve(context->output, encoded->length);
+    if (span) {
+        memcpy(span, encoding_bytes(encoded), encoded->length);
     }
-    return len;
+    return encoded->length;
 }
 
 static void gen_strings(assembly_context *context, token_type directive, const operand *operand)
@@ -151,6 +171,10 @@ static void gen_strings(assembly_context *context, token_type directive, const o
         }
         output_add(context->output, v, (int)val_size);
     }
+    if (!output_bytes && (directive == TOKEN_LSTRING || directive == TOKEN_NSTRING)) {
+        /* there is no last byte to mark */
+        return;
+    }
     switch (directive) {
         case TOKEN_CSTRING:
             output_add(context->output, 0, 1);
@@ -209,14 +233,14 @@ static void gen_binary_file(assembly_context *context, const operand *operand)
         }
     }
     char file_name_text[TOKEN_TEXT_MAX_LEN] = {}, *c = file_name_text;
-    const char *file_name_src = file_token->src.ref + file_token->src.start + 1;
+    const char *file_name_src = token_get_text(file_token) + 1;
     while (*file_name_src != '"' && c != file_name_text + TOKEN_TEXT_MAX_LEN) {
         *c++ = *file_name_src++;
     }
     binary_file bf;
     htable_entry *bin_entry = string_htable_find_bucket(context->binary_files, file_name_text);
     if (!bin_entry) {
-        bf = binary_file_read(file_name_text);
+        bf = prefetch_binary_read(file_name_text);
         if (!bf.read_success) {
             tiny_error(file_token, ERROR_MODE_RECOVER, "File not found");
             return;
@@ -249,11 +273,8 @@ static void gen_fill(assembly_context *context, token_type directive, const oper
     const pseudo_op_arg **args = (const pseudo_op_arg**)operand->pseudo_op_arg_args.args->data;
     value amount = get_expr_value(context, operand, INT16_MIN, UINT16_MAX, 0);
     if (directive == TOKEN_ALIGN) {
-        int align = 0;
-        while ((context->output->logical_pc + align) % (int)amount != 0) {
-            align++;
-        }
-        amount = align;
+        int align = amount > 0 ? context->output->logical_pc % (int)amount : 0;
+        amount = align ? amount - align : 0;
     }
     if (operand->pseudo_op_arg_args.args->count > 1) {
         if (operand->pseudo_op_arg_args.args->count > 2) {
@@ -352,6 +373,285 @@ static void set_register_sizes(assembly_context *context, const token *directive
     }
 }
 
+static void add_cycle_budget(assembly_context *context, const token *directive_token, const operand *operand)
+{
+    if (operand->pseudo_op_arg_args.args->count != 3) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive expects a start address, an end address and a cycle count");
+        return;
+    }
+    value start = get_expr_value(context, operand, INT16_MIN, UINT16_MAX, 0);
+    value end = get_expr_value(context, operand, INT16_MIN, UINT16_MAX, 1);
+    value budget = get_expr_value(context, operand, 0, INT32_MAX, 2);
+    if (start == VALUE_UNDEFINED || end == VALUE_UNDEFINED || budget == VALUE_UNDEFINED) {
+        return;
+    }
+    /* the region runs from start up to but not including end */
+    cycle_log_add_budget(context->cycle_log, directive_token, (int)start & 0xffff, (int)end & 0xffff,
+        (int)budget, directive_token->type == TOKEN_CYCLEEXACT);
+}
+
+static const token *string_arg(const pseudo_op_arg *arg)
+{
+    if (arg->arg_type != PSEUDO_OP_EXPRESSION || arg->arg.expression->type != TYPE_LITERAL ||
+        arg->arg.expression->token->type != TOKEN_STRINGLITERAL) {
+        return NULL;
+    }
+    return arg->arg.expression->token;
+}
+
+/* 1 if a jump table is aligned to a page, 0 if it is not, or -1 if its option is not valid */
+static int jump_table_is_paged(const operand *operand)
+{
+    const token *option = string_arg(operand->pseudo_op_arg_args.args->data[0]);
+    if (!option) {
+        return 0;
+    }
+    TOKEN_GET_TEXT(option, name);
+    return strcmp(name, "\"page\"") ? -1 : 1;
+}
+
+int pseudo_op_label_padding(const assembly_context *context, const token *directive_token, const operand *operand)
+{
+    if ((directive_token->type != TOKEN_JUMPTABLE && directive_token->type != TOKEN_RTSTABLE) ||
+        jump_table_is_paged(operand) != 1) {
+        return 0;
+    }
+    int offset = context->output->logical_pc & 0xff;
+    return offset ? 0x100 - offset : 0;
+}
+
+/* the low bytes of each address, then the high bytes, less one for dispatch through rts */
+static void gen_jump_table(assembly_context *context, const token *directive_token, const operand *operand)
+{
+    const pseudo_op_arg **args = (const pseudo_op_arg**)operand->pseudo_op_arg_args.args->data;
+    size_t count = operand->pseudo_op_arg_args.args->count;
+    int paged = jump_table_is_paged(operand);
+    if (paged < 0) {
+        TOKEN_GET_TEXT(args[0]->arg.expression->token, name);
+        tiny_error(args[0]->arg.expression->token, ERROR_MODE_RECOVER, "Unknown jump table option %s", name);
+        return;
+    }
+    const pseudo_op_arg **entries = args + paged;
+    count -= paged;
+    if (!count) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive expects one or more addresses");
+        return;
+    }
+    if (paged && count > 0x100) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "A page-aligned jump table cannot have more than 256 entries");
+        return;
+    }
+    /* the entries are evaluated before the table is reserved, so '*' is the table's start */
+    int adjust = directive_token->type == TOKEN_RTSTABLE;
+    int *addresses = tiny_malloc(count * sizeof(int));
+    for(size_t i = 0; i < count; i++) {
+        addresses[i] = -1;
+        if (entries[i]->arg_type == PSEUDO_OP_QUERY) {
+            continue;
+        }
+        value v = evaluate_expression(context, entries[i]->arg.expression);
+        if (v == VALUE_UNDEFINED) {
+            continue;
+        }
+        if (v < 0 || v > UINT16_MAX) {
+            if (!context->pass_needed) {
+                tiny_error(expression_get_lhs_token(entries[i]->arg.expression), ERROR_MODE_RECOVER, "Illegal quantity");
+            }
+            continue;
+        }
+        addresses[i] = (int)((v - adjust) & 0xffff);
+    }
+    /* with "page" the high bytes follow on the same page if both tables fit, and start the next
+       page if not, so each table is indexed without crossing one */
+    size_t high = paged && 2 * count > 0x100 ? 0x100 : count;
+    char *span = output_reserve(context->output, high + count);
+    for(size_t i = 0; span && i < count; i++) {
+        if (addresses[i] >= 0) {
+            span[i] = (char)(addresses[i] & 0xff);
+            span[high + i] = (char)(addresses[i] >> 8);
+        }
+    }
+    tiny_free(addresses);
+}
+
+static void begin_compress(assembly_context *context, const token *directive_token, const operand *operand)
+{
+    if (operand) {
+        const pseudo_op_arg_array *args = operand->pseudo_op_arg_args.args;
+        const token *algorithm = args->count == 1 ? string_arg(args->data[0]) : NULL;
+        if (!algorithm) {
+            tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive expects an optional algorithm");
+            return;
+        }
+        TOKEN_GET_TEXT(algorithm, name);
+        if (strcmp(name, "\"lz\"")) {
+            tiny_error(algorithm, ERROR_MODE_RECOVER, "Unknown compression algorithm %s", name);
+            return;
+        }
+    }
+    compress_begin(context->compress, context, directive_token);
+}
+
+static void begin_test(assembly_context *context, const token *directive_token, const operand *operand)
+{
+    const pseudo_op_arg **args = (const pseudo_op_arg**)operand->pseudo_op_arg_args.args->data;
+    size_t count = operand->pseudo_op_arg_args.args->count;
+    const token *name_token = string_arg(args[0]);
+    if (!name_token || count < 2 || count > 3) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive expects a test name, a routine and an optional cycle limit");
+        return;
+    }
+    value routine = get_expr_value(context, operand, INT16_MIN, UINT16_MAX, 1);
+    value max_cycles = count > 2 ? get_expr_value(context, operand, 1, INT32_MAX, 2) : 0;
+    TOKEN_GET_TEXT(name_token, name);
+    /* strip the quotes */
+    name[strlen(name) - 1] = '\0';
+    if (!test_suite_begin(context->tests, directive_token, name + 1, (int)routine & 0xffff,
+        max_cycles == VALUE_UNDEFINED ? 0 : (unsigned long long)max_cycles)) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Tests cannot be nested");
+    }
+}
+
+static void add_test_condition(assembly_context *context, const token *directive_token, const operand *operand)
+{
+    if (!context->tests->open) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive is only valid inside a test");
+        return;
+    }
+    const pseudo_op_arg **args = (const pseudo_op_arg**)operand->pseudo_op_arg_args.args->data;
+    size_t count = operand->pseudo_op_arg_args.args->count;
+    const token *register_token = string_arg(args[0]);
+    if (count < 2 || (register_token && count > 2)) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive expects a register or an address followed by its value");
+        return;
+    }
+    int is_expectation = directive_token->type == TOKEN_EXPECT;
+    if (register_token) {
+        TOKEN_GET_TEXT(register_token, reg);
+        int reg_name = tolower((unsigned char)reg[1]);
+        if (strlen(reg) != 3 || !strchr("apsxy", reg_name)) {
+            tiny_error(register_token, ERROR_MODE_RECOVER, "Register must be one of \"a\", \"x\", \"y\", \"p\" or \"s\"");
+            return;
+        }
+        value v = get_expr_value(context, operand, INT8_MIN, UINT8_MAX, 1);
+        if (v != VALUE_UNDEFINED) {
+            test_suite_add_condition(context->tests, directive_token, is_expectation, reg_name, 0, (int)v & 0xff);
+        }
+        return;
+    }
+    /* an address followed by one or more bytes */
+    value address = get_expr_value(context, operand, 0, UINT16_MAX, 0);
+    for(size_t i = 1; i < count && address != VALUE_UNDEFINED; i++) {
+        value v = get_expr_value(context, operand, INT8_MIN, UINT8_MAX, i);
+        if (v != VALUE_UNDEFINED) {
+            test_suite_add_condition(context->tests, directive_token, is_expectation, 0, (int)(address + i - 1) & 0xffff, (int)v & 0xff);
+        }
+    }
+}
+
+static void end_test(assembly_context *context, const token *directive_token)
+{
+    if (!test_suite_end(context->tests)) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive \".endtest\" without a matching \".test\"");
+    }
+}
+
+static void set_zp_range(assembly_context *context, const token *directive_token, const operand *operand)
+{
+    size_t count = operand->pseudo_op_arg_args.args->count;
+    if (context->passes) {
+        /* variables are only placed after the first pass */
+        return;
+    }
+    if (count < 2 || count > 3) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive expects a start address, an end address and an optional spill address");
+        return;
+    }
+    value start = get_expr_value(context, operand, 0, UINT8_MAX, 0);
+    value end = get_expr_value(context, operand, 0, UINT8_MAX, 1);
+    value spill = count > 2 ? get_expr_value(context, operand, 0, UINT16_MAX, 2) : -1;
+    if (start == VALUE_UNDEFINED || end == VALUE_UNDEFINED || spill == VALUE_UNDEFINED) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Zero page range must be constant");
+        return;
+    }
+    if (end < start) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Zero page range ends before it starts");
+        return;
+    }
+    zp_allocator_set_range(context->zp_vars, directive_token, (int)start, (int)end, (int)spill);
+}
+
+static void begin_page_block(assembly_context *context, const token *directive_token, const operand *operand)
+{
+    value span = 0;
+    if (operand) {
+        if (operand->pseudo_op_arg_args.args->count > 1) {
+            tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive expects an optional span");
+            return;
+        }
+        span = get_expr_value(context, operand, 1, 256, 0);
+        if (span == VALUE_UNDEFINED) {
+            /* keep the whole block on one page until the span is known */
+            span = 0;
+        }
+    }
+    int padding = page_layout_begin(context->pages, directive_token, (int)span, context->output->logical_pc);
+    if (padding < 0) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Page-sensitive blocks cannot be nested");
+        return;
+    }
+    output_fill(context->output, padding);
+}
+
+static void end_page_block(assembly_context *context, const token *directive_token)
+{
+    int size;
+    int resized = page_layout_end(context->pages, context->output->logical_pc, &size);
+    if (resized < 0) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive \".endpagesafe\" without a matching \".pagesafe\"");
+        return;
+    }
+    const page_block *block = context->pages->blocks + context->pages->current - 1;
+    if (resized && !block->span) {
+        /* the padding before the block depends on its size */
+        context->pass_needed = 1;
+    } else if (!block->span && size > 256 && !context->pass_needed) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Page-sensitive block is larger than a page");
+    }
+}
+
+static void mark_proc(assembly_context *context, const token *directive_token)
+{
+    if (context->passes) {
+        /* blocks are only found on the first pass */
+        return;
+    }
+    if (directive_token->type == TOKEN_PROC) {
+        if (!dead_code_begin(context->procs, directive_token)) {
+            tiny_error(directive_token, ERROR_MODE_RECOVER, "Procedures cannot be nested");
+        }
+    } else if (!dead_code_end(context->procs)) {
+        tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive \".endproc\" without a matching \".proc\"");
+    }
+}
+
+static void export_symbols(assembly_context *context, const token *directive_token, const operand *operand)
+{
+    const pseudo_op_arg **args = (const pseudo_op_arg**)operand->pseudo_op_arg_args.args->data;
+    for(size_t i = 0; i < operand->pseudo_op_arg_args.args->count; i++) {
+        if (args[i]->arg_type != PSEUDO_OP_EXPRESSION || args[i]->arg.expression->type != TYPE_IDENT) {
+            tiny_error(directive_token, ERROR_MODE_RECOVER, "Directive \".export\" expects a list of labels");
+            return;
+        }
+        if (!context->passes) {
+            TOKEN_GET_TEXT(args[i]->arg.expression->token, name);
+            dead_code_add_reference(context->procs, name, 1);
+        }
+        /* report a symbol that is never defined */
+        evaluate_expression(context, args[i]->arg.expression);
+    }
+}
+
 static void set_print_off_on(assembly_context *context, token_type directive, const operand *operand)
 {
     context->print_off = directive == TOKEN_PROFF;
@@ -380,6 +680,40 @@ void pseudo_op_gen(assembly_context *context, const token *directive_token, cons
         case TOKEN_DP: set_page(context, directive_token, operand); break;
         case TOKEN_PRON:
         case TOKEN_PROFF: set_print_off_on(context, directive, operand); break;
+        case TOKEN_CYCLELIMIT:
+        case TOKEN_CYCLEEXACT: add_cycle_budget(context, directive_token, operand); break;
+        case TOKEN_TEST: begin_test(context, directive_token, operand); break;
+        case TOKEN_GIVEN:
+        case TOKEN_EXPECT: add_test_condition(context, directive_token, operand); break;
+        case TOKEN_ENDTEST: end_test(context, directive_token); break;
+        case TOKEN_OPTON:
+        case TOKEN_OPTOFF: break; /* read by the peephole optimizer */
+        case TOKEN_ZPVAR: break; /* placed by the zero page allocator */
+        case TOKEN_ZPRANGE: set_zp_range(context, directive_token, operand); break;
+        case TOKEN_PAGESAFE: begin_page_block(context, directive_token, operand); break;
+        case TOKEN_ENDPAGESAFE: end_page_block(context, directive_token); break;
+        case TOKEN_PAGEREGION:
+        case TOKEN_ENDPAGEREGION: break; /* read by the page layout */
+        case TOKEN_INLINE:
+        case TOKEN_ENDINLINE: break; /* read by the parser */
+        case TOKEN_PROC:
+        case TOKEN_ENDPROC: mark_proc(context, directive_token); break;
+        case TOKEN_EXPORT: export_symbols(context, directive_token, operand); break;
+        case TOKEN_REPEAT:
+        case TOKEN_ENDREPEAT:
+        case TOKEN_FOR:
+        case TOKEN_ENDFOR:
+        case TOKEN_IF:
+        case TOKEN_IFDEF:
+        case TOKEN_IFNDEF:
+        case TOKEN_ELSE:
+        case TOKEN_ENDIF: break; /* run by the executor */
+        case TOKEN_ENCODING:
+        case TOKEN_MAP: break; /* applied by the parser */
+        case TOKEN_JUMPTABLE:
+        case TOKEN_RTSTABLE: gen_jump_table(context, directive_token, operand); break;
+        case TOKEN_COMPRESS: begin_compress(context, directive_token, operand); break;
+        case TOKEN_ENDCOMPRESS: compress_end(context->compress, context, directive_token); break;
         default: gen_strings(context, directive, operand);
     }
 }
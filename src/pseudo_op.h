@@ -16,4 +16,7 @@ typedef struct token token;
 
 void pseudo_op_gen(assembly_context *context, const token *directive_token, const operand *operand);
 
+/* the bytes to skip before the directive's label, so the label is the address of what it assembles */
+int pseudo_op_label_padding(const assembly_context *context, const token *directive_token, const operand *operand);
+
 #endif /* pseudo_op_h */
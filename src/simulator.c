@@ -0,0 +1,459 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "cycles.h"
+#include "memory.h"
+#include "options.h"
+#include "simulator.h"
+#include "token.h"
+#include <string.h>
+
+#define STACK_PAGE  0x100
+
+static int read_byte(const simulator *sim, int address)
+{
+    return sim->memory[address & 0xffff];
+}
+
+static int read_word(const simulator *sim, int address)
+{
+    return read_byte(sim, address) | (read_byte(sim, address + 1) << 8);
+}
+
+/* zero page pointers wrap within the zero page */
+static int read_zp_word(const simulator *sim, int zp)
+{
+    return read_byte(sim, zp & 0xff) | (read_byte(sim, (zp + 1) & 0xff) << 8);
+}
+
+static void write_byte(simulator *sim, int address, int value)
+{
+    sim->memory[address & 0xffff] = (unsigned char)value;
+}
+
+static void push(simulator *sim, int value)
+{
+    write_byte(sim, STACK_PAGE + sim->s, value);
+    sim->s = (sim->s - 1) & 0xff;
+}
+
+static int pull(simulator *sim)
+{
+    sim->s = (sim->s + 1) & 0xff;
+    return read_byte(sim, STACK_PAGE + sim->s);
+}
+
+static void set_flag(simulator *sim, int flag, int set)
+{
+    sim->p = set ? sim->p | flag : sim->p & ~flag;
+}
+
+static int set_nz(simulator *sim, int value)
+{
+    value &= 0xff;
+    set_flag(sim, SIMULATOR_FLAG_Z, value == 0);
+    set_flag(sim, SIMULATOR_FLAG_N, value & 0x80);
+    return value;
+}
+
+static int crosses_page(int from, int to)
+{
+    return ((from ^ to) & 0xff00) != 0;
+}
+
+static int operand_size(m6502_decoding decoding)
+{
+    switch (decoding.mode) {
+        case MODES_IMP:
+            /* the illegal nops take operands they ignore */
+            return decoding.mnemonic == TOKEN_DOP ? 1 : decoding.mnemonic == TOKEN_TOP ? 2 : 0;
+        case MODES_ACC:
+            return 0;
+        case MODES_ABS:
+        case MODES_ABSX:
+        case MODES_ABSY:
+        case MODES_IND_ABS:
+        case MODES_IND_ABS_X:
+        case MODES_BIT_OFFS:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+static int effective_address(const simulator *sim, m6502_mode mode, int *crossed)
+{
+    int operand = read_byte(sim, sim->pc + 1);
+    int base;
+    switch (mode) {
+        case MODES_ZIP:
+        case MODES_BIT:
+        case MODES_BIT_OFFS: return operand;
+        case MODES_IMM:      return (sim->pc + 1) & 0xffff;
+        case MODES_ZPX:      return (operand + sim->x) & 0xff;
+        case MODES_ZPY:      return (operand + sim->y) & 0xff;
+        case MODES_ABS:      return read_word(sim, sim->pc + 1);
+        case MODES_IND_ZP:   return read_zp_word(sim, operand);
+        case MODES_INDX:     return read_zp_word(sim, operand + sim->x);
+        case MODES_REL:      return (sim->pc + 2 + (signed char)operand) & 0xffff;
+        case MODES_ABSX:
+        case MODES_ABSY:
+            base = read_word(sim, sim->pc + 1);
+            break;
+        case MODES_INDY:
+            base = read_zp_word(sim, operand);
+            break;
+        case MODES_IND_ABS:
+            base = read_word(sim, sim->pc + 1);
+            if (sim->cpu == CPU_65C02) {
+                return read_word(sim, base);
+            }
+            /* the NMOS 6502 does not carry into the pointer's high byte */
+            return read_byte(sim, base) | (read_byte(sim, (base & 0xff00) | ((base + 1) & 0xff)) << 8);
+        case MODES_IND_ABS_X:
+            return read_word(sim, (read_word(sim, sim->pc + 1) + sim->x) & 0xffff);
+        default:
+            return 0;
+    }
+    int address = (base + (mode == MODES_ABSX ? sim->x : sim->y)) & 0xffff;
+    *crossed = crosses_page(base, address);
+    return address;
+}
+
+static void add(simulator *sim, int value)
+{
+    int carry = sim->p & SIMULATOR_FLAG_C;
+    int sum = sim->a + value + carry;
+    set_flag(sim, SIMULATOR_FLAG_V, ~(sim->a ^ value) & (sim->a ^ sum) & 0x80);
+    if (sim->p & SIMULATOR_FLAG_D) {
+        int lo = (sim->a & 0x0f) + (value & 0x0f) + carry;
+        int hi = (sim->a & 0xf0) + (value & 0xf0);
+        if (lo > 0x09) {
+            lo += 0x06;
+            hi += 0x10;
+        }
+        if (hi > 0x90) {
+            hi += 0x60;
+        }
+        sum = (lo & 0x0f) | hi;
+    }
+    set_flag(sim, SIMULATOR_FLAG_C, sum > 0xff);
+    sim->a = set_nz(sim, sum);
+}
+
+static void subtract(simulator *sim, int value)
+{
+    int borrow = !(sim->p & SIMULATOR_FLAG_C);
+    int difference = sim->a - value - borrow;
+    set_flag(sim, SIMULATOR_FLAG_V, (sim->a ^ value) & (sim->a ^ difference) & 0x80);
+    set_flag(sim, SIMULATOR_FLAG_C, difference >= 0);
+    if (sim->p & SIMULATOR_FLAG_D) {
+        int lo = (sim->a & 0x0f) - (value & 0x0f) - borrow;
+        int hi = (sim->a & 0xf0) - (value & 0xf0);
+        if (lo & 0x10) {
+            lo -= 0x06;
+            hi -= 0x10;
+        }
+        if (hi & 0x100) {
+            hi -= 0x60;
+        }
+        difference = (lo & 0x0f) | hi;
+    }
+    sim->a = set_nz(sim, difference);
+}
+
+static void compare(simulator *sim, int reg, int value)
+{
+    set_flag(sim, SIMULATOR_FLAG_C, reg >= value);
+    set_nz(sim, reg - value);
+}
+
+static int shift(simulator *sim, int mnemonic, int value)
+{
+    int carry_in = sim->p & SIMULATOR_FLAG_C;
+    int result;
+    if (mnemonic == TOKEN_ASL || mnemonic == TOKEN_ROL) {
+        set_flag(sim, SIMULATOR_FLAG_C, value & 0x80);
+        result = (value << 1) | (mnemonic == TOKEN_ROL ? carry_in : 0);
+    } else {
+        set_flag(sim, SIMULATOR_FLAG_C, value & 0x01);
+        result = (value >> 1) | (mnemonic == TOKEN_ROR && carry_in ? 0x80 : 0);
+    }
+    return set_nz(sim, result);
+}
+
+/* the cycles a branch adds to its base when taken */
+static int branch(simulator *sim, int taken, int target, int always)
+{
+    if (!taken) {
+        return 0;
+    }
+    int cycles = always ? 0 : 1;
+    if (sim->cpu != CPU_65816 && crosses_page(sim->pc, target)) {
+        cycles++;
+    }
+    sim->pc = target;
+    return cycles;
+}
+
+static int is_set(const simulator *sim, int flag)
+{
+    return (sim->p & flag) != 0;
+}
+
+int simulator_step(simulator *sim, simulator_stop *stop)
+{
+    int pc = sim->pc;
+    int opcode = read_byte(sim, pc);
+    m6502_decoding decoding = sim->decoding[opcode];
+    int cycles = cycles_base(sim->cpu, opcode);
+    if (!decoding.mnemonic || !cycles) {
+        *stop = decoding.mnemonic ? SIMULATOR_HALTED : SIMULATOR_UNSUPPORTED;
+        return 0;
+    }
+    int crossed = 0;
+    int ea = effective_address(sim, decoding.mode, &crossed);
+    int on_accumulator = decoding.mode == MODES_IMP || decoding.mode == MODES_ACC;
+    int decimal_penalty = sim->cpu == CPU_65C02 && is_set(sim, SIMULATOR_FLAG_D);
+    int mnemonic = decoding.mnemonic;
+    int value;
+    sim->pc = (pc + 1 + operand_size(decoding)) & 0xffff;
+    switch (mnemonic) {
+        case TOKEN_ADC: add(sim, read_byte(sim, ea)); cycles += decimal_penalty; break;
+        case TOKEN_SBC: subtract(sim, read_byte(sim, ea)); cycles += decimal_penalty; break;
+        case TOKEN_AND: sim->a = set_nz(sim, sim->a & read_byte(sim, ea)); break;
+        case TOKEN_EOR: sim->a = set_nz(sim, sim->a ^ read_byte(sim, ea)); break;
+        case TOKEN_ORA: sim->a = set_nz(sim, sim->a | read_byte(sim, ea)); break;
+        case TOKEN_ASL:
+        case TOKEN_LSR:
+        case TOKEN_ROL:
+        case TOKEN_ROR:
+            if (on_accumulator) {
+                sim->a = shift(sim, mnemonic, sim->a);
+            } else {
+                write_byte(sim, ea, shift(sim, mnemonic, read_byte(sim, ea)));
+            }
+            break;
+        case TOKEN_BIT:
+            value = read_byte(sim, ea);
+            set_flag(sim, SIMULATOR_FLAG_Z, (sim->a & value) == 0);
+            if (decoding.mode != MODES_IMM) {
+                set_flag(sim, SIMULATOR_FLAG_N, value & 0x80);
+                set_flag(sim, SIMULATOR_FLAG_V, value & 0x40);
+            }
+            break;
+        case TOKEN_BCC: cycles += branch(sim, !is_set(sim, SIMULATOR_FLAG_C), ea, 0); break;
+        case TOKEN_BCS: cycles += branch(sim, is_set(sim, SIMULATOR_FLAG_C), ea, 0); break;
+        case TOKEN_BEQ: cycles += branch(sim, is_set(sim, SIMULATOR_FLAG_Z), ea, 0); break;
+        case TOKEN_BNE: cycles += branch(sim, !is_set(sim, SIMULATOR_FLAG_Z), ea, 0); break;
+        case TOKEN_BMI: cycles += branch(sim, is_set(sim, SIMULATOR_FLAG_N), ea, 0); break;
+        case TOKEN_BPL: cycles += branch(sim, !is_set(sim, SIMULATOR_FLAG_N), ea, 0); break;
+        case TOKEN_BVC: cycles += branch(sim, !is_set(sim, SIMULATOR_FLAG_V), ea, 0); break;
+        case TOKEN_BVS: cycles += branch(sim, is_set(sim, SIMULATOR_FLAG_V), ea, 0); break;
+        case TOKEN_BRA: cycles += branch(sim, 1, ea, 1); break;
+        case TOKEN_BBR:
+        case TOKEN_BBS:
+            value = read_byte(sim, ea) & (1 << ((opcode >> 4) & 7));
+            cycles += branch(sim, mnemonic == TOKEN_BBS ? value != 0 : value == 0,
+                (sim->pc + (signed char)read_byte(sim, pc + 2)) & 0xffff, 0);
+            break;
+        case TOKEN_RMB: write_byte(sim, ea, read_byte(sim, ea) & ~(1 << ((opcode >> 4) & 7))); break;
+        case TOKEN_SMB: write_byte(sim, ea, read_byte(sim, ea) | (1 << ((opcode >> 4) & 7))); break;
+        case TOKEN_BRK:
+            sim->pc = pc;
+            *stop = SIMULATOR_BREAK;
+            return 0;
+        case TOKEN_CLC: set_flag(sim, SIMULATOR_FLAG_C, 0); break;
+        case TOKEN_CLD: set_flag(sim, SIMULATOR_FLAG_D, 0); break;
+        case TOKEN_CLI: set_flag(sim, SIMULATOR_FLAG_I, 0); break;
+        case TOKEN_CLV: set_flag(sim, SIMULATOR_FLAG_V, 0); break;
+        case TOKEN_SEC: set_flag(sim, SIMULATOR_FLAG_C, 1); break;
+        case TOKEN_SED: set_flag(sim, SIMULATOR_FLAG_D, 1); break;
+        case TOKEN_SEI: set_flag(sim, SIMULATOR_FLAG_I, 1); break;
+        case TOKEN_CMP: compare(sim, sim->a, read_byte(sim, ea)); break;
+        case TOKEN_CPX: compare(sim, sim->x, read_byte(sim, ea)); break;
+        case TOKEN_CPY: compare(sim, sim->y, read_byte(sim, ea)); break;
+        case TOKEN_DEC:
+        case TOKEN_INC:
+            value = mnemonic == TOKEN_INC ? 1 : -1;
+            if (on_accumulator) {
+                sim->a = set_nz(sim, sim->a + value);
+            } else {
+                write_byte(sim, ea, set_nz(sim, read_byte(sim, ea) + value));
+            }
+            break;
+        case TOKEN_DEX: sim->x = set_nz(sim, sim->x - 1); break;
+        case TOKEN_DEY: sim->y = set_nz(sim, sim->y - 1); break;
+        case TOKEN_INX: sim->x = set_nz(sim, sim->x + 1); break;
+        case TOKEN_INY: sim->y = set_nz(sim, sim->y + 1); break;
+        case TOKEN_JMP: sim->pc = ea; break;
+        case TOKEN_JSR:
+            push(sim, ((sim->pc - 1) >> 8) & 0xff);
+            push(sim, (sim->pc - 1) & 0xff);
+            sim->pc = ea;
+            break;
+        case TOKEN_RTS:
+            value = pull(sim);
+            sim->pc = ((value | (pull(sim) << 8)) + 1) & 0xffff;
+            break;
+        case TOKEN_RTI:
+            sim->p = (pull(sim) & ~SIMULATOR_FLAG_B) | SIMULATOR_FLAG_U;
+            value = pull(sim);
+            sim->pc = value | (pull(sim) << 8);
+            break;
+        case TOKEN_LDA: sim->a = set_nz(sim, read_byte(sim, ea)); break;
+        case TOKEN_LDX: sim->x = set_nz(sim, read_byte(sim, ea)); break;
+        case TOKEN_LDY: sim->y = set_nz(sim, read_byte(sim, ea)); break;
+        case TOKEN_STA: write_byte(sim, ea, sim->a); break;
+        case TOKEN_STX: write_byte(sim, ea, sim->x); break;
+        case TOKEN_STY: write_byte(sim, ea, sim->y); break;
+        case TOKEN_STZ: write_byte(sim, ea, 0); break;
+        case TOKEN_TRB:
+        case TOKEN_TSB:
+            value = read_byte(sim, ea);
+            set_flag(sim, SIMULATOR_FLAG_Z, (sim->a & value) == 0);
+            write_byte(sim, ea, mnemonic == TOKEN_TSB ? value | sim->a : value & ~sim->a);
+            break;
+        case TOKEN_PHA: push(sim, sim->a); break;
+        case TOKEN_PHX: push(sim, sim->x); break;
+        case TOKEN_PHY: push(sim, sim->y); break;
+        case TOKEN_PHP: push(sim, sim->p | SIMULATOR_FLAG_B | SIMULATOR_FLAG_U); break;
+        case TOKEN_PLA: sim->a = set_nz(sim, pull(sim)); break;
+        case TOKEN_PLX: sim->x = set_nz(sim, pull(sim)); break;
+        case TOKEN_PLY: sim->y = set_nz(sim, pull(sim)); break;
+        case TOKEN_PLP: sim->p = (pull(sim) & ~SIMULATOR_FLAG_B) | SIMULATOR_FLAG_U; break;
+        case TOKEN_TAX: sim->x = set_nz(sim, sim->a); break;
+        case TOKEN_TAY: sim->y = set_nz(sim, sim->a); break;
+        case TOKEN_TSX: sim->x = set_nz(sim, sim->s); break;
+        case TOKEN_TXA: sim->a = set_nz(sim, sim->x); break;
+        case TOKEN_TXS: sim->s = sim->x; break;
+        case TOKEN_TYA: sim->a = set_nz(sim, sim->y); break;
+        case TOKEN_NOP:
+        case TOKEN_DOP:
+        case TOKEN_TOP: break;
+        /* the stable undocumented opcodes of the 6502i */
+        case TOKEN_LAX: sim->a = sim->x = set_nz(sim, read_byte(sim, ea)); break;
+        case TOKEN_SAX: write_byte(sim, ea, sim->a & sim->x); break;
+        case TOKEN_ANC:
+            sim->a = set_nz(sim, sim->a & read_byte(sim, ea));
+            set_flag(sim, SIMULATOR_FLAG_C, sim->a & 0x80);
+            break;
+        case TOKEN_ASR: sim->a = shift(sim, TOKEN_LSR, sim->a & read_byte(sim, ea)); break;
+        case TOKEN_DCP:
+            value = (read_byte(sim, ea) - 1) & 0xff;
+            write_byte(sim, ea, value);
+            compare(sim, sim->a, value);
+            break;
+        case TOKEN_ISB:
+            value = (read_byte(sim, ea) + 1) & 0xff;
+            write_byte(sim, ea, value);
+            subtract(sim, value);
+            break;
+        case TOKEN_SLO:
+        case TOKEN_RLA:
+        case TOKEN_SRE:
+        case TOKEN_RRA:
+            value = shift(sim, mnemonic == TOKEN_SLO ? TOKEN_ASL : mnemonic == TOKEN_RLA ? TOKEN_ROL :
+                               mnemonic == TOKEN_SRE ? TOKEN_LSR : TOKEN_ROR, read_byte(sim, ea));
+            write_byte(sim, ea, value);
+            if (mnemonic == TOKEN_SLO) {
+                sim->a = set_nz(sim, sim->a | value);
+            } else if (mnemonic == TOKEN_RLA) {
+                sim->a = set_nz(sim, sim->a & value);
+            } else if (mnemonic == TOKEN_SRE) {
+                sim->a = set_nz(sim, sim->a ^ value);
+            } else {
+                add(sim, value);
+            }
+            break;
+        case TOKEN_STP:
+        case TOKEN_STP_I:
+        case TOKEN_WAI:
+        case TOKEN_JAM:
+            sim->pc = pc;
+            *stop = SIMULATOR_HALTED;
+            return 0;
+        default:
+            sim->pc = pc;
+            *stop = SIMULATOR_UNSUPPORTED;
+            return 0;
+    }
+    int crossing = crossed && cycles_reads_across_page(sim->cpu, opcode);
+    cycles += crossing;
+    if (sim->executions) {
+        sim->page_crossings[pc] += crossing;
+        sim->executions[pc]++;
+        sim->address_cycles[pc] += cycles;
+    }
+    sim->cycles += cycles;
+    return cycles;
+}
+
+simulator_stop simulator_call(simulator *sim, int address, unsigned long long max_cycles)
+{
+    int stack = sim->s;
+    simulator_stop stop = SIMULATOR_RETURNED;
+    /* the return address is never reached, an rts back to this depth ends the call */
+    push(sim, 0xff);
+    push(sim, 0xff);
+    sim->pc = address & 0xffff;
+    unsigned long long limit = sim->cycles + max_cycles;
+    while (sim->cycles < limit) {
+        int returning = read_byte(sim, sim->pc) == 0x60;
+        if (!simulator_step(sim, &stop)) {
+            return stop;
+        }
+        if (returning && sim->s == stack) {
+            return SIMULATOR_RETURNED;
+        }
+    }
+    return SIMULATOR_CYCLE_LIMIT;
+}
+
+const char *simulator_stop_reason(simulator_stop stop)
+{
+    switch (stop) {
+        case SIMULATOR_RETURNED:    return "returned";
+        case SIMULATOR_BREAK:       return "stopped at brk";
+        case SIMULATOR_HALTED:      return "halted";
+        case SIMULATOR_UNSUPPORTED: return "stopped at an unsupported opcode";
+        default:                    return "reached the cycle limit";
+    }
+}
+
+simulator *simulator_create(int cpu, const char *image)
+{
+    simulator *sim = tiny_calloc(1, sizeof(simulator));
+    sim->cpu = cpu;
+    sim->s = 0xff;
+    sim->p = SIMULATOR_FLAG_U | SIMULATOR_FLAG_I;
+    memcpy(sim->memory, image, sizeof sim->memory);
+    m6502_decode_table(cpu, sim->decoding);
+    return sim;
+}
+
+void simulator_enable_profile(simulator *sim)
+{
+    if (!sim->executions) {
+        sim->executions = tiny_calloc(0x10000, sizeof(unsigned long));
+        sim->address_cycles = tiny_calloc(0x10000, sizeof(unsigned long long));
+        sim->page_crossings = tiny_calloc(0x10000, sizeof(unsigned long));
+    }
+}
+
+void simulator_destroy(simulator *sim)
+{
+    if (!sim) {
+        return;
+    }
+    tiny_free(sim->page_crossings);
+    tiny_free(sim->address_cycles);
+    tiny_free(sim->executions);
+    tiny_free(sim);
+}
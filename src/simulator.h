@@ -0,0 +1,75 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef simulator_h
+#define simulator_h
+
+#include "m6502.h"
+
+#define SIMULATOR_FLAG_C    0x01
+#define SIMULATOR_FLAG_Z    0x02
+#define SIMULATOR_FLAG_I    0x04
+#define SIMULATOR_FLAG_D    0x08
+#define SIMULATOR_FLAG_B    0x10
+#define SIMULATOR_FLAG_U    0x20
+#define SIMULATOR_FLAG_V    0x40
+#define SIMULATOR_FLAG_N    0x80
+
+typedef enum simulator_stop
+{
+    SIMULATOR_RETURNED,
+    SIMULATOR_BREAK,
+    SIMULATOR_HALTED,
+    SIMULATOR_UNSUPPORTED,
+    SIMULATOR_CYCLE_LIMIT
+
+} simulator_stop;
+
+/*
+
+A simulated 6502 or 65C02 running an assembled image. Each instruction is
+decoded through the assembler's own opcode maps and costs the cycles the
+listing reports, plus whatever page crossings and taken branches it actually
+incurs. With profiling on, the executions, cycles and indexed reads that
+crossed a page of every address are counted.
+**/
+
+typedef struct simulator
+{
+    int cpu;
+    int a;
+    int x;
+    int y;
+    int s;
+    int p;
+    int pc;
+    unsigned long long cycles;
+    unsigned long *executions;
+    unsigned long long *address_cycles;
+    unsigned long *page_crossings;
+    m6502_decoding decoding[256];
+    unsigned char memory[0x10000];
+
+} simulator;
+
+/* the image is the full 64K of the assembled output */
+simulator *simulator_create(int cpu, const char *image);
+void simulator_destroy(simulator *sim);
+
+void simulator_enable_profile(simulator *sim);
+
+/* execute one instruction, returning its cycles or 0 if the cpu cannot continue */
+int simulator_step(simulator *sim, simulator_stop *stop);
+
+/* run the code at address as a subroutine until it returns or stops */
+simulator_stop simulator_call(simulator *sim, int address, unsigned long long max_cycles);
+
+const char *simulator_stop_reason(simulator_stop stop);
+
+#endif /* simulator_h */
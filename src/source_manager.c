@@ -0,0 +1,211 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "error.h"
+#include "memory.h"
+#include "source_manager.h"
+#include <string.h>
+
+typedef struct line_entry
+{
+    source_loc start;
+    int line_number;
+    int context;
+    const char *text;
+
+} line_entry;
+
+typedef struct source_context
+{
+    int file_id;
+    int is_expansion;
+    source_loc parent;
+
+} source_context;
+
+typedef struct source_manager
+{
+    chunked_array lines;
+    chunked_array contexts;
+    chunked_array file_names;
+    atomic_uint next_loc;
+
+} source_manager;
+
+/* location 0 is reserved for SOURCE_LOC_INVALID */
+static source_manager manager = {
+    .lines = { .elem_size = sizeof(line_entry) },
+    .contexts = { .elem_size = sizeof(source_context) },
+    .file_names = { .elem_size = sizeof(char*) },
+    .next_loc = 1
+};
+
+/* lines are added on the thread that parses while other threads decode the locations of
+   lines already added, so the tables are chunked and never move */
+static _Thread_local size_t last_line;
+
+#define LINE_AT(i)      CHUNKED_ARRAY_AT(&manager.lines, line_entry, i)
+#define CONTEXT_AT(i)   CHUNKED_ARRAY_AT(&manager.contexts, source_context, i)
+#define FILE_NAME_AT(i) (*CHUNKED_ARRAY_AT(&manager.file_names, char*, i))
+
+static int file_id(const char *file_name)
+{
+    if (!file_name) {
+        return -1;
+    }
+    size_t count = chunked_array_count(&manager.file_names);
+    for(size_t i = 0; i < count; i++) {
+        if (strcmp(FILE_NAME_AT(i), file_name) == 0) {
+            return (int)i;
+        }
+    }
+    *(char**)chunked_array_next(&manager.file_names) = strdup(file_name);
+    return (int)chunked_array_publish(&manager.file_names);
+}
+
+static int add_context(int file, source_loc parent, int is_expansion)
+{
+    source_context *context = chunked_array_next(&manager.contexts);
+    context->file_id = file;
+    context->parent = parent;
+    context->is_expansion = is_expansion;
+    return (int)chunked_array_publish(&manager.contexts);
+}
+
+static const line_entry *find_line(source_loc loc)
+{
+    size_t line_count = chunked_array_count(&manager.lines);
+    if (loc == SOURCE_LOC_INVALID || !line_count || loc >= atomic_load_explicit(&manager.next_loc, memory_order_relaxed)) {
+        return NULL;
+    }
+    /* tokens are mostly decoded in source order, so check the last hit first */
+    if (last_line >= line_count) {
+        last_line = 0;
+    }
+    const line_entry *last = LINE_AT(last_line);
+    if (loc >= last->start &&
+        (last_line + 1 == line_count || loc < LINE_AT(last_line + 1)->start)) {
+        return last;
+    }
+    size_t lo = 0, hi = line_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (LINE_AT(mid)->start <= loc) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    last_line = lo;
+    return LINE_AT(lo);
+}
+
+int source_manager_add_file(const char *file_name, source_loc include_loc)
+{
+    return add_context(file_id(file_name), include_loc, 0);
+}
+
+int source_manager_add_expansion(source_loc expansion_loc, source_loc definition_loc)
+{
+    const line_entry *definition = find_line(definition_loc);
+    int file = definition ? CONTEXT_AT(definition->context)->file_id : -1;
+    return add_context(file, expansion_loc, 1);
+}
+
+source_loc source_manager_add_line(int context, const char *text, int line_number, size_t span)
+{
+    source_loc start = atomic_load_explicit(&manager.next_loc, memory_order_relaxed);
+    if (!span) {
+        span = 1;
+    }
+    if (span > UINT32_MAX - start) {
+        tiny_error(NULL, ERROR_MODE_PANIC, "Too much source to track locations for.");
+    }
+    line_entry *line = chunked_array_next(&manager.lines);
+    line->start = start;
+    line->line_number = line_number;
+    line->context = context;
+    line->text = text;
+    atomic_store_explicit(&manager.next_loc, start + (source_loc)span, memory_order_relaxed);
+    chunked_array_publish(&manager.lines);
+    return line->start;
+}
+
+const char *source_manager_text(source_loc loc)
+{
+    const line_entry *line = find_line(loc);
+    return line ? line->text + (loc - line->start) : NULL;
+}
+
+const char *source_manager_line(source_loc loc)
+{
+    const line_entry *line = find_line(loc);
+    return line ? line->text : NULL;
+}
+
+const char *source_manager_file_name(source_loc loc)
+{
+    const line_entry *line = find_line(loc);
+    if (!line) {
+        return NULL;
+    }
+    int file = CONTEXT_AT(line->context)->file_id;
+    return file < 0 ? NULL : FILE_NAME_AT(file);
+}
+
+int source_manager_line_number(source_loc loc)
+{
+    const line_entry *line = find_line(loc);
+    return line ? line->line_number : 0;
+}
+
+int source_manager_line_offset(source_loc loc)
+{
+    const line_entry *line = find_line(loc);
+    return line ? (int)(loc - line->start) : 0;
+}
+
+source_location source_manager_decode(source_loc loc)
+{
+    source_location location = {};
+    const line_entry *line = find_line(loc);
+    if (line) {
+        int file = CONTEXT_AT(line->context)->file_id;
+        location.file_name = file < 0 ? NULL : FILE_NAME_AT(file);
+        location.line_text = line->text;
+        location.line = line->line_number;
+        location.column = (int)(loc - line->start) + 1;
+    }
+    return location;
+}
+
+source_loc source_manager_parent(source_loc loc, int *is_expansion)
+{
+    const line_entry *line = find_line(loc);
+    if (!line) {
+        return SOURCE_LOC_INVALID;
+    }
+    const source_context *context = CONTEXT_AT(line->context);
+    if (is_expansion) {
+        *is_expansion = context->is_expansion;
+    }
+    return context->parent;
+}
+
+void source_manager_cleanup(void)
+{
+    size_t file_count = chunked_array_count(&manager.file_names);
+    for(size_t i = 0; i < file_count; i++) {
+        tiny_free(FILE_NAME_AT(i));
+    }
+    chunked_array_cleanup(&manager.file_names);
+    chunked_array_cleanup(&manager.contexts);
+    chunked_array_cleanup(&manager.lines);
+    atomic_store(&manager.next_loc, 1);
+}
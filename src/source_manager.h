@@ -0,0 +1,53 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef source_manager_h
+#define source_manager_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+
+The source manager maps every line the lexer or macro expander hands out
+into one flat 32-bit location space. A location is the start offset of its
+line plus the column, so tokens only need to carry a single source_loc.
+File names, include parents and macro expansion parents live once per
+context in side tables and are only decoded when a diagnostic needs them.
+**/
+
+typedef uint32_t source_loc;
+
+#define SOURCE_LOC_INVALID  0
+
+typedef struct source_location
+{
+    const char *file_name;
+    const char *line_text;
+    int line;
+    int column;
+
+} source_location;
+
+int source_manager_add_file(const char *file_name, source_loc include_loc);
+int source_manager_add_expansion(source_loc expansion_loc, source_loc definition_loc);
+source_loc source_manager_add_line(int context, const char *text, int line_number, size_t span);
+
+const char *source_manager_text(source_loc loc);
+const char *source_manager_line(source_loc loc);
+const char *source_manager_file_name(source_loc loc);
+int source_manager_line_number(source_loc loc);
+int source_manager_line_offset(source_loc loc);
+
+source_location source_manager_decode(source_loc loc);
+source_loc source_manager_parent(source_loc loc, int *is_expansion);
+
+void source_manager_cleanup(void);
+
+#endif /* source_manager_h */
@@ -11,6 +11,7 @@
 #include "operand.h"
 #include "statement.h"
 #include "token.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -25,7 +26,23 @@ statement *statement_create(token *label, token *instruction)
 
 void statement_get_source_line_from_token(const token *token, char *dest)
 {
-    strncpy(dest, token->src.ref, LINE_DISPLAY_LEN);
+    strncpy(dest, token_get_line(token), LINE_DISPLAY_LEN);
+}
+
+void statement_get_label_name(const statement *statement, const token *scope, char *dest)
+{
+    if (*token_get_text(statement->label) == '_') {
+        TOKEN_GET_TEXT(statement->label, label_text);
+        if (scope) {
+            TOKEN_GET_TEXT(scope, local_label);
+            snprintf(dest, TOKEN_TEXT_MAX_LEN, "%s.%s", local_label, label_text);
+        }
+        else {
+            strncpy(dest, label_text, TOKEN_TEXT_MAX_LEN);
+        }
+        return;
+    }
+    token_copy_text_to_buffer(statement->label, dest, TOKEN_TEXT_MAX_LEN);
 }
 
 void statement_destroy(statement *statement)
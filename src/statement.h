@@ -31,5 +31,6 @@ statement *statement_create(token *label, token *instruction);
 void statement_destroy(statement *statement);
 
 void statement_get_source_line_from_token(const token *token, char *dest);
+void statement_get_label_name(const statement *statement, const token *scope, char *dest);
 
 #endif /* statement_h */
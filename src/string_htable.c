@@ -25,7 +25,7 @@ static size_t get_hash(const char *str)
     return hash;
 }
 
-static char normalized[255];
+static _Thread_local char normalized[255];
 
 string_htable *string_htable_create(size_t value_size)
 {
@@ -0,0 +1,173 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "assembly_context.h"
+#include "conditional.h"
+#include "encoding.h"
+#include "expression.h"
+#include "loop.h"
+#include "memory.h"
+#include "operand.h"
+#include "program.h"
+#include "statement.h"
+#include "string_pool.h"
+#include "token.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* a .cstring that can be pooled, its bytes without the terminating zero */
+typedef struct pooled_string
+{
+    size_t index;
+    const unsigned char *bytes;
+    size_t length;
+
+} pooled_string;
+
+string_pool *string_pool_create(void)
+{
+    return tiny_calloc(1, sizeof(string_pool));
+}
+
+void string_pool_destroy(string_pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    tiny_free(pool->hosts);
+    tiny_free(pool->offsets);
+    tiny_free(pool);
+}
+
+/* the bytes of a .cstring of a single string, or NULL if it is not one */
+static const encoded_string *pooled_bytes(const program *program, size_t index)
+{
+    if (program->kinds[index] != PROGRAM_KIND_PSEUDO_OP || program->statements[index]->instruction->type != TOKEN_CSTRING) {
+        return NULL;
+    }
+    const pseudo_op_arg_array *args = program->operands[index]->pseudo_op_arg_args.args;
+    const pseudo_op_arg *arg = args->count == 1 ? args->data[0] : NULL;
+    if (!arg || arg->arg_type != PSEUDO_OP_EXPRESSION || arg->arg.expression->type != TYPE_LITERAL ||
+        arg->arg.expression->token->type != TOKEN_STRINGLITERAL) {
+        return NULL;
+    }
+    return encoding_get(arg->arg.expression->token);
+}
+
+/* 1 if the statement begins a block, -1 if it ends one, otherwise 0 */
+static int block_nesting(const statement *statement)
+{
+    switch (statement->instruction->type) {
+        case TOKEN_RELOCATE:    return 1;
+        case TOKEN_ENDRELOCATE: return -1;
+        default: break;
+    }
+    int nesting = loop_nesting(statement);
+    return nesting ? nesting : conditional_nesting(statement);
+}
+
+/* strings in a loop, a block decided on each pass or relocated code are assembled where they are */
+static int keeps_strings(const statement *statement, const assembly_context *context)
+{
+    return !conditional_nesting(statement) || !conditional_is_decided(context->conditions, statement);
+}
+
+static int compare_reversed(const void *lhs, const void *rhs)
+{
+    const pooled_string *l = (const pooled_string*)lhs, *r = (const pooled_string*)rhs;
+    size_t count = l->length < r->length ? l->length : r->length;
+    for(size_t i = 1; i <= count; i++) {
+        int diff = (int)l->bytes[l->length - i] - (int)r->bytes[r->length - i];
+        if (diff) {
+            return diff;
+        }
+    }
+    if (l->length != r->length) {
+        return l->length < r->length ? -1 : 1;
+    }
+    /* of the same strings, the first in the program sorts last to be the host */
+    return l->index < r->index ? 1 : -1;
+}
+
+static int is_tail(const pooled_string *string, const pooled_string *of)
+{
+    return string->length <= of->length &&
+        !memcmp(string->bytes, of->bytes + of->length - string->length, string->length);
+}
+
+size_t string_pool_merge(string_pool *pool, const program *program, const assembly_context *context)
+{
+    pool->strings = pool->merged = 0;
+    pool->saved = 0;
+    pooled_string *strings = tiny_malloc((program->count ? program->count : 1) * sizeof(pooled_string));
+    unsigned char *keeping = tiny_malloc(program->count + 1);
+    size_t open = 0;
+    int depth = 0;
+    for(size_t i = 0; i < program->count; i++) {
+        if (program->kinds[i] != PROGRAM_KIND_PSEUDO_OP) {
+            continue;
+        }
+        int nesting = block_nesting(program->statements[i]);
+        if (nesting > 0) {
+            keeping[open] = (unsigned char)keeps_strings(program->statements[i], context);
+            depth += keeping[open++];
+        } else if (nesting < 0 && open) {
+            depth -= keeping[--open];
+        }
+        const encoded_string *encoded = depth ? NULL : pooled_bytes(program, i);
+        if (encoded) {
+            strings[pool->strings++] = (pooled_string){ .index = i, .bytes = encoding_bytes(encoded), .length = encoded->length };
+        }
+    }
+    tiny_free(keeping);
+    if (pool->capacity < program->count) {
+        pool->capacity = program->count;
+        pool->hosts = tiny_realloc(pool->hosts, pool->capacity * sizeof(int));
+        pool->offsets = tiny_realloc(pool->offsets, pool->capacity * sizeof(unsigned short));
+    }
+    for(size_t i = 0; i < program->count; i++) {
+        pool->hosts[i] = STRING_POOL_NOT_MERGED;
+    }
+    qsort(strings, pool->strings, sizeof(pooled_string), compare_reversed);
+    if (pool->strings) {
+        /* a string ends the one after it in this order, if any does, so the host is found scanning back */
+        for(size_t s = pool->strings - 1; s-- > 0;) {
+            const pooled_string *string = strings + s, *next = strings + s + 1;
+            if (!is_tail(string, next)) {
+                continue;
+            }
+            size_t host = pool->hosts[next->index] == STRING_POOL_NOT_MERGED ? next->index : (size_t)pool->hosts[next->index];
+            const encoded_string *host_bytes = pooled_bytes(program, host);
+            pool->hosts[string->index] = (int)host;
+            pool->offsets[string->index] = (unsigned short)(host_bytes->length - string->length);
+            pool->merged++;
+            pool->saved += (int)string->length + 1;
+        }
+    }
+    tiny_free(strings);
+    return pool->merged;
+}
+
+int string_pool_host(const string_pool *pool, size_t index, int *offset)
+{
+    if (!pool->merged || index >= pool->capacity || pool->hosts[index] == STRING_POOL_NOT_MERGED) {
+        return STRING_POOL_NOT_MERGED;
+    }
+    *offset = pool->offsets[index];
+    return pool->hosts[index];
+}
+
+void string_pool_report(const string_pool *pool, FILE *stream)
+{
+    if (!pool->strings) {
+        return;
+    }
+    fprintf(stream, "---------------------------------\n");
+    fprintf(stream, "String pool: %zu of %zu strings merged, saving %d bytes\n", pool->merged, pool->strings, pool->saved);
+}
@@ -0,0 +1,54 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef string_pool_h
+#define string_pool_h
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct assembly_context assembly_context;
+typedef struct program program;
+
+#define STRING_POOL_NOT_MERGED  -1
+
+/*
+
+With --pool-strings, a .cstring of a single string that is the same as
+another, or the tail of a longer one, is not assembled. Its label is the
+address of those bytes in the string it shares them with, its host. After
+the first pass the strings are sorted by their bytes from last to first,
+so a string is next to the longer ones it ends, and one scan finds each
+string's host.
+**/
+
+typedef struct string_pool
+{
+    int *hosts;
+    unsigned short *offsets;
+    size_t capacity;
+    size_t strings;
+    size_t merged;
+    int saved;
+
+} string_pool;
+
+string_pool *string_pool_create(void);
+void string_pool_destroy(string_pool *pool);
+
+/* find the host of each string that can share another's bytes; returns the number merged */
+size_t string_pool_merge(string_pool *pool, const program *program, const assembly_context *context);
+
+/* the index of the statement whose bytes the string at index shares, and the offset into them,
+   or STRING_POOL_NOT_MERGED */
+int string_pool_host(const string_pool *pool, size_t index, int *offset);
+
+void string_pool_report(const string_pool *pool, FILE *stream);
+
+#endif /* string_pool_h */
@@ -18,6 +18,8 @@
 typedef struct symbol_table
 {
     string_htable *table;
+    string_htable *hidden;
+    value current_pass;
 } symbol_table;
 
 symbol_table *symbol_table_create(int case_sensitive)
@@ -25,6 +27,8 @@ symbol_table *symbol_table_create(int case_sensitive)
     symbol_table *table = tiny_malloc(sizeof(symbol_table));
     table->table = string_htable_create(sizeof(value));
     table->table->case_sensitive = case_sensitive;
+    table->hidden = NULL;
+    table->current_pass = 1;
     return table;
 }
 
@@ -57,12 +61,25 @@ value symbol_table_lookup(symbol_table *table, char *name)
     if (BUILTIN_SYMBOL_TABLE) {
         entry = string_htable_find_bucket(BUILTIN_SYMBOL_TABLE, name);
         if (entry) {
+            if (builtin_is_current_pass(entry)) {
+                return table->current_pass;
+            }
             return (value)*entry->value;
         }
     }
     return VALUE_UNDEFINED;
 }
 
+void symbol_table_hide(symbol_table *table, char *name)
+{
+    if (!table->hidden) {
+        table->hidden = string_htable_create(sizeof(char));
+        table->hidden->case_sensitive = table->table->case_sensitive;
+    }
+    char hidden = 1;
+    string_htable_add(table->hidden, name, (const htable_value_ptr)&hidden);
+}
+
 #define REPORT_LINE_LEN 80
 
 #define HEADER(str) written = snprintf(p, REPORT_LINE_LEN - 1, str); p += written
@@ -81,7 +98,7 @@ char *symbol_table_report(symbol_table *table, char **buffer_ptr)
     HEADER(";;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;\n");
     for(size_t i = 0; i < htable->capacity; i++) {
         htable_entry *bucket = htable->buckets + i;
-        if (bucket->used) {
+        if (bucket->used && !(table->hidden && string_htable_contains(table->hidden, bucket->original_key))) {
             written = snprintf(p, REPORT_LINE_LEN-1, "%-32s= $%x ;(%d)\n", bucket->original_key, *bucket->value, *bucket->value);
             p += written;
         }
@@ -90,6 +107,11 @@ char *symbol_table_report(symbol_table *table, char **buffer_ptr)
     return buffer;
 }
 
+void symbol_table_set_current_pass(symbol_table *table, value pass)
+{
+    table->current_pass = pass;
+}
+
 void symbol_table_update(symbol_table *table, char *name, value val)
 {
     string_htable_update(table->table, name, (const htable_value_ptr)&val);
@@ -98,5 +120,6 @@ void symbol_table_update(symbol_table *table, char *name, value val)
 void symbol_table_destroy(symbol_table *table)
 {
     string_htable_destroy(table->table);
+    string_htable_destroy(table->hidden);
     tiny_free(table);
 }
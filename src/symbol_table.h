@@ -16,9 +16,13 @@ typedef struct symbol_table symbol_table;
 
 int symbol_table_define(symbol_table *table, char *name, value value);
 void symbol_table_update(symbol_table *table, char *name, value value);
+void symbol_table_set_current_pass(symbol_table *table, value pass);
 int symbol_exists(symbol_table *table, char *name);
 value symbol_table_lookup(symbol_table *table, char *name);
 
+/* keep a symbol defined but leave it out of the report */
+void symbol_table_hide(symbol_table *table, char *name);
+
 symbol_table *symbol_table_create(int case_sensitive);
 void symbol_table_destroy(symbol_table *table);
 
@@ -0,0 +1,196 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "error.h"
+#include "memory.h"
+#include "options.h"
+#include "test_suite.h"
+#include "thread_pool.h"
+#include <string.h>
+
+test_suite *test_suite_create(void)
+{
+    return tiny_calloc(1, sizeof(test_suite));
+}
+
+void test_suite_reset(test_suite *suite)
+{
+    for(size_t i = 0; i < suite->count; i++) {
+        tiny_free(suite->tests[i].name);
+    }
+    suite->count = 0;
+    suite->condition_count = 0;
+    suite->open = 0;
+}
+
+void test_suite_destroy(test_suite *suite)
+{
+    if (!suite) {
+        return;
+    }
+    test_suite_reset(suite);
+    tiny_free(suite->conditions);
+    tiny_free(suite->tests);
+    tiny_free(suite);
+}
+
+int test_suite_begin(test_suite *suite, const token *directive, const char *name, int routine, unsigned long long max_cycles)
+{
+    if (suite->open) {
+        return 0;
+    }
+    if (suite->count == suite->capacity) {
+        suite->capacity = suite->capacity ? suite->capacity * 2 : 16;
+        suite->tests = tiny_realloc(suite->tests, suite->capacity * sizeof(unit_test));
+    }
+    unit_test *test = suite->tests + suite->count++;
+    memset(test, 0, sizeof(unit_test));
+    test->directive = directive;
+    test->name = strdup(name);
+    test->routine = routine;
+    test->max_cycles = max_cycles;
+    test->first_condition = suite->condition_count;
+    suite->open = 1;
+    return 1;
+}
+
+int test_suite_add_condition(test_suite *suite, const token *directive, int is_expectation, int reg, int address, int value)
+{
+    if (!suite->open) {
+        return 0;
+    }
+    if (suite->condition_count == suite->condition_capacity) {
+        suite->condition_capacity = suite->condition_capacity ? suite->condition_capacity * 2 : 64;
+        suite->conditions = tiny_realloc(suite->conditions, suite->condition_capacity * sizeof(test_condition));
+    }
+    test_condition *condition = suite->conditions + suite->condition_count++;
+    condition->directive = directive;
+    condition->is_expectation = is_expectation;
+    condition->reg = reg;
+    condition->address = address;
+    condition->value = value;
+    suite->tests[suite->count - 1].condition_count++;
+    return 1;
+}
+
+int test_suite_end(test_suite *suite)
+{
+    if (!suite->open) {
+        return 0;
+    }
+    suite->open = 0;
+    return 1;
+}
+
+typedef struct test_job
+{
+    const test_suite *suite;
+    unit_test *test;
+    int cpu;
+    const char *image;
+
+} test_job;
+
+static int *register_of(simulator *sim, int reg)
+{
+    switch (reg) {
+        case 'a': return &sim->a;
+        case 'x': return &sim->x;
+        case 'y': return &sim->y;
+        case 'p': return &sim->p;
+        default:  return &sim->s;
+    }
+}
+
+static void run_test(void *job_ptr)
+{
+    test_job *job = (test_job*)job_ptr;
+    unit_test *test = job->test;
+    const test_condition *conditions = job->suite->conditions + test->first_condition;
+    simulator *sim = simulator_create(job->cpu, job->image);
+    for(size_t i = 0; i < test->condition_count; i++) {
+        if (conditions[i].is_expectation) {
+            continue;
+        }
+        if (conditions[i].reg) {
+            *register_of(sim, conditions[i].reg) = conditions[i].value;
+        } else {
+            sim->memory[conditions[i].address] = (unsigned char)conditions[i].value;
+        }
+    }
+    /* run one cycle past the budget so that exceeding it is seen */
+    test->stop = simulator_call(sim, test->routine, test->max_cycles ? test->max_cycles + 1 : TEST_SUITE_MAX_CYCLES);
+    test->stop_pc = sim->pc;
+    test->cycles = sim->cycles;
+    for(size_t i = 0; i < test->condition_count && test->stop == SIMULATOR_RETURNED; i++) {
+        if (!conditions[i].is_expectation) {
+            continue;
+        }
+        int actual = conditions[i].reg ? *register_of(sim, conditions[i].reg) : sim->memory[conditions[i].address];
+        if (actual != conditions[i].value) {
+            test->failed = conditions + i;
+            test->actual = actual;
+            break;
+        }
+    }
+    simulator_destroy(sim);
+}
+
+int test_suite_run(test_suite *suite, int cpu, const char *image, size_t threads)
+{
+    if (cpu == CPU_65816) {
+        return 0;
+    }
+    test_job *jobs = tiny_calloc(suite->count ? suite->count : 1, sizeof(test_job));
+    void **args = tiny_calloc(suite->count ? suite->count : 1, sizeof(void*));
+    for(size_t i = 0; i < suite->count; i++) {
+        jobs[i].suite = suite;
+        jobs[i].test = suite->tests + i;
+        jobs[i].cpu = cpu;
+        jobs[i].image = image;
+        args[i] = jobs + i;
+    }
+    thread_pool_run(run_test, args, suite->count, threads);
+    tiny_free(args);
+    tiny_free(jobs);
+    return 1;
+}
+
+void test_suite_report(const test_suite *suite, FILE *stream)
+{
+    size_t failures = 0;
+    for(size_t i = 0; i < suite->count; i++) {
+        const unit_test *test = suite->tests + i;
+        if (test->stop != SIMULATOR_RETURNED) {
+            if (test->stop == SIMULATOR_CYCLE_LIMIT && test->max_cycles) {
+                tiny_error(test->directive, ERROR_MODE_RECOVER, "Test '%s' did not return within %llu cycles",
+                    test->name, test->max_cycles);
+            } else {
+                tiny_error(test->directive, ERROR_MODE_RECOVER, "Test '%s' %s at $%04x",
+                    test->name, simulator_stop_reason(test->stop), test->stop_pc);
+            }
+        } else if (test->max_cycles && test->cycles > test->max_cycles) {
+            tiny_error(test->directive, ERROR_MODE_RECOVER, "Test '%s' took %llu cycles, more than %llu",
+                test->name, test->cycles, test->max_cycles);
+        } else if (test->failed) {
+            const test_condition *failed = test->failed;
+            if (failed->reg) {
+                tiny_error(failed->directive, ERROR_MODE_RECOVER, "Test '%s' expected %c to be $%02x but it was $%02x",
+                    test->name, failed->reg, failed->value, test->actual);
+            } else {
+                tiny_error(failed->directive, ERROR_MODE_RECOVER, "Test '%s' expected $%04x to be $%02x but it was $%02x",
+                    test->name, failed->address, failed->value, test->actual);
+            }
+        } else {
+            continue;
+        }
+        failures++;
+    }
+    fprintf(stream, "---------------------------------\n%zu tests passed, %zu failed\n", suite->count - failures, failures);
+}
@@ -0,0 +1,78 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef test_suite_h
+#define test_suite_h
+
+#include "simulator.h"
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct token token;
+
+#define TEST_SUITE_MAX_CYCLES   10000000ULL
+
+/* a register ('a', 'x', 'y', 'p' or 's') or, if register is 0, a byte of memory */
+typedef struct test_condition
+{
+    const token *directive;
+    int is_expectation;
+    int reg;
+    int address;
+    int value;
+
+} test_condition;
+
+typedef struct unit_test
+{
+    const token *directive;
+    char *name;
+    int routine;
+    unsigned long long max_cycles;
+    size_t first_condition;
+    size_t condition_count;
+
+    /* the outcome of running it */
+    simulator_stop stop;
+    int stop_pc;
+    unsigned long long cycles;
+    const test_condition *failed;
+    int actual;
+
+} unit_test;
+
+/* the .test blocks of a pass, run on the simulator with --test */
+typedef struct test_suite
+{
+    unit_test *tests;
+    size_t count;
+    size_t capacity;
+    test_condition *conditions;
+    size_t condition_count;
+    size_t condition_capacity;
+    int open;
+
+} test_suite;
+
+test_suite *test_suite_create(void);
+void test_suite_reset(test_suite *suite);
+void test_suite_destroy(test_suite *suite);
+
+/* each returns 0 if the block structure does not allow it */
+int test_suite_begin(test_suite *suite, const token *directive, const char *name, int routine, unsigned long long max_cycles);
+int test_suite_add_condition(test_suite *suite, const token *directive, int is_expectation, int reg, int address, int value);
+int test_suite_end(test_suite *suite);
+
+/* run every test on its own simulator, spread over threads; returns 0 if the cpu cannot be simulated */
+int test_suite_run(test_suite *suite, int cpu, const char *image, size_t threads);
+
+/* report each failed test as an error and print a summary */
+void test_suite_report(const test_suite *suite, FILE *stream);
+
+#endif /* test_suite_h */
@@ -0,0 +1,84 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "memory.h"
+#include "thread_pool.h"
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct thread_pool
+{
+    pthread_mutex_t lock;
+    thread_pool_job job;
+    void **args;
+    size_t count;
+    size_t next;
+
+} thread_pool;
+
+static void *worker(void *pool_ptr)
+{
+    thread_pool *pool = (thread_pool*)pool_ptr;
+    for(;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->count) {
+            return NULL;
+        }
+        pool->job(pool->args[i]);
+    }
+}
+
+size_t thread_pool_default_size(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0) {
+        return (size_t)cpus;
+    }
+#endif
+    return 4;
+}
+
+void thread_pool_run(thread_pool_job job, void **args, size_t count, size_t threads)
+{
+    if (threads > count) {
+        threads = count;
+    }
+    if (threads < 2) {
+        for(size_t i = 0; i < count; i++) {
+            job(args[i]);
+        }
+        return;
+    }
+    thread_pool pool = {
+        .job = job,
+        .args = args,
+        .count = count,
+        .next = 0
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_t *workers = tiny_calloc(threads, sizeof(pthread_t));
+    size_t started = 0;
+    for(; started < threads; started++) {
+        if (pthread_create(workers + started, NULL, worker, &pool)) {
+            break;
+        }
+    }
+    if (!started) {
+        /* could not start any threads, do the work here */
+        worker(&pool);
+    }
+    for(size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    tiny_free(workers);
+    pthread_mutex_destroy(&pool.lock);
+}
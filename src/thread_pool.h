@@ -0,0 +1,23 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef thread_pool_h
+#define thread_pool_h
+
+#include <stddef.h>
+
+typedef void (*thread_pool_job)(void *arg);
+
+/* the number of worker threads to use by default (the number of online cpus) */
+size_t thread_pool_default_size(void);
+
+/* run job once for each of args on up to threads workers and wait for all of them */
+void thread_pool_run(thread_pool_job job, void **args, size_t count, size_t threads);
+
+#endif /* thread_pool_h */
@@ -9,21 +9,44 @@
 
 #include "assembly_context.h"
 #include "builtin_symbols.h"
+#include "compress.h"
+#include "conditional.h"
+#include "cycles.h"
+#include "dataflow.h"
+#include "dead_code.h"
+#include "encoding.h"
 #include "memory.h"
 #include "error.h"
 #include "evaluator.h"
 #include "executor.h"
 #include "expression.h"
 #include "lexer.h"
+#include "loop.h"
 #include "m6502.h"
 #include "options_parser.h"
+#include "output.h"
+#include "page_layout.h"
 #include "parser.h"
+#include "pass_trace.h"
+#include "pipeline.h"
+#include "peephole.h"
+#include "prefetch.h"
+#include "profile.h"
+#include "program.h"
 #include "file.h"
+#include "source_manager.h"
 #include "statement.h"
 #include "string_htable.h"
+#include "string_pool.h"
+#include "test_suite.h"
+#include "thread_pool.h"
 #include "token.h"
+#include "zp_allocator.h"
+#include <locale.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 const char PRODUCT_NAME[] = "tiny6502 cross-assembler";
 const char VERSION[] = "0.2";
@@ -34,30 +57,92 @@ const char LEGAL[] = "tiny6502 comes with ABSOLUTELY NO WARRANTY. "
                      
 const int MAX_PASSES = 4;
 
-dynamic_array *first_pass(assembly_context *context, parser *parser)
+/* loops and conditions not known while parsing, whose statements are run once their block is parsed */
+typedef struct deferred_blocks
+{
+    assembly_context *context;
+    int depth;
+    size_t first;
+
+} deferred_blocks;
+
+static int decide_condition(void *deferred_ptr, const statement *statement)
+{
+    deferred_blocks *deferred = (deferred_blocks*)deferred_ptr;
+    if (deferred->depth || tiny_error_count()) {
+        /* the statements before it have not been run yet */
+        return CONDITIONAL_UNKNOWN;
+    }
+    return conditional_decide(deferred->context, statement);
+}
+
+/* 1 if the statement begins a deferred block, -1 if it ends one, otherwise 0 */
+static int deferred_nesting(const deferred_blocks *deferred, const statement *statement)
+{
+    int nesting = loop_nesting(statement);
+    int condition = conditional_nesting(statement);
+    if (condition > 0 && (deferred->depth || !deferred->context || !conditional_is_decided(deferred->context->conditions, statement))) {
+        nesting = condition;
+    } else if (condition < 0 && deferred->depth) {
+        nesting = condition;
+    }
+    return nesting;
+}
+
+/* parse the source into the program, executing each statement as the first pass
+   if there is a context */
+dynamic_array *first_pass(assembly_context *context, parser *parser, program *prog)
 {
     dynamic_array *stats;
     DYNAMIC_ARRAY_CREATE_WITH_CAPACITY(stats, statement*, 100);
 
-    printf("%s %s %s\n%s\n", PRODUCT_NAME, VERSION, COPYRIGHT, LEGAL);
+    deferred_blocks deferred = { .context = context };
+    pipeline *pipe = context ? pipeline_start(parser, decide_condition, &deferred) : NULL;
+    if (context && !pipe) {
+        parser_set_condition_callback(parser, decide_condition, &deferred);
+    }
     for(;;) {
-        statement *stat = parse_statement(parser);
+        statement *stat = pipe ? pipeline_next(pipe) : parse_statement(parser);
         if (!stat) {
             break;
         }
         dynamic_array_add(stats, stat);
-        if (!tiny_error_count()) {
+        size_t index = program_add(prog, stat);
+        int nesting = prog->kinds[index] == PROGRAM_KIND_PSEUDO_OP ? deferred_nesting(&deferred, stat) : 0;
+        size_t run_from = index;
+        if (nesting > 0 && !deferred.depth++) {
+            deferred.first = index;
+        } else if (nesting < 0 && deferred.depth && !--deferred.depth) {
+            run_from = deferred.first;
+        }
+        if (!context || tiny_error_count() || deferred.depth) {
+            continue;
+        }
+        if (nesting) {
+            program_run(context, prog, run_from, index + 1);
+        } else {
+            prog->pcs[index] = context->output->logical_pc;
             statement_execute(context, stat);
+            prog->sizes[index] = statement_size(context);
         }
     }
-    context->passes++;
+    pipeline_finish(pipe);
+    parser_set_condition_callback(parser, NULL, NULL);
+    if (deferred.depth && loop_nesting(prog->statements[deferred.first]) > 0) {
+        const token *directive = prog->statements[deferred.first]->instruction;
+        tiny_error(directive, ERROR_MODE_RECOVER, directive->type == TOKEN_FOR ?
+            "Directive \".for\" is missing \".endfor\"" : "Directive \".repeat\" is missing \".endrepeat\"");
+    }
+    if (context) {
+        context->passes++;
+    }
     return stats;
 }
 
-static void add_reserved_words(assembly_context *ctx, lexer *lexer)
+static void add_reserved_words(int cpu, lexer *lexer)
 {
-    if (ctx->options.cpu != CPU_6502) {
-        switch (ctx->options.cpu) {
+    if (cpu != CPU_6502) {
+        switch (cpu) {
             case CPU_6502I:
                 lexer_add_reserved_words(lexer, M6502I_WORDS, m6502i_mnemonics, m6502i_types);
                 break;
@@ -75,72 +160,177 @@ static void statement_dtor(void *stat_ptr)
     statement_destroy((statement*)stat_ptr);
 }
 
-int main(int argc, const char * argv[])
+static void define_symbols(assembly_context *ctx, const source_file *defines)
 {
-    tiny_reset_errors_warnings();
-    options opts = options_parse(argc, argv);
-    assembly_context *ctx = assembly_context_create(opts);
-    
-    if (ctx->options.input) {
-        ctx->source = source_file_read(ctx->options.input);
-        if (!ctx->source.lines || !ctx->source.file_name) {
-            tiny_error(NULL, ERROR_MODE_PANIC, "Unable to read file %s.", ctx->options.input);
+    /* parse '--defines' options as constants */
+    lexer *defines_lexer = lexer_create(defines, ctx->options.case_sensitive);
+    add_reserved_words(ctx->options.cpu, defines_lexer);
+    parser *defines_parser = parser_create(defines_lexer, ctx->options.case_sensitive);
+    statement *assign_stat;
+    for (;;) {
+        assign_stat = parse_assignment(defines_parser);
+        if (!assign_stat) {
+            break;
         }
-    } else {
-        ctx->source = source_file_from_user_input();
-    }
-
-    lexer *lexer = lexer_create(&ctx->source, ctx->options.case_sensitive),
-            *defines_lexer = NULL;
-            
-    add_reserved_words(ctx, lexer);
-    builtin_init(ctx->options.case_sensitive);
-    
-    parser *parser = parser_create(lexer, ctx->options.case_sensitive),
-            *defines_parser = NULL;
-
-
-    if (ctx->options.defines.line_numbers) {
-        /* parse '--defines' options as constants */
-        defines_lexer = lexer_create(&ctx->options.defines, ctx->options.case_sensitive);
-        add_reserved_words(ctx, defines_lexer);
-        defines_parser = parser_create(defines_lexer, ctx->options.case_sensitive);
-        statement *assign_stat;
-        for (;;) {
-            assign_stat = parse_assignment(defines_parser);
-            if (!assign_stat) {
-                break;
-            }
-            expression *assign_expr = assign_expression(defines_parser, assign_stat);
-            if (assign_expr) {
-                value v = evaluate_expression(ctx, assign_expr);
-                expression_destroy(assign_expr);
-                if (v == VALUE_UNDEFINED) {
-                    tiny_error(NULL, ERROR_MODE_PANIC, "Option --define argument must be a constant expression");
-                }
+        expression *assign_expr = assign_expression(defines_parser, assign_stat);
+        if (assign_expr) {
+            value v = evaluate_expression(ctx, assign_expr);
+            expression_destroy(assign_expr);
+            if (v == VALUE_UNDEFINED) {
+                tiny_error(NULL, ERROR_MODE_PANIC, "Option --define argument must be a constant expression");
             }
-            statement_destroy(assign_stat);
-        }
-        if (tiny_error_count()) {
-            tiny_error(NULL, ERROR_MODE_PANIC, "One or more arguments for option '--define' is invalid");
         }
+        statement_destroy(assign_stat);
     }
-    dynamic_array *stat_array = first_pass(ctx, parser);
-    stat_array->dtor = statement_dtor;
-    if (!tiny_error_count()) {
-        statement **stats = (statement**)stat_array->data;
-        while (ctx->pass_needed && ctx->passes <= MAX_PASSES && !tiny_error_count()) {
-            /* run multiple passes as needed */
-            ctx->passes++;
-            assembly_context_reset(ctx);
-            value curr_pass = ctx->passes + 1;
-            string_htable_update(BUILTIN_SYMBOL_TABLE, "CURRENT_PASS", (const htable_value_ptr)&curr_pass);
-            for(int i = 0; i < stat_array->count; i++) {
-                statement_execute(ctx, stats[i]);
-            }
+    if (tiny_error_count()) {
+        tiny_error(NULL, ERROR_MODE_PANIC, "One or more arguments for option '--define' is invalid");
+    }
+    parser_destroy(defines_parser);
+    lexer_destroy(defines_lexer);
+}
+
+static void compress_blocks(assembly_context *ctx)
+{
+    if (compress_finish_pass(ctx->compress, ctx)) {
+        /* the pass assembled the blocks it could not find as they were */
+        ctx->pass_needed = 1;
+    }
+}
+
+static void run_passes(assembly_context *ctx, program *prog)
+{
+    while (ctx->pass_needed && ctx->passes <= MAX_PASSES && !tiny_error_count()) {
+        /* run multiple passes as needed */
+        ctx->passes++;
+        assembly_context_reset(ctx);
+        symbol_table_set_current_pass(ctx->sym_tab, ctx->passes + 1);
+        program_execute(ctx, prog);
+        compress_blocks(ctx);
+    }
+}
+
+static void drop_dead_code(assembly_context *ctx, program *prog)
+{
+    if (dead_code_prune(ctx->procs, prog, ctx->sym_tab)) {
+        /* the first pass laid out the blocks nothing refers to */
+        ctx->pass_needed = 1;
+    }
+}
+
+static void allocate_zero_page(assembly_context *ctx, const program *prog)
+{
+    if (zp_allocator_allocate(ctx->zp_vars, prog, ctx)) {
+        /* the first pass assumed the variables were not in zero page */
+        ctx->pass_needed = 1;
+    }
+}
+
+static void optimize(assembly_context *ctx, program *prog)
+{
+    if (ctx->peephole && peephole_optimize(ctx->peephole, prog, ctx)) {
+        /* the first pass laid out the code before it was rewritten */
+        ctx->pass_needed = 1;
+    }
+}
+
+static void find_redundant(assembly_context *ctx, program *prog)
+{
+    if (ctx->dataflow && dataflow_analyze(ctx->dataflow, prog, ctx)) {
+        ctx->pass_needed = 1;
+    }
+}
+
+static void arrange_pages(assembly_context *ctx, program *prog)
+{
+    if (ctx->pages->count && !tiny_error_count()) {
+        /* the first pass did not know the size of each block to keep it on one page */
+        page_layout_arrange(ctx->pages, prog, ctx);
+        ctx->pass_needed = 1;
+    }
+}
+
+static void pool_strings(assembly_context *ctx, const program *prog)
+{
+    if (ctx->strings && !tiny_error_count() && string_pool_merge(ctx->strings, prog, ctx)) {
+        /* the first pass laid out every string */
+        ctx->pass_needed = 1;
+    }
+}
+
+static int profile_program(assembly_context *ctx)
+{
+    char entry_name[TOKEN_TEXT_MAX_LEN * 2 + 2] = {};
+    strncpy(entry_name, ctx->options.profile, TOKEN_TEXT_MAX_LEN * 2);
+    value entry = symbol_table_lookup(ctx->sym_tab, entry_name);
+    if (entry == VALUE_UNDEFINED) {
+        /* allow a plain address as well as a label */
+        char *end;
+        long address = strtol(entry_name, &end, 0);
+        if (*entry_name && !*end) {
+            entry = address;
         }
     }
+    if (entry < 0 || entry > UINT16_MAX) {
+        tiny_error(NULL, ERROR_MODE_RECOVER, "Profile entry '%s' is not a label or address.\n", ctx->options.profile);
+        return 0;
+    }
+    if (!profile_run(ctx->profile, ctx->options.cpu, ctx->output->buffer, (int)entry)) {
+        tiny_error(NULL, ERROR_MODE_RECOVER, "Profiling is not supported for the selected CPU.\n");
+        return 0;
+    }
+    return 1;
+}
+
+/* profile the final pass, then warn about the tables whose reads crossed a page while it ran */
+static void check_pages(assembly_context *ctx, const program *prog)
+{
+    if (!tiny_error_count() && !ctx->pass_needed && ctx->profile && profile_program(ctx)) {
+        page_layout_check(ctx->pages, prog, ctx->profile->sim);
+    }
+}
 
+static void run_tests(assembly_context *ctx)
+{
+    if (!test_suite_run(ctx->tests, ctx->options.cpu, ctx->output->buffer, thread_pool_default_size())) {
+        tiny_error(NULL, ERROR_MODE_RECOVER, "Tests are not supported for the selected CPU.\n");
+        return;
+    }
+    test_suite_report(ctx->tests, stdout);
+}
+
+static void report(assembly_context *ctx)
+{
+    if (ctx->trace) {
+        pass_trace_report(ctx->trace, ctx->passes, stdout);
+    }
+    if (ctx->peephole) {
+        peephole_report(ctx->peephole, stdout);
+    }
+    if (ctx->dataflow) {
+        dataflow_report(ctx->dataflow, stdout);
+    }
+    zp_allocator_report(ctx->zp_vars, stdout);
+    page_layout_report(ctx->pages, stdout);
+    dead_code_report(ctx->procs, stdout);
+    if (ctx->strings) {
+        string_pool_report(ctx->strings, stdout);
+    }
+    compressor_report(ctx->compress, stdout);
+    if (!tiny_error_count() && !ctx->pass_needed) {
+        cycle_log_check(ctx->cycle_log);
+        if (ctx->tests->open) {
+            tiny_error(ctx->tests->tests[ctx->tests->count - 1].directive, ERROR_MODE_RECOVER, "Test is missing \".endtest\"");
+        }
+        if (ctx->procs->current != DEAD_CODE_NO_PROC) {
+            tiny_error(ctx->procs->procs[ctx->procs->current].directive, ERROR_MODE_RECOVER, "Procedure is missing \".endproc\"");
+        }
+    }
+    if (!tiny_error_count() && !ctx->pass_needed && ctx->profile && ctx->profile->sim) {
+        profile_report(ctx->profile, stdout);
+    }
+    if (!tiny_error_count() && !ctx->pass_needed && ctx->options.test) {
+        run_tests(ctx);
+    }
     if (tiny_warn_count()) {
         printf("%d warnings.\n", tiny_warn_count());
     }
@@ -149,17 +339,194 @@ int main(int argc, const char * argv[])
     } else if (ctx->passes <= MAX_PASSES) {
         printf("---------------------------------\n%d passes\n", ctx->passes);
         assembly_context_to_disk(ctx);
+        compressor_save(ctx->compress);
     }
     if (ctx->passes > MAX_PASSES) {
         perror("Too many passes.");
     }
+}
+
+typedef struct variant
+{
+    assembly_context *context;
+    program *program;
+
+} variant;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void assemble_variant(void *variant_ptr)
+{
+    variant *var = (variant*)variant_ptr;
+    assembly_context *ctx = var->context;
+    tiny_reset_errors_warnings();
+    program_execute(ctx, var->program);
+    compress_blocks(ctx);
+    ctx->passes++;
+    if (ctx->procs->count && !tiny_error_count()) {
+        program_unshare(var->program);
+        drop_dead_code(ctx, var->program);
+    }
+    if (!tiny_error_count()) {
+        allocate_zero_page(ctx, var->program);
+    }
+    if ((ctx->peephole || ctx->dataflow) && !tiny_error_count()) {
+        program_unshare(var->program);
+        optimize(ctx, var->program);
+        find_redundant(ctx, var->program);
+    }
+    arrange_pages(ctx, var->program);
+    pool_strings(ctx, var->program);
+    run_passes(ctx, var->program);
+    check_pages(ctx, var->program);
+
+    /* keep each variant's summary together */
+    pthread_mutex_lock(&report_lock);
+    printf("=================================\nVariant '%s':\n", ctx->options.output);
+    report(ctx);
+    pthread_mutex_unlock(&report_lock);
+}
+
+static size_t read_variants(const options *base, source_file *manifest, variant **variants_ptr)
+{
+    *manifest = source_file_read(base->variants);
+    if (!manifest->lines) {
+        tiny_error(NULL, ERROR_MODE_PANIC, "Unable to read variants file %s.", base->variants);
+    }
+    variant *variants = tiny_calloc(manifest->line_numbers ? manifest->line_numbers : 1, sizeof(variant));
+    size_t count = 0;
+    for(size_t i = 0; i < manifest->line_numbers; i++) {
+        /* each line is a list of options separated by white space */
+        const char **argv = tiny_calloc(strlen(manifest->lines[i]) / 2 + 2, sizeof(char*));
+        int argc = 0;
+        argv[argc++] = base->argv[0];
+        for(char *arg = strtok(manifest->lines[i], " \t\r\n"); arg; arg = strtok(NULL, " \t\r\n")) {
+            argv[argc++] = arg;
+        }
+        if (argc == 1 || argv[1][0] == '#' || argv[1][0] == ';') {
+            tiny_free(argv);
+            continue;
+        }
+        options opts = options_parse_variant(base, argc, argv);
+        variants[count++].context = assembly_context_create(opts);
+    }
+    *variants_ptr = variants;
+    return count;
+}
+
+static void assemble_variants(const options *base, source_file *source)
+{
+    source_file manifest;
+    variant *variants;
+    size_t count = read_variants(base, &manifest, &variants);
+    if (!count) {
+        tiny_error(NULL, ERROR_MODE_PANIC, "No variants in file %s.", base->variants);
+    }
+    /* the reserved mnemonics depend on the cpu, so parse once per cpu */
+    lexer *lexers[CPU_65816 + 1] = {};
+    parser *parsers[CPU_65816 + 1] = {};
+    program *programs[CPU_65816 + 1] = {};
+    dynamic_array *stat_arrays[CPU_65816 + 1] = {};
+    void **jobs = tiny_calloc(count, sizeof(void*));
+    for(size_t i = 0; i < count; i++) {
+        assembly_context *ctx = variants[i].context;
+        int cpu = ctx->options.cpu;
+        if (!lexers[cpu]) {
+            lexers[cpu] = lexer_create(source, base->case_sensitive);
+            add_reserved_words(cpu, lexers[cpu]);
+            parsers[cpu] = parser_create(lexers[cpu], base->case_sensitive);
+            parser_set_inlining(parsers[cpu], base->inline_limit, base->inline_budget);
+            programs[cpu] = program_create();
+            stat_arrays[cpu] = first_pass(NULL, parsers[cpu], programs[cpu]);
+            stat_arrays[cpu]->dtor = statement_dtor;
+        }
+        if (base->defines.line_numbers) {
+            define_symbols(ctx, &base->defines);
+        }
+        if (ctx->options.defines.line_numbers) {
+            define_symbols(ctx, &ctx->options.defines);
+        }
+        variants[i].program = program_share(programs[cpu]);
+        jobs[i] = variants + i;
+    }
+    if (tiny_error_count()) {
+        printf("%d errors.\n", tiny_error_count());
+    } else {
+        thread_pool_run(assemble_variant, jobs, count, thread_pool_default_size());
+    }
+    for(size_t i = 0; i < count; i++) {
+        program_destroy(variants[i].program);
+        tiny_free((void*)variants[i].context->options.argv);
+        assembly_context_destroy(variants[i].context);
+    }
+    for(int cpu = 0; cpu <= CPU_65816; cpu++) {
+        program_destroy(programs[cpu]);
+        dynamic_array_cleanup_and_destroy(stat_arrays[cpu]);
+        parser_destroy(parsers[cpu]);
+        lexer_destroy(lexers[cpu]);
+    }
+    tiny_free(jobs);
+    tiny_free(variants);
+    source_file_cleanup(&manifest);
+}
+
+int main(int argc, const char * argv[])
+{
+    /* try to read source files as UTF8; set once, before any thread reads one */
+    setlocale(LC_CTYPE, "en_US.UTF-8");
+    tiny_reset_errors_warnings();
+    options opts = options_parse(argc, argv);
+    assembly_context *ctx = assembly_context_create(opts);
+    
+    if (ctx->options.input) {
+        ctx->source = source_file_read(ctx->options.input);
+        if (!ctx->source.lines || !ctx->source.file_name) {
+            tiny_error(NULL, ERROR_MODE_PANIC, "Unable to read file %s.", ctx->options.input);
+        }
+    } else {
+        ctx->source = source_file_from_user_input();
+    }
+    builtin_init(ctx->options.case_sensitive);
+
+    printf("%s %s %s\n%s\n", PRODUCT_NAME, VERSION, COPYRIGHT, LEGAL);
+    if (ctx->options.variants) {
+        assemble_variants(&ctx->options, &ctx->source);
+    } else {
+        lexer *lexer = lexer_create(&ctx->source, ctx->options.case_sensitive);
+        add_reserved_words(ctx->options.cpu, lexer);
+        parser *parser = parser_create(lexer, ctx->options.case_sensitive);
+        parser_set_inlining(parser, ctx->options.inline_limit, ctx->options.inline_budget);
+        if (ctx->options.defines.line_numbers) {
+            define_symbols(ctx, &ctx->options.defines);
+        }
+        program *prog = program_create();
+        dynamic_array *stat_array = first_pass(ctx, parser, prog);
+        compress_blocks(ctx);
+        stat_array->dtor = statement_dtor;
+        if (!tiny_error_count()) {
+            drop_dead_code(ctx, prog);
+            allocate_zero_page(ctx, prog);
+        }
+        if (!tiny_error_count()) {
+            optimize(ctx, prog);
+            find_redundant(ctx, prog);
+            arrange_pages(ctx, prog);
+            pool_strings(ctx, prog);
+            run_passes(ctx, prog);
+            check_pages(ctx, prog);
+        }
+        report(ctx);
+
+        program_destroy(prog);
+        dynamic_array_cleanup_and_destroy(stat_array);
+        parser_destroy(parser);
+        lexer_destroy(lexer);
+    }
     /* final cleanup */
-    dynamic_array_cleanup_and_destroy(stat_array);
-    parser_destroy(defines_parser);
-    parser_destroy(parser);
-    lexer_destroy(defines_lexer);
-    lexer_destroy(lexer);
     builtin_cleanup();
+    encoding_cleanup();
+    prefetch_cleanup();
+    source_manager_cleanup();
     assembly_context_destroy(ctx);
 
 #ifdef CHECK_LEAKS
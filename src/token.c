@@ -23,21 +23,29 @@ int token_is_of_type(const token *token, const token_type *types, size_t lut_siz
     return 0;
 }
 
+const char *token_get_text(const token *token)
+{
+    return source_manager_text(token->loc);
+}
+
+const char *token_get_line(const token *token)
+{
+    return source_manager_line(token->loc);
+}
+
 size_t token_copy_text_to_buffer(const token *token, char *buffer, size_t buffer_len)
 {
-    if (token->type == TOKEN_EOF || token->src.ref == NULL){
+    const char *text = token->type == TOKEN_EOF ? NULL : token_get_text(token);
+    if (!text){
         strncpy(buffer, "<EOF>", 5);
         buffer[5] = '\0';
         return 5;
     }
-    if (token->src.ref){
-        size_t len = token->src.end - token->src.start;
-        if (len >= TOKEN_TEXT_MAX_LEN){
-            len = buffer_len - 1;
-        }
-        strncpy(buffer, token->src.ref + token->src.start, len);
-        buffer[len] = '\0';
-        return len;
+    size_t len = token->length;
+    if (len >= buffer_len){
+        len = buffer_len - 1;
     }
-    return 0;
+    strncpy(buffer, text, len);
+    buffer[len] = '\0';
+    return len;
 }
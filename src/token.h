@@ -10,7 +10,7 @@
 #ifndef token_h
 #define token_h
 
-#include "string_view.h"
+#include "source_manager.h"
 #include <ctype.h>
 
 typedef enum token_type {
@@ -215,6 +215,40 @@ typedef enum token_type {
     TOKEN_DP,
     TOKEN_PRON,
     TOKEN_PROFF,
+    TOKEN_CYCLELIMIT,
+    TOKEN_CYCLEEXACT,
+    TOKEN_TEST,
+    TOKEN_GIVEN,
+    TOKEN_EXPECT,
+    TOKEN_ENDTEST,
+    TOKEN_OPTON,
+    TOKEN_OPTOFF,
+    TOKEN_ZPVAR,
+    TOKEN_ZPRANGE,
+    TOKEN_PAGESAFE,
+    TOKEN_ENDPAGESAFE,
+    TOKEN_PAGEREGION,
+    TOKEN_ENDPAGEREGION,
+    TOKEN_INLINE,
+    TOKEN_ENDINLINE,
+    TOKEN_PROC,
+    TOKEN_ENDPROC,
+    TOKEN_EXPORT,
+    TOKEN_REPEAT,
+    TOKEN_ENDREPEAT,
+    TOKEN_FOR,
+    TOKEN_ENDFOR,
+    TOKEN_IF,
+    TOKEN_IFDEF,
+    TOKEN_IFNDEF,
+    TOKEN_ELSE,
+    TOKEN_ENDIF,
+    TOKEN_ENCODING,
+    TOKEN_MAP,
+    TOKEN_COMPRESS,
+    TOKEN_ENDCOMPRESS,
+    TOKEN_JUMPTABLE,
+    TOKEN_RTSTABLE,
     TOKEN_STRING,
     TOKEN_CSTRING,
     TOKEN_LSTRING,
@@ -228,21 +262,22 @@ typedef enum token_type {
 
 #define TOKEN_TEXT_MAX_LEN    200
 
+/* A token is 16 bytes. Its text, file, line and column are recovered
+   through the source manager from loc and length; payload indexes any
+   side data attached to the token (0 when there is none). */
 typedef struct token
 {
     
     token_type type;
-    string_view src;
-    int src_line;
-    int src_line_pos;
-    const char *src_filename;
-    const struct token *expanded_macro;
-    const char *include_filename;
-    int include_line;
+    source_loc loc;
+    unsigned int length;
+    unsigned int payload;
     
 } token;
 
 int token_is_of_type(const token *token, const token_type *types, size_t lut_size);
+const char *token_get_text(const token *token);
+const char *token_get_line(const token *token);
 size_t token_copy_text_to_buffer(const token *token, char *buffer, size_t buffer_len);
 
 #define TOKEN_GET_TEXT(token, buffer) \
@@ -0,0 +1,425 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#include "assembly_context.h"
+#include "error.h"
+#include "expression.h"
+#include "m6502.h"
+#include "memory.h"
+#include "operand.h"
+#include "program.h"
+#include "statement.h"
+#include "string_htable.h"
+#include "token.h"
+#include "zp_allocator.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* a call, jump or branch from one routine to another, or one routine falling into the next */
+typedef struct call_edge
+{
+    int from;
+    int to;
+
+} call_edge;
+
+typedef struct call_graph
+{
+    call_edge *edges;
+    size_t count;
+    size_t capacity;
+    size_t routine_count;
+    size_t *first_edge;
+    unsigned char **reaches;
+
+} call_graph;
+
+#define BIT_SET(bits, n)    ((bits)[(n) >> 3] |= 1 << ((n) & 7))
+#define BIT_TEST(bits, n)   ((bits)[(n) >> 3] & (1 << ((n) & 7)))
+
+zp_allocator *zp_allocator_create(void)
+{
+    zp_allocator *allocator = tiny_calloc(1, sizeof(zp_allocator));
+    allocator->spill = -1;
+    return allocator;
+}
+
+void zp_allocator_destroy(zp_allocator *allocator)
+{
+    if (!allocator) {
+        return;
+    }
+    tiny_free(allocator->variables);
+    tiny_free(allocator);
+}
+
+void zp_allocator_set_range(zp_allocator *allocator, const token *directive, int start, int end, int spill)
+{
+    allocator->range_directive = directive;
+    allocator->start = start;
+    allocator->end = end;
+    allocator->spill = spill;
+}
+
+static void add_variable(zp_allocator *allocator, const statement *statement, int owner, int size)
+{
+    if (allocator->count == allocator->capacity) {
+        allocator->capacity = allocator->capacity ? allocator->capacity * 2 : 32;
+        allocator->variables = tiny_realloc(allocator->variables, allocator->capacity * sizeof(zp_variable));
+    }
+    zp_variable *variable = allocator->variables + allocator->count++;
+    variable->statement = statement;
+    variable->owner = owner;
+    variable->size = size;
+    variable->references = 0;
+    variable->address = -1;
+    variable->in_zp = 0;
+}
+
+static void add_edge(call_graph *graph, int from, int to)
+{
+    if (graph->count == graph->capacity) {
+        graph->capacity = graph->capacity ? graph->capacity * 2 : 64;
+        graph->edges = tiny_realloc(graph->edges, graph->capacity * sizeof(call_edge));
+    }
+    graph->edges[graph->count].from = from;
+    graph->edges[graph->count++].to = to;
+}
+
+static int compare_edges(const void *lhs, const void *rhs)
+{
+    return ((const call_edge*)lhs)->from - ((const call_edge*)rhs)->from;
+}
+
+static int variable_size(const statement *statement)
+{
+    const operand *operand = statement->operand;
+    const pseudo_op_arg *arg = NULL;
+    if (operand && operand->pseudo_op_arg_args.args->count == 1) {
+        arg = (const pseudo_op_arg*)operand->pseudo_op_arg_args.args->data[0];
+    }
+    if (!arg || arg->arg_type != PSEUDO_OP_EXPRESSION) {
+        tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".zpvar\" expects a size");
+        return 0;
+    }
+    value size = arg->arg.expression->value;
+    if (size == VALUE_UNDEFINED) {
+        tiny_error(expression_get_lhs_token(arg->arg.expression), ERROR_MODE_RECOVER, "Variable size must be a constant");
+        return 0;
+    }
+    if (size < 1 || size > 256) {
+        tiny_error(expression_get_lhs_token(arg->arg.expression), ERROR_MODE_RECOVER, "Illegal quantity");
+        return 0;
+    }
+    return (int)size;
+}
+
+/* collect the variables and index the routines (the non-local labels) by name */
+static void collect(zp_allocator *allocator, const program *program, string_htable *variables, string_htable *routines)
+{
+    int scope = ZP_ALLOCATOR_NO_OWNER;
+    for(size_t i = 0; i < program->count; i++) {
+        int label = program->labels[i];
+        if (label != PROGRAM_NO_LABEL && !PROGRAM_LABEL_IS_LOCAL(label)) {
+            scope = PROGRAM_LABEL_ID(label);
+            string_htable_add(routines, program->label_names[scope], (const htable_value_ptr)&scope);
+        }
+        const statement *statement = program->statements[i];
+        if (program->kinds[i] != PROGRAM_KIND_PSEUDO_OP || statement->instruction->type != TOKEN_ZPVAR) {
+            continue;
+        }
+        if (label == PROGRAM_NO_LABEL) {
+            tiny_error(statement->instruction, ERROR_MODE_RECOVER, "Directive \".zpvar\" requires a label");
+            continue;
+        }
+        int size = variable_size(statement);
+        if (!size) {
+            continue;
+        }
+        /* only local variables belong to the routine they are declared in */
+        int index = (int)allocator->count;
+        string_htable_add(variables, program->label_names[PROGRAM_LABEL_ID(label)], (const htable_value_ptr)&index);
+        add_variable(allocator, statement, PROGRAM_LABEL_IS_LOCAL(label) ? scope : ZP_ALLOCATOR_NO_OWNER, size);
+    }
+}
+
+static const int *lookup(string_htable *table, const char *name, const char *scope)
+{
+    const int *found = string_htable_get(table, name);
+    if (!found && name[0] == '_' && scope) {
+        char scoped_name[TOKEN_TEXT_MAX_LEN * 2 + 2] = {};
+        snprintf(scoped_name, TOKEN_TEXT_MAX_LEN * 2, "%s.%s", scope, name);
+        found = string_htable_get(table, scoped_name);
+    }
+    return found;
+}
+
+typedef struct reference_count
+{
+    zp_allocator *allocator;
+    string_htable *variables;
+    const char *scope;
+
+} reference_count;
+
+static expression_visit_result count_reference(const expression *expr, void *count_ptr)
+{
+    reference_count *count = (reference_count*)count_ptr;
+    if (expr->type == TYPE_IDENT) {
+        TOKEN_GET_TEXT(expr->token, name);
+        const int *index = lookup(count->variables, name, count->scope);
+        if (index) {
+            count->allocator->variables[*index].references++;
+        }
+    }
+    return EXPRESSION_VISIT_CHILDREN;
+}
+
+static int is_terminal(token_type mnemonic)
+{
+    return mnemonic == TOKEN_RTS || mnemonic == TOKEN_RTI || mnemonic == TOKEN_RTL ||
+           mnemonic == TOKEN_JMP || mnemonic == TOKEN_JML || mnemonic == TOKEN_BRA || mnemonic == TOKEN_BRL;
+}
+
+/* the label a call, jump or branch goes to, if it names one */
+static const expression *jump_target(token_type mnemonic, const operand *oper)
+{
+    const expression *target = NULL;
+    if (!oper) {
+        return NULL;
+    }
+    switch (mnemonic) {
+        case TOKEN_JSR:
+        case TOKEN_JMP:
+        case TOKEN_JSL:
+        case TOKEN_JML:
+            target = oper->form == FORM_ZP_ABSOLUTE ? oper->single_expression.expr : NULL;
+            break;
+        case TOKEN_BBR:
+        case TOKEN_BBS:
+            target = oper->form == FORM_BIT_OFFS_ZP ? oper->bit_offset_expression.expr : NULL;
+            break;
+        default:
+            if (m6502_classify(mnemonic, oper) == M6502_FORM_RELATIVE) {
+                target = oper->single_expression.expr;
+            }
+    }
+    return target && target->type == TYPE_IDENT ? target : NULL;
+}
+
+/* count each variable's references and record which routines call which */
+static void scan_code(zp_allocator *allocator, const program *program, string_htable *variables, string_htable *routines, call_graph *graph)
+{
+    int scope = ZP_ALLOCATOR_NO_OWNER, falls_through = 0;
+    for(size_t i = 0; i < program->count; i++) {
+        int label = program->labels[i];
+        if (label != PROGRAM_NO_LABEL && !PROGRAM_LABEL_IS_LOCAL(label)) {
+            if (scope != ZP_ALLOCATOR_NO_OWNER && falls_through) {
+                add_edge(graph, scope, PROGRAM_LABEL_ID(label));
+            }
+            scope = PROGRAM_LABEL_ID(label);
+        }
+        if (program->kinds[i] != PROGRAM_KIND_INSTRUCTION) {
+            continue;
+        }
+        const char *scope_name = scope == ZP_ALLOCATOR_NO_OWNER ? NULL : program->label_names[scope];
+        const operand *oper = program->operands[i];
+        token_type mnemonic = program->statements[i]->instruction->type;
+        reference_count count = { allocator, variables, scope_name };
+        operand_visit(oper, count_reference, &count);
+        falls_through = !is_terminal(mnemonic);
+        const expression *target = jump_target(mnemonic, oper);
+        if (target && scope != ZP_ALLOCATOR_NO_OWNER) {
+            TOKEN_GET_TEXT(target->token, name);
+            const int *callee = lookup(routines, name, NULL);
+            if (callee) {
+                add_edge(graph, scope, *callee);
+            }
+        }
+    }
+}
+
+static void reach(const call_graph *graph, unsigned char *reaches, int routine)
+{
+    for(size_t e = graph->first_edge[routine]; e < graph->first_edge[routine + 1]; e++) {
+        int callee = graph->edges[e].to;
+        if (!BIT_TEST(reaches, callee)) {
+            BIT_SET(reaches, callee);
+            reach(graph, reaches, callee);
+        }
+    }
+}
+
+/* find every routine each owner of local variables can be active under */
+static void build_reaches(call_graph *graph, const zp_allocator *allocator)
+{
+    qsort(graph->edges, graph->count, sizeof(call_edge), compare_edges);
+    graph->first_edge = tiny_calloc(graph->routine_count + 1, sizeof(size_t));
+    for(size_t e = 0; e < graph->count; e++) {
+        graph->first_edge[graph->edges[e].from + 1]++;
+    }
+    for(size_t r = 0; r < graph->routine_count; r++) {
+        graph->first_edge[r + 1] += graph->first_edge[r];
+    }
+    graph->reaches = tiny_calloc(graph->routine_count ? graph->routine_count : 1, sizeof(unsigned char*));
+    for(size_t i = 0; i < allocator->count; i++) {
+        int owner = allocator->variables[i].owner;
+        if (owner != ZP_ALLOCATOR_NO_OWNER && !graph->reaches[owner]) {
+            graph->reaches[owner] = tiny_calloc(graph->routine_count / 8 + 1, 1);
+            reach(graph, graph->reaches[owner], owner);
+        }
+    }
+}
+
+/* whether two variables can be live at the same time */
+static int conflicts(const call_graph *graph, const zp_variable *lhs, const zp_variable *rhs)
+{
+    if (lhs->owner == ZP_ALLOCATOR_NO_OWNER || rhs->owner == ZP_ALLOCATOR_NO_OWNER || lhs->owner == rhs->owner) {
+        return 1;
+    }
+    return BIT_TEST(graph->reaches[lhs->owner], rhs->owner) || BIT_TEST(graph->reaches[rhs->owner], lhs->owner);
+}
+
+/* the lowest address in the range the variable can share with those already placed there */
+static int first_fit(const call_graph *graph, zp_variable **placed, size_t placed_count, const zp_variable *variable, int in_zp, int start, int end)
+{
+    int best = -1;
+    for(size_t c = 0; c <= placed_count; c++) {
+        int candidate = c == placed_count ? start : placed[c]->address + placed[c]->size;
+        if (c < placed_count && (placed[c]->in_zp != in_zp || !conflicts(graph, placed[c], variable))) {
+            continue;
+        }
+        if (candidate < start || candidate + variable->size - 1 > end || (best >= 0 && candidate >= best)) {
+            continue;
+        }
+        size_t p = 0;
+        for(; p < placed_count; p++) {
+            const zp_variable *other = placed[p];
+            if (other->in_zp == in_zp && candidate < other->address + other->size &&
+                other->address < candidate + variable->size && conflicts(graph, other, variable)) {
+                break;
+            }
+        }
+        if (p == placed_count) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+/* most referenced first, then in the order declared */
+static int compare_by_references(const void *lhs, const void *rhs)
+{
+    const zp_variable *l = *(const zp_variable**)lhs, *r = *(const zp_variable**)rhs;
+    if (l->references != r->references) {
+        return l->references > r->references ? -1 : 1;
+    }
+    return l->statement->index < r->statement->index ? -1 : 1;
+}
+
+static size_t place(zp_allocator *allocator, const call_graph *graph)
+{
+    zp_variable **order = tiny_calloc(allocator->count, sizeof(zp_variable*));
+    for(size_t i = 0; i < allocator->count; i++) {
+        order[i] = allocator->variables + i;
+    }
+    qsort(order, allocator->count, sizeof(zp_variable*), compare_by_references);
+    size_t placed = 0;
+    for(; placed < allocator->count; placed++) {
+        zp_variable *variable = order[placed];
+        variable->in_zp = 1;
+        variable->address = first_fit(graph, order, placed, variable, 1, allocator->start, allocator->end);
+        if (variable->address >= 0) {
+            continue;
+        }
+        TOKEN_GET_TEXT(variable->statement->label, name);
+        variable->in_zp = 0;
+        if (allocator->spill >= 0) {
+            variable->address = first_fit(graph, order, placed, variable, 0, allocator->spill, UINT16_MAX);
+        }
+        if (variable->address < 0) {
+            tiny_error(variable->statement->label, ERROR_MODE_RECOVER, "No room in zero page for variable '%s'", name);
+            break;
+        }
+        tiny_warn(variable->statement->label, "Variable '%s' did not fit in zero page and was placed at $%04x", name, variable->address);
+    }
+    tiny_free(order);
+    return placed;
+}
+
+size_t zp_allocator_allocate(zp_allocator *allocator, const program *program, assembly_context *context)
+{
+    allocator->count = 0;
+    string_htable *variables = string_htable_create(sizeof(int));
+    string_htable *routines = string_htable_create(sizeof(int));
+    variables->case_sensitive = routines->case_sensitive = context->options.case_sensitive;
+    collect(allocator, program, variables, routines);
+    size_t placed = 0;
+    if (allocator->count && !allocator->range_directive) {
+        tiny_error(allocator->variables[0].statement->instruction, ERROR_MODE_RECOVER, "Zero page range not set with \".zprange\"");
+    } else if (allocator->count && !tiny_error_count()) {
+        call_graph graph = { .routine_count = program->label_count };
+        scan_code(allocator, program, variables, routines, &graph);
+        build_reaches(&graph, allocator);
+        placed = place(allocator, &graph);
+        for(size_t r = 0; r < graph.routine_count; r++) {
+            tiny_free(graph.reaches[r]);
+        }
+        tiny_free(graph.reaches);
+        tiny_free(graph.first_edge);
+        tiny_free(graph.edges);
+    }
+    string_htable_destroy(routines);
+    string_htable_destroy(variables);
+    return placed;
+}
+
+value zp_allocator_address(const zp_allocator *allocator, const statement *statement)
+{
+    size_t lo = 0, hi = allocator->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const zp_variable *variable = allocator->variables + mid;
+        if (variable->statement->index == statement->index) {
+            return variable->address < 0 ? VALUE_UNDEFINED : variable->address;
+        }
+        if (variable->statement->index < statement->index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return VALUE_UNDEFINED;
+}
+
+void zp_allocator_report(const zp_allocator *allocator, FILE *stream)
+{
+    if (!allocator->count || !allocator->range_directive) {
+        return;
+    }
+    unsigned char used[256] = {};
+    int requested = 0, used_count = 0;
+    size_t spilled = 0;
+    for(size_t i = 0; i < allocator->count; i++) {
+        const zp_variable *variable = allocator->variables + i;
+        if (!variable->in_zp) {
+            spilled += variable->address >= 0;
+            continue;
+        }
+        requested += variable->size;
+        for(int a = variable->address; a < variable->address + variable->size; a++) {
+            used_count += !used[a];
+            used[a] = 1;
+        }
+    }
+    fprintf(stream, "---------------------------------\n");
+    fprintf(stream, "Zero page: %zu variables in %d of %d bytes ($%02x-$%02x), %d bytes overlaid, %zu spilled\n",
+        allocator->count, used_count, allocator->end - allocator->start + 1, allocator->start, allocator->end,
+        requested - used_count, spilled);
+}
@@ -0,0 +1,63 @@
+/**
+* tiny6502
+*
+* Copyright (c) 2022 informedcitizenry <informedcitizenry@gmail.com>
+*
+* Licensed under the MIT license. See LICENSE for full license information.
+*
+*/
+
+#ifndef zp_allocator_h
+#define zp_allocator_h
+
+#include "value.h"
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct assembly_context assembly_context;
+typedef struct program program;
+typedef struct statement statement;
+typedef struct token token;
+
+#define ZP_ALLOCATOR_NO_OWNER   -1
+
+typedef struct zp_variable
+{
+    const statement *statement;
+    int owner;
+    int size;
+    size_t references;
+    int address;
+    int in_zp;
+
+} zp_variable;
+
+/* the .zpvar declarations of a program and the range they are placed in */
+typedef struct zp_allocator
+{
+    zp_variable *variables;
+    size_t count;
+    size_t capacity;
+    const token *range_directive;
+    int start;
+    int end;
+    int spill;
+
+} zp_allocator;
+
+zp_allocator *zp_allocator_create(void);
+void zp_allocator_destroy(zp_allocator *allocator);
+
+/* set the zero page range and where variables that do not fit go, -1 if nowhere */
+void zp_allocator_set_range(zp_allocator *allocator, const token *directive, int start, int end, int spill);
+
+/* place the program's variables using the symbols of the first pass,
+   returns the number of variables placed */
+size_t zp_allocator_allocate(zp_allocator *allocator, const program *program, assembly_context *context);
+
+/* the address of a .zpvar statement, or VALUE_UNDEFINED if it has not been placed */
+value zp_allocator_address(const zp_allocator *allocator, const statement *statement);
+
+void zp_allocator_report(const zp_allocator *allocator, FILE *stream);
+
+#endif /* zp_allocator_h */